@@ -8,13 +8,620 @@
  * Modified 04/18/12
  * Modified 11/16/17 by Shiv Mishra
  *
+ * Tree mode (-E/-D) converts a whole directory tree to or from the
+ * pa4-encfs block format (see encfs-block.h) on a pool of worker threads
+ * (see work-pool.h). Every file is written to a temporary next to its
+ * destination and renamed into place, so the destination may be the source
+ * itself. Mode, owner, times and extended attributes are kept; files that
+ * are already in the wanted format, or whose destination has the source's
+ * mtime, are skipped, so an interrupted run can simply be started again.
+ *
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
 #include "aes-crypt.h"
+#include "encfs-block.h"
+#include "journal.h"
+#include "name-crypt.h"
+#include "pack-store.h"
+#include "rekey.h"
+#include "work-pool.h"
+
+#define TREE_CHUNK       (1024 * 1024)    /* Bytes per read/write */
+#define TREE_TEMP_SUFFIX ".pa4-encfs~"
+#define TREE_XATTR_MAX   65536
+#define XATTR_ENCRYPTED  "user.encrypted"
+
+/* A directory whose metadata is copied once its contents are done */
+typedef struct tree_dir {
+    char* in;
+    char* out;
+    struct tree_dir* next;
+} tree_dir;
+
+/* One regular file to convert */
+typedef struct tree_job {
+    char* in;
+    char* out;
+} tree_job;
+
+typedef struct tree_state {
+    int encrypt;
+    int inplace;
+    char* key_str;                /* Legacy (whole-file CBC) files */
+    crypt_key key;
+    bufpool pool;
+    work_pool wp;
+    unsigned char** bufs;         /* TREE_CHUNK per worker */
+    dev_t out_dev;                /* Never walk into the destination */
+    ino_t out_ino;
+    tree_dir* dirs;               /* Deepest first */
+
+    unsigned long long files;     /* Updated with __sync builtins */
+    unsigned long long bytes;
+    unsigned long long skipped;
+    unsigned long long errors;
+} tree_state;
+
+/* Sink of legacy plaintext into a block-format file */
+typedef struct tree_sink {
+    encfs_file* ef;
+    int fd;
+    unsigned char* buf;
+    size_t fill;
+    off_t pos;
+    int err;
+} tree_sink;
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_full(int fd, const unsigned char* buf, size_t len){
+    ssize_t n;
+
+    while(len > 0){
+	n = write(fd, buf, len);
+	if(n == -1){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -errno;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* Plain byte copy of in to out */
+static int copy_raw(int in, int out, unsigned char* buf, unsigned long long* bytes){
+    ssize_t n;
+    int res;
+
+    while((n = read(in, buf, TREE_CHUNK)) != 0){
+	if(n == -1){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -errno;
+	}
+	res = write_full(out, buf, n);
+	if(res){
+	    return res;
+	}
+	*bytes += n;
+    }
+    return 0;
+}
+
+static int sink_flush(tree_sink* ts){
+    ssize_t n;
+
+    if(ts->ef != NULL){
+	n = encfs_pwrite(ts->ef, (char*)ts->buf, ts->fill, ts->pos);
+	if(n < 0){
+	    return ts->err = (int)n;
+	}
+    }
+    else if((ts->err = write_full(ts->fd, ts->buf, ts->fill)) != 0){
+	return ts->err;
+    }
+    ts->pos += ts->fill;
+    ts->fill = 0;
+    return 0;
+}
+
+static int sink_write(void* arg, const unsigned char* data, int len){
+    tree_sink* ts = arg;
+
+    while(len > 0){
+	size_t n = TREE_CHUNK - ts->fill;
+
+	if(n > (size_t)len){
+	    n = len;
+	}
+	memcpy(ts->buf + ts->fill, data, n);
+	ts->fill += n;
+	data += n;
+	len -= n;
+	if(ts->fill == TREE_CHUNK && sink_flush(ts)){
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/* Legacy whole-file CBC plaintext into out (block format if ef is set) */
+static int copy_legacy(tree_state* ts, int in, int out, encfs_file* ef,
+		       unsigned char* buf, unsigned long long* bytes){
+    tree_sink sk;
+
+    memset(&sk, 0, sizeof(sk));
+    sk.ef = ef;
+    sk.fd = out;
+    sk.buf = buf;
+    if(!do_crypt_fd(in, 0, ts->key_str, sink_write, &sk) || sink_flush(&sk)){
+	return sk.err ? sk.err : -EIO;
+    }
+    *bytes = sk.pos;
+    return 0;
+}
+
+/* Every extended attribute but the encryption marker */
+static void copy_xattrs(int in, int out){
+    char list[TREE_XATTR_MAX];
+    char val[TREE_XATTR_MAX];
+    ssize_t len;
+    ssize_t n;
+    char* name;
+
+    len = flistxattr(in, list, sizeof(list));
+    for(name = list; len > 0 && name < list + len; name += strlen(name) + 1){
+	if(!strcmp(name, XATTR_ENCRYPTED)){
+	    continue;
+	}
+	n = fgetxattr(in, name, val, sizeof(val));
+	if(n >= 0){
+	    fsetxattr(out, name, val, n, 0);
+	}
+    }
+}
+
+/* Owner (when allowed), mode, times and xattrs of in onto out */
+static int copy_meta(int in, int out, const struct stat* st){
+    struct timespec times[2];
+
+    copy_xattrs(in, out);
+    if(fchown(out, st->st_uid, st->st_gid) == -1 && errno != EPERM){
+	return -errno;
+    }
+    if(fchmod(out, st->st_mode & 07777) == -1){
+	return -errno;
+    }
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    if(futimens(out, times) == -1){
+	return -errno;
+    }
+    return 0;
+}
+
+/* Whether out already holds a conversion of in (quick check: format, size
+ * and the mtime that copy_meta() gave it) */
+static int tree_done(tree_state* ts, const char* out, const struct stat* st,
+		     int format, uint64_t size){
+    encfs_header hdr;
+    struct stat ost;
+    int fd;
+    int block;
+
+    if(lstat(out, &ost) == -1 || !S_ISREG(ost.st_mode) ||
+       ost.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+       ost.st_mtim.tv_nsec != st->st_mtim.tv_nsec){
+	return 0;
+    }
+    fd = open(out, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1){
+	return 0;
+    }
+    block = encfs_probe(fd, &hdr) == 1;
+    close(fd);
+    if(ts->encrypt){
+	return block && (format != 0 || hdr.size == size);
+    }
+    return !block && (format == 2 || (uint64_t)ost.st_size == size);
+}
+
+/* Convert one file. Returns 0 when done, 1 when skipped, -errno on error */
+static int tree_convert(tree_state* ts, const tree_job* job, unsigned char* buf,
+			unsigned long long* bytes){
+    char tmp[PATH_MAX];
+    char xval[5];
+    struct stat st;
+    encfs_header hdr;
+    encfs_file ef;
+    int format;                   /* 0 plain, 1 block, 2 legacy */
+    int in;
+    int out;
+    int res;
+
+    in = open(job->in, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(in == -1){
+	return -errno;
+    }
+    if(fstat(in, &st) == -1){
+	res = -errno;
+	close(in);
+	return res;
+    }
+    res = encfs_probe(in, &hdr);
+    if(res < 0){
+	close(in);
+	return res;
+    }
+    format = res ? 1 : fgetxattr(in, XATTR_ENCRYPTED, xval, sizeof(xval)) != -1 ? 2 : 0;
+
+    /* Already in the wanted format, or converted by an earlier run */
+    if((ts->inplace && format == (ts->encrypt ? 1 : 0)) ||
+       (!ts->inplace && tree_done(ts, job->out, &st, format,
+				  format == 1 ? hdr.size : (uint64_t)st.st_size))){
+	close(in);
+	return 1;
+    }
+
+    if(snprintf(tmp, sizeof(tmp), "%s%s", job->out, TREE_TEMP_SUFFIX) >= (int)sizeof(tmp)){
+	close(in);
+	return -ENAMETOOLONG;
+    }
+    out = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(out == -1){
+	res = -errno;
+	close(in);
+	return res;
+    }
+
+    memset(&ef, 0, sizeof(ef));
+    if(ts->encrypt && format != 1){
+	res = encfs_create(&ef, out, &ts->key, &ts->pool, ENCFS_BLOCK_SIZE);
+	if(res == 0 && format == 2){
+	    res = copy_legacy(ts, in, out, &ef, buf, bytes);
+	}
+	else if(res == 0){
+	    off_t pos = 0;
+	    ssize_t n;
+
+	    while(res == 0 && (n = pread(in, buf, TREE_CHUNK, pos)) != 0){
+		if(n == -1){
+		    res = errno == EINTR ? 0 : -errno;
+		    continue;
+		}
+		n = encfs_pwrite(&ef, (char*)buf, n, pos);
+		if(n < 0){
+		    res = (int)n;
+		    continue;
+		}
+		pos += n;
+	    }
+	    *bytes = pos;
+	}
+    }
+    else if(!ts->encrypt && format == 1){
+	res = encfs_open(&ef, in, &ts->key, &ts->pool);
+	if(res == 0){
+	    off_t pos = 0;
+	    ssize_t n;
+
+	    while(res == 0 && (n = encfs_pread(&ef, (char*)buf, TREE_CHUNK, pos)) != 0){
+		if(n < 0){
+		    res = (int)n;
+		    continue;
+		}
+		res = write_full(out, buf, n);
+		pos += n;
+	    }
+	    *bytes = pos;
+	}
+    }
+    else if(!ts->encrypt && format == 2){
+	res = copy_legacy(ts, in, out, NULL, buf, bytes);
+    }
+    else{
+	/* Block files copied to a new tree as they are */
+	res = copy_raw(in, out, buf, bytes);
+    }
+
+    if(res == 0 && ts->encrypt && fsetxattr(out, XATTR_ENCRYPTED, "true", 4, 0) == -1){
+	res = -errno;
+    }
+    if(res == 0){
+	res = copy_meta(in, out, &st);
+    }
+    if(res == 0 && rename(tmp, job->out) == -1){
+	res = -errno;
+    }
+    if(res){
+	unlink(tmp);
+    }
+    close(out);
+    close(in);
+    return res;
+}
+
+static void tree_file(void* arg, void* item, int worker){
+    tree_state* ts = arg;
+    tree_job* job = item;
+    unsigned long long bytes = 0;
+    int res;
+
+    res = tree_convert(ts, job, ts->bufs[worker], &bytes);
+    if(res < 0){
+	fprintf(stderr, "%s: %s\n", job->in, strerror(-res));
+	__sync_fetch_and_add(&ts->errors, 1);
+    }
+    else if(res){
+	__sync_fetch_and_add(&ts->skipped, 1);
+    }
+    else{
+	__sync_fetch_and_add(&ts->files, 1);
+	__sync_fetch_and_add(&ts->bytes, bytes);
+    }
+    free(job->in);
+    free(job);
+}
+
+/* Our stores, the re-key checkpoint and conversions in progress */
+static int internal_name(const char* name){
+    size_t len = strlen(name);
+
+    return !strncmp(name, ".pa4-encfs.", strlen(".pa4-encfs.")) ||
+	(len >= strlen(TREE_TEMP_SUFFIX) &&
+	 !strcmp(name + len - strlen(TREE_TEMP_SUFFIX), TREE_TEMP_SUFFIX));
+}
+
+static void tree_symlink(tree_state* ts, const char* in, const char* out,
+			 const struct stat* st){
+    char target[PATH_MAX];
+    struct timespec times[2];
+    ssize_t n;
+
+    n = readlink(in, target, sizeof(target) - 1);
+    if(n == -1){
+	fprintf(stderr, "%s: %s\n", in, strerror(errno));
+	__sync_fetch_and_add(&ts->errors, 1);
+	return;
+    }
+    target[n] = '\0';
+    unlink(out);
+    if(symlink(target, out) == -1){
+	fprintf(stderr, "%s: %s\n", out, strerror(errno));
+	__sync_fetch_and_add(&ts->errors, 1);
+	return;
+    }
+    if(lchown(out, st->st_uid, st->st_gid) == -1 && errno != EPERM){
+	__sync_fetch_and_add(&ts->errors, 1);
+    }
+    times[0] = st->st_atim;
+    times[1] = st->st_mtim;
+    utimensat(AT_FDCWD, out, times, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Queue everything below in; directories are made in out as we go. Each
+ * directory is read whole first: converting in place renames files into it,
+ * and a listing in progress might return those a second time. */
+static void tree_walk(tree_state* ts, const char* in, const char* out){
+    char ipath[PATH_MAX];
+    char opath[PATH_MAX];
+    struct dirent** names;
+    struct dirent* de;
+    struct stat st;
+    int n;
+    int i;
+
+    n = scandir(in, &names, NULL, NULL);
+    if(n == -1){
+	fprintf(stderr, "%s: %s\n", in, strerror(errno));
+	__sync_fetch_and_add(&ts->errors, 1);
+	return;
+    }
+    for(i = 0; i < n; free(names[i++])){
+	de = names[i];
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+	   internal_name(de->d_name)){
+	    continue;
+	}
+	if(snprintf(ipath, sizeof(ipath), "%s/%s", in, de->d_name) >= (int)sizeof(ipath) ||
+	   snprintf(opath, sizeof(opath), "%s/%s", out, de->d_name) >= (int)sizeof(opath)){
+	    fprintf(stderr, "%s/%s: %s\n", in, de->d_name, strerror(ENAMETOOLONG));
+	    __sync_fetch_and_add(&ts->errors, 1);
+	    continue;
+	}
+	if(lstat(ipath, &st) == -1){
+	    continue;
+	}
+	if(st.st_dev == ts->out_dev && st.st_ino == ts->out_ino){
+	    continue;
+	}
+	if(S_ISDIR(st.st_mode)){
+	    if(!ts->inplace){
+		tree_dir* d = malloc(sizeof(*d));
+
+		if(mkdir(opath, 0700) == -1 && errno != EEXIST){
+		    fprintf(stderr, "%s: %s\n", opath, strerror(errno));
+		    __sync_fetch_and_add(&ts->errors, 1);
+		    free(d);
+		    continue;
+		}
+		if(d != NULL){
+		    d->in = strdup(ipath);
+		    d->out = strdup(opath);
+		    d->next = ts->dirs;
+		    ts->dirs = d;
+		}
+	    }
+	    tree_walk(ts, ipath, opath);
+	}
+	else if(S_ISREG(st.st_mode)){
+	    tree_job* job = malloc(sizeof(*job));
+	    size_t ilen = strlen(ipath) + 1;
+
+	    if(job == NULL || (job->in = malloc(ilen + strlen(opath) + 1)) == NULL){
+		free(job);
+		__sync_fetch_and_add(&ts->errors, 1);
+		continue;
+	    }
+	    /* One allocation for both names */
+	    memcpy(job->in, ipath, ilen);
+	    job->out = strcpy(job->in + ilen, opath);
+	    if(work_pool_push(&ts->wp, job)){
+		free(job->in);
+		free(job);
+		__sync_fetch_and_add(&ts->errors, 1);
+	    }
+	}
+	else if(S_ISLNK(st.st_mode) && !ts->inplace){
+	    tree_symlink(ts, ipath, opath, &st);
+	}
+	else if(!S_ISLNK(st.st_mode)){
+	    __sync_fetch_and_add(&ts->skipped, 1);
+	}
+    }
+    free(names);
+}
+
+/* Directory metadata last, deepest first, so our own writes don't touch
+ * the times we set */
+static void tree_dirs(tree_state* ts){
+    tree_dir* d;
+    struct stat st;
+    int in;
+    int out;
+
+    while((d = ts->dirs) != NULL){
+	ts->dirs = d->next;
+	in = d->in ? open(d->in, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+	out = d->out ? open(d->out, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+	if(in == -1 || out == -1 || fstat(in, &st) == -1 || copy_meta(in, out, &st)){
+	    fprintf(stderr, "%s: could not copy attributes\n", d->out ? d->out : "?");
+	    __sync_fetch_and_add(&ts->errors, 1);
+	}
+	if(in != -1){
+	    close(in);
+	}
+	if(out != -1){
+	    close(out);
+	}
+	free(d->in);
+	free(d->out);
+	free(d);
+    }
+}
+
+/* Encrypt (or decrypt) the tree below in into out, with nthreads workers */
+static int do_tree(int encrypt, int nthreads, char* key_str, const char* in, const char* out){
+    static const char* const stores[] = {
+	PACK_FILE_NAME, DEDUP_DATA_NAME, DEDUP_INDEX_NAME, JOURNAL_NAME, NAME_MARKER_NAME,
+	REKEY_CHECKPOINT_NAME
+    };
+    tree_state ts;
+    struct stat ist;
+    struct stat ost;
+    char path[PATH_MAX];
+    double start;
+    double secs;
+    size_t i;
+    int res;
+
+    if(stat(in, &ist) == -1 || !S_ISDIR(ist.st_mode)){
+	fprintf(stderr, "%s: not a directory\n", in);
+	return EXIT_FAILURE;
+    }
+    /* Those need a mount: files are not self-contained there */
+    for(i = 0; i < sizeof(stores) / sizeof(stores[0]); i++){
+	snprintf(path, sizeof(path), "%s/%s", in, stores[i]);
+	if(access(path, F_OK) == 0){
+	    fprintf(stderr, "%s: mirror uses %s; convert it through a pa4-encfs mount\n",
+		    in, stores[i]);
+	    return EXIT_FAILURE;
+	}
+    }
+    if(mkdir(out, 0700) == -1 && errno != EEXIST){
+	perror("mkdir error");
+	return EXIT_FAILURE;
+    }
+    if(stat(out, &ost) == -1 || !S_ISDIR(ost.st_mode)){
+	fprintf(stderr, "%s: not a directory\n", out);
+	return EXIT_FAILURE;
+    }
+
+    memset(&ts, 0, sizeof(ts));
+    ts.encrypt = encrypt;
+    ts.inplace = ist.st_dev == ost.st_dev && ist.st_ino == ost.st_ino;
+    ts.key_str = key_str;
+    ts.out_dev = ost.st_dev;
+    ts.out_ino = ost.st_ino;
+    if(!crypt_derive_key(key_str, &ts.key)){
+	fprintf(stderr, "key derivation failed\n");
+	return EXIT_FAILURE;
+    }
+    if(nthreads < 1 || nthreads > WORK_POOL_MAX){
+	nthreads = nthreads < 1 ? 1 : WORK_POOL_MAX;
+    }
+    /* encfs_pread()/encfs_pwrite() hold a few block buffers each */
+    res = bufpool_init(&ts.pool, ENCFS_MAX_BLOCK_SIZE,
+		       (size_t)nthreads * 8 * ENCFS_MAX_BLOCK_SIZE, 0);
+    ts.bufs = calloc(nthreads, sizeof(*ts.bufs));
+    for(i = 0; res == 0 && ts.bufs != NULL && i < (size_t)nthreads; i++){
+	ts.bufs[i] = malloc(TREE_CHUNK);
+	if(ts.bufs[i] == NULL){
+	    res = -ENOMEM;
+	}
+    }
+    if(res == 0 && ts.bufs == NULL){
+	res = -ENOMEM;
+    }
+    if(res == 0){
+	res = work_pool_start(&ts.wp, nthreads, tree_file, &ts);
+    }
+    if(res){
+	fprintf(stderr, "setup failed: %s\n", strerror(-res));
+	return EXIT_FAILURE;
+    }
+
+    start = now();
+    tree_walk(&ts, in, out);
+    work_pool_finish(&ts.wp);
+    tree_dirs(&ts);
+    secs = now() - start;
+
+    printf("%llu files, %.1f MiB in %.2f s (%.1f MiB/s, %d threads); %llu skipped, %llu errors\n",
+	   ts.files, ts.bytes / 1048576.0, secs,
+	   secs > 0 ? ts.bytes / 1048576.0 / secs : 0.0, nthreads, ts.skipped, ts.errors);
+
+    for(i = 0; i < (size_t)nthreads; i++){
+	free(ts.bufs[i]);
+    }
+    free(ts.bufs);
+    bufpool_destroy(&ts.pool);
+    memset(&ts.key, 0, sizeof(ts.key));
+    return ts.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int main(int argc, char **argv)
 {
@@ -22,58 +629,75 @@ int main(int argc, char **argv)
     /* Local vars */
     int action = 0;
     int ifarg;
-    int ofarg;
-    FILE* inFile = NULL;
-    FILE* outFile = NULL;
+    int nfiles;
+    int inFd = STDIN_FILENO;
+    int outFd = STDOUT_FILENO;
     char* key_str = NULL;
 
     /* Check General Input */
-    if(argc < 3){
+    if(argc < 2){
 	fprintf(stderr, "usage: %s %s\n", argv[0],
 		"<type> <opt key phrase> <in path> <out path>");
 	exit(EXIT_FAILURE);
     }
 
+    /* Tree Cases */
+    if(!strcmp(argv[1], "-E") || !strcmp(argv[1], "-D")){
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int arg = 2;
+
+	/* Check Args */
+	if(argc > 3 && !strcmp(argv[2], "-j")){
+	    nthreads = strtol(argv[3], NULL, 10);
+	    arg = 4;
+	}
+	if(argc != arg + 3){
+	    fprintf(stderr, "usage: %s %s %s\n", argv[0], argv[1],
+		    "[-j <threads>] <key phrase> <in dir> <out dir>");
+	    exit(EXIT_FAILURE);
+	}
+	return do_tree(argv[1][1] == 'E', (int)nthreads, argv[arg], argv[arg + 1], argv[arg + 2]);
+    }
+
+    /* Paths left out or given as "-" are stdin and stdout */
+
     /* Encrypt Case */
     if(!strcmp(argv[1], "-e")){
 	/* Check Args */
-	if(argc != 5){
+	if(argc < 3 || argc > 5){
 	    fprintf(stderr, "usage: %s %s\n", argv[0],
-		    "-e <key phrase> <in path> <out path>");
+		    "-e <key phrase> [<in path>|-] [<out path>|-]");
 	    exit(EXIT_FAILURE);
 	}
 	/* Set Vars */
 	key_str = argv[2];
 	ifarg = 3;
-	ofarg = 4;
 	action = 1;
     }
     /* Decrypt Case */
     else if(!strcmp(argv[1], "-d")){
 	/* Check Args */
-	if(argc != 5){
+	if(argc < 3 || argc > 5){
 	    fprintf(stderr, "usage: %s %s\n", argv[0],
-		    "-d <key phrase> <in path> <out path>");
+		    "-d <key phrase> [<in path>|-] [<out path>|-]");
 	    exit(EXIT_FAILURE);
 	}
 	/* Set Vars */
 	key_str = argv[2];
 	ifarg = 3;
-	ofarg = 4;
 	action = 0;
     }
     /* Pass-Through (Copy) Case */
     else if(!strcmp(argv[1], "-c")){
 	/* Check Args */
-	if(argc != 4){
+	if(argc > 4){
 	    fprintf(stderr, "usage: %s %s\n", argv[0],
-		    "-c <in path> <out path>");
+		    "-c [<in path>|-] [<out path>|-]");
 	    exit(EXIT_FAILURE);
 	}
 	/* Set Vars */
 	key_str = NULL;
 	ifarg = 2;
-	ofarg = 3;
 	action = -1;
     }
     /* Bad Case */
@@ -81,30 +705,37 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Unkown action\n");
 	exit(EXIT_FAILURE);
     }
+    nfiles = argc - ifarg;
 
     /* Open Files */
-    inFile = fopen(argv[ifarg], "rb");
-    if(!inFile){
-	perror("infile fopen error");
-	return EXIT_FAILURE;
+    if(nfiles > 0 && strcmp(argv[ifarg], "-")){
+	inFd = open(argv[ifarg], O_RDONLY | O_CLOEXEC);
+	if(inFd == -1){
+	    perror("infile open error");
+	    return EXIT_FAILURE;
+	}
     }
-    outFile = fopen(argv[ofarg], "wb+");
-    if(!outFile){
-	perror("outfile fopen error");
-	return EXIT_FAILURE;
+    if(nfiles > 1 && strcmp(argv[ifarg + 1], "-")){
+	outFd = open(argv[ifarg + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(outFd == -1){
+	    perror("outfile open error");
+	    return EXIT_FAILURE;
+	}
     }
 
-    /* Perform do_crpt action (encrypt, decrypt, copy) */
-    if(!do_crypt(inFile, outFile, action, key_str)){
+    /* Perform do_crypt_stream action (encrypt, decrypt, copy) */
+    if(!do_crypt_stream(inFd, outFd, action, key_str)){
 	fprintf(stderr, "do_crypt failed\n");
+	return EXIT_FAILURE;
     }
 
     /* Cleanup */
-    if(fclose(outFile)){
-        perror("outFile fclose error\n");
+    if(close(outFd)){
+        perror("outFile close error\n");
+	return EXIT_FAILURE;
     }
-    if(fclose(inFile)){
-	perror("inFile fclose error\n");
+    if(close(inFd)){
+	perror("inFile close error\n");
     }
 
     return EXIT_SUCCESS;
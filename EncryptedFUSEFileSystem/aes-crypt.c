@@ -16,6 +16,17 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
 #include "aes-crypt.h"
 
 #define BLOCKSIZE 1024
@@ -34,7 +45,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     int writelen;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
+    EVP_CIPHER_CTX* ctx = NULL;
     unsigned char key[32];
     unsigned char iv[32];
     int nrounds = 5;
@@ -58,8 +69,11 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	    return 0;
 	}
 	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    return 0;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
     }    
 
     /* Loop through Input File*/
@@ -73,10 +87,10 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
 		{
 		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
+		    EVP_CIPHER_CTX_free(ctx);
 		    return 0;
 		}
 	}
@@ -91,7 +105,7 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
 	if(writelen != outlen){
 	    /* Error */
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
+	    EVP_CIPHER_CTX_free(ctx);
 	    return 0;
 	}
     }
@@ -99,17 +113,492 @@ extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
 	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen))
 	    {
 		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
+		EVP_CIPHER_CTX_free(ctx);
 		return 0;
 	    }
 	/* Write remainign cipher block + padding*/
 	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	EVP_CIPHER_CTX_free(ctx);
     }
     
     /* Success */
     return 1;
 }
+
+extern int do_crypt_fd(int fd, int action, char* key_str, crypt_sink sink, void* arg){
+    /* Buffers */
+    unsigned char inbuf[BLOCKSIZE * 4];
+    unsigned char outbuf[BLOCKSIZE * 4 + EVP_MAX_BLOCK_LENGTH];
+    ssize_t inlen;
+    int outlen;
+    off_t pos = 0;
+    int res = 0;
+
+    /* OpenSSL libcrypto vars */
+    EVP_CIPHER_CTX* ctx = NULL;
+    unsigned char key[32];
+    unsigned char iv[32];
+    int nrounds = 5;
+
+    /* Setup Encryption Key and Cipher Engine if in cipher mode */
+    if(action >= 0){
+	if(!key_str){
+	    fprintf(stderr, "Key_str must not be NULL\n");
+	    return FAILURE;
+	}
+	if(EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+			  (unsigned char*)key_str, strlen(key_str), nrounds,
+			  key, iv) != 32){
+	    return FAILURE;
+	}
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    return FAILURE;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+    }
+
+    /* Loop through input, handing every transformed chunk to the sink */
+    while(res == 0){
+	inlen = pread(fd, inbuf, sizeof(inbuf), pos);
+	if(inlen < 0){
+	    res = -1;
+	    break;
+	}
+	if(inlen == 0){
+	    break;
+	}
+	pos += inlen;
+
+	if(action >= 0){
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen)){
+		res = -1;
+		break;
+	    }
+	    if(outlen > 0){
+		res = sink(arg, outbuf, outlen);
+	    }
+	}
+	else{
+	    res = sink(arg, inbuf, inlen);
+	}
+    }
+
+    /* Handle remaining cipher block + padding */
+    if(action >= 0){
+	if(res == 0){
+	    if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen)){
+		res = -1;
+	    }
+	    else if(outlen > 0){
+		res = sink(arg, outbuf, outlen);
+	    }
+	}
+	EVP_CIPHER_CTX_free(ctx);
+    }
+
+    return res < 0 ? FAILURE : SUCCESS;
+}
+
+/* ---- Streaming interface ---- */
+
+typedef struct stream_slot {
+    unsigned char* in;
+    unsigned char* out;           /* STREAM_CHUNK + EVP_MAX_BLOCK_LENGTH */
+    int inlen;
+    int outlen;
+} stream_slot;
+
+/* Slot i % STREAM_SLOTS goes reader -> cipher -> writer; the counters say
+ * how far each stage has got */
+typedef struct stream_state {
+    int in;
+    int out;
+    stream_slot slots[STREAM_SLOTS];
+    unsigned long nread;
+    unsigned long ncrypted;
+    unsigned long nwritten;
+    int eof;                      /* Reader saw the end of the input */
+    int done;                     /* Cipher handled every slot */
+    int err;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} stream_state;
+
+static int write_full(int fd, const unsigned char* buf, size_t len){
+    ssize_t n;
+
+    while(len > 0){
+	n = write(fd, buf, len);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* Fill a whole chunk unless the input ends first */
+static int read_full(int fd, unsigned char* buf, size_t len){
+    size_t got = 0;
+    ssize_t n;
+
+    while(got < len){
+	n = read(fd, buf + got, len - got);
+	if(n < 0){
+	    if(errno == EINTR){
+		continue;
+	    }
+	    return -1;
+	}
+	if(n == 0){
+	    break;
+	}
+	got += n;
+    }
+    return (int)got;
+}
+
+static void stream_fail(stream_state* ss){
+    pthread_mutex_lock(&ss->mtx);
+    ss->err = 1;
+    pthread_cond_broadcast(&ss->cond);
+    pthread_mutex_unlock(&ss->mtx);
+}
+
+static void* stream_reader(void* arg){
+    stream_state* ss = arg;
+    stream_slot* slot;
+    unsigned long r;
+    int stop;
+
+    for(r = 0; ; r++){
+	pthread_mutex_lock(&ss->mtx);
+	while(!ss->err && r - ss->nwritten >= STREAM_SLOTS){
+	    pthread_cond_wait(&ss->cond, &ss->mtx);
+	}
+	stop = ss->err;
+	pthread_mutex_unlock(&ss->mtx);
+	if(stop){
+	    break;
+	}
+	slot = &ss->slots[r % STREAM_SLOTS];
+	slot->inlen = read_full(ss->in, slot->in, STREAM_CHUNK);
+	if(slot->inlen < 0){
+	    stream_fail(ss);
+	    break;
+	}
+	pthread_mutex_lock(&ss->mtx);
+	ss->nread++;
+	ss->eof = slot->inlen < STREAM_CHUNK;
+	pthread_cond_broadcast(&ss->cond);
+	pthread_mutex_unlock(&ss->mtx);
+	if(ss->eof){
+	    break;
+	}
+    }
+    return NULL;
+}
+
+static void* stream_writer(void* arg){
+    stream_state* ss = arg;
+    stream_slot* slot;
+    unsigned long w;
+    int stop;
+
+    for(w = 0; ; w++){
+	pthread_mutex_lock(&ss->mtx);
+	while(!ss->err && w == ss->ncrypted && !ss->done){
+	    pthread_cond_wait(&ss->cond, &ss->mtx);
+	}
+	stop = ss->err || w == ss->ncrypted;
+	pthread_mutex_unlock(&ss->mtx);
+	if(stop){
+	    break;
+	}
+	slot = &ss->slots[w % STREAM_SLOTS];
+	if(write_full(ss->out, slot->out, slot->outlen)){
+	    stream_fail(ss);
+	    break;
+	}
+	pthread_mutex_lock(&ss->mtx);
+	ss->nwritten++;
+	pthread_cond_broadcast(&ss->cond);
+	pthread_mutex_unlock(&ss->mtx);
+    }
+    return NULL;
+}
+
+/* Pass-through without copying through user space: copy_file_range()
+ * between regular files, splice() when either end is a pipe. Returns 1 if
+ * neither applies, so the caller copies by hand. */
+static int stream_copy(int in, int out){
+    struct stat ist;
+    struct stat ost;
+    ssize_t n;
+    int first = 1;
+
+    if(fstat(in, &ist) == -1 || fstat(out, &ost) == -1){
+	return -1;
+    }
+    if(S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode)){
+	while((n = copy_file_range(in, NULL, out, NULL, STREAM_CHUNK * 64, 0)) != 0){
+	    if(n < 0){
+		if(errno == EINTR){
+		    continue;
+		}
+		/* Not supported here: nothing was copied yet */
+		return first && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+				 errno == EOPNOTSUPP) ? 1 : -1;
+	    }
+	    first = 0;
+	}
+	return 0;
+    }
+    if(S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode)){
+	while((n = splice(in, NULL, out, NULL, STREAM_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0){
+	    if(n < 0){
+		if(errno == EINTR){
+		    continue;
+		}
+		return first && errno == EINVAL ? 1 : -1;
+	    }
+	    first = 0;
+	}
+	return 0;
+    }
+    return 1;
+}
+
+extern int do_crypt_stream(int in, int out, int action, char* key_str){
+    stream_state ss;
+    stream_slot* slot;
+    pthread_t reader;
+    pthread_t writer;
+    EVP_CIPHER_CTX* ctx = NULL;
+    unsigned char key[32];
+    unsigned char iv[32];
+    unsigned char final[EVP_MAX_BLOCK_LENGTH];
+    int finallen = 0;
+    int nrounds = 5;
+    unsigned long c;
+    int stop;
+    int res;
+    int i;
+
+    if(action < 0){
+	res = stream_copy(in, out);
+	if(res <= 0){
+	    return res == 0 ? SUCCESS : FAILURE;
+	}
+    }
+    else{
+	/* Same key and cipher as do_crypt() */
+	if(!key_str){
+	    fprintf(stderr, "Key_str must not be NULL\n");
+	    return FAILURE;
+	}
+	if(EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+			  (unsigned char*)key_str, strlen(key_str), nrounds,
+			  key, iv) != 32){
+	    return FAILURE;
+	}
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    return FAILURE;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
+    }
+
+    memset(&ss, 0, sizeof(ss));
+    ss.in = in;
+    ss.out = out;
+    res = 0;
+    for(i = 0; i < STREAM_SLOTS; i++){
+	ss.slots[i].in = malloc(STREAM_CHUNK);
+	ss.slots[i].out = action >= 0 ? malloc(STREAM_CHUNK + EVP_MAX_BLOCK_LENGTH)
+	                              : ss.slots[i].in;
+	if(ss.slots[i].in == NULL || ss.slots[i].out == NULL){
+	    res = -1;
+	}
+    }
+    pthread_mutex_init(&ss.mtx, NULL);
+    pthread_cond_init(&ss.cond, NULL);
+    if(res == 0 && pthread_create(&reader, NULL, stream_reader, &ss)){
+	res = -1;
+    }
+    else if(res == 0 && pthread_create(&writer, NULL, stream_writer, &ss)){
+	stream_fail(&ss);
+	pthread_join(reader, NULL);
+	res = -1;
+    }
+
+    /* The cipher runs here while the other two threads move data */
+    for(c = 0; res == 0; c++){
+	pthread_mutex_lock(&ss.mtx);
+	while(!ss.err && c == ss.nread && !ss.eof){
+	    pthread_cond_wait(&ss.cond, &ss.mtx);
+	}
+	stop = ss.err || c == ss.nread;
+	pthread_mutex_unlock(&ss.mtx);
+	if(stop){
+	    break;
+	}
+	slot = &ss.slots[c % STREAM_SLOTS];
+	slot->outlen = slot->inlen;
+	if(action >= 0 && !EVP_CipherUpdate(ctx, slot->out, &slot->outlen, slot->in, slot->inlen)){
+	    stream_fail(&ss);
+	    break;
+	}
+	pthread_mutex_lock(&ss.mtx);
+	ss.ncrypted++;
+	pthread_cond_broadcast(&ss.cond);
+	pthread_mutex_unlock(&ss.mtx);
+    }
+    if(res == 0){
+	pthread_mutex_lock(&ss.mtx);
+	ss.done = 1;
+	pthread_cond_broadcast(&ss.cond);
+	pthread_mutex_unlock(&ss.mtx);
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	res = ss.err ? -1 : 0;
+    }
+
+    /* Remaining cipher block + padding, after everything else */
+    if(ctx){
+	if(res == 0 && (!EVP_CipherFinal_ex(ctx, final, &finallen) ||
+			write_full(out, final, finallen))){
+	    res = -1;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+    }
+
+    for(i = 0; i < STREAM_SLOTS; i++){
+	if(ss.slots[i].out != ss.slots[i].in){
+	    free(ss.slots[i].out);
+	}
+	free(ss.slots[i].in);
+    }
+    pthread_cond_destroy(&ss.cond);
+    pthread_mutex_destroy(&ss.mtx);
+    return res < 0 ? FAILURE : SUCCESS;
+}
+
+/* ---- Block cipher interface ---- */
+
+#define KDF_SALT "pa4-encfs block key v1"
+#define KDF_ROUNDS 100000
+
+/* One GCM context per thread, reused for every block */
+static pthread_key_t gcm_key;
+static pthread_once_t gcm_once = PTHREAD_ONCE_INIT;
+
+static void gcm_ctx_free(void* ctx){
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+static void gcm_key_init(void){
+    pthread_key_create(&gcm_key, gcm_ctx_free);
+}
+
+static EVP_CIPHER_CTX* gcm_ctx(void){
+    EVP_CIPHER_CTX* ctx;
+
+    pthread_once(&gcm_once, gcm_key_init);
+    ctx = pthread_getspecific(gcm_key);
+    if(!ctx){
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx){
+	    return NULL;
+	}
+	EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, 1);
+	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CRYPT_IV_BYTES, NULL);
+	pthread_setspecific(gcm_key, ctx);
+    }
+    return ctx;
+}
+
+extern int crypt_derive_key(const char* key_str, crypt_key* key){
+    unsigned char out[2 * CRYPT_KEY_BYTES];
+
+    if(!key_str){
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    if(!PKCS5_PBKDF2_HMAC(key_str, strlen(key_str),
+			  (const unsigned char*)KDF_SALT, strlen(KDF_SALT),
+			  KDF_ROUNDS, EVP_sha256(), sizeof(out), out)){
+	return FAILURE;
+    }
+    memcpy(key->enc, out, CRYPT_KEY_BYTES);
+    memcpy(key->mac, out + CRYPT_KEY_BYTES, CRYPT_KEY_BYTES);
+    OPENSSL_cleanse(out, sizeof(out));
+    return SUCCESS;
+}
+
+static int gcm_block(int enc, const crypt_key* key, const unsigned char* iv,
+		     const void* aad, int aadlen,
+		     const unsigned char* in, int len,
+		     unsigned char* out, unsigned char* tag){
+    EVP_CIPHER_CTX* ctx = gcm_ctx();
+    int outlen;
+
+    if(!ctx){
+	return FAILURE;
+    }
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, key->enc, iv, enc)){
+	return FAILURE;
+    }
+    if(aadlen > 0 && !EVP_CipherUpdate(ctx, NULL, &outlen, aad, aadlen)){
+	return FAILURE;
+    }
+    if(len > 0 && !EVP_CipherUpdate(ctx, out, &outlen, in, len)){
+	return FAILURE;
+    }
+    if(!enc && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CRYPT_TAG_BYTES, tag)){
+	return FAILURE;
+    }
+    if(!EVP_CipherFinal_ex(ctx, out + len, &outlen)){
+	/* Tag mismatch on decrypt */
+	return FAILURE;
+    }
+    if(enc && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CRYPT_TAG_BYTES, tag)){
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+extern int crypt_seal_block(const crypt_key* key, const unsigned char* iv,
+			    const void* aad, int aadlen,
+			    const unsigned char* in, int len,
+			    unsigned char* out, unsigned char* tag){
+    return gcm_block(1, key, iv, aad, aadlen, in, len, out, tag);
+}
+
+extern int crypt_open_block(const crypt_key* key, const unsigned char* iv,
+			    const void* aad, int aadlen,
+			    const unsigned char* in, int len,
+			    unsigned char* out, const unsigned char* tag){
+    return gcm_block(0, key, iv, aad, aadlen, in, len, out, (unsigned char*)tag);
+}
+
+extern void crypt_mac(const crypt_key* key, const void* data, size_t len,
+		      unsigned char* tag){
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen = 0;
+
+    HMAC(EVP_sha256(), key->mac, CRYPT_KEY_BYTES, data, len, md, &mdlen);
+    memcpy(tag, md, CRYPT_TAG_BYTES);
+}
+
+extern int crypt_random(unsigned char* buf, int len){
+    return RAND_bytes(buf, len) == 1 ? SUCCESS : FAILURE;
+}
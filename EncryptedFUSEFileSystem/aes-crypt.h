@@ -40,4 +40,93 @@
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* int crypt_sink(void* arg, const unsigned char* data, int len)
+ * Purpose: Receives each output chunk produced by do_crypt_fd()
+ * Return: 0 to continue, >0 to stop early (success), <0 on error
+ */
+typedef int (*crypt_sink)(void* arg, const unsigned char* data, int len);
+
+/* int do_crypt_fd(int fd, int action, char* key_str, crypt_sink sink, void* arg)
+ * Purpose: Same cipher as do_crypt() but streams from a file descriptor into a
+ *          callback using stack buffers only
+ * Args: int fd          : Input file descriptor (read from offset 0 with pread)
+ *       int action      : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *       char* key_str   : C-string containing passpharse from which key is derived
+ *       crypt_sink sink : Called with every chunk of output
+ *       void* arg       : Passed through to sink
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_fd(int fd, int action, char* key_str, crypt_sink sink, void* arg);
+
+#define STREAM_CHUNK (1024 * 1024)
+#define STREAM_SLOTS 4
+
+/* int do_crypt_stream(int in, int out, int action, char* key_str)
+ * Purpose: Same cipher as do_crypt() between descriptors of any kind (pipes,
+ *          sockets, files). A reader and a writer thread move STREAM_CHUNK
+ *          buffers through STREAM_SLOTS slots while the calling thread runs
+ *          the cipher, so I/O and encryption overlap. Pass-through uses
+ *          copy_file_range() or splice() where the descriptors allow it.
+ * Args: int in, int out : Read to the end of in, write out from its current offset
+ *       int action      : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *       char* key_str   : C-string containing passpharse from which key is derived
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_stream(int in, int out, int action, char* key_str);
+
+/* ---- Block cipher interface (pa4-encfs block format) ---- */
+
+#define CRYPT_KEY_BYTES 32
+#define CRYPT_IV_BYTES  12
+#define CRYPT_TAG_BYTES 16
+
+/* Key material derived from a passphrase: AES-256-GCM key plus a separate
+ * HMAC key for authenticating metadata. Keep it in locked memory. */
+typedef struct crypt_key {
+    unsigned char enc[CRYPT_KEY_BYTES];
+    unsigned char mac[CRYPT_KEY_BYTES];
+} crypt_key;
+
+/* int crypt_derive_key(const char* key_str, crypt_key* key)
+ * Purpose: Derive block and MAC keys from a passphrase (PBKDF2-HMAC-SHA256)
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_derive_key(const char* key_str, crypt_key* key);
+
+/* int crypt_seal_block(...)
+ * Purpose: AES-256-GCM encrypt len bytes of in into out (same length)
+ * Args: const crypt_key* key : Key
+ *       const unsigned char* iv  : CRYPT_IV_BYTES nonce, must never repeat for a key
+ *       const void* aad, int aadlen : Additional authenticated data
+ *       const unsigned char* in, int len : Plaintext
+ *       unsigned char* out : Ciphertext output (may equal in)
+ *       unsigned char* tag : CRYPT_TAG_BYTES output
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_seal_block(const crypt_key* key, const unsigned char* iv,
+			    const void* aad, int aadlen,
+			    const unsigned char* in, int len,
+			    unsigned char* out, unsigned char* tag);
+
+/* int crypt_open_block(...)
+ * Purpose: Inverse of crypt_seal_block()
+ * Return: FAILURE on error or authentication failure, SUCCESS on success
+ */
+extern int crypt_open_block(const crypt_key* key, const unsigned char* iv,
+			    const void* aad, int aadlen,
+			    const unsigned char* in, int len,
+			    unsigned char* out, const unsigned char* tag);
+
+/* void crypt_mac(const crypt_key* key, const void* data, size_t len, unsigned char* tag)
+ * Purpose: HMAC-SHA256 of data truncated to CRYPT_TAG_BYTES
+ */
+extern void crypt_mac(const crypt_key* key, const void* data, size_t len,
+		      unsigned char* tag);
+
+/* int crypt_random(unsigned char* buf, int len)
+ * Purpose: Fill buf with cryptographically strong random bytes
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int crypt_random(unsigned char* buf, int len);
+
 #endif
@@ -0,0 +1,183 @@
+/* attr-cache.c
+ * Short-lived cache of file attributes for pa4-encfs
+ *
+ * See attr-cache.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "attr-cache.h"
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t path_hash(const char* s){
+    uint32_t h = 2166136261u;
+
+    while(*s){
+	h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t current_gen(attr_cache* ac){
+    return __sync_fetch_and_add(&ac->gen, 0);
+}
+
+#define SLOT(ac, h) ((h) & ((ac)->nslots - 1))
+#define LOCK(ac, i) (&(ac)->locks[(i) % ATTR_LOCKS])
+
+extern int attr_cache_init(attr_cache* ac, size_t nslots){
+    int i;
+
+    memset(ac, 0, sizeof(*ac));
+    ac->nslots = ATTR_LOCKS;
+    while(ac->nslots < nslots){
+	ac->nslots *= 2;
+    }
+    ac->slots = calloc(ac->nslots, sizeof(*ac->slots));
+    if(ac->slots == NULL){
+	return -ENOMEM;
+    }
+    for(i = 0; i < ATTR_LOCKS; i++){
+	pthread_mutex_init(&ac->locks[i], NULL);
+    }
+    return 0;
+}
+
+extern void attr_cache_destroy(attr_cache* ac){
+    size_t i;
+
+    for(i = 0; i < ac->nslots; i++){
+	free(ac->slots[i].path);
+    }
+    free(ac->slots);
+    for(i = 0; i < ATTR_LOCKS; i++){
+	pthread_mutex_destroy(&ac->locks[i]);
+    }
+}
+
+extern int attr_cache_get(attr_cache* ac, const char* path, struct stat* st){
+    uint32_t h = path_hash(path);
+    size_t i = SLOT(ac, h);
+    attr_entry* e = &ac->slots[i];
+    uint32_t gen = current_gen(ac);
+    int res = -ENOENT;
+
+    pthread_mutex_lock(LOCK(ac, i));
+    if(e->path != NULL && e->hash == h && e->gen == gen && !strcmp(e->path, path) &&
+       e->expires > now_ns()){
+	*st = e->st;
+	res = 0;
+    }
+    pthread_mutex_unlock(LOCK(ac, i));
+    return res;
+}
+
+extern uint64_t attr_cache_token(attr_cache* ac, const char* path){
+    size_t i = SLOT(ac, path_hash(path));
+    uint64_t token;
+
+    pthread_mutex_lock(LOCK(ac, i));
+    token = (uint64_t)current_gen(ac) << 32 | ac->slots[i].ver;
+    pthread_mutex_unlock(LOCK(ac, i));
+    return token;
+}
+
+extern void attr_cache_put(attr_cache* ac, const char* path, const struct stat* st,
+			   uint64_t token){
+    uint32_t h = path_hash(path);
+    size_t i = SLOT(ac, h);
+    attr_entry* e = &ac->slots[i];
+    char* copy = strdup(path);
+
+    if(copy == NULL){
+	return;
+    }
+    pthread_mutex_lock(LOCK(ac, i));
+    if(token == ((uint64_t)current_gen(ac) << 32 | e->ver)){
+	free(e->path);
+	e->path = copy;
+	copy = NULL;
+	e->hash = h;
+	e->gen = token >> 32;
+	e->expires = now_ns() + (uint64_t)ATTR_CACHE_TTL_MS * 1000000;
+	e->st = *st;
+    }
+    pthread_mutex_unlock(LOCK(ac, i));
+    free(copy);
+}
+
+extern void attr_cache_forget(attr_cache* ac, const char* path){
+    size_t i = SLOT(ac, path_hash(path));
+    attr_entry* e = &ac->slots[i];
+
+    pthread_mutex_lock(LOCK(ac, i));
+    e->ver++;
+    free(e->path);
+    e->path = NULL;
+    pthread_mutex_unlock(LOCK(ac, i));
+}
+
+/* Forget every entry match() picks, slot by slot. Every slot's version is
+ * bumped, match or not: a result in flight for a path that isn't cached
+ * (or whose slot holds another path) may be one of those to forget. */
+static void forget_matching(attr_cache* ac, int (*match)(const attr_entry*, const void*),
+			    const void* arg){
+    size_t i;
+
+    for(i = 0; i < ac->nslots; i++){
+	attr_entry* e = &ac->slots[i];
+
+	pthread_mutex_lock(LOCK(ac, i));
+	e->ver++;
+	if(e->path != NULL && match(e, arg)){
+	    free(e->path);
+	    e->path = NULL;
+	}
+	pthread_mutex_unlock(LOCK(ac, i));
+    }
+}
+
+static int match_ino(const attr_entry* e, const void* arg){
+    const struct stat* st = arg;
+
+    return e->st.st_ino == st->st_ino && e->st.st_dev == st->st_dev;
+}
+
+static int match_tree(const attr_entry* e, const void* arg){
+    const char* dir = arg;
+    size_t len = strlen(dir);
+
+    /* "/" is the root: everything is below it */
+    if(len == 1){
+	return 1;
+    }
+    return !strncmp(e->path, dir, len) && e->path[len] == '/';
+}
+
+extern void attr_cache_forget_ino(attr_cache* ac, dev_t dev, ino_t ino){
+    struct stat st;
+
+    st.st_dev = dev;
+    st.st_ino = ino;
+    forget_matching(ac, match_ino, &st);
+}
+
+extern void attr_cache_forget_tree(attr_cache* ac, const char* dir){
+    forget_matching(ac, match_tree, dir);
+}
+
+extern void attr_cache_clear(attr_cache* ac){
+    __sync_add_and_fetch(&ac->gen, 1);
+}
@@ -0,0 +1,93 @@
+/* attr-cache.h
+ * Short-lived cache of file attributes for pa4-encfs
+ *
+ * Directory listings stat every entry they return and leave the results
+ * here, keyed by mount path, so the getattr() calls that follow a listing
+ * (ls -l, rsync, find) are answered without resolving the path again or
+ * reading the file's header for its plaintext size. Entries expire after
+ * ATTR_CACHE_TTL_MS, the kernel's own default attribute timeout.
+ *
+ * Anything that changes a file forgets its entry (and its directory's).
+ * Changes that reach further forget just what they touch: every name of a
+ * hard-linked inode, or every path under a renamed directory. Those scan the
+ * table; clearing everything only bumps a generation count, but would throw
+ * away what the last listing prefetched. A result is stored with a token
+ * taken before it was computed, so an entry forgotten while its stat() was
+ * in flight is not brought back stale.
+ *
+ * The table is direct-mapped, each slot under one of ATTR_LOCKS striped
+ * locks.
+ *
+ */
+
+#ifndef ATTR_CACHE_H
+#define ATTR_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define ATTR_CACHE_DEFAULT 16384
+#define ATTR_CACHE_TTL_MS  1000
+#define ATTR_LOCKS         64
+
+typedef struct attr_entry {
+    char* path;                   /* NULL: empty */
+    uint32_t hash;
+    uint32_t gen;                 /* Cache generation it was stored in */
+    uint32_t ver;                 /* Bumped by every forget that may cover this slot */
+    uint64_t expires;             /* CLOCK_MONOTONIC ns */
+    struct stat st;
+} attr_entry;
+
+typedef struct attr_cache {
+    attr_entry* slots;
+    size_t nslots;                /* Power of two */
+    uint32_t gen;
+    pthread_mutex_t locks[ATTR_LOCKS];
+} attr_cache;
+
+/* int attr_cache_init(attr_cache* ac, size_t nslots)
+ * Purpose: Set up an empty cache (nslots rounded up to a power of two)
+ * Return: 0 on success, -errno on error
+ */
+extern int attr_cache_init(attr_cache* ac, size_t nslots);
+
+/* void attr_cache_destroy(attr_cache* ac) */
+extern void attr_cache_destroy(attr_cache* ac);
+
+/* int attr_cache_get(attr_cache* ac, const char* path, struct stat* st)
+ * Return: 0 with *st set on a hit, -ENOENT otherwise
+ */
+extern int attr_cache_get(attr_cache* ac, const char* path, struct stat* st);
+
+/* uint64_t attr_cache_token(attr_cache* ac, const char* path)
+ * Purpose: Taken before the attributes of path are read, for attr_cache_put()
+ */
+extern uint64_t attr_cache_token(attr_cache* ac, const char* path);
+
+/* void attr_cache_put(attr_cache* ac, const char* path, const struct stat* st, uint64_t token)
+ * Purpose: Store attributes, unless path was forgotten since token was taken
+ */
+extern void attr_cache_put(attr_cache* ac, const char* path, const struct stat* st,
+			   uint64_t token);
+
+/* void attr_cache_forget(attr_cache* ac, const char* path) */
+extern void attr_cache_forget(attr_cache* ac, const char* path);
+
+/* void attr_cache_forget_ino(attr_cache* ac, dev_t dev, ino_t ino)
+ * Purpose: Forget every name cached for an inode (its link count or ctime
+ *          changed through another name)
+ */
+extern void attr_cache_forget_ino(attr_cache* ac, dev_t dev, ino_t ino);
+
+/* void attr_cache_forget_tree(attr_cache* ac, const char* dir)
+ * Purpose: Forget every path below dir (which was renamed or replaced)
+ */
+extern void attr_cache_forget_tree(attr_cache* ac, const char* dir);
+
+/* void attr_cache_clear(attr_cache* ac) */
+extern void attr_cache_clear(attr_cache* ac);
+
+#endif
@@ -0,0 +1,301 @@
+/* buf-pool.c
+ * Pooled, aligned buffer allocator for pa4-encfs crypto and I/O buffers
+ *
+ * See buf-pool.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "buf-pool.h"
+
+/* Per-thread stash of free buffers, reached through pool->cache_key. Its
+ * lock is only ever contended by a thread draining it at the ceiling. Lock
+ * order: pool->lock, then a cache lock. */
+typedef struct bufpool_cache {
+    bufpool* pool;
+    pthread_spinlock_t lock;
+    int count;
+    void* bufs[BUFPOOL_CACHE_SIZE];
+    struct bufpool_cache* next;
+    struct bufpool_cache** pprev;
+} bufpool_cache;
+
+static void push_free(bufpool* pool, void* buf){
+    *(void**)buf = pool->free_list;
+    pool->free_list = buf;
+    pool->nfree++;
+}
+
+static void* pop_free(bufpool* pool){
+    void* buf = pool->free_list;
+    pool->free_list = *(void**)buf;
+    pool->nfree--;
+    return buf;
+}
+
+/* Move a cache's buffers to the shared free list. Called with pool->lock held. */
+static void cache_drain(bufpool* pool, bufpool_cache* cache){
+    pthread_spin_lock(&cache->lock);
+    while(cache->count > 0){
+	push_free(pool, cache->bufs[--cache->count]);
+    }
+    pthread_spin_unlock(&cache->lock);
+}
+
+/* Thread exit: hand the cached buffers back to the shared free list */
+static void cache_destroy(void* arg){
+    bufpool_cache* cache = arg;
+    bufpool* pool = cache->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    cache_drain(pool, cache);
+    *cache->pprev = cache->next;
+    if(cache->next){
+	cache->next->pprev = cache->pprev;
+    }
+    pthread_cond_broadcast(&pool->avail);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_spin_destroy(&cache->lock);
+    free(cache);
+}
+
+static bufpool_cache* get_cache(bufpool* pool){
+    bufpool_cache* cache = pthread_getspecific(pool->cache_key);
+
+    if(!cache){
+	/* Once per thread, never on the steady-state path */
+	cache = calloc(1, sizeof(*cache));
+	if(!cache){
+	    return NULL;
+	}
+	cache->pool = pool;
+	pthread_spin_init(&cache->lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_mutex_lock(&pool->lock);
+	cache->next = pool->caches;
+	cache->pprev = &pool->caches;
+	if(pool->caches){
+	    pool->caches->pprev = &cache->next;
+	}
+	pool->caches = cache;
+	pthread_mutex_unlock(&pool->lock);
+	pthread_setspecific(pool->cache_key, cache);
+    }
+    return cache;
+}
+
+/* Map one more slab and carve it into buffers. Called with pool->lock held. */
+static int grow(bufpool* pool){
+    size_t size = BUFPOOL_SLAB_SIZE;
+    bufpool_slab* slab;
+    void* base = MAP_FAILED;
+    size_t off;
+
+    if(pool->max_bytes - pool->total_bytes < size){
+	size = pool->max_bytes - pool->total_bytes;
+    }
+    size -= size % pool->block_size;
+    if(size == 0){
+	return -ENOMEM;
+    }
+
+    slab = malloc(sizeof(*slab));
+    if(!slab){
+	return -ENOMEM;
+    }
+
+#ifdef MAP_HUGETLB
+    if((pool->flags & BUFPOOL_HUGEPAGES) && size == BUFPOOL_SLAB_SIZE){
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if(base == MAP_FAILED){
+	/* No reserved huge pages: ask for transparent ones instead */
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED){
+	    free(slab);
+	    return -errno;
+	}
+#ifdef MADV_HUGEPAGE
+	if(pool->flags & BUFPOOL_HUGEPAGES){
+	    madvise(base, size, MADV_HUGEPAGE);
+	}
+#endif
+    }
+#ifdef MADV_DONTDUMP
+    /* Keep plaintext and keys out of core dumps */
+    madvise(base, size, MADV_DONTDUMP);
+#endif
+    if((pool->flags & BUFPOOL_MLOCK) && mlock(base, size)){
+	perror("bufpool: mlock failed, buffers may be swapped");
+	pool->flags &= ~BUFPOOL_MLOCK;
+    }
+
+    slab->base = base;
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->total_bytes += size;
+
+    for(off = 0; off < size; off += pool->block_size){
+	push_free(pool, (char*)base + off);
+    }
+    return 0;
+}
+
+/* Slow path: refill the thread cache from the shared list */
+static void* get_slow(bufpool* pool, bufpool_cache* cache, int block){
+    bufpool_cache* other;
+    void* buf = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->nfree == 0){
+	if(pool->total_bytes < pool->max_bytes && grow(pool) == 0){
+	    continue;
+	}
+	if(!block || pool->total_bytes == 0){
+	    pthread_mutex_unlock(&pool->lock);
+	    return NULL;
+	}
+	/* Ceiling reached: take back what idle threads are sitting on, and
+	 * if that's nothing, wait for a buffer to come back. Once waiters is
+	 * up, puts go to the shared list (see bufpool_put()). */
+	atomic_fetch_add(&pool->waiters, 1);
+	for(other = pool->caches; other; other = other->next){
+	    cache_drain(pool, other);
+	}
+	if(pool->nfree == 0){
+	    pthread_cond_wait(&pool->avail, &pool->lock);
+	}
+	atomic_fetch_sub(&pool->waiters, 1);
+    }
+    buf = pop_free(pool);
+    /* Take a few more while we hold the lock, unless others are waiting */
+    if(cache && !atomic_load(&pool->waiters)){
+	pthread_spin_lock(&cache->lock);
+	while(cache->count < BUFPOOL_CACHE_SIZE / 2 && pool->nfree > 0){
+	    cache->bufs[cache->count++] = pop_free(pool);
+	}
+	pthread_spin_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+extern int bufpool_init(bufpool* pool, size_t block_size, size_t max_bytes, int flags){
+    long page = sysconf(_SC_PAGESIZE);
+    int res;
+
+    memset(pool, 0, sizeof(*pool));
+    if(block_size == 0 || block_size > BUFPOOL_SLAB_SIZE){
+	return -EINVAL;
+    }
+    pool->block_size = (block_size + page - 1) / page * page;
+    pool->max_bytes = max_bytes < BUFPOOL_SLAB_SIZE ? BUFPOOL_SLAB_SIZE : max_bytes;
+    pool->flags = flags;
+
+    res = pthread_key_create(&pool->cache_key, cache_destroy);
+    if(res){
+	return -res;
+    }
+    atomic_init(&pool->waiters, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->avail, NULL);
+    return 0;
+}
+
+extern void bufpool_destroy(bufpool* pool){
+    bufpool_cache* cache = pthread_getspecific(pool->cache_key);
+    bufpool_slab* slab;
+
+    if(cache){
+	pthread_setspecific(pool->cache_key, NULL);
+	cache_destroy(cache);
+    }
+    pthread_key_delete(pool->cache_key);
+
+    while((slab = pool->slabs) != NULL){
+	pool->slabs = slab->next;
+	memset(slab->base, 0, slab->size);
+	if(pool->flags & BUFPOOL_MLOCK){
+	    munlock(slab->base, slab->size);
+	}
+	munmap(slab->base, slab->size);
+	free(slab);
+    }
+    pthread_cond_destroy(&pool->avail);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* Fast path: a buffer from this thread's cache, NULL if it has none */
+static void* cache_get(bufpool_cache* cache){
+    void* buf = NULL;
+
+    if(cache){
+	pthread_spin_lock(&cache->lock);
+	if(cache->count > 0){
+	    buf = cache->bufs[--cache->count];
+	}
+	pthread_spin_unlock(&cache->lock);
+    }
+    return buf;
+}
+
+extern void* bufpool_get(bufpool* pool){
+    bufpool_cache* cache = get_cache(pool);
+    void* buf = cache_get(cache);
+
+    return buf ? buf : get_slow(pool, cache, 1);
+}
+
+extern void* bufpool_tryget(bufpool* pool){
+    bufpool_cache* cache = get_cache(pool);
+    void* buf = cache_get(cache);
+
+    return buf ? buf : get_slow(pool, cache, 0);
+}
+
+extern void bufpool_put(bufpool* pool, void* buf){
+    bufpool_cache* cache = pthread_getspecific(pool->cache_key);
+    int cached = 0;
+
+    if(!buf){
+	return;
+    }
+    /* Fast path: stash locally unless another thread is starved */
+    if(cache && !atomic_load(&pool->waiters)){
+	pthread_spin_lock(&cache->lock);
+	if(cache->count < BUFPOOL_CACHE_SIZE){
+	    cache->bufs[cache->count++] = buf;
+	    cached = 1;
+	}
+	pthread_spin_unlock(&cache->lock);
+	/* A waiter that came in meanwhile may have drained us before the
+	 * stash: seeing it here is what keeps the buffer from being stranded */
+	if(cached && !atomic_load(&pool->waiters)){
+	    return;
+	}
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if(!cached){
+	push_free(pool, buf);
+    }
+    if(cache && atomic_load(&pool->waiters)){
+	/* Release our stash too so waiters aren't starved by idle caches */
+	cache_drain(pool, cache);
+    }
+    if(atomic_load(&pool->waiters)){
+	pthread_cond_broadcast(&pool->avail);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,82 @@
+/* buf-pool.h
+ * Pooled, aligned buffer allocator for pa4-encfs crypto and I/O buffers
+ *
+ * Buffers are fixed-size, page aligned and carved out of large slabs that can
+ * be backed by huge pages and mlock()ed, so plaintext and key material never
+ * reach swap. Every thread keeps a small private cache of free buffers, so a
+ * get/put pair on the read/write path takes no shared lock and never calls
+ * malloc(). The pool never holds more than its ceiling: once it is reached,
+ * bufpool_get() takes back whatever sits in other threads' caches, then
+ * blocks until some other thread returns a buffer.
+ *
+ */
+
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Pool flags */
+#define BUFPOOL_HUGEPAGES 0x1 /* Back slabs with (transparent) huge pages */
+#define BUFPOOL_MLOCK     0x2 /* Pin slabs in RAM */
+
+#define BUFPOOL_SLAB_SIZE  (2 * 1024 * 1024)
+#define BUFPOOL_CACHE_SIZE 8
+
+typedef struct bufpool_slab {
+    void* base;
+    size_t size;
+    struct bufpool_slab* next;
+} bufpool_slab;
+
+typedef struct bufpool {
+    size_t block_size;
+    size_t max_bytes;
+    size_t total_bytes;
+    int flags;
+
+    void* free_list;      /* Free buffers, linked through their first word */
+    size_t nfree;
+    atomic_int waiters;   /* Threads blocked on the ceiling */
+    bufpool_slab* slabs;
+    struct bufpool_cache* caches; /* Every thread's cache, so waiters can drain them */
+
+    pthread_mutex_t lock;
+    pthread_cond_t avail;
+    pthread_key_t cache_key;
+} bufpool;
+
+/* int bufpool_init(bufpool* pool, size_t block_size, size_t max_bytes, int flags)
+ * Purpose: Set up an empty pool. No memory is mapped until the first get.
+ * Args: bufpool* pool    : Pool to initialize
+ *       size_t block_size: Buffer size, rounded up to a multiple of the page size
+ *       size_t max_bytes : Memory ceiling (at least one slab)
+ *       int flags        : BUFPOOL_* flags
+ * Return: 0 on success, -errno on error
+ */
+extern int bufpool_init(bufpool* pool, size_t block_size, size_t max_bytes, int flags);
+
+/* void bufpool_destroy(bufpool* pool)
+ * Purpose: Wipe and unmap every slab. All buffers must have been returned.
+ */
+extern void bufpool_destroy(bufpool* pool);
+
+/* void* bufpool_get(bufpool* pool)
+ * Purpose: Take one buffer from the pool, blocking at the ceiling
+ * Return: Page aligned buffer of pool->block_size bytes, NULL if mapping failed
+ */
+extern void* bufpool_get(bufpool* pool);
+
+/* void* bufpool_tryget(bufpool* pool)
+ * Purpose: Like bufpool_get() but returns NULL instead of blocking
+ */
+extern void* bufpool_tryget(bufpool* pool);
+
+/* void bufpool_put(bufpool* pool, void* buf)
+ * Purpose: Return a buffer obtained from bufpool_get()/bufpool_tryget()
+ */
+extern void bufpool_put(bufpool* pool, void* buf);
+
+#endif
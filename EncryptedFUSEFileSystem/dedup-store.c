@@ -0,0 +1,419 @@
+/* dedup-store.c
+ * Content-addressed store of encrypted blocks shared between pa4-encfs files
+ *
+ * See dedup-store.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dedup-store.h"
+
+#define MIN_SLOTS 1024
+
+/* ---- Hash table of live chunks (caller holds ds->lock) ---- */
+
+static uint64_t home(const dedup_store* ds, const unsigned char* hash){
+    uint64_t h;
+
+    memcpy(&h, hash, sizeof(h));
+    return h & (ds->tcap - 1);
+}
+
+static uint64_t table_find(const dedup_store* ds, const unsigned char* hash){
+    uint64_t pos = home(ds, hash);
+
+    while(ds->table[pos] != 0){
+	if(!memcmp(ds->slots[ds->table[pos]].hash, hash, DEDUP_HASH_BYTES)){
+	    return ds->table[pos];
+	}
+	pos = (pos + 1) & (ds->tcap - 1);
+    }
+    return 0;
+}
+
+static void table_link(dedup_store* ds, uint64_t id){
+    uint64_t pos = home(ds, ds->slots[id].hash);
+
+    while(ds->table[pos] != 0){
+	pos = (pos + 1) & (ds->tcap - 1);
+    }
+    ds->table[pos] = id;
+}
+
+/* Keep the table at most half full */
+static int table_insert(dedup_store* ds, uint64_t id){
+    if((ds->nlive + 1) * 2 > ds->tcap){
+	uint64_t* old = ds->table;
+	uint64_t ocap = ds->tcap;
+	uint64_t i;
+
+	ds->table = calloc(ocap * 2, sizeof(*ds->table));
+	if(ds->table == NULL){
+	    ds->table = old;
+	    return -ENOMEM;
+	}
+	ds->tcap = ocap * 2;
+	for(i = 0; i < ocap; i++){
+	    if(old[i] != 0){
+		table_link(ds, old[i]);
+	    }
+	}
+	free(old);
+    }
+    table_link(ds, id);
+    ds->nlive++;
+    return 0;
+}
+
+/* Linear probing delete: shift later members of the cluster back */
+static void table_remove(dedup_store* ds, uint64_t id){
+    uint64_t mask = ds->tcap - 1;
+    uint64_t i = home(ds, ds->slots[id].hash);
+    uint64_t j;
+
+    while(ds->table[i] != id){
+	i = (i + 1) & mask;
+    }
+    for(j = (i + 1) & mask; ds->table[j] != 0; j = (j + 1) & mask){
+	uint64_t k = home(ds, ds->slots[ds->table[j]].hash);
+
+	/* Move j into the hole unless its home lies cyclically in (i, j] */
+	if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)){
+	    ds->table[i] = ds->table[j];
+	    i = j;
+	}
+    }
+    ds->table[i] = 0;
+    ds->nlive--;
+}
+
+/* ---- Slots ---- */
+
+static int free_push(dedup_store* ds, uint64_t id){
+    if(ds->nfree == ds->free_cap){
+	uint64_t ncap = ds->free_cap ? ds->free_cap * 2 : MIN_SLOTS;
+	uint64_t* ids = realloc(ds->free_ids, ncap * sizeof(*ids));
+
+	if(ids == NULL){
+	    return -ENOMEM;
+	}
+	ds->free_ids = ids;
+	ds->free_cap = ncap;
+    }
+    ds->free_ids[ds->nfree++] = id;
+    return 0;
+}
+
+/* Check the header of the mapped index and take the chunk size from it */
+static int header_check(dedup_store* ds){
+    dedup_header* hdr = (dedup_header*)ds->slots;
+
+    ds->chunk_size = hdr->chunk_size;
+    if(memcmp(hdr->magic, DEDUP_MAGIC, sizeof(hdr->magic)) ||
+       ds->chunk_size == 0 || ds->chunk_size > ds->pool->block_size){
+	return -EIO;
+    }
+    return 0;
+}
+
+/* Map cap slots of a read only index file */
+static int index_view(dedup_store* ds, uint64_t cap){
+    if(cap == 0){
+	return -EIO;
+    }
+    ds->slots = mmap(NULL, cap * sizeof(dedup_slot), PROT_READ, MAP_SHARED, ds->index_fd, 0);
+    if(ds->slots == MAP_FAILED){
+	ds->slots = NULL;
+	return -errno;
+    }
+    ds->cap = cap;
+    return header_check(ds);
+}
+
+/* Map cap slots of the index file, growing it as needed */
+static int index_map(dedup_store* ds, uint64_t cap){
+    dedup_slot* slots;
+    uint64_t i;
+
+    if(ftruncate(ds->index_fd, cap * sizeof(dedup_slot)) == -1){
+	return -errno;
+    }
+    slots = mmap(NULL, cap * sizeof(dedup_slot), PROT_READ | PROT_WRITE, MAP_SHARED,
+		 ds->index_fd, 0);
+    if(slots == MAP_FAILED){
+	return -errno;
+    }
+    if(ds->slots != NULL){
+	munmap(ds->slots, ds->cap * sizeof(dedup_slot));
+    }
+    ds->slots = slots;
+
+    /* New slots are free; hand out low ids first */
+    for(i = cap; i-- > (ds->cap ? ds->cap : 1); ){
+	if(free_push(ds, i)){
+	    return -ENOMEM;
+	}
+    }
+    ds->cap = cap;
+    return 0;
+}
+
+static int slot_alloc(dedup_store* ds, uint64_t* id){
+    int res;
+
+    if(ds->nfree == 0){
+	res = index_map(ds, ds->cap * 2);
+	if(res){
+	    return res;
+	}
+    }
+    *id = ds->free_ids[--ds->nfree];
+    return 0;
+}
+
+/* Hand a chunk id back, dropping its data */
+static void slot_free(dedup_store* ds, uint64_t id){
+    memset(&ds->slots[id], 0, sizeof(ds->slots[id]));
+    fallocate(ds->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	      (off_t)id * ds->chunk_size, ds->chunk_size);
+    free_push(ds, id);
+}
+
+/* ---- Interface ---- */
+
+extern int dedup_open(dedup_store* ds, const char* dir, const crypt_key* key, bufpool* pool,
+		      uint32_t chunk_size, int flags){
+    static const char label1[] = "pa4-encfs dedup hash key 1";
+    static const char label2[] = "pa4-encfs dedup hash key 2";
+    char path[PATH_MAX];
+    dedup_header* hdr;
+    struct stat st;
+    uint64_t i;
+    int res;
+
+    memset(ds, 0, sizeof(*ds));
+    ds->data_fd = -1;
+    ds->index_fd = -1;
+    ds->key = key;
+    ds->pool = pool;
+    pthread_mutex_init(&ds->lock, NULL);
+
+    /* Separate key for content hashes */
+    crypt_mac(key, label1, sizeof(label1), ds->hash_key.mac);
+    crypt_mac(key, label2, sizeof(label2), ds->hash_key.mac + CRYPT_TAG_BYTES);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, DEDUP_DATA_NAME);
+    ds->data_fd = flags & DEDUP_RDONLY ? open(path, O_RDONLY) : open(path, O_RDWR | O_CREAT, 0600);
+    snprintf(path, sizeof(path), "%s/%s", dir, DEDUP_INDEX_NAME);
+    ds->index_fd = flags & DEDUP_RDONLY ? open(path, O_RDONLY) : open(path, O_RDWR | O_CREAT, 0600);
+    if(ds->data_fd == -1 || ds->index_fd == -1 || fstat(ds->index_fd, &st) == -1){
+	res = -errno;
+	dedup_close(ds);
+	return res;
+    }
+
+    if(flags & DEDUP_RDONLY){
+	/* The slots as they are: dedup_get() needs nothing else */
+	res = index_view(ds, st.st_size / sizeof(dedup_slot));
+	if(res){
+	    dedup_close(ds);
+	}
+	return res;
+    }
+
+    if(st.st_size < (off_t)sizeof(dedup_slot)){
+	/* New store */
+	res = index_map(ds, MIN_SLOTS);
+	if(res == 0){
+	    hdr = (dedup_header*)ds->slots;
+	    memcpy(hdr->magic, DEDUP_MAGIC, sizeof(hdr->magic));
+	    hdr->chunk_size = chunk_size;
+	}
+    }
+    else{
+	res = index_map(ds, st.st_size / sizeof(dedup_slot));
+    }
+    if(res == 0){
+	res = header_check(ds);
+    }
+
+    /* Index the live chunks; the rest are already on the free list */
+    ds->tcap = MIN_SLOTS * 2;
+    ds->table = res ? NULL : calloc(ds->tcap, sizeof(*ds->table));
+    if(res == 0 && ds->table == NULL){
+	res = -ENOMEM;
+    }
+    if(res == 0){
+	ds->nfree = 0;
+	for(i = ds->cap; res == 0 && i-- > 1; ){
+	    if(ds->slots[i].refcnt == 0){
+		res = free_push(ds, i);
+	    }
+	    else if(table_find(ds, ds->slots[i].hash) != 0){
+		/* A crash between storing twice and dropping one */
+		ds->slots[table_find(ds, ds->slots[i].hash)].refcnt += ds->slots[i].refcnt;
+		slot_free(ds, i);
+	    }
+	    else{
+		res = table_insert(ds, i);
+	    }
+	}
+    }
+    if(res){
+	dedup_close(ds);
+    }
+    return res;
+}
+
+extern void dedup_close(dedup_store* ds){
+    if(ds->slots != NULL){
+	munmap(ds->slots, ds->cap * sizeof(dedup_slot));
+    }
+    if(ds->data_fd != -1){
+	close(ds->data_fd);
+    }
+    if(ds->index_fd != -1){
+	close(ds->index_fd);
+    }
+    free(ds->table);
+    free(ds->free_ids);
+    pthread_mutex_destroy(&ds->lock);
+    memset(ds, 0, sizeof(*ds));
+    ds->data_fd = -1;
+    ds->index_fd = -1;
+}
+
+extern int dedup_put(dedup_store* ds, const unsigned char* plain, uint32_t len, uint64_t* id){
+    unsigned char hash[DEDUP_HASH_BYTES];
+    unsigned char iv[CRYPT_IV_BYTES];
+    unsigned char tag[CRYPT_TAG_BYTES];
+    unsigned char* buf;
+    uint64_t found;
+    ssize_t res;
+
+    if(len > ds->chunk_size){
+	return -EINVAL;
+    }
+    crypt_mac(&ds->hash_key, plain, len, hash);
+
+    /* Known block: just count the new user */
+    pthread_mutex_lock(&ds->lock);
+    found = table_find(ds, hash);
+    if(found != 0){
+	ds->slots[found].refcnt++;
+	pthread_mutex_unlock(&ds->lock);
+	*id = found;
+	return 0;
+    }
+    res = slot_alloc(ds, id);
+    pthread_mutex_unlock(&ds->lock);
+    if(res){
+	return res;
+    }
+
+    /* New block: seal and write it outside the lock */
+    buf = bufpool_get(ds->pool);
+    if(buf == NULL){
+	res = -ENOMEM;
+    }
+    else if(!crypt_random(iv, sizeof(iv)) ||
+	    !crypt_seal_block(ds->key, iv, hash, sizeof(hash), plain, len, buf, tag)){
+	res = -EIO;
+    }
+    else{
+	res = pwrite(ds->data_fd, buf, len, (off_t)*id * ds->chunk_size);
+	res = res == (ssize_t)len ? 0 : (res == -1 ? -errno : -EIO);
+    }
+    bufpool_put(ds->pool, buf);
+
+    pthread_mutex_lock(&ds->lock);
+    found = res ? 0 : table_find(ds, hash);
+    if(res || found != 0){
+	/* Failed, or someone stored the same block meanwhile */
+	slot_free(ds, *id);
+	if(found != 0){
+	    ds->slots[found].refcnt++;
+	    *id = found;
+	}
+    }
+    else{
+	dedup_slot* s = &ds->slots[*id];
+
+	memcpy(s->hash, hash, sizeof(hash));
+	memcpy(s->iv, iv, sizeof(iv));
+	memcpy(s->tag, tag, sizeof(tag));
+	s->len = len;
+	s->refcnt = 1;
+	res = table_insert(ds, *id);
+	if(res){
+	    slot_free(ds, *id);
+	}
+    }
+    pthread_mutex_unlock(&ds->lock);
+    return res;
+}
+
+extern int dedup_get(dedup_store* ds, uint64_t id, unsigned char* out, uint32_t cap){
+    unsigned char* buf;
+    dedup_slot s;
+    ssize_t res;
+
+    pthread_mutex_lock(&ds->lock);
+    if(id == 0 || id >= ds->cap || ds->slots[id].refcnt == 0){
+	pthread_mutex_unlock(&ds->lock);
+	return -EIO;
+    }
+    s = ds->slots[id];
+    pthread_mutex_unlock(&ds->lock);
+    if(s.len > cap){
+	return -EIO;
+    }
+
+    buf = bufpool_get(ds->pool);
+    if(buf == NULL){
+	return -ENOMEM;
+    }
+    res = pread(ds->data_fd, buf, s.len, (off_t)id * ds->chunk_size);
+    if(res != (ssize_t)s.len){
+	res = res == -1 ? -errno : -EIO;
+    }
+    else if(!crypt_open_block(ds->key, s.iv, s.hash, sizeof(s.hash), buf, s.len, out, s.tag)){
+	res = -EIO;
+    }
+    bufpool_put(ds->pool, buf);
+    return res;
+}
+
+extern void dedup_unref(dedup_store* ds, uint64_t id){
+    pthread_mutex_lock(&ds->lock);
+    if(id != 0 && id < ds->cap && ds->slots[id].refcnt > 0 && --ds->slots[id].refcnt == 0){
+	table_remove(ds, id);
+	slot_free(ds, id);
+    }
+    pthread_mutex_unlock(&ds->lock);
+}
+
+extern int dedup_sync(dedup_store* ds){
+    int res = 0;
+
+    pthread_mutex_lock(&ds->lock);
+    if(msync(ds->slots, ds->cap * sizeof(dedup_slot), MS_SYNC) == -1){
+	res = -errno;
+    }
+    pthread_mutex_unlock(&ds->lock);
+    if(res == 0 && fdatasync(ds->data_fd) == -1){
+	res = -errno;
+    }
+    return res;
+}
@@ -0,0 +1,114 @@
+/* dedup-store.h
+ * Content-addressed store of encrypted blocks shared between pa4-encfs files
+ *
+ * Every distinct plaintext block is stored once. Blocks are addressed by a
+ * keyed hash (HMAC-SHA256 under a key derived from the mount key, truncated
+ * to DEDUP_HASH_BYTES), so the index reveals nothing about the contents to
+ * anyone without the key. A file's map entry for a deduplicated block holds
+ * only the chunk id; writing a block that is already stored takes a
+ * reference and neither encrypts nor writes data.
+ *
+ * Two files in the mirror root hold the store:
+ *
+ *   .pa4-encfs.dedup      Chunk ciphertexts; chunk id n lives at n * chunk_size
+ *   .pa4-encfs.dedup-idx  Header, then one dedup_slot per chunk id (mmap()ed)
+ *
+ * Each chunk is sealed with AES-256-GCM under a random IV with its hash as
+ * additional data. Reference counts live in the slots. A count is raised
+ * before the map entry that needs it is written and dropped only after the
+ * entry is gone, so a crash can leak a chunk but never free one still in use.
+ * Free chunk slots are punched out of the data file and reused.
+ *
+ */
+
+#ifndef DEDUP_STORE_H
+#define DEDUP_STORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "aes-crypt.h"
+#include "buf-pool.h"
+
+#define DEDUP_DATA_NAME  ".pa4-encfs.dedup"
+#define DEDUP_INDEX_NAME ".pa4-encfs.dedup-idx"
+#define DEDUP_MAGIC      "PA4DEDUP"
+#define DEDUP_HASH_BYTES CRYPT_TAG_BYTES
+
+/* dedup_open() flags */
+#define DEDUP_RDONLY     0x1                /* Look, don't touch: for offline checks */
+
+/* On-disk slot (host byte order); slot 0 is the header */
+typedef struct dedup_slot {
+    unsigned char hash[DEDUP_HASH_BYTES];
+    uint32_t refcnt;                      /* 0: free */
+    uint32_t len;                         /* Plaintext bytes */
+    unsigned char iv[CRYPT_IV_BYTES];
+    unsigned char tag[CRYPT_TAG_BYTES];
+    uint32_t pad[3];
+} dedup_slot;
+
+typedef struct dedup_header {
+    char magic[8];
+    uint32_t chunk_size;
+    uint32_t pad[13];
+} dedup_header;
+
+typedef struct dedup_store {
+    int data_fd;
+    int index_fd;
+    const crypt_key* key;
+    crypt_key hash_key;                   /* Keys the content hashes */
+    bufpool* pool;
+    uint32_t chunk_size;
+    pthread_mutex_t lock;                 /* Protects everything below */
+    dedup_slot* slots;                    /* Mapped index, slots[0] = header */
+    uint64_t cap;                         /* Slots mapped, header included */
+    uint64_t nlive;                       /* Chunks in use */
+    uint64_t* table;                      /* Open addressing: hash -> id, 0 empty */
+    uint64_t tcap;                        /* Power of two */
+    uint64_t* free_ids;
+    uint64_t nfree;
+    uint64_t free_cap;
+} dedup_store;
+
+/* int dedup_open(dedup_store* ds, const char* dir, const crypt_key* key, bufpool* pool, uint32_t chunk_size, int flags)
+ * Purpose: Open (or create) the store in dir and load its index
+ * Args: const char* dir      : Mirror root
+ *       uint32_t chunk_size  : Block size of new stores; an existing store
+ *                              keeps its own (see ds->chunk_size)
+ *       int flags            : DEDUP_RDONLY opens an existing store without
+ *                              writing to it (no reference counts merged, no
+ *                              chunks freed); only dedup_get() may be used
+ * Return: 0 on success, -errno on error
+ */
+extern int dedup_open(dedup_store* ds, const char* dir, const crypt_key* key, bufpool* pool,
+		      uint32_t chunk_size, int flags);
+
+/* void dedup_close(dedup_store* ds) */
+extern void dedup_close(dedup_store* ds);
+
+/* int dedup_put(dedup_store* ds, const unsigned char* plain, uint32_t len, uint64_t* id)
+ * Purpose: Store a block, or take another reference on an identical one
+ * Return: 0 on success (*id set), -errno on error
+ */
+extern int dedup_put(dedup_store* ds, const unsigned char* plain, uint32_t len, uint64_t* id);
+
+/* int dedup_get(dedup_store* ds, uint64_t id, unsigned char* out, uint32_t cap)
+ * Purpose: Read and decrypt a chunk; the caller holds a reference
+ * Return: Plaintext length, -EIO on a bad chunk, -errno on error
+ */
+extern int dedup_get(dedup_store* ds, uint64_t id, unsigned char* out, uint32_t cap);
+
+/* void dedup_unref(dedup_store* ds, uint64_t id)
+ * Purpose: Drop a reference; the last one frees the chunk
+ */
+extern void dedup_unref(dedup_store* ds, uint64_t id);
+
+/* int dedup_sync(dedup_store* ds)
+ * Purpose: Flush chunks and reference counts to disk
+ * Return: 0 on success, -errno on error
+ */
+extern int dedup_sync(dedup_store* ds);
+
+#endif
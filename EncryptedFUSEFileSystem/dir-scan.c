@@ -0,0 +1,67 @@
+/* dir-scan.c
+ * Batched directory listing for pa4-encfs
+ *
+ * See dir-scan.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "dir-scan.h"
+
+/* What getdents64() returns, one after another */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+extern int dir_open(const char* path){
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    return fd == -1 ? -errno : fd;
+}
+
+extern int dir_scan(int fd, off_t offset, void* buf, size_t cap, dir_scan_fn fn, void* arg){
+    if(lseek(fd, offset, SEEK_SET) == -1){
+	return -errno;
+    }
+    for(;;){
+	long n = syscall(SYS_getdents64, fd, buf, cap);
+	long pos;
+
+	if(n == -1){
+	    return -errno;
+	}
+	if(n == 0){
+	    return 0;
+	}
+	for(pos = 0; pos < n;){
+	    struct linux_dirent64* de = (struct linux_dirent64*)((char*)buf + pos);
+
+	    pos += de->d_reclen;
+	    if(fn(arg, fd, de->d_name, de->d_ino, de->d_type, de->d_off)){
+		return 1;
+	    }
+	}
+    }
+}
+
+extern int dir_stat(int dirfd, const char* name, struct stat* st){
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW) == -1 ? -errno : 0;
+}
+
+extern int dir_open_entry(int dirfd, const char* name){
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+
+    return fd == -1 ? -errno : fd;
+}
@@ -0,0 +1,55 @@
+/* dir-scan.h
+ * Batched directory listing for pa4-encfs
+ *
+ * dir_scan() reads a directory with getdents64() into one large buffer, so
+ * a directory costs one system call per buffer-full of entries rather than
+ * one per readdir(). Every entry comes with the kernel's offset of the next
+ * one; handing that back to dir_scan() resumes the listing there, so a
+ * directory of any size can be streamed without being held in memory.
+ *
+ * The *at() helpers let callers look at entries relative to the directory
+ * descriptor instead of resolving a full path for each.
+ *
+ */
+
+#ifndef DIR_SCAN_H
+#define DIR_SCAN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* int dir_scan_fn(void* arg, int dirfd, const char* name, ino_t ino, unsigned char type, off_t next)
+ * Called for every entry; type is a DT_* value and next the offset to resume
+ * after this entry. Returns non-zero to stop the scan.
+ */
+typedef int (*dir_scan_fn)(void* arg, int dirfd, const char* name, ino_t ino,
+			   unsigned char type, off_t next);
+
+/* int dir_open(const char* path)
+ * Purpose: Open a directory for dir_scan()
+ * Return: Descriptor, -errno on error
+ */
+extern int dir_open(const char* path);
+
+/* int dir_scan(int fd, off_t offset, void* buf, size_t cap, dir_scan_fn fn, void* arg)
+ * Purpose: Hand fn the entries of fd from offset on
+ * Args: off_t offset : 0, or a next offset fn was given earlier
+ *       void* buf    : getdents64() buffer of cap bytes
+ * Return: 0 at the end of the directory, 1 if fn stopped it, -errno on error
+ */
+extern int dir_scan(int fd, off_t offset, void* buf, size_t cap, dir_scan_fn fn, void* arg);
+
+/* int dir_stat(int dirfd, const char* name, struct stat* st)
+ * Purpose: lstat() of an entry
+ * Return: 0 on success, -errno on error
+ */
+extern int dir_stat(int dirfd, const char* name, struct stat* st);
+
+/* int dir_open_entry(int dirfd, const char* name)
+ * Purpose: Open a regular file entry read-only, without following links
+ * Return: Descriptor, -errno on error
+ */
+extern int dir_open_entry(int dirfd, const char* name);
+
+#endif
@@ -0,0 +1,1195 @@
+/* encfs-block.c
+ * Block-addressable encrypted file format used by pa4-encfs
+ *
+ * See encfs-block.h for the on-disk layout
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include <openssl/crypto.h>
+
+#include "encfs-block.h"
+#include "lz-block.h"
+
+#define HEADER_MAC_LEN offsetof(encfs_header, tag)
+
+#define KEY_ID_LABEL "pa4-encfs key id"
+
+/* Additional data for a block: its index, with the top bit telling compressed
+ * blocks apart so the flag in the (unauthenticated) map can't be flipped,
+ * then the file ID so blocks can't be moved from one file to another */
+#define AAD_LZ (1ULL << 63)
+
+typedef struct block_ad {
+    uint64_t idx;
+    unsigned char file_id[16];            /* encfs_header.file_id */
+} block_ad;
+
+/* Don't bother compressing tiny blocks, or keeping ones that barely shrink */
+#define LZ_MIN_LEN   512
+#define LZ_MIN_SAVED 4096
+
+#define PAGE_ROUND(x) (((off_t)(x) + 4095) & ~(off_t)4095)
+
+/* Scratch buffers for one call, all from the pool */
+typedef struct scratch {
+    encfs_map_entry* map;   /* Map block of the current group */
+    unsigned char* cbuf;    /* Ciphertext */
+    unsigned char* pbuf;    /* Plaintext for partial blocks */
+    unsigned char* zbuf;    /* Compressed plaintext */
+    uint64_t group;
+    int lo, hi;             /* Dirty entry range in map, lo > hi when clean */
+    uint64_t drop[ENCFS_MAP_ENTRIES];   /* Dedup chunks replaced in map, */
+    int ndrop;                          /* released once it is written */
+} scratch;
+
+/* Walks the caller's data for encfs_pwritev() */
+typedef struct cursor {
+    const struct iovec* iov;
+    int iovcnt;
+    size_t off;             /* Into iov[0] */
+} cursor;
+
+static int scratch_get(encfs_file* f, scratch* s){
+    s->map = bufpool_get(f->pool);
+    s->cbuf = bufpool_get(f->pool);
+    s->pbuf = bufpool_get(f->pool);
+    s->zbuf = bufpool_get(f->pool);
+    s->group = UINT64_MAX;
+    s->lo = ENCFS_MAP_ENTRIES;
+    s->hi = -1;
+    s->ndrop = 0;
+    if(!s->map || !s->cbuf || !s->pbuf || !s->zbuf){
+	bufpool_put(f->pool, s->map);
+	bufpool_put(f->pool, s->cbuf);
+	bufpool_put(f->pool, s->pbuf);
+	bufpool_put(f->pool, s->zbuf);
+	return -ENOMEM;
+    }
+    return 0;
+}
+
+static void scratch_put(encfs_file* f, scratch* s){
+    bufpool_put(f->pool, s->map);
+    bufpool_put(f->pool, s->cbuf);
+    bufpool_put(f->pool, s->pbuf);
+    bufpool_put(f->pool, s->zbuf);
+}
+
+/* Pointer to the next n bytes if they are contiguous, else NULL */
+static const unsigned char* cursor_peek(cursor* c, size_t n){
+    while(c->iovcnt > 0 && c->off == c->iov->iov_len){
+	c->iov++;
+	c->iovcnt--;
+	c->off = 0;
+    }
+    if(c->iovcnt == 0 || c->iov->iov_len - c->off < n){
+	return NULL;
+    }
+    return (const unsigned char*)c->iov->iov_base + c->off;
+}
+
+/* Copy the next n bytes to dst (or skip them when dst is NULL) */
+static void cursor_take(cursor* c, unsigned char* dst, size_t n){
+    while(n > 0){
+	size_t k;
+
+	while(c->off == c->iov->iov_len){
+	    c->iov++;
+	    c->iovcnt--;
+	    c->off = 0;
+	}
+	k = c->iov->iov_len - c->off;
+	if(k > n){
+	    k = n;
+	}
+	if(dst){
+	    memcpy(dst, (const char*)c->iov->iov_base + c->off, k);
+	    dst += k;
+	}
+	c->off += k;
+	n -= k;
+    }
+}
+
+/* HMAC tying a dedup entry to this file and block, kept in its tag */
+static void dedup_entry_tag(const encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			    unsigned char* tag){
+    struct {
+	unsigned char file_id[sizeof(f->hdr.file_id)];
+	uint64_t idx;
+	uint32_t len;
+	unsigned char iv[CRYPT_IV_BYTES];
+    } ad;
+
+    memset(&ad, 0, sizeof(ad));
+    memcpy(ad.file_id, f->hdr.file_id, sizeof(ad.file_id));
+    ad.idx = idx;
+    ad.len = entry->len;
+    memcpy(ad.iv, entry->iv, sizeof(ad.iv));
+    crypt_mac(f->key, &ad, sizeof(ad), tag);
+}
+
+static uint64_t dedup_entry_id(const encfs_map_entry* entry){
+    uint64_t id;
+
+    memcpy(&id, entry->iv, sizeof(id));
+    return id;
+}
+
+/* Additional data for block idx, returning its length: the index alone in
+ * files from before ENCFS_FLAG_FILE_AAD */
+static size_t block_aad(const encfs_file* f, uint64_t idx, int lz, block_ad* ad){
+    ad->idx = idx | (lz ? AAD_LZ : 0);
+    if(!(f->hdr.flags & ENCFS_FLAG_FILE_AAD)){
+	return sizeof(ad->idx);
+    }
+    memcpy(ad->file_id, f->hdr.file_id, sizeof(ad->file_id));
+    return sizeof(*ad);
+}
+
+static void drop_chunks(encfs_file* f, scratch* s){
+    int i;
+
+    for(i = 0; i < s->ndrop; i++){
+	dedup_unref(f->dedup, s->drop[i]);
+    }
+    s->ndrop = 0;
+}
+
+/* Forget what an entry pointed at: queue its chunk, or punch its data from
+ * byte keep of the slot on */
+static void release_entry(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			  scratch* s, off_t keep){
+    uint32_t old = entry->len & ENCFS_LEN_MASK;
+
+    if(entry->len & ENCFS_LEN_DEDUP){
+	if(f->dedup){
+	    s->drop[s->ndrop++] = dedup_entry_id(entry);
+	}
+    }
+    else if(PAGE_ROUND(old) > keep){
+	fallocate(f->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  encfs_data_off(f, idx) + keep, PAGE_ROUND(old) - keep);
+    }
+}
+
+/* Write back the dirty part of the cached map block */
+static int map_flush(encfs_file* f, scratch* s){
+    ssize_t len;
+    ssize_t res;
+
+    if(s->lo > s->hi){
+	return 0;
+    }
+    len = (s->hi - s->lo + 1) * sizeof(encfs_map_entry);
+    res = pwrite(f->fd, &s->map[s->lo], len,
+		 encfs_map_off(f, s->group * ENCFS_MAP_ENTRIES + s->lo));
+    s->lo = ENCFS_MAP_ENTRIES;
+    s->hi = -1;
+    if(res == len){
+	/* The old entries are gone from disk; their chunks can go too */
+	drop_chunks(f, s);
+	return 0;
+    }
+    /* Otherwise leak them rather than free chunks the disk still uses */
+    s->ndrop = 0;
+    return res == -1 ? -errno : -EIO;
+}
+
+/* Read through the O_DIRECT descriptor if there is one: whole pages at a
+ * page-aligned offset into a pool buffer, which has room for them. Falls
+ * back to the normal descriptor where the backing filesystem refuses. */
+static ssize_t block_pread(encfs_file* f, void* buf, size_t len, off_t off){
+    ssize_t res;
+
+    if(f->dfd != -1 && (off & 4095) == 0){
+	res = pread(f->dfd, buf, PAGE_ROUND(len), off);
+	if(res != -1 || errno != EINVAL){
+	    return res > (ssize_t)len ? (ssize_t)len : res;
+	}
+    }
+    return pread(f->fd, buf, len, off);
+}
+
+/* Make sure the map block holding idx is loaded and return its entry */
+static int map_load(encfs_file* f, scratch* s, uint64_t idx, encfs_map_entry** entry){
+    uint64_t group = idx / ENCFS_MAP_ENTRIES;
+    ssize_t res;
+
+    if(group != s->group){
+	res = map_flush(f, s);
+	if(res){
+	    return res;
+	}
+	res = block_pread(f, s->map, ENCFS_MAP_SIZE,
+			  encfs_map_off(f, group * ENCFS_MAP_ENTRIES));
+	if(res == -1){
+	    return -errno;
+	}
+	/* Past the end of the backing file everything is a hole */
+	memset((char*)s->map + res, 0, ENCFS_MAP_SIZE - res);
+	s->group = group;
+    }
+    *entry = &s->map[idx % ENCFS_MAP_ENTRIES];
+    return 0;
+}
+
+static void map_dirty(scratch* s, uint64_t idx){
+    int i = idx % ENCFS_MAP_ENTRIES;
+
+    if(i < s->lo){
+	s->lo = i;
+    }
+    if(i > s->hi){
+	s->hi = i;
+    }
+}
+
+/* Latest version of block idx's entry: the one in the redo log (with its
+ * cipher in s->cbuf; return 1) if there is one, entry otherwise (return 0),
+ * -errno on error */
+static int logged_block(encfs_file* f, uint64_t idx, const encfs_map_entry** entry,
+			encfs_map_entry* logged, scratch* s){
+    int res;
+
+    if(!f->redo){
+	return 0;
+    }
+    res = f->redo->get(f->redo, idx, logged, s->cbuf);
+    if(res == 1){
+	*entry = logged;
+    }
+    return res;
+}
+
+/* Decrypt (and decompress) block idx into out and zero-fill it to cap bytes.
+ * cap must be the block size for compressed blocks. inlog: the cipher is in
+ * s->cbuf already (see logged_block()). */
+static int open_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry, int inlog,
+		      scratch* s, unsigned char* out, size_t cap){
+    uint32_t stored;
+    int lz;
+    block_ad ad;
+    size_t adlen;
+    ssize_t res;
+    int len;
+
+    stored = entry->len & ENCFS_LEN_MASK;
+    lz = (entry->len & ENCFS_LEN_LZ) != 0;
+    adlen = block_aad(f, idx, lz, &ad);
+
+    if(stored == 0 || stored > f->hdr.block_size || (!lz && stored > cap)){
+	memset(out, 0, cap);
+	return entry->len == 0 ? 0 : -EIO;
+    }
+    if(entry->len & ENCFS_LEN_DEDUP){
+	unsigned char tag[CRYPT_TAG_BYTES];
+
+	dedup_entry_tag(f, idx, entry, tag);
+	if(!f->dedup || lz || CRYPTO_memcmp(tag, entry->tag, sizeof(tag))){
+	    return -EIO;
+	}
+	len = dedup_get(f->dedup, dedup_entry_id(entry), out, cap);
+	if(len < 0){
+	    return len;
+	}
+	memset(out + len, 0, cap - len);
+	return 0;
+    }
+    if(!inlog){
+	res = block_pread(f, s->cbuf, stored, encfs_data_off(f, idx));
+	if(res == -1){
+	    return -errno;
+	}
+	if(res != (ssize_t)stored){
+	    return -EIO;
+	}
+    }
+    if(!crypt_open_block(f->key, entry->iv, &ad, adlen,
+			 s->cbuf, stored, lz ? s->zbuf : out, entry->tag)){
+	return -EIO;
+    }
+    len = stored;
+    if(lz){
+	len = lz_decompress(s->zbuf, stored, out, cap);
+	if(len < 0){
+	    return -EIO;
+	}
+    }
+    memset(out + len, 0, cap - len);
+    return 0;
+}
+
+/* open_block() on the latest version of block idx: a version of the block
+ * in the redo log wins over entry */
+static int read_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+		      scratch* s, unsigned char* out, size_t cap){
+    encfs_map_entry logged;
+    int inlog = logged_block(f, idx, &entry, &logged, s);
+
+    if(inlog < 0){
+	return inlog;
+    }
+    return open_block(f, idx, entry, inlog, s, out, cap);
+}
+
+/* Encrypt len bytes of plain as block idx and update its map entry. With a
+ * redo log the block goes there instead, with size as the plaintext size to
+ * expose once it is in place, and 1 is returned: entry is left alone. */
+static int write_block(encfs_file* f, uint64_t idx, encfs_map_entry* entry,
+		       const unsigned char* plain, uint32_t len, uint64_t size, scratch* s){
+    encfs_map_entry prev = *entry;
+    encfs_map_entry next;
+    const unsigned char* data = plain;
+    uint32_t stored = len;
+    block_ad ad;
+    size_t adlen;
+    off_t pos = encfs_data_off(f, idx);
+    ssize_t res;
+
+    /* Dedup: a block already in the store costs a reference, nothing more */
+    if(f->dedup && f->hdr.block_size == f->dedup->chunk_size){
+	uint64_t id;
+
+	res = dedup_put(f->dedup, plain, len, &id);
+	if(res){
+	    return res;
+	}
+	memset(entry, 0, sizeof(*entry));
+	entry->len = len | ENCFS_LEN_DEDUP;
+	memcpy(entry->iv, &id, sizeof(id));
+	dedup_entry_tag(f, idx, entry, entry->tag);
+	release_entry(f, idx, &prev, s, 0);
+	return 0;
+    }
+
+    /* Compress first; keep the result only if it saves backing pages */
+    if(f->compress && len >= LZ_MIN_LEN){
+	int zlen = lz_compress(plain, len, s->zbuf, len - LZ_MIN_LEN / 2);
+
+	if(zlen > 0 && PAGE_ROUND(zlen) < PAGE_ROUND(len)){
+	    data = s->zbuf;
+	    stored = zlen;
+	}
+    }
+
+    adlen = block_aad(f, idx, data == s->zbuf, &ad);
+    if(!crypt_random(next.iv, CRYPT_IV_BYTES) ||
+       !crypt_seal_block(f->key, next.iv, &ad, adlen,
+			 data, stored, s->cbuf, next.tag)){
+	return -EIO;
+    }
+    next.len = stored | (data == s->zbuf ? ENCFS_LEN_LZ : 0);
+
+    if(f->redo){
+	res = f->redo->put(f->redo, idx, &next, s->cbuf, size);
+	if(res < 0){
+	    return res;
+	}
+	/* Blocks were put in place under the cached map (which is clean:
+	 * nothing is written to it with a log) */
+	if(res){
+	    s->group = UINT64_MAX;
+	}
+	return 1;
+    }
+    res = pwrite(f->fd, s->cbuf, stored, pos);
+    if(res == -1){
+	return -errno;
+    }
+    if(res != stored){
+	return -EIO;
+    }
+    *entry = next;
+
+    /* Give back the pages the block no longer uses */
+    release_entry(f, idx, &prev, s, PAGE_ROUND(stored));
+    return 0;
+}
+
+/* Cut whole groups from the end of the file down to the one holding block
+ * nblocks, releasing the dedup chunks of each after it is gone */
+static int drop_groups(encfs_file* f, uint64_t nblocks, scratch* s){
+    uint64_t first = (nblocks + ENCFS_MAP_ENTRIES - 1) / ENCFS_MAP_ENTRIES;
+    uint64_t end = (f->hdr.size + f->hdr.block_size - 1) / f->hdr.block_size;
+    uint64_t group = (end + ENCFS_MAP_ENTRIES - 1) / ENCFS_MAP_ENTRIES;
+    ssize_t res;
+    int i;
+
+    s->group = UINT64_MAX;
+    while(group-- > first){
+	res = pread(f->fd, s->map, ENCFS_MAP_SIZE,
+		    encfs_map_off(f, group * ENCFS_MAP_ENTRIES));
+	if(res == -1){
+	    return -errno;
+	}
+	for(i = 0; i < (int)(res / sizeof(encfs_map_entry)); i++){
+	    if(s->map[i].len & ENCFS_LEN_DEDUP){
+		release_entry(f, 0, &s->map[i], s, 0);
+	    }
+	}
+	if(ftruncate(f->fd, encfs_group_off(f, group * ENCFS_MAP_ENTRIES)) == -1){
+	    s->ndrop = 0;
+	    return -errno;
+	}
+	drop_chunks(f, s);
+    }
+    return 0;
+}
+
+extern uint32_t encfs_key_id(const crypt_key* key){
+    unsigned char mac[CRYPT_TAG_BYTES];
+    uint32_t id;
+
+    crypt_mac(key, KEY_ID_LABEL, sizeof(KEY_ID_LABEL) - 1, mac);
+    memcpy(&id, mac, sizeof(id));
+    return id ? id : 1;
+}
+
+extern int encfs_probe(int fd, encfs_header* hdr){
+    encfs_header tmp;
+    ssize_t res;
+
+    if(!hdr){
+	hdr = &tmp;
+    }
+    res = pread(fd, hdr, sizeof(*hdr), 0);
+    if(res == -1){
+	return -errno;
+    }
+    if(res != sizeof(*hdr)){
+	return 0;
+    }
+    return memcmp(hdr->magic, ENCFS_MAGIC, sizeof(hdr->magic)) == 0 &&
+	hdr->version == ENCFS_VERSION &&
+	(hdr->flags & ~ENCFS_FLAG_FILE_AAD) == 0 &&
+	hdr->block_size >= ENCFS_BLOCK_SIZE &&
+	hdr->block_size <= ENCFS_MAX_BLOCK_SIZE &&
+	(hdr->block_size & (hdr->block_size - 1)) == 0;
+}
+
+extern int encfs_write_header(encfs_file* f){
+    ssize_t res;
+
+    crypt_mac(f->key, &f->hdr, HEADER_MAC_LEN, f->hdr.tag);
+    res = pwrite(f->fd, &f->hdr, sizeof(f->hdr), 0);
+    if(res == -1){
+	return -errno;
+    }
+    return res == sizeof(f->hdr) ? 0 : -EIO;
+}
+
+extern int encfs_create(encfs_file* f, int fd, const crypt_key* key, bufpool* pool,
+			uint32_t block_size){
+    f->fd = fd;
+    f->dfd = -1;
+    f->key = key;
+    f->pool = pool;
+    f->redo = NULL;
+    f->tail = NULL;
+    f->tail_ok = 0;
+
+    memset(&f->hdr, 0, sizeof(f->hdr));
+    memcpy(f->hdr.magic, ENCFS_MAGIC, sizeof(f->hdr.magic));
+    f->hdr.version = ENCFS_VERSION;
+    f->hdr.block_size = block_size;
+    f->hdr.flags = ENCFS_FLAG_FILE_AAD;
+    f->hdr.key_id = encfs_key_id(key);
+    if(block_size < ENCFS_BLOCK_SIZE || block_size > ENCFS_MAX_BLOCK_SIZE ||
+       (block_size & (block_size - 1)) || block_size > pool->block_size){
+	return -EINVAL;
+    }
+    if(!crypt_random(f->hdr.file_id, sizeof(f->hdr.file_id))){
+	return -EIO;
+    }
+    /* The backing file is never shorter than the header */
+    if(ftruncate(fd, 0) == -1 || ftruncate(fd, ENCFS_HEADER_SIZE) == -1){
+	return -errno;
+    }
+    return encfs_write_header(f);
+}
+
+extern int encfs_open(encfs_file* f, int fd, const crypt_key* key, bufpool* pool){
+    return encfs_open_keys(f, fd, &key, 1, pool);
+}
+
+extern int encfs_open_keys(encfs_file* f, int fd, const crypt_key* const* keys, int nkeys,
+			   bufpool* pool){
+    unsigned char tag[CRYPT_TAG_BYTES];
+    int res;
+    int i;
+
+    f->fd = fd;
+    f->dfd = -1;
+    f->key = NULL;
+    f->pool = pool;
+    f->redo = NULL;
+    f->tail = NULL;
+    f->tail_ok = 0;
+
+    res = encfs_probe(fd, &f->hdr);
+    if(res <= 0){
+	return res < 0 ? res : -EIO;
+    }
+    if(f->hdr.block_size > pool->block_size){
+	return -EIO;
+    }
+    for(i = 0; i < nkeys && f->key == NULL; i++){
+	if(f->hdr.key_id != 0 && f->hdr.key_id != encfs_key_id(keys[i])){
+	    continue;
+	}
+	crypt_mac(keys[i], &f->hdr, HEADER_MAC_LEN, tag);
+	if(!CRYPTO_memcmp(tag, f->hdr.tag, sizeof(tag))){
+	    f->key = keys[i];
+	}
+    }
+    return f->key ? 0 : -EIO;
+}
+
+extern int encfs_set_direct(encfs_file* f, int on){
+    char path[64];
+
+    if(f->dfd != -1){
+	close(f->dfd);
+	f->dfd = -1;
+    }
+    if(on){
+	/* Reopen the very same inode, whatever its name is by now */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+	f->dfd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if(f->dfd == -1){
+	    return -errno;
+	}
+    }
+    return 0;
+}
+
+extern int encfs_set_append(encfs_file* f, int on){
+    f->tail_ok = 0;
+    if(on && f->tail == NULL){
+	/* Only an optimization: don't wait at the pool's ceiling for it */
+	f->tail = bufpool_tryget(f->pool);
+	return f->tail ? 0 : -ENOMEM;
+    }
+    if(!on && f->tail != NULL){
+	bufpool_put(f->pool, f->tail);
+	f->tail = NULL;
+    }
+    return 0;
+}
+
+extern ssize_t encfs_pread(encfs_file* f, char* buf, size_t size, off_t offset){
+    size_t bs = f->hdr.block_size;
+    encfs_map_entry* entry;
+    const encfs_map_entry* cur;
+    encfs_map_entry logged;
+    uint64_t fsize = f->hdr.size;
+    int inlog;
+    size_t done = 0;
+    scratch s;
+    int res;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    if((uint64_t)offset >= fsize){
+	return 0;
+    }
+    if(size > fsize - offset){
+	size = fsize - offset;
+    }
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+
+    while(done < size){
+	uint64_t idx = (offset + done) / bs;
+	size_t boff = (offset + done) % bs;
+	size_t n = bs - boff;
+
+	if(n > size - done){
+	    n = size - done;
+	}
+	res = map_load(f, &s, idx, &entry);
+	if(res){
+	    break;
+	}
+	/* The map is stale for a block in the redo log: decide on the logged entry */
+	cur = entry;
+	inlog = logged_block(f, idx, &cur, &logged, &s);
+	if(inlog < 0){
+	    res = inlog;
+	    break;
+	}
+	if(boff == 0 && (n == bs ||
+			 (!(cur->len & ENCFS_LEN_LZ) && (cur->len & ENCFS_LEN_MASK) <= n))){
+	    /* Whole stored block wanted: decrypt straight into the caller */
+	    res = open_block(f, idx, cur, inlog, &s, (unsigned char*)buf + done, n);
+	}
+	else{
+	    res = open_block(f, idx, cur, inlog, &s, s.pbuf, bs);
+	    if(!res){
+		memcpy(buf + done, s.pbuf + boff, n);
+	    }
+	}
+	if(res){
+	    break;
+	}
+	done += n;
+    }
+
+    scratch_put(f, &s);
+    if(res && done == 0){
+	return res;
+    }
+    return done;
+}
+
+extern int encfs_check(encfs_file* f, off_t backing_size, encfs_check_result* r){
+    uint64_t bs = f->hdr.block_size;
+    uint64_t nblocks = (f->hdr.size + bs - 1) / bs;
+    uint64_t end = nblocks;
+    off_t gsize = ENCFS_MAP_SIZE + (off_t)ENCFS_MAP_ENTRIES * bs;
+    encfs_map_entry* entry;
+    uint64_t idx;
+    scratch s;
+    int res;
+
+    memset(r, 0, sizeof(*r));
+    if(backing_size > ENCFS_HEADER_SIZE){
+	uint64_t groups = (backing_size - ENCFS_HEADER_SIZE + gsize - 1) / gsize;
+
+	if(groups * ENCFS_MAP_ENTRIES > end){
+	    end = groups * ENCFS_MAP_ENTRIES;
+	}
+    }
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+    for(idx = 0; idx < end; idx++){
+	res = map_load(f, &s, idx, &entry);
+	if(res){
+	    break;
+	}
+	if(entry->len == 0){
+	    continue;
+	}
+	if(idx >= nblocks){
+	    r->stale++;
+	    continue;
+	}
+	res = read_block(f, idx, entry, &s, s.pbuf, bs);
+	if(res == -EIO){
+	    if(r->bad++ == 0){
+		r->first_bad = idx;
+	    }
+	    res = 0;
+	}
+	else if(res){
+	    break;
+	}
+	else{
+	    r->blocks++;
+	}
+    }
+    scratch_put(f, &s);
+    if(res){
+	return res;
+    }
+    return r->bad ? -EIO : 0;
+}
+
+extern ssize_t encfs_pwritev(encfs_file* f, const struct iovec* iov, int iovcnt, off_t offset){
+    size_t bs = f->hdr.block_size;
+    encfs_map_entry* entry;
+    uint64_t newsize = f->hdr.size;
+    size_t size = 0;
+    size_t done = 0;
+    cursor c;
+    scratch s;
+    int res;
+    int i;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    for(i = 0; i < iovcnt; i++){
+	size += iov[i].iov_len;
+    }
+    if((uint64_t)offset + size > newsize){
+	newsize = offset + size;
+    }
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+    c.iov = iov;
+    c.iovcnt = iovcnt;
+    c.off = 0;
+
+    while(done < size){
+	uint64_t idx = (offset + done) / bs;
+	size_t boff = (offset + done) % bs;
+	size_t n = bs - boff;
+	uint64_t valid = newsize - idx * bs;
+	const unsigned char* plain = NULL;
+
+	if(n > size - done){
+	    n = size - done;
+	}
+	if(valid > bs){
+	    valid = bs;
+	}
+	res = map_load(f, &s, idx, &entry);
+	if(res){
+	    break;
+	}
+	if(boff == 0 && n == valid){
+	    /* Block fully overwritten: no need to read the old contents */
+	    plain = cursor_peek(&c, n);
+	    if(plain){
+		cursor_take(&c, NULL, n);
+	    }
+	    else{
+		cursor_take(&c, s.pbuf, n);
+		plain = s.pbuf;
+	    }
+	}
+	else if(f->tail_ok && f->tail_idx == idx){
+	    /* Appending to the block the last write left partial: it is in
+	     * memory already, zeros past its end included */
+	    cursor_take(&c, f->tail + boff, n);
+	    plain = f->tail;
+	}
+	else{
+	    res = read_block(f, idx, entry, &s, s.pbuf, bs);
+	    if(res){
+		break;
+	    }
+	    cursor_take(&c, s.pbuf + boff, n);
+	    plain = s.pbuf;
+	}
+	res = write_block(f, idx, entry, plain, valid,
+			  idx * bs + valid > f->hdr.size ? idx * bs + valid : f->hdr.size, &s);
+	if(res < 0){
+	    break;
+	}
+	if(res == 0){
+	    map_dirty(&s, idx);
+	}
+	res = 0;
+	done += n;
+
+	/* A partial block can only be the last one: keep it for the next append */
+	if(f->tail != NULL && valid < bs){
+	    if(plain != f->tail){
+		memcpy(f->tail, plain, valid);
+		memset(f->tail + valid, 0, bs - valid);
+	    }
+	    f->tail_idx = idx;
+	    f->tail_ok = 1;
+	}
+	else if(f->tail_idx == idx){
+	    f->tail_ok = 0;
+	}
+    }
+    if(res){
+	f->tail_ok = 0;
+    }
+
+    if(map_flush(f, &s) && !res){
+	res = -EIO;
+    }
+    scratch_put(f, &s);
+
+    /* Only expose what actually reached the disk. With a redo log the
+     * records carry the size, and its owner stores it once they are in place:
+     * a bigger size in the header would expose blocks that aren't. */
+    if((uint64_t)offset + done > f->hdr.size){
+	f->hdr.size = offset + done;
+	if(!f->redo && encfs_write_header(f) && !res){
+	    res = -EIO;
+	}
+    }
+    if(res && done == 0){
+	return res;
+    }
+    return done;
+}
+
+/* Copy block idx of src to dst (same block size), whose entry is to: sealed
+ * as it is when same (same key) unless it is a dedup reference, decrypted
+ * and sealed again otherwise. Return as write_block(). */
+static int copy_block(encfs_file* dst, encfs_file* src, uint64_t idx, const encfs_map_entry* from,
+		      encfs_map_entry* to, uint64_t size, int same, scratch* s, scratch* d){
+    uint64_t bs = src->hdr.block_size;
+    encfs_map_entry logged;
+    uint32_t stored;
+    int inlog;
+    ssize_t res;
+
+    inlog = logged_block(src, idx, &from, &logged, s);
+    if(inlog < 0){
+	return inlog;
+    }
+    if(from->len == 0){
+	return 1;   /* Hole: dst was emptied, nothing to do */
+    }
+    if(!same || (from->len & ENCFS_LEN_DEDUP)){
+	res = open_block(src, idx, from, inlog, s, s->pbuf, bs);
+	if(res){
+	    return res;
+	}
+	return write_block(dst, idx, to, s->pbuf, size - idx * bs < bs ? size - idx * bs : bs,
+			   size, d);
+    }
+    stored = from->len & ENCFS_LEN_MASK;
+    if(stored > bs){
+	return -EIO;
+    }
+    if(!inlog){
+	res = block_pread(src, s->cbuf, stored, encfs_data_off(src, idx));
+	if(res == -1){
+	    return -errno;
+	}
+	if(res != (ssize_t)stored){
+	    return -EIO;
+	}
+    }
+    if(dst->redo){
+	res = dst->redo->put(dst->redo, idx, from, s->cbuf, size);
+	if(res < 0){
+	    return res;
+	}
+	if(res){
+	    d->group = UINT64_MAX;
+	}
+	return 1;
+    }
+    res = pwrite(dst->fd, s->cbuf, stored, encfs_data_off(dst, idx));
+    if(res == -1){
+	return -errno;
+    }
+    if(res != (ssize_t)stored){
+	return -EIO;
+    }
+    *to = *from;
+    return 0;
+}
+
+/* Whether blocks sealed for src are good in dst */
+static int same_aad(const encfs_file* dst, const encfs_file* src){
+    if((dst->hdr.flags ^ src->hdr.flags) & ENCFS_FLAG_FILE_AAD){
+	return 0;
+    }
+    return !(dst->hdr.flags & ENCFS_FLAG_FILE_AAD) ||
+	!memcmp(dst->hdr.file_id, src->hdr.file_id, sizeof(dst->hdr.file_id));
+}
+
+/* Copy between files whose blocks don't line up: plaintext a pool buffer at
+ * a time, leaving runs of zeros as holes */
+static int copy_plain(encfs_file* dst, encfs_file* src){
+    uint64_t size = src->hdr.size;
+    unsigned char* buf;
+    uint64_t off;
+    ssize_t n = 0;
+
+    buf = bufpool_get(dst->pool);
+    if(buf == NULL){
+	return -ENOMEM;
+    }
+    for(off = 0; off < size; off += n){
+	n = encfs_pread(src, (char*)buf, dst->pool->block_size, off);
+	if(n <= 0){
+	    n = n < 0 ? n : -EIO;
+	    break;
+	}
+	if((buf[0] || memcmp(buf, buf + 1, n - 1)) &&
+	   encfs_pwrite(dst, (char*)buf, n, off) != n){
+	    n = -EIO;
+	    break;
+	}
+    }
+    bufpool_put(dst->pool, buf);
+    if(n < 0){
+	return n;
+    }
+    return encfs_truncate(dst, size);
+}
+
+extern int encfs_copy(encfs_file* dst, encfs_file* src){
+    uint64_t size = src->hdr.size;
+    uint64_t bs = src->hdr.block_size;
+    uint64_t nblocks = (size + bs - 1) / bs;
+    struct file_clone_range clone;
+    encfs_map_entry* from;
+    encfs_map_entry* to;
+    uint64_t idx;
+    scratch s, d;
+    int same;
+    int res;
+
+    res = encfs_truncate(dst, 0);
+    if(res){
+	return res;
+    }
+    same = dst->key == src->key;
+
+    /* An empty file can take any block size, so take src's and let blocks
+     * line up. Under the same key it can take src's file ID too, making
+     * src's sealed blocks good as they are in dst. (Not with a redo log: its
+     * records would be read back under the old header if the new one didn't
+     * make it.) */
+    if(!dst->redo && (dst->hdr.block_size != bs || (same && !same_aad(dst, src))) &&
+       bs <= dst->pool->block_size){
+	dst->hdr.block_size = bs;
+	if(same && (src->hdr.flags & ENCFS_FLAG_FILE_AAD)){
+	    dst->hdr.flags |= ENCFS_FLAG_FILE_AAD;
+	    memcpy(dst->hdr.file_id, src->hdr.file_id, sizeof(dst->hdr.file_id));
+	}
+	res = encfs_write_header(dst);
+	if(res){
+	    return res;
+	}
+    }
+    if(dst->hdr.block_size != bs){
+	return copy_plain(dst, src);
+    }
+    same = same && same_aad(dst, src);
+
+    /* Share the groups' extents where the filesystem can */
+    if(same && nblocks && !src->redo && !dst->redo && !src->dedup && !dst->dedup){
+	clone.src_fd = src->fd;
+	clone.src_offset = ENCFS_HEADER_SIZE;
+	clone.src_length = 0;   /* To the end */
+	clone.dest_offset = ENCFS_HEADER_SIZE;
+	if(ioctl(dst->fd, FICLONERANGE, &clone) == 0){
+	    dst->hdr.size = size;
+	    return encfs_write_header(dst);
+	}
+    }
+
+    res = scratch_get(src, &s);
+    if(res){
+	return res;
+    }
+    res = scratch_get(dst, &d);
+    if(res){
+	scratch_put(src, &s);
+	return res;
+    }
+    for(idx = 0; idx < nblocks; idx++){
+	res = map_load(src, &s, idx, &from);
+	if(!res){
+	    res = map_load(dst, &d, idx, &to);
+	}
+	if(!res){
+	    res = copy_block(dst, src, idx, from, to,
+			     (idx + 1) * bs < size ? (idx + 1) * bs : size, same, &s, &d);
+	}
+	if(res < 0){
+	    break;
+	}
+	if(res == 0){
+	    map_dirty(&d, idx);
+	}
+	res = 0;
+    }
+    if(map_flush(dst, &d) && !res){
+	res = -EIO;
+    }
+    scratch_put(dst, &d);
+    scratch_put(src, &s);
+    if(res){
+	return res;
+    }
+    /* With a redo log the records carry the size (see encfs_pwritev()) */
+    dst->hdr.size = size;
+    return dst->redo ? 0 : encfs_write_header(dst);
+}
+
+extern int encfs_verify_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			      const unsigned char* cipher){
+    uint32_t stored = entry->len & ENCFS_LEN_MASK;
+    block_ad ad;
+    size_t adlen = block_aad(f, idx, (entry->len & ENCFS_LEN_LZ) != 0, &ad);
+    unsigned char* out;
+    int ok;
+
+    if(stored == 0 || stored > f->hdr.block_size || (entry->len & ENCFS_LEN_DEDUP)){
+	return -EIO;
+    }
+    out = bufpool_get(f->pool);
+    if(!out){
+	return -ENOMEM;
+    }
+    ok = crypt_open_block(f->key, entry->iv, &ad, adlen, cipher, stored, out, entry->tag);
+    bufpool_put(f->pool, out);
+    return ok ? 0 : -EIO;
+}
+
+extern int encfs_put_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			   const unsigned char* cipher){
+    uint32_t stored = entry->len & ENCFS_LEN_MASK;
+    encfs_map_entry* cur;
+    encfs_map_entry prev;
+    ssize_t res;
+    scratch s;
+
+    if(stored == 0 || stored > f->hdr.block_size || (entry->len & ENCFS_LEN_DEDUP)){
+	return -EINVAL;
+    }
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+    res = map_load(f, &s, idx, &cur);
+    if(!res){
+	res = pwrite(f->fd, cipher, stored, encfs_data_off(f, idx));
+	res = res == -1 ? -errno : res != (ssize_t)stored ? -EIO : 0;
+    }
+    if(!res){
+	prev = *cur;
+	*cur = *entry;
+	map_dirty(&s, idx);
+	release_entry(f, idx, &prev, &s, PAGE_ROUND(stored));
+	res = map_flush(f, &s);
+    }
+    scratch_put(f, &s);
+    return res;
+}
+
+extern ssize_t encfs_pwrite(encfs_file* f, const char* buf, size_t size, off_t offset){
+    struct iovec iov;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = size;
+    return encfs_pwritev(f, &iov, 1, offset);
+}
+
+extern int encfs_release_chunks(encfs_file* f){
+    uint64_t end = (f->hdr.size + f->hdr.block_size - 1) / f->hdr.block_size;
+    uint64_t groups = (end + ENCFS_MAP_ENTRIES - 1) / ENCFS_MAP_ENTRIES;
+    uint64_t group;
+    ssize_t res = 0;
+    scratch s;
+    int i;
+
+    if(!f->dedup){
+	return 0;
+    }
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+    for(group = 0; group < groups; group++){
+	res = pread(f->fd, s.map, ENCFS_MAP_SIZE, encfs_map_off(f, group * ENCFS_MAP_ENTRIES));
+	if(res == -1){
+	    res = -errno;
+	    break;
+	}
+	for(i = 0; i < (int)(res / sizeof(encfs_map_entry)); i++){
+	    if(s.map[i].len & ENCFS_LEN_DEDUP){
+		release_entry(f, 0, &s.map[i], &s, 0);
+	    }
+	}
+	drop_chunks(f, &s);
+	res = 0;
+    }
+    scratch_put(f, &s);
+    return res;
+}
+
+extern int encfs_truncate(encfs_file* f, off_t size){
+    size_t bs = f->hdr.block_size;
+    encfs_map_entry* entry;
+    uint64_t nblocks;
+    off_t len;
+    scratch s;
+    int res;
+
+    if(size < 0){
+	return -EINVAL;
+    }
+    f->tail_ok = 0;
+    /* Logged first, so replaying the log redoes it after the blocks before */
+    if(f->redo){
+	res = f->redo->trunc(f->redo, size);
+	if(res){
+	    return res;
+	}
+    }
+    if((uint64_t)size >= f->hdr.size){
+	/* Growing only moves the size: the gap reads as zeros */
+	if((uint64_t)size == f->hdr.size){
+	    return 0;
+	}
+	f->hdr.size = size;
+	return encfs_write_header(f);
+    }
+
+    res = scratch_get(f, &s);
+    if(res){
+	return res;
+    }
+    nblocks = (size + bs - 1) / bs;
+
+    /* Re-encrypt a partial last block without its old tail */
+    if(size % bs){
+	uint64_t idx = size / bs;
+
+	res = map_load(f, &s, idx, &entry);
+	if(!res){
+	    res = read_block(f, idx, entry, &s, s.pbuf, bs);
+	}
+	if(!res){
+	    res = write_block(f, idx, entry, s.pbuf, size % bs, size, &s);
+	    if(res == 0){
+		map_dirty(&s, idx);
+	    }
+	    res = res > 0 ? 0 : res;
+	}
+    }
+    /* Forget the blocks past the end in the last remaining group */
+    if(!res && nblocks % ENCFS_MAP_ENTRIES){
+	int i;
+
+	res = map_load(f, &s, nblocks, &entry);
+	for(i = nblocks % ENCFS_MAP_ENTRIES; !res && i < (int)ENCFS_MAP_ENTRIES; i++){
+	    if(s.map[i].len & ENCFS_LEN_DEDUP){
+		release_entry(f, 0, &s.map[i], &s, 0);
+	    }
+	    memset(&s.map[i], 0, sizeof(s.map[i]));
+	    map_dirty(&s, (nblocks / ENCFS_MAP_ENTRIES) * ENCFS_MAP_ENTRIES + i);
+	}
+    }
+    if(!res){
+	res = map_flush(f, &s);
+    }
+    if(!res && f->dedup){
+	res = drop_groups(f, nblocks, &s);
+    }
+    scratch_put(f, &s);
+    if(res){
+	return res;
+    }
+
+    len = nblocks ? encfs_data_off(f, nblocks - 1) + bs : ENCFS_HEADER_SIZE;
+    if(ftruncate(f->fd, len) == -1){
+	return -errno;
+    }
+    f->hdr.size = size;
+    return encfs_write_header(f);
+}
@@ -0,0 +1,284 @@
+/* encfs-block.h
+ * Block-addressable encrypted file format used by pa4-encfs
+ *
+ * A file in the mirror is a header followed by groups. Each group is one map
+ * block holding ENCFS_MAP_ENTRIES entries followed by that many data blocks:
+ *
+ *   [header][map 0][data 0]...[data 127][map 1][data 128]...
+ *
+ * Every data block is encrypted on its own with AES-256-GCM under a fresh
+ * random IV, with its block index and the file's ID as additional data, so
+ * any block can be read or rewritten without touching the rest of the file,
+ * and can't be moved to another index or another file. The map entry keeps
+ * the IV, the GCM tag and the stored length (0 = hole, reads as zeros). The
+ * header carries the plaintext size and the ID of the key the file is under
+ * (see encfs_key_id()), and is authenticated with an HMAC.
+ * Everything is page aligned.
+ *
+ * Files written before ENCFS_FLAG_FILE_AAD bind their blocks to the index
+ * alone: someone with write access to the mirror can move a block (with its
+ * map entry) to the same index of another file under the same key. They are
+ * still read, and get the file ID once rewritten whole (re-keying does
+ * that). A copy made by encfs_copy() shares its source's file ID so it can
+ * share its blocks, and blocks can be swapped between the two in the same way.
+ *
+ * The block size is chosen per file (4 KiB by default). Blocks may be LZ
+ * compressed before encryption; the map then records the compressed length,
+ * only that many bytes are read and written, and the rest of the block's slot
+ * is left as a hole in the backing file. Blocks that don't shrink are stored
+ * raw. Compressed files use ENCFS_LZ_BLOCK_SIZE blocks so the savings
+ * survive the backing filesystem's 4 KiB allocation unit.
+ *
+ * With a dedup store attached (see dedup-store.h) blocks of the store's chunk
+ * size go to the store instead. Their map entry holds the chunk id in the IV
+ * field and an HMAC binding it to the file and block index in the tag, and
+ * nothing is written to the file's own data slot.
+ *
+ * A file can also be given an O_DIRECT descriptor (encfs_set_direct()). Map
+ * and data blocks are then read through it in whole pages into pool
+ * buffers, bypassing the backing filesystem's page cache; writes still go
+ * through the normal descriptor, whose dirty pages the kernel writes back
+ * before any direct read of the same range.
+ *
+ * Rewriting a block in place isn't atomic: a crash between the data write
+ * and the map write leaves an entry whose tag doesn't match the data, and
+ * the block reads as -EIO from then on. A file can be given a redo log
+ * (encfs_redo, see journal.h) to avoid that. Sealed blocks and size changes
+ * then go to the log instead, reads look there first, and the log's owner
+ * copies them in place later with encfs_put_block().
+ *
+ */
+
+#ifndef ENCFS_BLOCK_H
+#define ENCFS_BLOCK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aes-crypt.h"
+#include "buf-pool.h"
+#include "dedup-store.h"
+
+#define ENCFS_MAGIC       "PA4ENCFS"
+#define ENCFS_VERSION     1
+#define ENCFS_BLOCK_SIZE  4096      /* Default and minimum block size */
+#define ENCFS_LZ_BLOCK_SIZE  65536  /* Block size of compressed files */
+#define ENCFS_MAX_BLOCK_SIZE 65536
+#define ENCFS_HEADER_SIZE 4096
+#define ENCFS_MAP_SIZE    4096
+#define ENCFS_MAP_ENTRIES (ENCFS_MAP_SIZE / sizeof(encfs_map_entry))
+
+/* encfs_header.flags */
+#define ENCFS_FLAG_FILE_AAD 0x1       /* Blocks are bound to the file ID too */
+
+/* encfs_map_entry.len */
+#define ENCFS_LEN_MASK    0x00ffffff
+#define ENCFS_LEN_LZ      0x80000000  /* Stored bytes are LZ compressed */
+#define ENCFS_LEN_DEDUP   0x40000000  /* Block lives in the dedup store; the
+				       * length is the plaintext length */
+
+/* On-disk header (host byte order) */
+typedef struct encfs_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t flags;                       /* ENCFS_FLAG_* */
+    uint32_t key_id;                      /* encfs_key_id(), 0 in old files */
+    uint64_t size;                        /* Plaintext size */
+    unsigned char file_id[16];            /* Random, unique per file */
+    unsigned char tag[CRYPT_TAG_BYTES];   /* HMAC of the fields above */
+} encfs_header;
+
+/* On-disk map entry, one per data block */
+typedef struct encfs_map_entry {
+    uint32_t len;                         /* Stored bytes | flags, 0 = hole */
+    unsigned char iv[CRYPT_IV_BYTES];
+    unsigned char tag[CRYPT_TAG_BYTES];
+} encfs_map_entry;
+
+typedef struct encfs_redo encfs_redo;
+
+/* An open block-format file */
+typedef struct encfs_file {
+    int fd;
+    int dfd;                              /* O_DIRECT reads, or -1 */
+    const crypt_key* key;
+    bufpool* pool;                        /* ENCFS_MAX_BLOCK_SIZE buffers */
+    int compress;                         /* Compress blocks on write */
+    dedup_store* dedup;                   /* Shared block store, or NULL */
+    encfs_redo* redo;                     /* Redo log, or NULL to write in place */
+    unsigned char* tail;                  /* Last written partial block (encfs_set_append()), or NULL */
+    uint64_t tail_idx;                    /* Its index, while tail_ok */
+    int tail_ok;
+    encfs_header hdr;
+} encfs_file;
+
+/* Where a file's updates go instead of their place in the file. Called with
+ * the file locked as for the encfs_*() call making them. */
+struct encfs_redo {
+    /* Log block idx as sealed (entry->len & ENCFS_LEN_MASK bytes of cipher),
+     * and size as the plaintext size once it is in place. Return 0, 1 if
+     * earlier blocks of the file were put in place to make room (maps read
+     * before are stale), -errno on error */
+    int (*put)(encfs_redo* r, uint64_t idx, const encfs_map_entry* entry,
+	       const unsigned char* cipher, uint64_t size);
+    /* Latest logged version of block idx: 1 and entry/cipher filled in, 0
+     * if there is none, -errno on error */
+    int (*get)(encfs_redo* r, uint64_t idx, encfs_map_entry* entry, unsigned char* cipher);
+    /* Log a truncate to size, and forget blocks logged past it */
+    int (*trunc)(encfs_redo* r, uint64_t size);
+};
+
+/* Byte offsets of a data block and its map entry in the backing file */
+static inline off_t encfs_group_off(const encfs_file* f, uint64_t idx){
+    return ENCFS_HEADER_SIZE + (off_t)(idx / ENCFS_MAP_ENTRIES) *
+	(ENCFS_MAP_SIZE + (off_t)ENCFS_MAP_ENTRIES * f->hdr.block_size);
+}
+
+static inline off_t encfs_data_off(const encfs_file* f, uint64_t idx){
+    return encfs_group_off(f, idx) + ENCFS_MAP_SIZE
+	+ (off_t)(idx % ENCFS_MAP_ENTRIES) * f->hdr.block_size;
+}
+
+static inline off_t encfs_map_off(const encfs_file* f, uint64_t idx){
+    return encfs_group_off(f, idx)
+	+ (off_t)(idx % ENCFS_MAP_ENTRIES) * sizeof(encfs_map_entry);
+}
+
+/* uint32_t encfs_key_id(const crypt_key* key)
+ * Purpose: Short public ID of a key, recorded in the headers of its files
+ * Return: Non-zero key ID
+ */
+extern uint32_t encfs_key_id(const crypt_key* key);
+
+/* int encfs_probe(int fd, encfs_header* hdr)
+ * Purpose: Check whether fd holds a block-format file (magic, version and flags only)
+ * Args: int fd            : Backing file
+ *       encfs_header* hdr : Receives the header if non-NULL
+ * Return: 1 if it does, 0 if not, -errno on I/O error
+ */
+extern int encfs_probe(int fd, encfs_header* hdr);
+
+/* int encfs_create(encfs_file* f, int fd, const crypt_key* key, bufpool* pool, uint32_t block_size)
+ * Purpose: Write a fresh header for an empty file and truncate anything after it
+ * Args: uint32_t block_size : Power of two, ENCFS_BLOCK_SIZE..ENCFS_MAX_BLOCK_SIZE
+ * Return: 0 on success, -errno on error
+ */
+extern int encfs_create(encfs_file* f, int fd, const crypt_key* key, bufpool* pool,
+			uint32_t block_size);
+
+/* int encfs_open(encfs_file* f, int fd, const crypt_key* key, bufpool* pool)
+ * Purpose: Read and authenticate the header of an existing file
+ * Return: 0 on success, -EIO if the header is bad, -errno on error
+ */
+extern int encfs_open(encfs_file* f, int fd, const crypt_key* key, bufpool* pool);
+
+/* int encfs_open_keys(encfs_file* f, int fd, const crypt_key* const* keys, int nkeys, bufpool* pool)
+ * Purpose: encfs_open() for a file under any one of several keys. The key is
+ *          picked by the header's key ID (files without one try each key).
+ * Return: 0 on success (f->key is the file's key), -EIO if no key fits,
+ *         -errno on error
+ */
+extern int encfs_open_keys(encfs_file* f, int fd, const crypt_key* const* keys, int nkeys,
+			   bufpool* pool);
+
+/* int encfs_set_direct(encfs_file* f, int on)
+ * Purpose: Open (or close) an O_DIRECT descriptor for reads of f->fd's file
+ * Return: 0 on success, -errno on error (reads keep using f->fd)
+ */
+extern int encfs_set_direct(encfs_file* f, int on);
+
+/* int encfs_set_append(encfs_file* f, int on)
+ * Purpose: Keep (or stop keeping) the plaintext of the partial block a write
+ *          leaves at the end of the file in a pool buffer, so the next append
+ *          re-seals it from memory instead of reading and decrypting it back
+ * Return: 0 on success, -ENOMEM if the pool has no buffer to spare
+ */
+extern int encfs_set_append(encfs_file* f, int on);
+
+/* Outcome of encfs_check() */
+typedef struct encfs_check_result {
+    uint64_t blocks;                      /* Stored blocks that authenticate */
+    uint64_t bad;                         /* Stored blocks that don't */
+    uint64_t first_bad;                   /* Index of the first bad block */
+    uint64_t stale;                       /* Stored blocks past the plaintext size */
+} encfs_check_result;
+
+/* int encfs_check(encfs_file* f, off_t backing_size, encfs_check_result* r)
+ * Purpose: Authenticate every stored block of an open file (fsck). Map
+ *          groups the backing file holds past the plaintext size are looked
+ *          at too: a write cut short before its header update leaves blocks
+ *          there.
+ * Args: off_t backing_size : Size of the backing file
+ * Return: 0 if every block within the size is good, -EIO if not, -errno on
+ *         I/O error
+ */
+extern int encfs_check(encfs_file* f, off_t backing_size, encfs_check_result* r);
+
+/* ssize_t encfs_pread(encfs_file* f, char* buf, size_t size, off_t offset)
+ * Purpose: Read and decrypt plaintext, clamped to the file size
+ * Return: Bytes read, -EIO on authentication failure, -errno on error
+ */
+extern ssize_t encfs_pread(encfs_file* f, char* buf, size_t size, off_t offset);
+
+/* ssize_t encfs_pwrite(encfs_file* f, const char* buf, size_t size, off_t offset)
+ * Purpose: Encrypt and write plaintext, re-encrypting only the blocks touched
+ * Return: Bytes written, -errno on error
+ */
+extern ssize_t encfs_pwrite(encfs_file* f, const char* buf, size_t size, off_t offset);
+
+/* ssize_t encfs_pwritev(encfs_file* f, const struct iovec* iov, int iovcnt, off_t offset)
+ * Purpose: encfs_pwrite() of the concatenation of iov, as one block-aligned pass
+ * Return: Bytes written, -errno on error
+ */
+extern ssize_t encfs_pwritev(encfs_file* f, const struct iovec* iov, int iovcnt, off_t offset);
+
+/* int encfs_release_chunks(encfs_file* f)
+ * Purpose: Drop every reference the file holds on dedup chunks, without
+ *          touching the file (it may be open read-only). Only for a file
+ *          with no name left, which nobody will read again.
+ * Return: 0 on success, -errno on error
+ */
+extern int encfs_release_chunks(encfs_file* f);
+
+/* int encfs_truncate(encfs_file* f, off_t size)
+ * Purpose: Shrink or extend the plaintext size. Shrinking drops the file's
+ *          references to dedup chunks past the new end.
+ * Return: 0 on success, -errno on error
+ */
+extern int encfs_truncate(encfs_file* f, off_t size);
+
+/* int encfs_copy(encfs_file* dst, encfs_file* src)
+ * Purpose: Replace dst's contents with src's. The emptied dst takes src's
+ *          block size first, and under the same key its file ID, so sealed
+ *          blocks are copied as they are: whole groups with FICLONERANGE
+ *          where the backing filesystem shares extents (and neither file
+ *          has a redo log or dedup store). Anything else is decrypted and
+ *          sealed again.
+ * Return: 0 on success, -errno on error (dst is then empty)
+ */
+extern int encfs_copy(encfs_file* dst, encfs_file* src);
+
+/* int encfs_verify_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry, const unsigned char* cipher)
+ * Purpose: Authenticate a sealed block of f without storing it
+ * Return: 0 if it is good, -EIO if not, -errno on error
+ */
+extern int encfs_verify_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			      const unsigned char* cipher);
+
+/* int encfs_put_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry, const unsigned char* cipher)
+ * Purpose: Store a block sealed earlier (by way of f->redo) in place: data,
+ *          then map entry. The plaintext size is left to the caller.
+ * Return: 0 on success, -errno on error
+ */
+extern int encfs_put_block(encfs_file* f, uint64_t idx, const encfs_map_entry* entry,
+			   const unsigned char* cipher);
+
+/* int encfs_write_header(encfs_file* f)
+ * Purpose: Re-authenticate and store f->hdr
+ * Return: 0 on success, -errno on error
+ */
+extern int encfs_write_header(encfs_file* f);
+
+#endif
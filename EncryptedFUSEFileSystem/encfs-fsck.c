@@ -0,0 +1,557 @@
+/* encfs-fsck.c
+ * Offline consistency check of a pa4-encfs mirror
+ *
+ * Walks the mirror (which must not be mounted) and hands every file to a
+ * pool of worker threads (see work-pool.h). Block-format files have their
+ * header authenticated and every stored block decrypted and checked against
+ * its GCM tag (see encfs_check()); legacy whole-file files are decrypted
+ * in full, which catches truncation through the padding. The pack container
+ * and encrypted names are checked too when the mirror has them. The container
+ * and the dedup store are opened read only, under whichever key given they
+ * are under: a check never changes them.
+ *
+ * Each worker reads with its own pool buffers, files are read front to back
+ * with sequential readahead and dropped from the page cache afterwards, and
+ * the walk stalls while the queue is full, so memory stays bounded however
+ * big the mirror is.
+ *
+ * Bad files are listed, or moved to a quarantine directory with -q. -m
+ * throws the metadata index away and rebuilds it from the files that check
+ * out. A journal that still holds updates (a crash the mirror hasn't been
+ * mounted since) is a warning, and -q is ignored: files can look bad until
+ * a mount replays it.
+ *
+ * Exit status: 0 if everything checked out, 1 if problems were found,
+ * 2 if the check could not be run.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "aes-crypt.h"
+#include "encfs-block.h"
+#include "journal.h"
+#include "meta-index.h"
+#include "name-crypt.h"
+#include "pack-store.h"
+#include "work-pool.h"
+
+#define FSCK_OK       0
+#define FSCK_PROBLEMS 1
+#define FSCK_FAILED   2
+
+#define INTERNAL_PREFIX ".pa4-encfs."
+#define TEMP_SUFFIX     ".pa4-encfs~"
+
+typedef struct fsck_state {
+    const char* root;
+    const crypt_key* keys[2];
+    int nkeys;
+    char* legacy_key;             /* Phrase for whole-file CBC files */
+    bufpool pool;
+    work_pool wp;
+    dedup_store ds;
+    int dedup;
+    name_crypt nc;
+    int names;
+    meta_index mi;
+    int meta;
+    const char* quarantine;
+    dev_t q_dev;                  /* Not walked into if it is in the mirror */
+    ino_t q_ino;
+    pthread_mutex_t out_lock;     /* Keeps report lines whole */
+
+    unsigned long long files;     /* Updated with __sync builtins */
+    unsigned long long bytes;     /* Backing bytes read */
+    unsigned long long blocks;
+    unsigned long long plain;
+    unsigned long long bad;
+    unsigned long long warnings;
+} fsck_state;
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Mirror path as the mount shows it, where names can be decrypted */
+static void display_path(fsck_state* fs, const char* rel, char* out, size_t cap){
+    char name[NAME_MAX + 1];
+    const char* p = rel;
+    const char* end;
+    size_t len = 0;
+    int n;
+
+    if(!fs->names){
+	snprintf(out, cap, "%s", rel);
+	return;
+    }
+    out[0] = '\0';
+    while(*p == '/'){
+	end = strchr(p + 1, '/');
+	if(end == NULL){
+	    end = p + strlen(p);
+	}
+	n = name_decrypt(&fs->nc, p + 1, end - p - 1, name);
+	len += snprintf(out + len, len < cap ? cap - len : 0, "/%s",
+			n < 0 ? "?" : name);
+	if(len >= cap){
+	    break;
+	}
+	p = end;
+    }
+}
+
+static void report(fsck_state* fs, const char* kind, const char* rel, const char* fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void report(fsck_state* fs, const char* kind, const char* rel, const char* fmt, ...){
+    char shown[PATH_MAX * 2];
+    va_list ap;
+
+    display_path(fs, rel, shown, sizeof(shown));
+    pthread_mutex_lock(&fs->out_lock);
+    printf("%s %s", kind, shown);
+    if(fs->names){
+	printf(" (%s)", rel);
+    }
+    printf(": ");
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    pthread_mutex_unlock(&fs->out_lock);
+}
+
+/* Move a bad file out of the mirror, flattening its path into one name */
+static void quarantine(fsck_state* fs, const char* rel){
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    char* p;
+    int len;
+
+    snprintf(from, sizeof(from), "%s%s", fs->root, rel);
+    len = snprintf(to, sizeof(to), "%s/", fs->quarantine);
+    if(len + strlen(rel + 1) >= sizeof(to)){
+	report(fs, "WARN", rel, "not quarantined: %s", strerror(ENAMETOOLONG));
+	return;
+    }
+    strcpy(to + len, rel + 1);
+    for(p = to + len; *p; p++){
+	if(*p == '/'){
+	    *p = '%';
+	}
+    }
+    if(rename(from, to) == -1){
+	report(fs, "WARN", rel, "not quarantined: %s", strerror(errno));
+    }
+}
+
+static int discard(void* arg, const unsigned char* data, int len){
+    (void)arg;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+/* Check one block-format file. Returns 0 when good, else a problem was
+ * reported. */
+static int check_block(fsck_state* fs, const char* rel, int fd, const struct stat* st){
+    encfs_check_result r;
+    encfs_file ef;
+    int res;
+
+    memset(&ef, 0, sizeof(ef));
+    ef.dedup = fs->dedup ? &fs->ds : NULL;
+    res = encfs_open_keys(&ef, fd, fs->keys, fs->nkeys, &fs->pool);
+    if(res){
+	report(fs, "BAD", rel, "%s", res == -EIO ? "header does not authenticate" :
+	       strerror(-res));
+	return 1;
+    }
+    res = encfs_check(&ef, st->st_size, &r);
+    __sync_fetch_and_add(&fs->blocks, r.blocks);
+    if(res == -EIO){
+	report(fs, "BAD", rel, "%llu of %llu blocks do not authenticate (first: block %llu, "
+	       "plaintext offset %llu)", (unsigned long long)r.bad,
+	       (unsigned long long)(r.bad + r.blocks), (unsigned long long)r.first_bad,
+	       (unsigned long long)r.first_bad * ef.hdr.block_size);
+	return 1;
+    }
+    if(res){
+	report(fs, "BAD", rel, "%s", strerror(-res));
+	return 1;
+    }
+    if(r.stale){
+	/* Readable, but a write past the old end never reached the header */
+	report(fs, "WARN", rel, "%llu blocks stored past the size of %llu bytes",
+	       (unsigned long long)r.stale, (unsigned long long)ef.hdr.size);
+	__sync_fetch_and_add(&fs->warnings, 1);
+    }
+    if(fs->meta){
+	meta_store(&fs->mi, st, ef.hdr.size);
+    }
+    return 0;
+}
+
+static void check_file(void* arg, void* item, int worker){
+    fsck_state* fs = arg;
+    char* rel = item;
+    char path[PATH_MAX];
+    char xval[5];
+    struct stat st;
+    int fd;
+    int bad = 0;
+    int res;
+
+    (void)worker;
+    snprintf(path, sizeof(path), "%s%s", fs->root, rel);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1){
+	report(fs, "BAD", rel, "%s", strerror(errno));
+	__sync_fetch_and_add(&fs->bad, 1);
+	if(fd != -1){
+	    close(fd);
+	}
+	free(rel);
+	return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    res = encfs_probe(fd, NULL);
+    if(res < 0){
+	report(fs, "BAD", rel, "%s", strerror(-res));
+	bad = 1;
+    }
+    else if(res){
+	bad = check_block(fs, rel, fd, &st);
+    }
+    else if(fgetxattr(fd, "user.encrypted", xval, sizeof(xval)) != -1){
+	if(!do_crypt_fd(fd, 0, fs->legacy_key, discard, NULL)){
+	    report(fs, "BAD", rel, "legacy file does not decrypt");
+	    bad = 1;
+	}
+    }
+    else{
+	/* Plaintext: pa4-encfs converts it on its first write */
+	__sync_fetch_and_add(&fs->plain, 1);
+    }
+
+    /* Read once, no need to keep it cached */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    __sync_fetch_and_add(&fs->files, 1);
+    __sync_fetch_and_add(&fs->bytes, st.st_size);
+    if(bad){
+	__sync_fetch_and_add(&fs->bad, 1);
+	if(fs->quarantine){
+	    quarantine(fs, rel);
+	}
+    }
+    free(rel);
+}
+
+/* Queue every file below rel ("" for the root) */
+static void walk(fsck_state* fs, const char* rel){
+    char path[PATH_MAX];
+    char sub[PATH_MAX];
+    char name[NAME_MAX + 1];
+    struct dirent* de;
+    struct stat st;
+    DIR* dp;
+    size_t len;
+
+    snprintf(path, sizeof(path), "%s%s", fs->root, rel);
+    dp = opendir(path);
+    if(dp == NULL){
+	report(fs, "BAD", rel[0] ? rel : "/", "%s", strerror(errno));
+	__sync_fetch_and_add(&fs->bad, 1);
+	return;
+    }
+    while((de = readdir(dp)) != NULL){
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+	   (!rel[0] && !strncmp(de->d_name, INTERNAL_PREFIX, strlen(INTERNAL_PREFIX)))){
+	    continue;
+	}
+	if(snprintf(sub, sizeof(sub), "%s/%s", rel, de->d_name) >= (int)sizeof(sub) ||
+	   snprintf(path, sizeof(path), "%s%s", fs->root, sub) >= (int)sizeof(path)){
+	    continue;
+	}
+	len = strlen(de->d_name);
+	if(len >= strlen(TEMP_SUFFIX) && !strcmp(de->d_name + len - strlen(TEMP_SUFFIX), TEMP_SUFFIX)){
+	    report(fs, "WARN", sub, "leftover of a conversion cut short");
+	    __sync_fetch_and_add(&fs->warnings, 1);
+	    continue;
+	}
+	if(fs->names && name_decrypt(&fs->nc, de->d_name, len, name) < 0){
+	    report(fs, "BAD", sub, "name does not authenticate");
+	    __sync_fetch_and_add(&fs->bad, 1);
+	}
+	if(lstat(path, &st) == -1){
+	    continue;
+	}
+	if(S_ISDIR(st.st_mode)){
+	    if(fs->quarantine == NULL || st.st_dev != fs->q_dev || st.st_ino != fs->q_ino){
+		walk(fs, sub);
+	    }
+	}
+	else if(S_ISREG(st.st_mode)){
+	    char* item = strdup(sub);
+
+	    if(item == NULL || work_pool_push(&fs->wp, item)){
+		free(item);
+		report(fs, "BAD", sub, "not checked: %s", strerror(ENOMEM));
+		__sync_fetch_and_add(&fs->bad, 1);
+	    }
+	}
+    }
+    closedir(dp);
+}
+
+/* Every packed file is read back, which authenticates its contents. The
+ * container is only read: it is under the mount key, whichever of the keys
+ * given that is. */
+static void check_pack(fsck_state* fs){
+    char path[PATH_MAX];
+    pack_store ps;
+    pack_entry* pe;
+    char* buf;
+    size_t i;
+    ssize_t n;
+    int res = -EKEYREJECTED;
+    int k;
+
+    snprintf(path, sizeof(path), "%s/%s", fs->root, PACK_FILE_NAME);
+    if(access(path, F_OK) == -1){
+	return;
+    }
+    for(k = 0; k < fs->nkeys && res == -EKEYREJECTED; k++){
+	res = pack_open(&ps, path, fs->keys[k], &fs->pool, PACK_RDONLY);
+    }
+    if(res){
+	report(fs, "BAD", "/" PACK_FILE_NAME, "%s", res == -EKEYREJECTED ?
+	       "under none of the keys given" : res == -EIO ?
+	       "damaged: the records after the damage can't be found" : strerror(-res));
+	fs->bad++;
+	return;
+    }
+    if(ps.bad){
+	report(fs, "BAD", "/" PACK_FILE_NAME, "%llu records do not authenticate",
+	       (unsigned long long)ps.bad);
+	fs->bad += ps.bad;
+    }
+    buf = bufpool_get(&fs->pool);
+    for(i = 0; buf != NULL && i < ps.nbuckets; i++){
+	for(pe = ps.paths[i]; pe != NULL; pe = pe->next){
+	    n = pack_read(&ps, pe, buf, pe->rec.size, 0);
+	    fs->files++;
+	    fs->bytes += pe->rec.reclen;
+	    if(n != (ssize_t)pe->rec.size){
+		/* Packed paths are mount paths already */
+		printf("BAD %s: packed file does not authenticate\n", pe->path);
+		fs->bad++;
+	    }
+	}
+    }
+    bufpool_put(&fs->pool, buf);
+    pack_close(&ps);
+}
+
+/* Open the dedup store read only. It has no key check of its own: take the
+ * key its first live chunk opens under. */
+static int open_dedup(fsck_state* fs){
+    unsigned char* buf;
+    uint64_t id;
+    int res;
+    int k;
+
+    buf = bufpool_get(&fs->pool);
+    if(buf == NULL){
+	return -ENOMEM;
+    }
+    for(k = 0; k < fs->nkeys; k++){
+	res = dedup_open(&fs->ds, fs->root, fs->keys[k], &fs->pool, ENCFS_BLOCK_SIZE, DEDUP_RDONLY);
+	if(res){
+	    break;
+	}
+	for(id = 1; id < fs->ds.cap && fs->ds.slots[id].refcnt == 0; id++){
+	}
+	if(id == fs->ds.cap || k == fs->nkeys - 1 ||
+	   dedup_get(&fs->ds, id, buf, fs->pool.block_size) != -EIO){
+	    break;
+	}
+	dedup_close(&fs->ds);
+    }
+    bufpool_put(&fs->pool, buf);
+    return res;
+}
+
+static void usage(const char* prog){
+    fprintf(stderr, "usage: %s %s\n", prog,
+	    "[-j <threads>] [-k <Old Key Phrase>] [-q <Quarantine Dir>] [-m] "
+	    "<Key Phrase> <Mirror Directory>");
+    exit(FSCK_FAILED);
+}
+
+int main(int argc, char** argv){
+    fsck_state fs;
+    crypt_key keys[2];
+    char path[PATH_MAX + NAME_MAX + 2];
+    char root[PATH_MAX];
+    struct stat st;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char* old_key = NULL;
+    int rebuild = 0;
+    double start;
+    double secs;
+    int res;
+    int c;
+
+    memset(&fs, 0, sizeof(fs));
+    while((c = getopt(argc, argv, "j:k:q:m")) != -1){
+	switch(c){
+	case 'j':
+	    nthreads = strtol(optarg, NULL, 10);
+	    break;
+	case 'k':
+	    old_key = optarg;
+	    break;
+	case 'q':
+	    fs.quarantine = optarg;
+	    break;
+	case 'm':
+	    rebuild = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if(argc - optind != 2){
+	usage(argv[0]);
+    }
+    if(realpath(argv[optind + 1], root) == NULL){
+	perror("mirror directory");
+	return FSCK_FAILED;
+    }
+    fs.root = root;
+    fs.legacy_key = old_key ? old_key : argv[optind];
+
+    /* Blocks still in the journal aren't in place: a file's own copy may
+     * not authenticate until a mount replays them, so move nothing */
+    res = journal_pending(root);
+    if(res){
+	fprintf(stderr, "%s: %s; mount it once for a full check%s\n", root,
+		res < 0 ? strerror(-res) : "the journal holds updates not in place yet",
+		fs.quarantine ? " (nothing is quarantined)" : "");
+	fs.quarantine = NULL;
+	fs.warnings++;
+    }
+    if(fs.quarantine){
+	if(mkdir(fs.quarantine, 0700) == -1 && errno != EEXIST){
+	    perror("quarantine directory");
+	    return FSCK_FAILED;
+	}
+	if(stat(fs.quarantine, &st) == -1){
+	    perror("quarantine directory");
+	    return FSCK_FAILED;
+	}
+	fs.q_dev = st.st_dev;
+	fs.q_ino = st.st_ino;
+    }
+
+    /* Same keys as the mount: the new one first */
+    if(!crypt_derive_key(argv[optind], &keys[0]) ||
+       (old_key && !crypt_derive_key(old_key, &keys[1]))){
+	fprintf(stderr, "key derivation failed\n");
+	return FSCK_FAILED;
+    }
+    fs.keys[0] = &keys[0];
+    fs.keys[1] = &keys[1];
+    fs.nkeys = old_key ? 2 : 1;
+    if(nthreads < 1 || nthreads > WORK_POOL_MAX){
+	nthreads = nthreads < 1 ? 1 : WORK_POOL_MAX;
+    }
+    /* encfs_check() holds four buffers at a time */
+    res = bufpool_init(&fs.pool, ENCFS_MAX_BLOCK_SIZE,
+		       (size_t)(nthreads + 1) * 4 * ENCFS_MAX_BLOCK_SIZE, 0);
+    if(res){
+	fprintf(stderr, "buffer pool: %s\n", strerror(-res));
+	return FSCK_FAILED;
+    }
+    pthread_mutex_init(&fs.out_lock, NULL);
+
+    snprintf(path, sizeof(path), "%s/%s", root, DEDUP_DATA_NAME);
+    if(access(path, F_OK) == 0){
+	res = open_dedup(&fs);
+	if(res){
+	    fprintf(stderr, "dedup store: %s\n", strerror(-res));
+	    return FSCK_FAILED;
+	}
+	fs.dedup = 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", root, NAME_MARKER_NAME);
+    if(access(path, F_OK) == 0){
+	res = name_crypt_init(&fs.nc, fs.keys[0], NAME_CACHE_DEFAULT);
+	if(res){
+	    fprintf(stderr, "names: %s\n", strerror(-res));
+	    return FSCK_FAILED;
+	}
+	fs.names = 1;
+    }
+    if(rebuild){
+	snprintf(path, sizeof(path), "%s/%s", root, META_INDEX_NAME);
+	unlink(path);
+	res = meta_open(&fs.mi, root, META_DEFAULT_SLOTS);
+	if(res){
+	    fprintf(stderr, "metadata index: %s\n", strerror(-res));
+	    return FSCK_FAILED;
+	}
+	fs.meta = 1;
+    }
+
+    res = work_pool_start(&fs.wp, (int)nthreads, check_file, &fs);
+    if(res){
+	fprintf(stderr, "threads: %s\n", strerror(-res));
+	return FSCK_FAILED;
+    }
+    start = now();
+    check_pack(&fs);
+    walk(&fs, "");
+    work_pool_finish(&fs.wp);
+    secs = now() - start;
+
+    printf("%llu files (%llu plaintext), %llu blocks, %.1f MiB in %.2f s (%.1f MiB/s, %ld threads); "
+	   "%llu bad, %llu warnings%s\n",
+	   fs.files, fs.plain, fs.blocks, fs.bytes / 1048576.0, secs,
+	   secs > 0 ? fs.bytes / 1048576.0 / secs : 0.0, nthreads, fs.bad, fs.warnings,
+	   fs.meta ? "; metadata index rebuilt" : "");
+
+    if(fs.meta){
+	meta_close(&fs.mi);
+    }
+    if(fs.names){
+	name_crypt_destroy(&fs.nc);
+    }
+    if(fs.dedup){
+	dedup_close(&fs.ds);
+    }
+    bufpool_destroy(&fs.pool);
+    pthread_mutex_destroy(&fs.out_lock);
+    memset(keys, 0, sizeof(keys));
+    return fs.bad || fs.warnings ? FSCK_PROBLEMS : FSCK_OK;
+}
@@ -14,91 +14,410 @@
   See the file COPYING.
 
   gcc -Wall `pkg-config fuse --cflags` hello.c -o hello `pkg-config fuse --libs`
+
+  Note: Besides /hello, this can serve a read-only tree that exists only as
+        a function of its mount options, for measuring what FUSE itself
+        costs (dispatch, thread count, transport) with no storage or crypto
+        underneath:
+
+          fanout=<n>     subdirectories per directory, d0 .. d<n-1>
+          depth=<n>      levels of subdirectories below the root
+          files=<n>      files per directory, f0 .. f<n-1>
+          size=<bytes>   file size (default 4096), spread by size_dist:
+          size_dist=fixed|uniform|log
+                         uniform: 0 .. 2*size; log: size, size/2, ...
+                         size/2^15, all equally likely
+          pattern=text|zero|random
+                         file content, the same for every file
+          delay=<us>     sleep added to every getattr, readdir and open
+          read_delay=<us>
+                         sleep added to every read
+
+        Nothing is stored per file: a path is parsed back into its place in
+        the tree, and a file's size is a hash of that place. Reads hand FUSE
+        pointers into one shared pattern buffer (read_buf()), so no data is
+        copied here. With no options the tree is empty and only /hello is
+        served, as before.
+
 */
 
-#define FUSE_USE_VERSION 28
+/* read_buf() is FUSE 2.9 */
+#define FUSE_USE_VERSION 29
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+
+#define PATTERN_SPAN (1 << 20)     /* Pattern period, roughly */
+#define HELLO_FH     (1ULL << 63)  /* fi->fh of /hello; others hold the size */
 
 static const char *hello_str = "Hello World!\n";
 static const char *hello_path = "/hello";
 
-static int hello_getattr(const char *path, struct stat *stbuf)
+enum { DIST_FIXED, DIST_UNIFORM, DIST_LOG };
+
+static struct hello_state {
+	unsigned long fanout;
+	unsigned long depth;
+	unsigned long files;
+	unsigned long size;
+	char *size_dist;
+	char *pattern;
+	unsigned long delay;
+	unsigned long read_delay;
+
+	int dist;
+	char *buf;                 /* Two periods, so any period-long run is contiguous */
+	size_t period;
+	time_t mounted;
+} hello = { .size = 4096 };
+
+// What a path names
+typedef struct {
+	enum { NODE_DIR, NODE_FILE, NODE_HELLO } type;
+	unsigned long level;       //of a directory
+	uint64_t id;               //hash of the indices along the path
+} node;
+
+static uint64_t mix(uint64_t x)
+{
+	//splitmix64 finalizer
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static void op_delay(unsigned long us)
+{
+	struct timespec ts;
+
+	if (us == 0)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+// "d12" or "f3" with n below max; one spelling per number, so no "f03"
+static int parse_index(const char *name, size_t len, char kind, unsigned long max,
+		       unsigned long *index)
 {
-	int res = 0;
+	unsigned long n = 0;
+	size_t i;
 
+	if (len < 2 || name[0] != kind || (name[1] == '0' && len > 2))
+		return 0;
+	for (i = 1; i < len; i++) {
+		if (name[i] < '0' || name[i] > '9' || n > (max - 1) / 10)
+			return 0;
+		n = n * 10 + (name[i] - '0');
+	}
+	if (n >= max)
+		return 0;
+	*index = n;
+	return 1;
+}
+
+static int lookup(const char *path, node *n)
+{
+	const char *name = path + 1;
+	const char *end;
+	unsigned long index;
+	size_t len;
+
+	n->type = NODE_DIR;
+	n->level = 0;
+	n->id = 0;
+	if (strcmp(path, hello_path) == 0) {
+		n->type = NODE_HELLO;
+		n->id = 2;
+		return 0;
+	}
+	while (*name != '\0') {
+		end = strchr(name, '/');
+		len = end != NULL ? (size_t) (end - name) : strlen(name);
+		if (n->level < hello.depth &&
+		    parse_index(name, len, 'd', hello.fanout, &index)) {
+			n->level++;
+			n->id = mix(n->id ^ index);
+		} else if (end == NULL &&
+			   parse_index(name, len, 'f', hello.files, &index)) {
+			n->type = NODE_FILE;
+			n->id = mix(n->id ^ index ^ HELLO_FH);
+		} else
+			return -ENOENT;
+		name += len + (end != NULL);
+	}
+	return 0;
+}
+
+static off_t file_size(const node *n)
+{
+	uint64_t h = mix(n->id);
+
+	switch (hello.dist) {
+	case DIST_UNIFORM:
+		return h % (2 * (uint64_t) hello.size + 1);
+	case DIST_LOG:
+		return hello.size >> (h % 16);
+	default:
+		return hello.size;
+	}
+}
+
+static void fill_stat(const node *n, struct stat *stbuf)
+{
 	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
+	stbuf->st_ino = n->id ? n->id : 1;
+	stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = hello.mounted;
+	if (n->type == NODE_DIR) {
 		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else if (strcmp(path, hello_path) == 0) {
+		stbuf->st_nlink = 2 + (n->level < hello.depth ? hello.fanout : 0);
+	} else {
 		stbuf->st_mode = S_IFREG | 0444;
 		stbuf->st_nlink = 1;
-		stbuf->st_size = strlen(hello_str);
-	} else
-		res = -ENOENT;
+		stbuf->st_size = n->type == NODE_HELLO ? (off_t) strlen(hello_str) :
+			file_size(n);
+	}
+}
+
+static int hello_getattr(const char *path, struct stat *stbuf)
+{
+	node n;
+	int res;
+
+	op_delay(hello.delay);
+	res = lookup(path, &n);
+	if (res == 0)
+		fill_stat(&n, stbuf);
 
 	return res;
 }
 
+// Entries are numbered, so a big directory can be listed a buffer at a time:
+// ".", "..", hello (root only), the subdirectories, then the files
 static int hello_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi)
 {
-	(void) offset;
+	unsigned long dirs, hellos, total, i;
+	char name[32];
+	struct stat st;
+	node n;
+
 	(void) fi;
 
-	if (strcmp(path, "/") != 0)
+	op_delay(hello.delay);
+	if (lookup(path, &n) != 0 || n.type != NODE_DIR)
 		return -ENOENT;
 
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	filler(buf, hello_path + 1, NULL, 0);
+	hellos = n.level == 0;
+	dirs = n.level < hello.depth ? hello.fanout : 0;
+	total = 2 + hellos + dirs + hello.files;
+	memset(&st, 0, sizeof(st));
+	for (i = offset; i < total; i++) {
+		if (i < 2) {
+			strcpy(name, i ? ".." : ".");
+			st.st_mode = S_IFDIR;
+		} else if (i < 2 + hellos) {
+			strcpy(name, hello_path + 1);
+			st.st_mode = S_IFREG;
+		} else if (i < 2 + hellos + dirs) {
+			sprintf(name, "d%lu", i - 2 - hellos);
+			st.st_mode = S_IFDIR;
+		} else {
+			sprintf(name, "f%lu", i - 2 - hellos - dirs);
+			st.st_mode = S_IFREG;
+		}
+		if (filler(buf, name, &st, i + 1))
+			break;
+	}
 
 	return 0;
 }
 
 static int hello_open(const char *path, struct fuse_file_info *fi)
 {
-	if (strcmp(path, hello_path) != 0)
+	node n;
+
+	op_delay(hello.delay);
+	if (lookup(path, &n) != 0)
 		return -ENOENT;
+	if (n.type == NODE_DIR)
+		return -EISDIR;
 
 	if ((fi->flags & 3) != O_RDONLY)
 		return -EACCES;
 
+	//reads need nothing but the size, so they don't need the path either
+	fi->fh = n.type == NODE_HELLO ? HELLO_FH : (uint64_t) file_size(&n);
 	return 0;
 }
 
+// Bytes [offset, offset + size) of an open file, clipped at its end
+static const char *file_data(struct fuse_file_info *fi, off_t offset, size_t *size)
+{
+	off_t len = fi->fh == HELLO_FH ? (off_t) strlen(hello_str) : (off_t) fi->fh;
+
+	if (offset >= len) {
+		*size = 0;
+		return NULL;
+	}
+	if (offset + (off_t) *size > len)
+		*size = len - offset;
+	if (fi->fh == HELLO_FH)
+		return hello_str + offset;
+	return hello.buf + offset % hello.period;
+}
+
 static int hello_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	size_t len;
-	(void) fi;
-	if(strcmp(path, hello_path) != 0)
-		return -ENOENT;
+	const char *data;
+	size_t done, len;
+
+	(void) path;
 
-	len = strlen(hello_str);
-	if (offset < (int)len) {
-		if (offset + size > len)
-			size = len - offset;
-		memcpy(buf, hello_str + offset, size);
-	} else
-		size = 0;
+	op_delay(hello.read_delay);
+	data = file_data(fi, offset, &size);
+	if (fi->fh == HELLO_FH) {
+		memcpy(buf, data, size);
+		return size;
+	}
+	for (done = 0; done < size; done += len) {
+		len = size - done < hello.period ? size - done : hello.period;
+		memcpy(buf + done, hello.buf + (offset + done) % hello.period, len);
+	}
 
 	return size;
 }
 
+// Point FUSE into the pattern buffer instead of copying out of it: one
+// segment per period of the read
+static int hello_read_buf(const char *path, struct fuse_bufvec **bufp,
+			  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+	const char *data;
+	size_t count, done, len;
+
+	(void) path;
+
+	op_delay(hello.read_delay);
+	data = file_data(fi, offset, &size);
+	count = size / hello.period + 2;
+	src = malloc(sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].mem = (void *) data;
+	if (fi->fh != HELLO_FH) {
+		for (count = 0, done = 0; done < size; count++, done += len) {
+			len = size - done < hello.period ? size - done : hello.period;
+			src->buf[count] = src->buf[0];
+			src->buf[count].size = len;
+			src->buf[count].mem = hello.buf + (offset + done) % hello.period;
+		}
+		src->count = count ? count : 1;
+	}
+
+	*bufp = src;
+	return 0;
+}
+
 static struct fuse_operations hello_oper = {
 	.getattr	= hello_getattr,
 	.readdir	= hello_readdir,
 	.open		= hello_open,
 	.read		= hello_read,
+	.read_buf	= hello_read_buf,
+	/* Reads get by on fi->fh, don't look their paths up */
+	.flag_nullpath_ok = 1,
+	.flag_nopath	= 1,
 };
 
+#define HELLO_OPT(t, p, v) { t, offsetof(struct hello_state, p), v }
+
+static struct fuse_opt hello_opts[] = {
+	HELLO_OPT("fanout=%lu",		fanout, 0),
+	HELLO_OPT("depth=%lu",		depth, 0),
+	HELLO_OPT("files=%lu",		files, 0),
+	HELLO_OPT("size=%lu",		size, 0),
+	HELLO_OPT("size_dist=%s",	size_dist, 0),
+	HELLO_OPT("pattern=%s",		pattern, 0),
+	HELLO_OPT("delay=%lu",		delay, 0),
+	HELLO_OPT("read_delay=%lu",	read_delay, 0),
+	FUSE_OPT_END
+};
+
+// The shared content: two periods back to back
+static int make_pattern(const char *pattern)
+{
+	size_t len = strlen(hello_str);
+	uint64_t x = 0x2545f4914f6cdd1dULL;
+	size_t i;
+
+	hello.period = PATTERN_SPAN;
+	if (pattern == NULL || strcmp(pattern, "text") == 0)
+		hello.period = PATTERN_SPAN / len * len;
+	else if (strcmp(pattern, "zero") != 0 && strcmp(pattern, "random") != 0)
+		return -EINVAL;
+
+	hello.buf = malloc(2 * hello.period);
+	if (hello.buf == NULL)
+		return -ENOMEM;
+	for (i = 0; i < hello.period; i++) {
+		if (pattern == NULL || strcmp(pattern, "text") == 0)
+			hello.buf[i] = hello_str[i % len];
+		else if (strcmp(pattern, "zero") == 0)
+			hello.buf[i] = 0;
+		else {
+			//xorshift64: incompressible
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			hello.buf[i] = x >> 56;
+		}
+	}
+	memcpy(hello.buf + hello.period, hello.buf, hello.period);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	//Pick out our own -o options, the rest go to fuse_main
+	if (fuse_opt_parse(&args, &hello, hello_opts, NULL) == -1)
+		return 1;
+	if (hello.size_dist == NULL || strcmp(hello.size_dist, "fixed") == 0)
+		hello.dist = DIST_FIXED;
+	else if (strcmp(hello.size_dist, "uniform") == 0)
+		hello.dist = DIST_UNIFORM;
+	else if (strcmp(hello.size_dist, "log") == 0)
+		hello.dist = DIST_LOG;
+	else {
+		fprintf(stderr, "size_dist is fixed, uniform or log.\n");
+		return 1;
+	}
+	res = make_pattern(hello.pattern);
+	if (res) {
+		fprintf(stderr, res == -EINVAL ? "pattern is text, zero or random.\n" :
+			"Failed to allocate the pattern buffer.\n");
+		return 1;
+	}
+	hello.mounted = time(NULL);
+
+	res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	free(hello.buf);
+	return res;
 }
@@ -12,17 +12,25 @@
 
   gcc -Wall `pkg-config fuse --cflags` fusexmp.c -o fusexmp `pkg-config fuse --libs`
 
-  Note: This implementation is largely stateless and does not maintain
-        open file handels between open and release calls (fi->fh).
-        Instead, files are opened and closed as necessary inside read(), write(),
-        etc calls. As such, the functions that rely on maintaining file handles are
-        not implmented (fgetattr(), etc). Those seeking a more efficient and
-        more complete implementation may wish to add fi->fh support to minimize
-        open() and close() calls and support fh dependent functions.
+  Note: This is the reference pass-through the pa4-encfs benchmarks are
+        measured against, so it does what pa4-encfs does short of encrypting:
+        files stay open between open() and release() (fi->fh), directories
+        between opendir() and releasedir(), and are listed with getdents64()
+        through dir-scan.h. Data moves with read_buf()/write_buf(), which lets
+        libfuse splice() it between /dev/fuse and the backing file without
+        copying it through this process. fuse_main() runs the multi-threaded
+        loop unless -s is given; nothing here needs a lock.
+
+        It takes pa4-encfs's attribute cache option, attr_cache=<entries>
+        (attr-cache.h; 0 turns it off), and no_splice, which serves reads and
+        writes through plain buffers. The kernel cache options (kernel_cache,
+        auto_cache, entry_timeout, attr_timeout, ...) are libfuse's and work
+        on both.
 
 */
 
-#define FUSE_USE_VERSION 28
+/* read_buf() and write_buf() are FUSE 2.9 */
+#define FUSE_USE_VERSION 29
 #define HAVE_SETXATTR
 
 #ifdef HAVE_CONFIG_H
@@ -30,13 +38,17 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() */
-#define _XOPEN_SOURCE 500
+/* For pread()/pwrite(), fdatasync() and utimensat() */
+#define _GNU_SOURCE
 #endif
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -46,10 +58,50 @@
 #include <sys/xattr.h>
 #endif
 
+#include "attr-cache.h"
+#include "dir-scan.h"
+
+#define XMP_DENTS 32768     /* getdents64() buffer, on the stack */
+
+static struct xmp_state {
+	unsigned long attr_entries;
+	int no_splice;
+	attr_cache ac;
+} xmp = { .attr_entries = ATTR_CACHE_DEFAULT };
+
+// Attribute cache upkeep, after path changed (parent: its directory did too)
+static void attr_forget(const char *path, int parent)
+{
+	char dir[PATH_MAX];
+	char *slash;
+
+	if (!xmp.attr_entries || path == NULL)
+		return;
+	attr_cache_forget(&xmp.ac, path);
+	if (parent) {
+		strcpy(dir, path);
+		slash = strrchr(dir, '/');
+		if (slash != NULL) {
+			slash[slash == dir ? 1 : 0] = '\0';
+			attr_cache_forget(&xmp.ac, dir);
+		}
+	}
+}
+
+// ... and after a change that can touch any number of paths
+static void attr_clear(void)
+{
+	if (xmp.attr_entries)
+		attr_cache_clear(&xmp.ac);
+}
+
 static int xmp_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 
+	if (xmp.attr_entries && attr_cache_get(&xmp.ac, path, stbuf) == 0)
+		return 0;
+
 	res = lstat(path, stbuf);
 	if (res == -1)
 		return -errno;
@@ -57,6 +109,20 @@ static int xmp_getattr(const char *path, struct stat *stbuf)
 	return 0;
 }
 
+static int xmp_fgetattr(const char *path, struct stat *stbuf,
+			struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+
+	res = fstat(fi->fh, stbuf);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
 static int xmp_access(const char *path, int mask)
 {
 	int res;
@@ -81,29 +147,70 @@ static int xmp_readlink(const char *path, char *buf, size_t size)
 }
 
 
+// The directory stays open from opendir() to releasedir() so that a big one
+// can be listed a buffer at a time, picking up at the offset FUSE hands back
+static int xmp_opendir(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+
+	fd = dir_open(path);
+	if (fd < 0)
+		return fd;
+	fi->fh = fd;
+	return 0;
+}
+
+// One readdir() call's way through the directory
+typedef struct {
+	const char *path;
+	void *buf;
+	fuse_fill_dir_t filler;
+} list_state;
+
+static int list_fill(void *arg, int dirfd, const char *name, ino_t ino,
+		     unsigned char type, off_t next)
+{
+	list_state *ls = arg;
+	char childPath[PATH_MAX];
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = type << 12;
+	//stat every entry for the getattr() that usually follows, as pa4-encfs does
+	if (xmp.attr_entries && ls->path != NULL && strcmp(name, ".") && strcmp(name, "..") &&
+	    snprintf(childPath, sizeof(childPath), "%s/%s",
+		     strcmp(ls->path, "/") ? ls->path : "", name) < (int) sizeof(childPath)) {
+		uint64_t token = attr_cache_token(&xmp.ac, childPath);
+		struct stat full;
+
+		if (dir_stat(dirfd, name, &full) == 0) {
+			attr_cache_put(&xmp.ac, childPath, &full, token);
+			st = full;
+		}
+	}
+	return ls->filler(ls->buf, name, &st, next);
+}
+
 static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
-	DIR *dp;
-	struct dirent *de;
+	uint64_t dents[XMP_DENTS / sizeof(uint64_t)];
+	list_state ls = { path, buf, filler };
+	int res;
 
-	(void) offset;
-	(void) fi;
+	res = dir_scan(fi->fh, offset, dents, sizeof(dents), list_fill, &ls);
+	if (res < 0)
+		return res;
 
-	dp = opendir(path);
-	if (dp == NULL)
-		return -errno;
+	return 0;
+}
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
-	}
+static int xmp_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
 
-	closedir(dp);
+	close(fi->fh);
 	return 0;
 }
 
@@ -124,6 +231,8 @@ static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 1);
+
 	return 0;
 }
 
@@ -135,6 +244,8 @@ static int xmp_mkdir(const char *path, mode_t mode)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 1);
+
 	return 0;
 }
 
@@ -146,6 +257,8 @@ static int xmp_unlink(const char *path)
 	if (res == -1)
 		return -errno;
 
+	attr_clear();
+
 	return 0;
 }
 
@@ -157,6 +270,8 @@ static int xmp_rmdir(const char *path)
 	if (res == -1)
 		return -errno;
 
+	attr_clear();
+
 	return 0;
 }
 
@@ -168,6 +283,8 @@ static int xmp_symlink(const char *from, const char *to)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(to, 1);
+
 	return 0;
 }
 
@@ -179,6 +296,8 @@ static int xmp_rename(const char *from, const char *to)
 	if (res == -1)
 		return -errno;
 
+	attr_clear();
+
 	return 0;
 }
 
@@ -190,6 +309,8 @@ static int xmp_link(const char *from, const char *to)
 	if (res == -1)
 		return -errno;
 
+	attr_clear();
+
 	return 0;
 }
 
@@ -201,6 +322,8 @@ static int xmp_chmod(const char *path, mode_t mode)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 0);
+
 	return 0;
 }
 
@@ -212,6 +335,8 @@ static int xmp_chown(const char *path, uid_t uid, gid_t gid)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 0);
+
 	return 0;
 }
 
@@ -223,73 +348,110 @@ static int xmp_truncate(const char *path, off_t size)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 0);
+
 	return 0;
 }
 
 static int xmp_utimens(const char *path, const struct timespec ts[2])
 {
 	int res;
-	struct timeval tv[2];
 
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
-	res = utimes(path, tv);
+	/* nanosecond times, and don't follow symlinks */
+	res = utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(path, 0);
 	return 0;
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+static int xmp_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
 {
 	int res;
 
-	res = open(path, fi->flags);
+	res = ftruncate(fi->fh, size);
 	if (res == -1)
 		return -errno;
 
-	close(res);
+	attr_forget(path, 0);
 	return 0;
 }
 
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+static int xmp_open(const char *path, struct fuse_file_info *fi)
 {
 	int fd;
-	int res;
 
-	(void) fi;
-	fd = open(path, O_RDONLY);
+	fd = open(path, fi->flags);
 	if (fd == -1)
 		return -errno;
 
-	res = pread(fd, buf, size, offset);
+	fi->fh = fd;
+	return 0;
+}
+
+static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+
+	res = pread(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	close(fd);
 	return res;
 }
 
+// Hand FUSE the backing file itself: it splices from it straight into the
+// reply when it can, and reads into its own buffer when it can't
+static int xmp_read_buf(const char *path, struct fuse_bufvec **bufp,
+			size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	(void) path;
+
+	src = malloc(sizeof(struct fuse_bufvec));
+	if (src == NULL)
+		return -ENOMEM;
+
+	*src = FUSE_BUFVEC_INIT(size);
+	src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	src->buf[0].fd = fi->fh;
+	src->buf[0].pos = offset;
+
+	*bufp = src;
+	return 0;
+}
+
 static int xmp_write(const char *path, const char *buf, size_t size,
 		     off_t offset, struct fuse_file_info *fi)
 {
-	int fd;
 	int res;
 
-	(void) fi;
-	fd = open(path, O_WRONLY);
-	if (fd == -1)
-		return -errno;
-
-	res = pwrite(fd, buf, size, offset);
+	res = pwrite(fi->fh, buf, size, offset);
 	if (res == -1)
 		res = -errno;
 
-	close(fd);
+	attr_forget(path, 0);
+	return res;
+}
+
+static int xmp_write_buf(const char *path, struct fuse_bufvec *buf,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	ssize_t res;
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	attr_forget(path, 0);
 	return res;
 }
 
@@ -306,38 +468,54 @@ static int xmp_statfs(const char *path, struct statvfs *stbuf)
 
 static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
 
-    (void) fi;
-
-    int res;
-    res = creat(path, mode);
-    if(res == -1)
+    int fd;
+    fd = open(path, fi->flags | O_CREAT, mode);
+    if(fd == -1)
 	return -errno;
 
-    close(res);
+    fi->fh = fd;
+    attr_forget(path, 1);
 
     return 0;
 }
 
+static int xmp_flush(const char *path, struct fuse_file_info *fi)
+{
+	int res;
+
+	(void) path;
+	/* Called on every close() of a descriptor of this open file, so
+	   report errors the way close() on the backing file would:
+	   close a duplicate, the file itself stays open until release() */
+	res = close(dup(fi->fh));
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
 
 static int xmp_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
-
 	(void) path;
-	(void) fi;
+
+	close(fi->fh);
 	return 0;
 }
 
 static int xmp_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	int res;
 
 	(void) path;
-	(void) isdatasync;
-	(void) fi;
+
+	if (isdatasync)
+		res = fdatasync(fi->fh);
+	else
+		res = fsync(fi->fh);
+	if (res == -1)
+		return -errno;
+
 	return 0;
 }
 
@@ -348,6 +526,7 @@ static int xmp_setxattr(const char *path, const char *name, const char *value,
 	int res = lsetxattr(path, name, value, size, flags);
 	if (res == -1)
 		return -errno;
+	attr_forget(path, 0);
 	return 0;
 }
 
@@ -373,15 +552,19 @@ static int xmp_removexattr(const char *path, const char *name)
 	int res = lremovexattr(path, name);
 	if (res == -1)
 		return -errno;
+	attr_forget(path, 0);
 	return 0;
 }
 #endif /* HAVE_SETXATTR */
 
 static struct fuse_operations xmp_oper = {
 	.getattr	= xmp_getattr,
+	.fgetattr	= xmp_fgetattr,
 	.access		= xmp_access,
 	.readlink	= xmp_readlink,
+	.opendir	= xmp_opendir,
 	.readdir	= xmp_readdir,
+	.releasedir	= xmp_releasedir,
 	.mknod		= xmp_mknod,
 	.mkdir		= xmp_mkdir,
 	.symlink	= xmp_symlink,
@@ -392,12 +575,16 @@ static struct fuse_operations xmp_oper = {
 	.chmod		= xmp_chmod,
 	.chown		= xmp_chown,
 	.truncate	= xmp_truncate,
+	.ftruncate	= xmp_ftruncate,
 	.utimens	= xmp_utimens,
 	.open		= xmp_open,
 	.read		= xmp_read,
+	.read_buf	= xmp_read_buf,
 	.write		= xmp_write,
+	.write_buf	= xmp_write_buf,
 	.statfs		= xmp_statfs,
 	.create         = xmp_create,
+	.flush		= xmp_flush,
 	.release	= xmp_release,
 	.fsync		= xmp_fsync,
 #ifdef HAVE_SETXATTR
@@ -406,10 +593,44 @@ static struct fuse_operations xmp_oper = {
 	.listxattr	= xmp_listxattr,
 	.removexattr	= xmp_removexattr,
 #endif
+	/* Paths are only used for the attribute cache, which copes without */
+	.flag_nullpath_ok = 1,
+};
+
+#define XMP_OPT(t, p, v) { t, offsetof(struct xmp_state, p), v }
+
+static struct fuse_opt xmp_opts[] = {
+	XMP_OPT("attr_cache=%lu",	attr_entries, 0),
+	XMP_OPT("no_splice",	no_splice, 1),
+	FUSE_OPT_END
 };
 
 int main(int argc, char *argv[])
 {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
 	umask(0);
-	return fuse_main(argc, argv, &xmp_oper, NULL);
+
+	//Pick out our own -o options, the rest go to fuse_main
+	if (fuse_opt_parse(&args, &xmp, xmp_opts, NULL) == -1)
+		return 1;
+	if (xmp.attr_entries) {
+		res = attr_cache_init(&xmp.ac, xmp.attr_entries);
+		if (res) {
+			fprintf(stderr, "Failed to set up attribute cache: %s\n", strerror(-res));
+			return 1;
+		}
+	}
+	//without splicing, reads and writes go through read() and write()
+	if (xmp.no_splice) {
+		xmp_oper.read_buf = NULL;
+		xmp_oper.write_buf = NULL;
+	}
+
+	res = fuse_main(args.argc, args.argv, &xmp_oper, NULL);
+	fuse_opt_free_args(&args);
+	if (xmp.attr_entries)
+		attr_cache_destroy(&xmp.ac);
+	return res;
 }
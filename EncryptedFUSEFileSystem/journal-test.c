@@ -0,0 +1,210 @@
+/* journal-test.c
+ * Regression check of journal mode (see journal.h)
+ *
+ * Works on block files in a fresh directory under /tmp:
+ *  - A child process grows a file through the journal, syncs the journal
+ *    and exits without putting anything in place, as a crash would. The
+ *    file's header must still have the old size; replay must bring back
+ *    the new size and contents.
+ *  - A file rewritten through the journal must read back the logged blocks
+ *    whatever the read looks like, compressed blocks included, and its
+ *    header must only grow once the journal is closed (everything in place).
+ *
+ * Run by "make check". Exit status: 0 if everything checked out, 1 if not
+ * (the directory is then left as it was).
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "aes-crypt.h"
+#include "buf-pool.h"
+#include "encfs-block.h"
+#include "journal.h"
+
+#define OLD_SIZE 100
+#define NEW_SIZE 3000
+
+#define CHECK(cond) do{							\
+	if(!(cond)){							\
+	    fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+	    exit(1);							\
+	}								\
+    } while(0)
+
+static char dir[] = "/tmp/journal-test.XXXXXX";
+static crypt_key key;
+static bufpool pool;
+
+/* Contents of the file after the rewrite: text, so it compresses */
+static void fill(char* buf, size_t len){
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	buf[i] = "journal test "[i % 13];
+    }
+}
+
+/* Create name in dir holding OLD_SIZE bytes, in place */
+static int create_file(encfs_file* f, const char* name, int compress){
+    char path[PATH_MAX];
+    char buf[OLD_SIZE];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd != -1);
+    memset(f, 0, sizeof(*f));
+    CHECK(encfs_create(f, fd, &key, &pool,
+		       compress ? ENCFS_LZ_BLOCK_SIZE : ENCFS_BLOCK_SIZE) == 0);
+    f->compress = compress;
+    memset(buf, 'x', sizeof(buf));
+    CHECK(encfs_pwrite(f, buf, sizeof(buf), 0) == sizeof(buf));
+    return fd;
+}
+
+/* Plaintext size in fd's header */
+static uint64_t header_size(int fd){
+    encfs_header hdr;
+
+    CHECK(encfs_probe(fd, &hdr) == 1);
+    return hdr.size;
+}
+
+static void open_journal(journal* j){
+    const crypt_key* keys[1] = { &key };
+
+    CHECK(journal_open(j, dir, (off_t)JOURNAL_DEFAULT_MAX << 20, &key) == 0);
+    CHECK(journal_replay(j, dir, keys, 1, &pool) >= 0);
+}
+
+/* Grow a file through the journal and stop dead once the journal is synced */
+static void crash(void){
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    char buf[NEW_SIZE];
+    journal_file jf;
+    encfs_file f;
+    journal j;
+    int fd;
+
+    fd = create_file(&f, "crash", 0);
+    open_journal(&j);
+    memset(&jf, 0, sizeof(jf));
+    CHECK(journal_attach(&jf, &j, &f, &lock) == 0);
+    fill(buf, sizeof(buf));
+    pthread_rwlock_wrlock(&lock);
+    CHECK(encfs_pwrite(&f, buf, sizeof(buf), 0) == sizeof(buf));
+    pthread_rwlock_unlock(&lock);
+    CHECK(journal_sync(&j) == 0);
+    CHECK(header_size(fd) == OLD_SIZE);
+    _exit(0);
+}
+
+static void check_replay(void){
+    char want[NEW_SIZE];
+    char got[NEW_SIZE];
+    char path[PATH_MAX];
+    encfs_file f;
+    journal j;
+    pid_t pid;
+    int status;
+    int fd;
+
+    pid = fork();
+    CHECK(pid != -1);
+    if(pid == 0){
+	crash();
+    }
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    open_journal(&j);
+    journal_close(&j);
+    snprintf(path, sizeof(path), "%s/crash", dir);
+    fd = open(path, O_RDWR);
+    CHECK(fd != -1);
+    memset(&f, 0, sizeof(f));
+    CHECK(encfs_open(&f, fd, &key, &pool) == 0);
+    CHECK(f.hdr.size == NEW_SIZE);
+    fill(want, sizeof(want));
+    CHECK(encfs_pread(&f, got, sizeof(got), 0) == sizeof(got));
+    CHECK(!memcmp(got, want, sizeof(got)));
+    close(fd);
+}
+
+static void check_reads(journal* j, const char* name, int compress){
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    char want[NEW_SIZE];
+    char got[NEW_SIZE];
+    journal_file jf;
+    encfs_file f;
+    size_t len;
+    int fd;
+
+    fd = create_file(&f, name, compress);
+    memset(&jf, 0, sizeof(jf));
+    CHECK(journal_attach(&jf, j, &f, &lock) == 0);
+    fill(want, sizeof(want));
+    pthread_rwlock_wrlock(&lock);
+    CHECK(encfs_pwrite(&f, want, sizeof(want), 0) == sizeof(want));
+    pthread_rwlock_unlock(&lock);
+
+    /* Less than the logged block, which the map on disk knows nothing of */
+    pthread_rwlock_rdlock(&lock);
+    for(len = 1; len <= sizeof(got); len = len < 200 ? 200 : len * 2 + 1){
+	if(len > sizeof(got)){
+	    len = sizeof(got);
+	}
+	memset(got, 0, sizeof(got));
+	CHECK(encfs_pread(&f, got, len, 0) == (ssize_t)len);
+	CHECK(!memcmp(got, want, len));
+	if(len == sizeof(got)){
+	    break;
+	}
+    }
+    pthread_rwlock_unlock(&lock);
+    CHECK(header_size(fd) == OLD_SIZE);
+    journal_detach(&jf);
+    close(fd);
+}
+
+int main(void){
+    static const char* const names[] = { "crash", "read", "read-lz", JOURNAL_NAME };
+    journal j;
+    char path[PATH_MAX];
+    size_t i;
+    int fd;
+
+    CHECK(mkdtemp(dir) != NULL);
+    CHECK(crypt_derive_key("journal test", &key));
+    CHECK(bufpool_init(&pool, ENCFS_MAX_BLOCK_SIZE, 16 << 20, 0) == 0);
+
+    /* First: the child mustn't inherit the checkpoint thread */
+    check_replay();
+
+    open_journal(&j);
+    check_reads(&j, "read", 0);
+    check_reads(&j, "read-lz", 1);
+    journal_close(&j);
+    snprintf(path, sizeof(path), "%s/read", dir);
+    fd = open(path, O_RDONLY);
+    CHECK(fd != -1 && header_size(fd) == NEW_SIZE);
+    close(fd);
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++){
+	snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+	unlink(path);
+    }
+    rmdir(dir);
+    printf("journal checks passed\n");
+    return 0;
+}
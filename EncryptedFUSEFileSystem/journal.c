@@ -0,0 +1,1204 @@
+/* journal.c
+ * Write-ahead journal of block updates for pa4-encfs
+ *
+ * See journal.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <openssl/crypto.h>
+
+#include "dir-scan.h"
+#include "journal.h"
+
+#define HEADER_MAC_LEN offsetof(journal_header, tag)
+#define REC_MAC_LEN    offsetof(journal_rec, tag)
+
+#define EMPTY UINT64_MAX
+
+#define RETRY_US     1000       /* Between checkpoint rounds while files are busy */
+#define LOCK_WAIT_NS 10000000   /* For a busy file's lock, per round */
+#define SCAN_BUF     32768      /* getdents64() buffer per directory level */
+
+/* A closed file whose records aren't in place yet */
+typedef struct journal_orphan {
+    journal_file jf;
+    encfs_file ef;                /* Copy, on a descriptor of its own */
+    pthread_rwlock_t lock;
+} journal_orphan;
+
+/* A file named in the journal, found at replay */
+typedef struct replay_file {
+    uint64_t ino;
+    unsigned char file_id[16];
+    int fd;                       /* -1 until found */
+    int touched;
+    mode_t mode;                  /* To put back, if it was made writable */
+    encfs_file ef;
+} replay_file;
+
+typedef struct replay {
+    replay_file* files;           /* Sorted by inode */
+    int nfiles;
+    int missing;                  /* Not found yet */
+    int error;                    /* A file with records that couldn't be opened */
+    const crypt_key* const* keys;
+    int nkeys;
+    bufpool* pool;
+} replay;
+
+/*----pending blocks of a file, under its lock---------------------------------*/
+
+static size_t slot_hash(uint64_t idx, size_t cap){
+    return (size_t)(idx * 0x9e3779b97f4a7c15ULL) & (cap - 1);
+}
+
+/* Slot of idx, also one whose record is in place already (off < 0) */
+static journal_slot* slot_find(journal_file* jf, uint64_t idx){
+    size_t i;
+
+    if(jf->cap == 0){
+	return NULL;
+    }
+    for(i = slot_hash(idx, jf->cap); jf->slots[i].idx != EMPTY; i = (i + 1) & (jf->cap - 1)){
+	if(jf->slots[i].idx == idx){
+	    return &jf->slots[i];
+	}
+    }
+    return NULL;
+}
+
+/* Rehash into cap slots, dropping the ones in place */
+static int slot_rebuild(journal_file* jf, size_t cap){
+    journal_slot* slots = malloc(cap * sizeof(*slots));
+    journal_slot* sl;
+    size_t i, k;
+
+    if(slots == NULL){
+	return -ENOMEM;
+    }
+    for(i = 0; i < cap; i++){
+	slots[i].idx = EMPTY;
+    }
+    for(i = 0; i < jf->cap; i++){
+	sl = &jf->slots[i];
+	if(sl->idx == EMPTY || sl->off < 0){
+	    continue;
+	}
+	for(k = slot_hash(sl->idx, cap); slots[k].idx != EMPTY; k = (k + 1) & (cap - 1)){
+	}
+	slots[k] = *sl;
+    }
+    free(jf->slots);
+    jf->slots = slots;
+    jf->cap = cap;
+    jf->used = jf->live;
+    return 0;
+}
+
+/* Room for one more slot, taken before the record is written so that a
+ * record in the journal is never missing from the table */
+static int slot_reserve(journal_file* jf){
+    size_t cap = 64;
+
+    if((jf->used + 1) * 4 <= jf->cap * 3){
+	return 0;
+    }
+    while((jf->live + 1) * 2 > cap){
+	cap *= 2;
+    }
+    return slot_rebuild(jf, cap);
+}
+
+static void slot_set(journal_file* jf, uint64_t idx, off_t off, const encfs_map_entry* entry,
+		     uint64_t size){
+    size_t i;
+
+    for(i = slot_hash(idx, jf->cap); jf->slots[i].idx != EMPTY && jf->slots[i].idx != idx;
+	i = (i + 1) & (jf->cap - 1)){
+    }
+    if(jf->slots[i].idx == EMPTY){
+	jf->slots[i].idx = idx;
+	jf->slots[i].off = -1;
+	jf->used++;
+    }
+    if(jf->slots[i].off < 0){
+	jf->live++;
+    }
+    jf->slots[i].off = off;
+    jf->slots[i].size = size;
+    jf->slots[i].entry = *entry;
+}
+
+static void slot_clear(journal_file* jf){
+    free(jf->slots);
+    jf->slots = NULL;
+    jf->cap = 0;
+    jf->used = 0;
+    jf->live = 0;
+}
+
+/*----list of files with records, under j->mtx--------------------------------*/
+
+static void list_add(journal* j, journal_file* jf){
+    jf->prev = NULL;
+    jf->next = j->files;
+    if(j->files){
+	j->files->prev = jf;
+    }
+    j->files = jf;
+    jf->listed = 1;
+}
+
+static void list_del(journal* j, journal_file* jf){
+    if(jf->prev){
+	jf->prev->next = jf->next;
+    }
+    else{
+	j->files = jf->next;
+    }
+    if(jf->next){
+	jf->next->prev = jf->prev;
+    }
+    jf->prev = NULL;
+    jf->next = NULL;
+    jf->listed = 0;
+}
+
+static void orphan_free(journal* j, journal_file* jf){
+    journal_orphan* o = (journal_orphan*)jf;
+
+    j->orphans--;
+    close(o->ef.fd);
+    free(jf->slots);
+    pthread_rwlock_destroy(&o->lock);
+    free(o);
+}
+
+/*----journal file------------------------------------------------------------*/
+
+/* Start over under the next generation. Called with j->mtx held. */
+static int reset(journal* j, const crypt_key* key){
+    journal_header hdr;
+    ssize_t res;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.gen = j->gen + 1;
+    crypt_mac(key, &hdr, HEADER_MAC_LEN, hdr.tag);
+    res = pwrite(j->fd, &hdr, sizeof(hdr), 0);
+    if(res != sizeof(hdr)){
+	return res == -1 ? -errno : -EIO;
+    }
+    if(fdatasync(j->fd) == -1){
+	return -errno;
+    }
+    j->gen = hdr.gen;
+    j->tail = JOURNAL_HEADER_SIZE;
+    j->synced = JOURNAL_HEADER_SIZE;
+    return 0;
+}
+
+extern int journal_sync(journal* j){
+    uint64_t gen;
+    off_t upto;
+
+    pthread_mutex_lock(&j->mtx);
+    gen = j->gen;
+    upto = j->tail;
+    pthread_mutex_unlock(&j->mtx);
+    if(fdatasync(j->fd) == -1){
+	return -errno;
+    }
+    pthread_mutex_lock(&j->mtx);
+    /* A checkpoint that started over meanwhile synced everything itself */
+    if(j->gen == gen && upto > j->synced){
+	j->synced = upto;
+    }
+    pthread_mutex_unlock(&j->mtx);
+    return 0;
+}
+
+/* Store size in ef's header if it holds less: the size the records put in
+ * place expose. The file may be bigger by now, with the rest logged. */
+static int grow_header(encfs_file* ef, uint64_t size){
+    encfs_header hdr;
+    encfs_file f;
+    int res;
+
+    res = encfs_probe(ef->fd, &hdr);
+    if(res <= 0){
+	return res < 0 ? res : -EIO;
+    }
+    if(hdr.size >= size){
+	return 0;
+    }
+    f = *ef;
+    f.hdr.size = size;
+    return encfs_write_header(&f);
+}
+
+/* Put the file's records that are on disk in place (syncing the journal
+ * first if sync), then the size they carry, then sync the file. Called with
+ * jf->lock held for writing. Records are only forgotten once the file is
+ * synced; putting one in place twice does no harm. */
+static int apply(journal_file* jf, int sync){
+    journal* j = jf->j;
+    unsigned char* cipher;
+    journal_slot* sl;
+    uint32_t stored;
+    uint64_t size = 0;
+    off_t upto;
+    ssize_t n;
+    size_t i;
+    int done = 0;
+    int res = 0;
+
+    if(jf->live == 0){
+	return 0;
+    }
+    if(sync){
+	res = journal_sync(j);
+	if(res){
+	    return res;
+	}
+    }
+    pthread_mutex_lock(&j->mtx);
+    upto = j->synced;
+    pthread_mutex_unlock(&j->mtx);
+
+    cipher = bufpool_get(jf->ef->pool);
+    if(cipher == NULL){
+	return -ENOMEM;
+    }
+    for(i = 0; !res && i < jf->cap; i++){
+	sl = &jf->slots[i];
+	stored = sl->entry.len & ENCFS_LEN_MASK;
+	if(sl->idx == EMPTY || sl->off < 0 || sl->off + (off_t)stored > upto){
+	    continue;
+	}
+	n = pread(j->fd, cipher, stored, sl->off);
+	res = n == -1 ? -errno : n != (ssize_t)stored ? -EIO : 0;
+	if(!res){
+	    res = encfs_put_block(jf->ef, sl->idx, &sl->entry, cipher);
+	    done++;
+	}
+	if(sl->size > size){
+	    size = sl->size;
+	}
+    }
+    bufpool_put(jf->ef->pool, cipher);
+    if(!res && done){
+	res = grow_header(jf->ef, size);
+    }
+    if(!res && done && fdatasync(jf->ef->fd) == -1){
+	res = -errno;
+    }
+    if(res || !done){
+	return res;
+    }
+
+    for(i = 0; i < jf->cap; i++){
+	sl = &jf->slots[i];
+	if(sl->idx != EMPTY && sl->off >= 0 &&
+	   sl->off + (off_t)(sl->entry.len & ENCFS_LEN_MASK) <= upto){
+	    sl->off = -1;
+	    jf->live--;
+	}
+    }
+    /* Same size, so the reservation made for a record being written holds */
+    slot_rebuild(jf, jf->cap);
+    return 0;
+}
+
+/* Write a record (and len bytes of data after it) at the tail, and list the
+ * file if asked. Called with jf->lock held for writing. A full journal is
+ * made room in by putting the file's own records in place (*applied is then
+ * set) and waiting for the checkpoint. */
+static int append(journal_file* jf, journal_rec* rec, const void* data, size_t len,
+		  int list, off_t* at, int* applied){
+    journal* j = jf->j;
+    off_t need = sizeof(*rec) + len;
+    struct iovec iov[2];
+    ssize_t res;
+
+    pthread_mutex_lock(&j->mtx);
+    while(j->tail + need > j->max){
+	/* Ours may be the records keeping the checkpoint from finishing */
+	if(jf->live){
+	    pthread_mutex_unlock(&j->mtx);
+	    res = apply(jf, 1);
+	    pthread_mutex_lock(&j->mtx);
+	    if(res){
+		pthread_mutex_unlock(&j->mtx);
+		return res;
+	    }
+	    *applied = 1;
+	    continue;
+	}
+	/* Nothing of ours is left out; the checkpoint mustn't wait for us */
+	if(jf->listed){
+	    list_del(j, jf);
+	}
+	j->want = 1;
+	pthread_cond_signal(&j->work);
+	pthread_cond_wait(&j->space, &j->mtx);
+	if(j->err){
+	    res = j->err;
+	    pthread_mutex_unlock(&j->mtx);
+	    return res;
+	}
+    }
+
+    rec->gen = j->gen;
+    crypt_mac(j->key, rec, REC_MAC_LEN, rec->tag);
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(*rec);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    /* Under the lock: everything before the tail is written */
+    res = pwritev(j->fd, iov, len ? 2 : 1, j->tail);
+    if(res == need){
+	*at = j->tail;
+	j->tail += need;
+	if(list && !jf->listed){
+	    list_add(j, jf);
+	}
+	if(j->tail * 2 > j->max && !j->want){
+	    j->want = 1;
+	    pthread_cond_signal(&j->work);
+	}
+	res = 0;
+    }
+    else{
+	res = res == -1 ? -errno : -EIO;
+    }
+    pthread_mutex_unlock(&j->mtx);
+    return res;
+}
+
+static void rec_init(journal_file* jf, journal_rec* rec, uint32_t type, uint64_t size){
+    memset(rec, 0, sizeof(*rec));
+    rec->type = type;
+    rec->ino = jf->ino;
+    memcpy(rec->file_id, jf->ef->hdr.file_id, sizeof(rec->file_id));
+    rec->size = size;
+}
+
+/*----encfs_redo--------------------------------------------------------------*/
+
+static int jf_put(encfs_redo* r, uint64_t idx, const encfs_map_entry* entry,
+		  const unsigned char* cipher, uint64_t size){
+    journal_file* jf = (journal_file*)r;
+    journal_rec rec;
+    int applied = 0;
+    off_t at;
+    int res;
+
+    res = slot_reserve(jf);
+    if(res){
+	return res;
+    }
+    rec_init(jf, &rec, JOURNAL_BLOCK, size);
+    rec.idx = idx;
+    rec.entry = *entry;
+    res = append(jf, &rec, cipher, entry->len & ENCFS_LEN_MASK, 1, &at, &applied);
+    if(res){
+	return res;
+    }
+    slot_set(jf, idx, at + sizeof(rec), entry, size);
+    return applied;
+}
+
+static int jf_get(encfs_redo* r, uint64_t idx, encfs_map_entry* entry, unsigned char* cipher){
+    journal_file* jf = (journal_file*)r;
+    journal_slot* sl = slot_find(jf, idx);
+    uint32_t stored;
+    ssize_t res;
+
+    if(sl == NULL || sl->off < 0){
+	return 0;
+    }
+    stored = sl->entry.len & ENCFS_LEN_MASK;
+    res = pread(jf->j->fd, cipher, stored, sl->off);
+    if(res == -1){
+	return -errno;
+    }
+    if(res != (ssize_t)stored){
+	return -EIO;
+    }
+    *entry = sl->entry;
+    return 1;
+}
+
+static int jf_trunc(encfs_redo* r, uint64_t size){
+    journal_file* jf = (journal_file*)r;
+    uint64_t bs = jf->ef->hdr.block_size;
+    uint64_t end = (size + bs - 1) / bs;
+    journal_rec rec;
+    int applied = 0;
+    off_t at;
+    size_t i;
+    int res;
+
+    rec_init(jf, &rec, JOURNAL_TRUNC, size);
+    res = append(jf, &rec, NULL, 0, 0, &at, &applied);
+    if(res){
+	return res;
+    }
+    for(i = 0; i < jf->cap; i++){
+	if(jf->slots[i].idx != EMPTY && jf->slots[i].idx >= end && jf->slots[i].off >= 0){
+	    jf->slots[i].off = -1;
+	    jf->live--;
+	}
+	/* Putting a block logged before in place mustn't grow the file back */
+	if(jf->slots[i].size > size){
+	    jf->slots[i].size = size;
+	}
+    }
+    return 0;
+}
+
+/*----checkpoint--------------------------------------------------------------*/
+
+/* Put a listed file's records in place and unlist it once it has none left.
+ * Called with j->mtx held, which is let go meanwhile; the pin keeps jf from
+ * being detached under us. wait: take the lock however long that takes and
+ * sync the journal first; otherwise give a busy file LOCK_WAIT_NS.
+ * Return: 0 on success, -EBUSY if the lock wasn't had, -errno on error */
+static int settle(journal* j, journal_file* jf, int wait){
+    struct timespec ts;
+    int res;
+
+    jf->pin++;
+    pthread_mutex_unlock(&j->mtx);
+    if(wait){
+	res = -pthread_rwlock_wrlock(jf->lock);
+    }
+    else{
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += LOCK_WAIT_NS;
+	if(ts.tv_nsec >= 1000000000){
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000;
+	}
+	res = -pthread_rwlock_timedwrlock(jf->lock, &ts);
+	if(res == -ETIMEDOUT){
+	    res = -EBUSY;
+	}
+    }
+    if(!res){
+	res = apply(jf, wait);
+	/* Still holding the file: nothing can be logged between the two */
+	pthread_mutex_lock(&j->mtx);
+	if(jf->listed && jf->live == 0){
+	    list_del(j, jf);
+	}
+	pthread_rwlock_unlock(jf->lock);
+    }
+    else{
+	pthread_mutex_lock(&j->mtx);
+    }
+    if(--jf->pin == 0){
+	pthread_cond_broadcast(&j->unpin);
+	if(jf->orphan && !jf->listed){
+	    orphan_free(j, jf);
+	}
+    }
+    return res;
+}
+
+/* A listed file not visited in this round yet */
+static journal_file* unvisited(journal* j){
+    journal_file* jf;
+
+    for(jf = j->files; jf != NULL; jf = jf->next){
+	if(jf->round != j->round){
+	    return jf;
+	}
+    }
+    return NULL;
+}
+
+/* Rounds of syncing the journal and settling every file, until none has
+ * records left and the journal can start over. Called with j->mtx held. */
+static void checkpoint(journal* j){
+    journal_file* jf;
+    int res;
+
+    j->err = 0;
+    for(;;){
+	pthread_mutex_unlock(&j->mtx);
+	res = journal_sync(j);
+	pthread_mutex_lock(&j->mtx);
+	j->round++;
+	while(!res && (jf = unvisited(j)) != NULL){
+	    jf->round = j->round;
+	    res = settle(j, jf, 0);
+	    if(res == -EBUSY){
+		res = 0;
+	    }
+	}
+	if(!res && j->files == NULL){
+	    res = reset(j, j->key);
+	    if(!res){
+		break;
+	    }
+	}
+	if(res){
+	    j->err = res;
+	    break;
+	}
+	/* Files were busy, or were written to meanwhile: go round again */
+	pthread_mutex_unlock(&j->mtx);
+	usleep(RETRY_US);
+	pthread_mutex_lock(&j->mtx);
+    }
+    j->want = 0;
+    pthread_cond_broadcast(&j->space);
+}
+
+static void* checkpointer(void* arg){
+    journal* j = arg;
+
+    pthread_mutex_lock(&j->mtx);
+    while(!j->stop){
+	if(j->want){
+	    checkpoint(j);
+	}
+	else{
+	    pthread_cond_wait(&j->work, &j->mtx);
+	}
+    }
+    pthread_mutex_unlock(&j->mtx);
+    return NULL;
+}
+
+/*----replay------------------------------------------------------------------*/
+
+/* First file named ino, or where it would go */
+static int replay_lower(replay* rp, uint64_t ino){
+    int lo = 0;
+    int hi = rp->nfiles;
+
+    while(lo < hi){
+	int mid = (lo + hi) / 2;
+
+	if(rp->files[mid].ino < ino){
+	    lo = mid + 1;
+	}
+	else{
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+static replay_file* replay_find(replay* rp, uint64_t ino, const unsigned char* file_id){
+    int i;
+
+    for(i = replay_lower(rp, ino); i < rp->nfiles && rp->files[i].ino == ino; i++){
+	if(!memcmp(rp->files[i].file_id, file_id, sizeof(rp->files[i].file_id))){
+	    return &rp->files[i];
+	}
+    }
+    return NULL;
+}
+
+static int replay_add(replay* rp, const journal_rec* rec){
+    replay_file* grown;
+    int i;
+
+    if(replay_find(rp, rec->ino, rec->file_id)){
+	return 0;
+    }
+    grown = realloc(rp->files, (rp->nfiles + 1) * sizeof(*grown));
+    if(grown == NULL){
+	return -ENOMEM;
+    }
+    rp->files = grown;
+    i = replay_lower(rp, rec->ino);
+    memmove(&rp->files[i + 1], &rp->files[i], (rp->nfiles - i) * sizeof(*grown));
+    memset(&rp->files[i], 0, sizeof(*grown));
+    rp->files[i].ino = rec->ino;
+    memcpy(rp->files[i].file_id, rec->file_id, sizeof(rec->file_id));
+    rp->files[i].fd = -1;
+    rp->files[i].mode = (mode_t)-1;
+    rp->nfiles++;
+    rp->missing++;
+    return 0;
+}
+
+static int replay_walk(replay* rp, int dirfd);
+
+/* Open a file with records for writing. One made read-only since (the
+ * mount that logged them had it open already) is made writable by its
+ * owner until replay is done; *mode gets the mode to put back. */
+static int replay_open(int dirfd, const char* name, mode_t* mode){
+    struct stat st;
+    struct stat now;
+    int fd;
+    int rfd;
+    int res;
+
+    *mode = (mode_t)-1;
+    fd = openat(dirfd, name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if(fd != -1 || errno != EACCES){
+	return fd == -1 ? -errno : fd;
+    }
+    rfd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(rfd == -1){
+	return -errno;
+    }
+    if(fstat(rfd, &st) == -1 || fchmod(rfd, (st.st_mode & 07777) | S_IWUSR) == -1){
+	res = -errno;
+	close(rfd);
+	return res;
+    }
+    fd = openat(dirfd, name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    res = fd == -1 ? -errno : 0;
+    if(res == 0 && (fstat(fd, &now) == -1 || now.st_ino != st.st_ino || now.st_dev != st.st_dev)){
+	/* Renamed over in between: not the file we made writable */
+	res = -EAGAIN;
+	close(fd);
+    }
+    if(res){
+	fchmod(rfd, st.st_mode & 07777);
+	close(rfd);
+	return res;
+    }
+    close(rfd);
+    *mode = st.st_mode & 07777;
+    return fd;
+}
+
+/* Close a file replay_open() opened, putting its mode back */
+static void replay_close(int fd, mode_t mode){
+    if(mode != (mode_t)-1){
+	fchmod(fd, mode);
+    }
+    close(fd);
+}
+
+static int replay_entry(void* arg, int dirfd, const char* name, ino_t ino,
+			unsigned char type, off_t next){
+    replay* rp = arg;
+    struct stat st;
+    encfs_file ef;
+    replay_file* rf;
+    mode_t mode;
+    int i, fd, res;
+
+    (void)next;
+    if(!strcmp(name, ".") || !strcmp(name, "..")){
+	return 0;
+    }
+    if(type == DT_UNKNOWN){
+	if(dir_stat(dirfd, name, &st)){
+	    return 0;
+	}
+	type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if(type == DT_DIR){
+	fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd == -1){
+	    return 0;
+	}
+	res = replay_walk(rp, fd);
+	close(fd);
+	return rp->missing == 0 || res < 0;
+    }
+    if(type != DT_REG){
+	return 0;
+    }
+    i = replay_lower(rp, ino);
+    if(i == rp->nfiles || rp->files[i].ino != ino){
+	return 0;
+    }
+    fd = replay_open(dirfd, name, &mode);
+    if(fd < 0){
+	/* Its records can't be put in place: they must stay in the journal */
+	rp->error = fd;
+	return 1;
+    }
+    /* Blocks are put in place as they are; only a truncate seals one */
+    memset(&ef, 0, sizeof(ef));
+    if(encfs_open_keys(&ef, fd, rp->keys, rp->nkeys, rp->pool) ||
+       (rf = replay_find(rp, ino, ef.hdr.file_id)) == NULL || rf->fd != -1){
+	replay_close(fd, mode);
+	return 0;
+    }
+    rf->fd = fd;
+    rf->mode = mode;
+    rf->ef = ef;
+    rp->missing--;
+    return rp->missing == 0;
+}
+
+static int replay_walk(replay* rp, int dirfd){
+    void* buf = malloc(SCAN_BUF);
+    int res;
+
+    if(buf == NULL){
+	return -ENOMEM;
+    }
+    res = dir_scan(dirfd, 0, buf, SCAN_BUF, replay_entry, rp);
+    free(buf);
+    return res;
+}
+
+/* Put one record in place; cipher holds its block */
+static int replay_apply(replay_file* rf, const journal_rec* rec, const unsigned char* cipher){
+    int res;
+
+    rf->touched = 1;
+    if(rec->type == JOURNAL_TRUNC){
+	return encfs_truncate(&rf->ef, rec->size);
+    }
+    res = encfs_put_block(&rf->ef, rec->idx, &rec->entry, cipher);
+    if(!res && rec->size > rf->ef.hdr.size){
+	rf->ef.hdr.size = rec->size;
+    }
+    return res;
+}
+
+/* Whether the journal behind fd may hold updates: its first record is of the
+ * current generation (unauthenticated, so it may also just be damaged) */
+static int holds_records(int fd, const journal_header* hdr){
+    journal_rec rec;
+
+    return !memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) &&
+	pread(fd, &rec, sizeof(rec), JOURNAL_HEADER_SIZE) == sizeof(rec) &&
+	rec.gen == hdr->gen;
+}
+
+extern int journal_pending(const char* dir){
+    char path[PATH_MAX];
+    journal_header hdr;
+    int res;
+    int fd;
+
+    if(snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_NAME) >= (int)sizeof(path)){
+	return -ENAMETOOLONG;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+	return errno == ENOENT ? 0 : -errno;
+    }
+    res = pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && holds_records(fd, &hdr);
+    close(fd);
+    return res;
+}
+
+extern int journal_replay(journal* j, const char* root, const crypt_key* const* keys, int nkeys,
+			  bufpool* pool){
+    unsigned char tag[CRYPT_TAG_BYTES];
+    const crypt_key* key = NULL;
+    journal_header hdr;
+    journal_rec* recs = NULL;
+    off_t* offs = NULL;
+    unsigned char* cipher = NULL;
+    replay_file* rf;
+    replay rp;
+    struct stat st;
+    off_t off;
+    ssize_t n;
+    int nrecs = 0;
+    int applied = 0;
+    int res = 0;
+    int fd;
+    int i;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.keys = keys;
+    rp.nkeys = nkeys;
+    rp.pool = pool;
+
+    /* The journal is under whichever key the last mount had */
+    n = pread(j->fd, &hdr, sizeof(hdr), 0);
+    for(i = 0; n == sizeof(hdr) && i < nkeys && key == NULL; i++){
+	crypt_mac(keys[i], &hdr, HEADER_MAC_LEN, tag);
+	if(!CRYPTO_memcmp(tag, hdr.tag, sizeof(tag))){
+	    key = keys[i];
+	}
+    }
+    if(fstat(j->fd, &st) == -1){
+	res = -errno;
+	goto done;
+    }
+    if(key == NULL){
+	/* Under another key: fine to start over if it is empty, not if it
+	 * may hold updates */
+	if(n == sizeof(hdr) && holds_records(j->fd, &hdr)){
+	    res = -EKEYREJECTED;
+	}
+	goto done;
+    }
+
+    /* Every record up to the first torn one */
+    off = JOURNAL_HEADER_SIZE;
+    while(off + (off_t)sizeof(journal_rec) <= st.st_size){
+	journal_rec rec;
+	uint32_t stored = 0;
+	void* grown;
+
+	if(pread(j->fd, &rec, sizeof(rec), off) != sizeof(rec)){
+	    break;
+	}
+	crypt_mac(key, &rec, REC_MAC_LEN, tag);
+	if(CRYPTO_memcmp(tag, rec.tag, sizeof(tag)) || rec.gen != hdr.gen){
+	    break;
+	}
+	if(rec.type == JOURNAL_BLOCK){
+	    stored = rec.entry.len & ENCFS_LEN_MASK;
+	}
+	else if(rec.type != JOURNAL_TRUNC){
+	    break;
+	}
+	if(stored > ENCFS_MAX_BLOCK_SIZE ||
+	   off + (off_t)sizeof(rec) + (off_t)stored > st.st_size){
+	    break;
+	}
+	grown = realloc(recs, (nrecs + 1) * sizeof(*recs));
+	if(grown == NULL){
+	    res = -ENOMEM;
+	    goto done;
+	}
+	recs = grown;
+	grown = realloc(offs, (nrecs + 1) * sizeof(*offs));
+	if(grown == NULL){
+	    res = -ENOMEM;
+	    goto done;
+	}
+	offs = grown;
+	recs[nrecs] = rec;
+	offs[nrecs++] = off + sizeof(rec);
+	res = replay_add(&rp, &rec);
+	if(res){
+	    goto done;
+	}
+	off += sizeof(rec) + stored;
+    }
+    if(nrecs == 0){
+	goto done;
+    }
+
+    /* Find the files by inode: they may have been renamed since */
+    fd = dir_open(root);
+    if(fd < 0){
+	res = fd;
+	goto done;
+    }
+    res = replay_walk(&rp, fd);
+    close(fd);
+    if(res < 0 || rp.error){
+	res = rp.error ? rp.error : res;
+	goto done;
+    }
+    res = 0;
+
+    /* A block that doesn't authenticate was being written at the crash;
+     * nothing after it was synced (files that are gone can't be checked,
+     * and don't matter) */
+    cipher = bufpool_get(pool);
+    if(cipher == NULL){
+	res = -ENOMEM;
+	goto done;
+    }
+    for(i = 0; i < nrecs; i++){
+	rf = replay_find(&rp, recs[i].ino, recs[i].file_id);
+	if(rf == NULL || rf->fd == -1 || recs[i].type != JOURNAL_BLOCK){
+	    continue;
+	}
+	n = pread(j->fd, cipher, recs[i].entry.len & ENCFS_LEN_MASK, offs[i]);
+	if(n != (ssize_t)(recs[i].entry.len & ENCFS_LEN_MASK) ||
+	   encfs_verify_block(&rf->ef, recs[i].idx, &recs[i].entry, cipher)){
+	    nrecs = i;
+	    break;
+	}
+    }
+
+    /* Then put them in place, in order */
+    for(i = 0; !res && i < nrecs; i++){
+	rf = replay_find(&rp, recs[i].ino, recs[i].file_id);
+	if(rf == NULL || rf->fd == -1){
+	    continue;
+	}
+	if(recs[i].type == JOURNAL_BLOCK){
+	    n = pread(j->fd, cipher, recs[i].entry.len & ENCFS_LEN_MASK, offs[i]);
+	    if(n != (ssize_t)(recs[i].entry.len & ENCFS_LEN_MASK)){
+		res = n == -1 ? -errno : -EIO;
+		break;
+	    }
+	}
+	res = replay_apply(rf, &recs[i], cipher);
+	applied++;
+    }
+    for(i = 0; !res && i < rp.nfiles; i++){
+	if(rp.files[i].touched){
+	    res = encfs_write_header(&rp.files[i].ef);
+	    if(!res && fdatasync(rp.files[i].fd) == -1){
+		res = -errno;
+	    }
+	}
+    }
+
+done:
+    if(cipher){
+	bufpool_put(pool, cipher);
+    }
+    for(i = 0; i < rp.nfiles; i++){
+	if(rp.files[i].fd != -1){
+	    replay_close(rp.files[i].fd, rp.files[i].mode);
+	}
+    }
+    free(rp.files);
+    free(recs);
+    free(offs);
+    if(res){
+	return res;
+    }
+    /* Everything is in place (or was never synced): start over */
+    pthread_mutex_lock(&j->mtx);
+    res = reset(j, j->key);
+    pthread_mutex_unlock(&j->mtx);
+    return res ? res : applied;
+}
+
+/*----setup-------------------------------------------------------------------*/
+
+extern int journal_open(journal* j, const char* dir, off_t max, const crypt_key* key){
+    char path[PATH_MAX];
+    journal_header hdr;
+    int res;
+
+    memset(j, 0, sizeof(*j));
+    j->key = key;
+    j->max = max;
+    j->tail = JOURNAL_HEADER_SIZE;
+    j->synced = JOURNAL_HEADER_SIZE;
+    pthread_mutex_init(&j->mtx, NULL);
+    pthread_cond_init(&j->work, NULL);
+    pthread_cond_init(&j->space, NULL);
+    pthread_cond_init(&j->unpin, NULL);
+
+    if(max < JOURNAL_HEADER_SIZE + (off_t)sizeof(journal_rec) + ENCFS_MAX_BLOCK_SIZE){
+	res = -EINVAL;
+	goto fail;
+    }
+    if(snprintf(path, sizeof(path), "%s/%s", dir, JOURNAL_NAME) >= (int)sizeof(path)){
+	res = -ENAMETOOLONG;
+	goto fail;
+    }
+    j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(j->fd == -1){
+	res = -errno;
+	goto fail;
+    }
+    /* An existing journal keeps its generation (and records) for replay */
+    if(pread(j->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+       !memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic))){
+	j->gen = hdr.gen;
+    }
+    else{
+	res = reset(j, key);
+	if(res){
+	    close(j->fd);
+	    goto fail;
+	}
+    }
+    /* Allocated up front, so appends never have to extend the file */
+    fallocate(j->fd, 0, 0, max);
+
+    res = -pthread_create(&j->thread, NULL, checkpointer, j);
+    if(res){
+	close(j->fd);
+	goto fail;
+    }
+    j->started = 1;
+    return 0;
+
+fail:
+    pthread_cond_destroy(&j->unpin);
+    pthread_cond_destroy(&j->space);
+    pthread_cond_destroy(&j->work);
+    pthread_mutex_destroy(&j->mtx);
+    return res;
+}
+
+extern int journal_attach(journal_file* jf, journal* j, encfs_file* ef, pthread_rwlock_t* lock){
+    journal_file* o;
+    struct stat st;
+    uint64_t size = 0;
+    int found = 0;
+    int res = 0;
+
+    if(fstat(ef->fd, &st) == -1){
+	return -errno;
+    }
+    jf->redo.put = jf_put;
+    jf->redo.get = jf_get;
+    jf->redo.trunc = jf_trunc;
+    jf->j = j;
+    jf->ef = ef;
+    jf->lock = lock;
+    jf->ino = st.st_ino;
+
+    /* A closed copy of the same inode may still have records out */
+    pthread_mutex_lock(&j->mtx);
+    do{
+	for(o = j->files; o != NULL; o = o->next){
+	    if(o->orphan && o->ino == jf->ino){
+		break;
+	    }
+	}
+	if(o != NULL){
+	    size = o->ef->hdr.size;
+	    found = 1;
+	    res = settle(j, o, 1);
+	}
+    } while(o != NULL && !res);
+    pthread_mutex_unlock(&j->mtx);
+
+    if(!res){
+	/* ef's header was read before the records were put in place */
+	if(found){
+	    ef->hdr.size = size;
+	}
+	ef->redo = &jf->redo;
+    }
+    return res;
+}
+
+extern int journal_size(journal* j, uint64_t ino, uint64_t* size){
+    journal_file* o;
+
+    pthread_mutex_lock(&j->mtx);
+    for(o = j->files; o != NULL; o = o->next){
+	if(o->orphan && o->ino == ino){
+	    *size = o->ef->hdr.size;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&j->mtx);
+    return o != NULL;
+}
+
+extern void journal_forget(journal_file* jf){
+    journal* j = jf->j;
+
+    jf->ef->redo = NULL;
+    pthread_mutex_lock(&j->mtx);
+    if(jf->listed){
+	list_del(j, jf);
+    }
+    pthread_mutex_unlock(&j->mtx);
+    slot_clear(jf);
+}
+
+extern void journal_detach(journal_file* jf){
+    journal* j = jf->j;
+    journal_orphan* o = NULL;
+
+    pthread_rwlock_wrlock(jf->lock);
+    jf->ef->redo = NULL;
+    if(jf->live){
+	o = calloc(1, sizeof(*o));
+	if(o != NULL){
+	    o->ef = *jf->ef;
+	    o->ef.dfd = -1;
+	    o->ef.tail = NULL;
+	    o->ef.fd = fcntl(jf->ef->fd, F_DUPFD_CLOEXEC, 0);
+	    if(o->ef.fd == -1){
+		free(o);
+		o = NULL;
+	    }
+	}
+	if(o != NULL){
+	    pthread_rwlock_init(&o->lock, NULL);
+	    o->jf = *jf;
+	    o->jf.ef = &o->ef;
+	    o->jf.lock = &o->lock;
+	    o->jf.orphan = 1;
+	    o->jf.listed = 0;
+	    o->jf.pin = 0;
+	    o->ef.redo = &o->jf.redo;
+	    /* The slots go with it */
+	    jf->slots = NULL;
+	    jf->cap = 0;
+	    jf->used = 0;
+	    jf->live = 0;
+	}
+	else{
+	    /* Out of memory or descriptors: put them in place now instead */
+	    apply(jf, 1);
+	}
+    }
+
+    pthread_mutex_lock(&j->mtx);
+    if(jf->listed){
+	list_del(j, jf);
+    }
+    if(o != NULL){
+	list_add(j, &o->jf);
+	if(++j->orphans > JOURNAL_MAX_ORPHANS && !j->want){
+	    j->want = 1;
+	    pthread_cond_signal(&j->work);
+	}
+    }
+    pthread_rwlock_unlock(jf->lock);
+    /* A checkpoint may be waiting for the lock, which goes with the file */
+    while(jf->pin){
+	pthread_cond_wait(&j->unpin, &j->mtx);
+    }
+    pthread_mutex_unlock(&j->mtx);
+    slot_clear(jf);
+}
+
+extern void journal_close(journal* j){
+    journal_file* jf;
+
+    if(j->started){
+	pthread_mutex_lock(&j->mtx);
+	j->stop = 1;
+	pthread_cond_signal(&j->work);
+	pthread_mutex_unlock(&j->mtx);
+	pthread_join(j->thread, NULL);
+	j->started = 0;
+    }
+
+    /* Everything in place, so the next mount has nothing to replay */
+    pthread_mutex_lock(&j->mtx);
+    while((jf = j->files) != NULL && settle(j, jf, 1) == 0){
+    }
+    if(j->files == NULL){
+	reset(j, j->key);
+    }
+    while((jf = j->files) != NULL){
+	list_del(j, jf);
+	if(jf->orphan){
+	    orphan_free(j, jf);
+	}
+    }
+    pthread_mutex_unlock(&j->mtx);
+
+    close(j->fd);
+    pthread_cond_destroy(&j->unpin);
+    pthread_cond_destroy(&j->space);
+    pthread_cond_destroy(&j->work);
+    pthread_mutex_destroy(&j->mtx);
+}
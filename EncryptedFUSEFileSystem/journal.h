@@ -0,0 +1,193 @@
+/* journal.h
+ * Write-ahead journal of block updates for pa4-encfs
+ *
+ * A block file rewrites a block in place: the data, then its map entry. A
+ * crash in between leaves the two disagreeing, and the block fails to
+ * authenticate from then on. In journal mode sealed blocks go to
+ * JOURNAL_NAME in the mirror root instead (through the file's encfs_redo,
+ * see encfs-block.h), appended one after the other; reads of those blocks
+ * are served from the journal until they are in place. An fsync() of the
+ * file syncs the journal: one sequential write, wherever in the file the
+ * blocks were.
+ *
+ * Records are put in place lazily by a checkpoint. Once the journal is
+ * half full a background thread syncs it, copies the records of every file
+ * into place (taking each file's lock for writing, and skipping files busy
+ * for now), syncs those files and starts the journal over under a new
+ * generation. A writer that finds the journal full puts its own file's
+ * records in place and waits for the checkpoint. Closing a file doesn't put
+ * anything in place: its records stay with a descriptor of its own until
+ * the next checkpoint, or until the file is opened again.
+ *
+ * Records name their file by inode number and header file ID, since the
+ * file can be renamed at any time. After a crash journal_replay() finds
+ * the files named by walking the mirror (a clean unmount leaves the journal
+ * empty, so this is the only walk) and puts the records in place in journal
+ * order. Every record carries an HMAC and the block's own GCM tag; replay
+ * stops at the first record that fails either, since nothing after it was
+ * synced. Truncates are journaled too (and done in place at once), so that
+ * replay doesn't bring back blocks cut off after they were logged. A file
+ * grown by writes keeps its old size in its header until the blocks are in
+ * place: the records carry the new one, and putting them in place stores it.
+ *
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "buf-pool.h"
+#include "encfs-block.h"
+
+#define JOURNAL_NAME         ".pa4-encfs.journal"
+#define JOURNAL_MAGIC        "PA4JRNL1"
+#define JOURNAL_HEADER_SIZE  4096
+#define JOURNAL_DEFAULT_MAX  64          /* MiB */
+#define JOURNAL_MAX_ORPHANS  256         /* Closed files waiting, before a checkpoint */
+
+/* journal_rec.type */
+#define JOURNAL_BLOCK 1
+#define JOURNAL_TRUNC 2
+
+/* On-disk header (host byte order) */
+typedef struct journal_header {
+    char magic[8];
+    uint64_t gen;                         /* Records of other generations are stale */
+    unsigned char tag[CRYPT_TAG_BYTES];   /* HMAC of the fields above */
+} journal_header;
+
+/* On-disk record, followed by the sealed block for JOURNAL_BLOCK */
+typedef struct journal_rec {
+    uint32_t type;
+    uint32_t pad;
+    uint64_t gen;
+    uint64_t ino;
+    unsigned char file_id[16];
+    uint64_t idx;                         /* JOURNAL_BLOCK */
+    uint64_t size;                        /* Plaintext size with the block in, or truncated to */
+    encfs_map_entry entry;                /* JOURNAL_BLOCK */
+    unsigned char tag[CRYPT_TAG_BYTES];   /* HMAC of the fields above */
+} journal_rec;
+
+/* Latest journaled version of a block */
+typedef struct journal_slot {
+    uint64_t idx;                         /* UINT64_MAX: empty */
+    off_t off;                            /* Of the sealed block in the journal */
+    uint64_t size;                        /* Plaintext size its record carries */
+    encfs_map_entry entry;
+} journal_slot;
+
+typedef struct journal journal;
+typedef struct journal_file journal_file;
+
+/* One per block file using the journal */
+struct journal_file {
+    encfs_redo redo;                      /* First: ef->redo points here */
+    journal* j;
+    encfs_file* ef;
+    pthread_rwlock_t* lock;               /* ef's lock; held for writing to change slots */
+    uint64_t ino;
+    journal_slot* slots;                  /* Open addressing by block index */
+    size_t cap;
+    size_t used;                          /* Slots taken, ones in place included */
+    size_t live;                          /* Records not in place yet */
+    /* Under j->mtx */
+    int listed;                           /* In j->files */
+    int orphan;                           /* Closed: owns ef, lock and descriptor */
+    int pin;                              /* A checkpoint is using it */
+    unsigned round;                       /* Last checkpoint round it was visited in */
+    journal_file* prev;
+    journal_file* next;
+};
+
+struct journal {
+    int fd;
+    const crypt_key* key;
+    off_t max;
+    pthread_t thread;
+    int started;
+    pthread_mutex_t mtx;                  /* Guards everything below */
+    pthread_cond_t work;                  /* Checkpoint wanted, or stop */
+    pthread_cond_t space;                 /* Journal started over, or failed to */
+    pthread_cond_t unpin;                 /* A checkpoint let go of a file */
+    uint64_t gen;
+    off_t tail;                           /* Next record goes here */
+    off_t synced;                         /* Everything before is on disk */
+    journal_file* files;                  /* With records not in place yet */
+    int orphans;
+    unsigned round;
+    int want;
+    int stop;
+    int err;                              /* Last checkpoint failed */
+};
+
+/* int journal_open(journal* j, const char* dir, off_t max, const crypt_key* key)
+ * Purpose: Open (or create) the journal in dir and start the checkpoint
+ *          thread. Call journal_replay() before anything is attached.
+ * Args: off_t max : Journal size in bytes
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_open(journal* j, const char* dir, off_t max, const crypt_key* key);
+
+/* int journal_replay(journal* j, const char* root, const crypt_key* const* keys, int nkeys, bufpool* pool)
+ * Purpose: Put what a crash left in the journal in place, then empty it.
+ *          A read-only file is made writable by its owner while its
+ *          records go in; if one can't be opened for writing at all, the
+ *          journal is left as it is.
+ * Args: const char* root : Mirror root, walked to find the files
+ *       keys             : Keys the journal and files may be under
+ * Return: Records replayed, -errno on error
+ */
+extern int journal_replay(journal* j, const char* root, const crypt_key* const* keys, int nkeys,
+			  bufpool* pool);
+
+/* int journal_pending(const char* dir)
+ * Purpose: Tell whether dir's journal holds records a mount would replay,
+ *          without opening it (for offline tools)
+ * Return: 1 if it may, 0 if it is empty or there is none, -errno on error
+ */
+extern int journal_pending(const char* dir);
+
+/* int journal_sync(journal* j)
+ * Purpose: Make every record written so far durable
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_sync(journal* j);
+
+/* int journal_attach(journal_file* jf, journal* j, encfs_file* ef, pthread_rwlock_t* lock)
+ * Purpose: Send ef's block updates through the journal. Records a closed
+ *          copy of the same inode left are put in place first.
+ * Args: pthread_rwlock_t* lock : Readers of ef share it, writers exclude
+ * Return: 0 on success, -errno on error
+ */
+extern int journal_attach(journal_file* jf, journal* j, encfs_file* ef, pthread_rwlock_t* lock);
+
+/* int journal_size(journal* j, uint64_t ino, uint64_t* size)
+ * Purpose: Plaintext size of a closed file whose records aren't all in
+ *          place yet (its header may still have an older one)
+ * Return: 1 and *size if ino is such a file, 0 if not
+ */
+extern int journal_size(journal* j, uint64_t ino, uint64_t* size);
+
+/* void journal_forget(journal_file* jf)
+ * Purpose: Drop the file's records unapplied (its contents were copied to
+ *          a new file) and detach it. Called with the lock held for writing.
+ */
+extern void journal_forget(journal_file* jf);
+
+/* void journal_detach(journal_file* jf)
+ * Purpose: Detach a file that is being closed; records not in place yet are
+ *          handed to the checkpoint together with a copy of its descriptor
+ */
+extern void journal_detach(journal_file* jf);
+
+/* void journal_close(journal* j)
+ * Purpose: Stop the checkpoint thread, put everything in place and close
+ */
+extern void journal_close(journal* j);
+
+#endif
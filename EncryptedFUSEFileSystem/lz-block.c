@@ -0,0 +1,173 @@
+/* lz-block.c
+ * Small LZ77 block compressor for pa4-encfs
+ *
+ * See lz-block.h for details
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz-block.h"
+
+#define HASH_LOG      12
+#define MIN_MATCH     4
+#define LAST_LITERALS 5   /* The last 5 bytes are always literals */
+#define MF_LIMIT      12  /* No match may start in the last 12 bytes */
+#define MAX_OFFSET    65535
+
+static uint32_t read32(const unsigned char* p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v){
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Emit a length continuation (after a 15 in the token) */
+static unsigned char* put_len(unsigned char* op, int len){
+    while(len >= 255){
+	*op++ = 255;
+	len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Emit one sequence; mlen == 0 means the final, literal-only sequence */
+static unsigned char* put_seq(unsigned char* op, unsigned char* oend,
+			      const unsigned char* lit, int litlen,
+			      int offset, int mlen){
+    unsigned char* token = op++;
+    int ml = mlen - MIN_MATCH;
+
+    /* Worst case: lengths, literals, offset */
+    if(oend - op < litlen + litlen / 255 + 1 + 2 + ml / 255 + 1){
+	return NULL;
+    }
+    *token = (unsigned char)((litlen < 15 ? litlen : 15) << 4);
+    if(litlen >= 15){
+	op = put_len(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if(mlen == 0){
+	return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= ml < 15 ? ml : 15;
+    if(ml >= 15){
+	op = put_len(op, ml - 15);
+    }
+    return op;
+}
+
+extern int lz_compress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap){
+    uint32_t table[1 << HASH_LOG];
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dstcap;
+    int anchor = 0;
+    int ip = 0;
+
+    if(srclen < 0 || srclen > MAX_OFFSET + 1 || dstcap < 1){
+	return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while(ip < srclen - MF_LIMIT){
+	uint32_t v = read32(src + ip);
+	uint32_t h = hash4(v);
+	int ref = table[h];
+
+	table[h] = ip;
+	if(ref < ip && ip - ref <= MAX_OFFSET && read32(src + ref) == v){
+	    int mlen = MIN_MATCH;
+
+	    while(ip + mlen < srclen - LAST_LITERALS && src[ref + mlen] == src[ip + mlen]){
+		mlen++;
+	    }
+	    op = put_seq(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+	    if(!op){
+		return 0;
+	    }
+	    ip += mlen;
+	    anchor = ip;
+	}
+	else{
+	    ip++;
+	}
+    }
+
+    op = put_seq(op, oend, src + anchor, srclen - anchor, 0, 0);
+    if(!op){
+	return 0;
+    }
+    return op - dst;
+}
+
+extern int lz_decompress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap){
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + srclen;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + dstcap;
+
+    while(ip < iend){
+	unsigned token = *ip++;
+	size_t lit = token >> 4;
+	size_t ml = token & 15;
+	size_t offset;
+	unsigned b;
+
+	if(lit == 15){
+	    do{
+		if(ip >= iend){
+		    return -1;
+		}
+		b = *ip++;
+		lit += b;
+	    } while(b == 255);
+	}
+	if((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit){
+	    return -1;
+	}
+	memcpy(op, ip, lit);
+	ip += lit;
+	op += lit;
+	if(ip == iend){
+	    /* Final sequence has no match */
+	    break;
+	}
+
+	if(iend - ip < 2){
+	    return -1;
+	}
+	offset = ip[0] | (ip[1] << 8);
+	ip += 2;
+	if(offset == 0 || offset > (size_t)(op - dst)){
+	    return -1;
+	}
+	if(ml == 15){
+	    do{
+		if(ip >= iend){
+		    return -1;
+		}
+		b = *ip++;
+		ml += b;
+	    } while(b == 255);
+	}
+	ml += MIN_MATCH;
+	if((size_t)(oend - op) < ml){
+	    return -1;
+	}
+	/* Byte at a time: source and destination may overlap */
+	while(ml--){
+	    *op = *(op - offset);
+	    op++;
+	}
+    }
+    return op - dst;
+}
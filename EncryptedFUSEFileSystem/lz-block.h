@@ -0,0 +1,31 @@
+/* lz-block.h
+ * Small LZ77 block compressor for pa4-encfs
+ *
+ * Produces the LZ4 block format (token, literals, 16-bit offset, match
+ * length), so blocks can be read back by any LZ4 block decoder. Tuned for
+ * compressing one encryption block (at most 64 KiB) at a time, using only
+ * the stack.
+ *
+ */
+
+#ifndef LZ_BLOCK_H
+#define LZ_BLOCK_H
+
+/* int lz_compress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap)
+ * Purpose: Compress src into dst
+ * Args: const unsigned char* src : Input, at most 64 KiB
+ *       int srclen               : Input length
+ *       unsigned char* dst       : Output
+ *       int dstcap               : Output capacity; pass less than srclen to
+ *                                  give up on data that doesn't shrink
+ * Return: Compressed length, 0 if it does not fit in dstcap
+ */
+extern int lz_compress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap);
+
+/* int lz_decompress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap)
+ * Purpose: Decompress src into dst, never reading or writing out of bounds
+ * Return: Decompressed length, -1 if src is malformed or dst too small
+ */
+extern int lz_decompress(const unsigned char* src, int srclen, unsigned char* dst, int dstcap);
+
+#endif
@@ -0,0 +1,192 @@
+/* meta-index.c
+ * Persistent index of per-file metadata for pa4-encfs
+ *
+ * See meta-index.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "meta-index.h"
+
+#define SUM_WORDS (offsetof(meta_slot, sum) / sizeof(uint64_t))
+
+static uint64_t slot_sum(const meta_slot* s){
+    const uint64_t* w = (const uint64_t*)s;
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for(i = 0; i < SUM_WORDS; i++){
+	h = (h ^ w[i]) * 1099511628211ULL;
+    }
+    return h | 1;                 /* Never 0: a zeroed slot doesn't check out */
+}
+
+static int64_t ns(const struct timespec* ts){
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static uint64_t bucket_of(const meta_index* mi, const struct stat* st){
+    uint64_t h = (uint64_t)st->st_ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)st->st_dev;
+
+    return (h >> 17) & (mi->nbuckets - 1);
+}
+
+static meta_slot* bucket_slots(const meta_index* mi, uint64_t b){
+    return mi->slots + 1 + b * META_BUCKET_SLOTS;
+}
+
+extern int meta_open(meta_index* mi, const char* dir, uint64_t nslots){
+    char path[PATH_MAX];
+    meta_header* hdr;
+    struct stat st;
+    uint64_t nbuckets = 1;
+    size_t len;
+    int res;
+    int i;
+
+    memset(mi, 0, sizeof(*mi));
+    mi->fd = -1;
+    for(i = 0; i < META_LOCKS; i++){
+	pthread_mutex_init(&mi->locks[i], NULL);
+    }
+    if(snprintf(path, sizeof(path), "%s/%s", dir, META_INDEX_NAME) >= (int)sizeof(path)){
+	return -ENAMETOOLONG;
+    }
+    mi->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(mi->fd == -1 || fstat(mi->fd, &st) == -1){
+	res = -errno;
+	meta_close(mi);
+	return res;
+    }
+
+    if(st.st_size < (off_t)sizeof(meta_slot)){
+	/* New index: a sparse file, pages are allocated as they are used */
+	while(nbuckets * META_BUCKET_SLOTS < nslots){
+	    nbuckets *= 2;
+	}
+	len = (1 + nbuckets * META_BUCKET_SLOTS) * sizeof(meta_slot);
+	if(ftruncate(mi->fd, len) == -1){
+	    res = -errno;
+	    meta_close(mi);
+	    return res;
+	}
+    }
+    else{
+	len = st.st_size;
+    }
+    mi->slots = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, mi->fd, 0);
+    if(mi->slots == MAP_FAILED){
+	mi->slots = NULL;
+	res = -errno;
+	meta_close(mi);
+	return res;
+    }
+    hdr = (meta_header*)mi->slots;
+    if(st.st_size < (off_t)sizeof(meta_slot)){
+	memcpy(hdr->magic, META_MAGIC, sizeof(hdr->magic));
+	hdr->nbuckets = nbuckets;
+    }
+    mi->nbuckets = hdr->nbuckets;
+    if(memcmp(hdr->magic, META_MAGIC, sizeof(hdr->magic)) || mi->nbuckets == 0 ||
+       (mi->nbuckets & (mi->nbuckets - 1)) ||
+       (1 + mi->nbuckets * META_BUCKET_SLOTS) * sizeof(meta_slot) != len){
+	munmap(mi->slots, len);
+	mi->slots = NULL;
+	meta_close(mi);
+	return -EIO;
+    }
+    mi->victim = calloc(mi->nbuckets, 1);
+    if(mi->victim == NULL){
+	meta_close(mi);
+	return -ENOMEM;
+    }
+    return 0;
+}
+
+extern void meta_close(meta_index* mi){
+    int i;
+
+    if(mi->slots != NULL){
+	munmap(mi->slots, (1 + mi->nbuckets * META_BUCKET_SLOTS) * sizeof(meta_slot));
+    }
+    for(i = 0; i < META_LOCKS; i++){
+	pthread_mutex_destroy(&mi->locks[i]);
+    }
+    if(mi->fd != -1){
+	close(mi->fd);
+    }
+    free(mi->victim);
+    memset(mi, 0, sizeof(*mi));
+    mi->fd = -1;
+}
+
+extern int meta_lookup(meta_index* mi, const struct stat* st, off_t* size){
+    uint64_t b = bucket_of(mi, st);
+    meta_slot* s = bucket_slots(mi, b);
+    int res = -ENOENT;
+    int i;
+
+    pthread_mutex_lock(&mi->locks[b % META_LOCKS]);
+    for(i = 0; i < META_BUCKET_SLOTS; i++){
+	if(s[i].ino == (uint64_t)st->st_ino && s[i].dev == (uint64_t)st->st_dev){
+	    if(s[i].sum == slot_sum(&s[i]) && s[i].mtime_ns == ns(&st->st_mtim) &&
+	       s[i].ctime_ns == ns(&st->st_ctim)){
+		*size = s[i].size;
+		res = 0;
+	    }
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&mi->locks[b % META_LOCKS]);
+    return res;
+}
+
+extern void meta_store(meta_index* mi, const struct stat* st, off_t size){
+    uint64_t b = bucket_of(mi, st);
+    meta_slot* s = bucket_slots(mi, b);
+    meta_slot* slot = NULL;
+    struct timespec now;
+    int i;
+
+    /* Racily clean: another change in the same tick wouldn't move ctime */
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(st->st_ctim.tv_sec + META_RACY_SEC > now.tv_sec){
+	return;
+    }
+
+    pthread_mutex_lock(&mi->locks[b % META_LOCKS]);
+    for(i = 0; i < META_BUCKET_SLOTS && slot == NULL; i++){
+	if(s[i].ino == (uint64_t)st->st_ino && s[i].dev == (uint64_t)st->st_dev){
+	    slot = &s[i];
+	}
+    }
+    for(i = 0; i < META_BUCKET_SLOTS && slot == NULL; i++){
+	if(s[i].ino == 0 || s[i].sum != slot_sum(&s[i])){
+	    slot = &s[i];
+	}
+    }
+    if(slot == NULL){
+	slot = &s[mi->victim[b]];
+	mi->victim[b] = (mi->victim[b] + 1) % META_BUCKET_SLOTS;
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->mtime_ns = ns(&st->st_mtim);
+    slot->ctime_ns = ns(&st->st_ctim);
+    slot->size = size;
+    slot->sum = slot_sum(slot);
+    pthread_mutex_unlock(&mi->locks[b % META_LOCKS]);
+}
@@ -0,0 +1,86 @@
+/* meta-index.h
+ * Persistent index of per-file metadata for pa4-encfs
+ *
+ * The plaintext size of a block-format file is in its header, so answering
+ * getattr() for it costs an open() and a header read on top of the lstat().
+ * The index keeps those answers across mounts: META_INDEX_NAME in the mirror
+ * root is a memory-mapped table keyed by inode, where each entry records
+ * what the header said (the plaintext size, or that the file is not in the
+ * block format) together with the file's mtime and ctime at the time.
+ *
+ * An entry is used only while the file's lstat() still shows the same
+ * inode, mtime and ctime. Anything that changed the file, through the mount
+ * or behind its back, moved its ctime, so the lookup misses and the caller
+ * reads the header and stores the fresh answer. Files changed within the
+ * last META_RACY_SEC are not stored, since a second write in the same
+ * timestamp tick could go unnoticed (git's "racily clean" rule).
+ *
+ * The table is split into buckets of META_BUCKET_SLOTS; a full bucket
+ * evicts round robin. Every slot carries a checksum, so one torn by a crash
+ * reads as empty. Each bucket is under one of META_LOCKS striped locks.
+ *
+ */
+
+#ifndef META_INDEX_H
+#define META_INDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define META_INDEX_NAME    ".pa4-encfs.meta"
+#define META_MAGIC         "PA4META1"
+#define META_BUCKET_SLOTS  8
+#define META_DEFAULT_SLOTS (1 << 18)
+#define META_RACY_SEC      2
+#define META_LOCKS         64
+
+/* On-disk slot (host byte order); slot 0 is the header */
+typedef struct meta_slot {
+    uint64_t dev;
+    uint64_t ino;                 /* 0: empty */
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int64_t size;                 /* Plaintext size, -1: not a block-format file */
+    uint64_t pad[2];
+    uint64_t sum;                 /* Checksum of the fields above */
+} meta_slot;
+
+typedef struct meta_header {
+    char magic[8];
+    uint64_t nbuckets;            /* Power of two */
+    uint64_t pad[6];
+} meta_header;
+
+typedef struct meta_index {
+    int fd;
+    meta_slot* slots;             /* Mapped file, slots[0] = header */
+    uint64_t nbuckets;
+    uint8_t* victim;              /* Next slot to evict, per bucket (in memory) */
+    pthread_mutex_t locks[META_LOCKS];
+} meta_index;
+
+/* int meta_open(meta_index* mi, const char* dir, uint64_t nslots)
+ * Purpose: Open (or create) the index in dir
+ * Args: uint64_t nslots : Size of a new index; an existing one keeps its own
+ * Return: 0 on success, -errno on error
+ */
+extern int meta_open(meta_index* mi, const char* dir, uint64_t nslots);
+
+/* void meta_close(meta_index* mi) */
+extern void meta_close(meta_index* mi);
+
+/* int meta_lookup(meta_index* mi, const struct stat* st, off_t* size)
+ * Purpose: The stored size of the file st was just taken of
+ * Return: 0 on a valid hit, -ENOENT otherwise
+ */
+extern int meta_lookup(meta_index* mi, const struct stat* st, off_t* size);
+
+/* void meta_store(meta_index* mi, const struct stat* st, off_t size)
+ * Purpose: Record what the header of the file st was taken of said
+ *          (st must be from before the header was read)
+ */
+extern void meta_store(meta_index* mi, const struct stat* st, off_t size);
+
+#endif
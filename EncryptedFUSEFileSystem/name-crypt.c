@@ -0,0 +1,378 @@
+/* name-crypt.c
+ * Deterministic filename encryption with a translation cache for pa4-encfs
+ *
+ * See name-crypt.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "name-crypt.h"
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* ---- base64url without padding ---- */
+
+static size_t b64_encode(const unsigned char* in, size_t len, char* out){
+    size_t i;
+    size_t o = 0;
+
+    for(i = 0; i + 2 < len; i += 3){
+	out[o++] = b64[in[i] >> 2];
+	out[o++] = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+	out[o++] = b64[((in[i + 1] & 15) << 2) | (in[i + 2] >> 6)];
+	out[o++] = b64[in[i + 2] & 63];
+    }
+    if(len - i == 1){
+	out[o++] = b64[in[i] >> 2];
+	out[o++] = b64[(in[i] & 3) << 4];
+    }
+    else if(len - i == 2){
+	out[o++] = b64[in[i] >> 2];
+	out[o++] = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+	out[o++] = b64[(in[i + 1] & 15) << 2];
+    }
+    out[o] = '\0';
+    return o;
+}
+
+static int b64_value(char c){
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '-') return 62;
+    if(c == '_') return 63;
+    return -1;
+}
+
+/* Returns the decoded length, or -1. Only the canonical encoding is
+ * accepted (unused trailing bits zero) so two names never decode alike. */
+static int b64_decode(const char* in, size_t len, unsigned char* out){
+    uint32_t acc = 0;
+    int bits = 0;
+    int o = 0;
+    size_t i;
+
+    if(len % 4 == 1){
+	return -1;
+    }
+    for(i = 0; i < len; i++){
+	int v = b64_value(in[i]);
+
+	if(v < 0){
+	    return -1;
+	}
+	acc = (acc << 6) | v;
+	bits += 6;
+	if(bits >= 8){
+	    bits -= 8;
+	    out[o++] = (acc >> bits) & 0xff;
+	}
+    }
+    if(acc & ((1u << bits) - 1)){
+	return -1;
+    }
+    return o;
+}
+
+/* ---- Cipher ---- */
+
+static void ctx_free(void* ctx){
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+/* This thread's AES-256-CTR context, keyed once */
+static EVP_CIPHER_CTX* name_ctx(name_crypt* nc){
+    EVP_CIPHER_CTX* ctx = pthread_getspecific(nc->ctx_key);
+
+    if(ctx == NULL){
+	ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL){
+	    return NULL;
+	}
+	if(!EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, nc->key.enc, NULL) ||
+	   pthread_setspecific(nc->ctx_key, ctx) != 0){
+	    EVP_CIPHER_CTX_free(ctx);
+	    return NULL;
+	}
+    }
+    return ctx;
+}
+
+/* CTR is its own inverse */
+static int ctr(EVP_CIPHER_CTX* ctx, const unsigned char* siv, const unsigned char* in,
+	       int len, unsigned char* out){
+    int outlen;
+
+    return EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, siv) &&
+	EVP_EncryptUpdate(ctx, out, &outlen, in, len) && outlen == len;
+}
+
+/* ---- Cache ---- */
+
+static uint32_t name_hash(const char* s, size_t len){
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static size_t cache_get(name_crypt* nc, name_slot* table, const char* key, size_t klen,
+			char* out){
+    uint32_t h = name_hash(key, klen);
+    size_t i = h & (nc->nslots - 1);
+    name_slot* s = &table[i];
+    pthread_mutex_t* lock = &nc->locks[i % NAME_LOCKS];
+    size_t vlen = 0;
+
+    pthread_mutex_lock(lock);
+    if(s->hash == h && s->klen == klen && !memcmp(s->kv, key, klen)){
+	vlen = s->vlen;
+	memcpy(out, s->kv + klen, vlen);
+	out[vlen] = '\0';
+    }
+    pthread_mutex_unlock(lock);
+    return vlen;
+}
+
+static void cache_put(name_crypt* nc, name_slot* table, const char* key, size_t klen,
+		      const char* val, size_t vlen){
+    uint32_t h = name_hash(key, klen);
+    size_t i = h & (nc->nslots - 1);
+    name_slot* s = &table[i];
+    pthread_mutex_t* lock = &nc->locks[i % NAME_LOCKS];
+    char* kv = malloc(klen + vlen);
+
+    if(kv == NULL){
+	return;
+    }
+    memcpy(kv, key, klen);
+    memcpy(kv + klen, val, vlen);
+    pthread_mutex_lock(lock);
+    free(s->kv);
+    s->kv = kv;
+    s->hash = h;
+    s->klen = klen;
+    s->vlen = vlen;
+    pthread_mutex_unlock(lock);
+}
+
+static void cache_both(name_crypt* nc, const char* plain, size_t plen,
+		       const char* enc, size_t elen){
+    cache_put(nc, nc->enc, plain, plen, enc, elen);
+    cache_put(nc, nc->dec, enc, elen, plain, plen);
+}
+
+/* ---- Translation ---- */
+
+static int dot_name(const char* name, size_t len){
+    return (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+extern int name_crypt_init(name_crypt* nc, const crypt_key* key, size_t nslots){
+    static const char label1[] = "pa4-encfs names enc 1";
+    static const char label2[] = "pa4-encfs names enc 2";
+    static const char label3[] = "pa4-encfs names mac 1";
+    static const char label4[] = "pa4-encfs names mac 2";
+    int i;
+    int res;
+
+    memset(nc, 0, sizeof(*nc));
+    crypt_mac(key, label1, sizeof(label1), nc->key.enc);
+    crypt_mac(key, label2, sizeof(label2), nc->key.enc + CRYPT_TAG_BYTES);
+    crypt_mac(key, label3, sizeof(label3), nc->key.mac);
+    crypt_mac(key, label4, sizeof(label4), nc->key.mac + CRYPT_TAG_BYTES);
+
+    nc->nslots = NAME_LOCKS;
+    while(nc->nslots < nslots){
+	nc->nslots *= 2;
+    }
+    nc->enc = calloc(nc->nslots, sizeof(*nc->enc));
+    nc->dec = calloc(nc->nslots, sizeof(*nc->dec));
+    res = pthread_key_create(&nc->ctx_key, ctx_free);
+    if(nc->enc == NULL || nc->dec == NULL || res){
+	free(nc->enc);
+	free(nc->dec);
+	if(!res){
+	    pthread_key_delete(nc->ctx_key);
+	}
+	OPENSSL_cleanse(&nc->key, sizeof(nc->key));
+	return res ? -res : -ENOMEM;
+    }
+    for(i = 0; i < NAME_LOCKS; i++){
+	pthread_mutex_init(&nc->locks[i], NULL);
+    }
+    return 0;
+}
+
+extern void name_crypt_destroy(name_crypt* nc){
+    EVP_CIPHER_CTX* ctx = pthread_getspecific(nc->ctx_key);
+    size_t i;
+
+    /* Other threads' contexts go with their threads */
+    EVP_CIPHER_CTX_free(ctx);
+    pthread_key_delete(nc->ctx_key);
+    for(i = 0; i < nc->nslots; i++){
+	free(nc->enc[i].kv);
+	free(nc->dec[i].kv);
+    }
+    free(nc->enc);
+    free(nc->dec);
+    for(i = 0; i < NAME_LOCKS; i++){
+	pthread_mutex_destroy(&nc->locks[i]);
+    }
+    OPENSSL_cleanse(&nc->key, sizeof(nc->key));
+}
+
+extern int name_encrypt(name_crypt* nc, const char* name, size_t len, char* out){
+    unsigned char raw[NAME_CRYPT_SIV + NAME_CRYPT_MAX];
+    EVP_CIPHER_CTX* ctx;
+    size_t olen;
+
+    if(dot_name(name, len)){
+	memcpy(out, name, len);
+	out[len] = '\0';
+	return len;
+    }
+    if(len > NAME_CRYPT_MAX){
+	return -ENAMETOOLONG;
+    }
+    olen = cache_get(nc, nc->enc, name, len, out);
+    if(olen){
+	return olen;
+    }
+
+    ctx = name_ctx(nc);
+    crypt_mac(&nc->key, name, len, raw);
+    if(ctx == NULL || !ctr(ctx, raw, (const unsigned char*)name, len, raw + NAME_CRYPT_SIV)){
+	return -EIO;
+    }
+    olen = b64_encode(raw, NAME_CRYPT_SIV + len, out);
+    cache_both(nc, name, len, out, olen);
+    return olen;
+}
+
+/* Decrypt a cache miss with ctx */
+static int decrypt_miss(name_crypt* nc, EVP_CIPHER_CTX* ctx, const char* name, size_t len,
+			char* out){
+    unsigned char raw[NAME_ENC_MAX];
+    unsigned char siv[NAME_CRYPT_SIV];
+    int rlen;
+
+    if(len >= NAME_ENC_MAX){
+	return -EINVAL;
+    }
+    rlen = b64_decode(name, len, raw);
+    if(rlen <= NAME_CRYPT_SIV || rlen - NAME_CRYPT_SIV > NAME_MAX){
+	return -EINVAL;
+    }
+    rlen -= NAME_CRYPT_SIV;
+    if(ctx == NULL || !ctr(ctx, raw, raw + NAME_CRYPT_SIV, rlen, (unsigned char*)out)){
+	return -EIO;
+    }
+    crypt_mac(&nc->key, out, rlen, siv);
+    if(CRYPTO_memcmp(siv, raw, NAME_CRYPT_SIV) != 0){
+	return -EINVAL;
+    }
+    out[rlen] = '\0';
+    cache_both(nc, out, rlen, name, len);
+    return rlen;
+}
+
+extern int name_decrypt(name_crypt* nc, const char* name, size_t len, char* out){
+    size_t olen;
+
+    if(dot_name(name, len)){
+	memcpy(out, name, len);
+	out[len] = '\0';
+	return len;
+    }
+    if(len > NAME_MAX){
+	return -EINVAL;
+    }
+    olen = cache_get(nc, nc->dec, name, len, out);
+    if(olen){
+	return olen;
+    }
+    return decrypt_miss(nc, name_ctx(nc), name, len, out);
+}
+
+extern void name_decrypt_batch(name_crypt* nc, const char* const* names, int n,
+			       char (*out)[NAME_MAX + 1], int* lens){
+    EVP_CIPHER_CTX* ctx = NULL;
+    int i;
+
+    for(i = 0; i < n; i++){
+	size_t len = strlen(names[i]);
+
+	if(dot_name(names[i], len)){
+	    strcpy(out[i], names[i]);
+	    lens[i] = len;
+	}
+	else if(len > NAME_MAX){
+	    lens[i] = -EINVAL;
+	}
+	else{
+	    lens[i] = cache_get(nc, nc->dec, names[i], len, out[i]);
+	    if(lens[i] == 0){
+		lens[i] = -ENOENT;
+		if(ctx == NULL){
+		    ctx = name_ctx(nc);
+		}
+	    }
+	}
+    }
+    if(ctx == NULL){
+	return;
+    }
+    for(i = 0; i < n; i++){
+	if(lens[i] == -ENOENT){
+	    lens[i] = decrypt_miss(nc, ctx, names[i], strlen(names[i]), out[i]);
+	}
+    }
+}
+
+extern int name_encrypt_path(name_crypt* nc, const char* path, char* out, size_t cap){
+    char enc[NAME_ENC_MAX];
+    size_t o = 0;
+
+    while(*path){
+	size_t len;
+	int elen;
+
+	if(*path == '/'){
+	    if(o + 1 >= cap){
+		return -ENAMETOOLONG;
+	    }
+	    out[o++] = *path++;
+	    continue;
+	}
+	len = strcspn(path, "/");
+	elen = name_encrypt(nc, path, len, enc);
+	if(elen < 0){
+	    return elen;
+	}
+	if(o + elen >= cap){
+	    return -ENAMETOOLONG;
+	}
+	memcpy(out + o, enc, elen);
+	o += elen;
+	path += len;
+    }
+    if(o >= cap){
+	return -ENAMETOOLONG;
+    }
+    out[o] = '\0';
+    return 0;
+}
@@ -0,0 +1,96 @@
+/* name-crypt.h
+ * Deterministic filename encryption with a translation cache for pa4-encfs
+ *
+ * In names mode every component of a path in the mirror is encrypted. The
+ * scheme is deterministic, so a name is found with one lookup instead of a
+ * directory scan: a synthetic IV, the HMAC-SHA256 of the name truncated to
+ * NAME_CRYPT_SIV bytes, is both the AES-256-CTR IV for the name and its
+ * authenticator (the SIV construction). The stored name is the unpadded
+ * base64url of SIV and ciphertext. Equal names encrypt alike anywhere in the
+ * tree; that is what lets a directory be renamed without touching what is
+ * inside it. Names of up to NAME_CRYPT_MAX bytes fit in a 255-byte mirror
+ * name; longer ones fail with ENAMETOOLONG.
+ *
+ * Translations are cached both ways in two direct-mapped tables, each slot
+ * under one of NAME_LOCKS striped locks, so a hot lookup costs a hash and a
+ * compare. Each thread keeps a cipher context with the key already set up,
+ * and directory listings decrypt their cache misses as one batch.
+ *
+ * A mirror either has encrypted names throughout or none at all;
+ * NAME_MARKER_NAME in its root records that it has them.
+ *
+ */
+
+#ifndef NAME_CRYPT_H
+#define NAME_CRYPT_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "aes-crypt.h"
+
+#define NAME_MARKER_NAME   ".pa4-encfs.names"  /* In the root of a mirror using them */
+#define NAME_CRYPT_SIV     16
+#define NAME_CRYPT_MAX     (NAME_MAX * 3 / 4 - NAME_CRYPT_SIV)
+#define NAME_ENC_MAX       ((NAME_MAX + NAME_CRYPT_SIV + 2) / 3 * 4 + 1)  /* Buffer size */
+#define NAME_CACHE_DEFAULT 8192
+#define NAME_LOCKS         64
+
+typedef struct name_slot {
+    uint32_t hash;                /* 0: empty */
+    uint16_t klen;
+    uint16_t vlen;
+    char* kv;                     /* Key then value, one allocation */
+} name_slot;
+
+typedef struct name_crypt {
+    crypt_key key;                /* Names keys, derived from the mount key */
+    pthread_key_t ctx_key;        /* Per-thread cipher context */
+    name_slot* enc;               /* Plain -> encrypted */
+    name_slot* dec;               /* Encrypted -> plain */
+    size_t nslots;                /* Per table, power of two */
+    pthread_mutex_t locks[NAME_LOCKS];
+} name_crypt;
+
+/* int name_crypt_init(name_crypt* nc, const crypt_key* key, size_t nslots)
+ * Purpose: Derive the names keys and set up the caches
+ * Args: size_t nslots : Cache entries per direction (rounded up to a power of two)
+ * Return: 0 on success, -errno on error
+ */
+extern int name_crypt_init(name_crypt* nc, const crypt_key* key, size_t nslots);
+
+/* void name_crypt_destroy(name_crypt* nc) */
+extern void name_crypt_destroy(name_crypt* nc);
+
+/* int name_encrypt(name_crypt* nc, const char* name, size_t len, char* out)
+ * Purpose: Encrypt one name ("." and ".." are kept as they are)
+ * Args: char* out : NAME_ENC_MAX bytes, NUL terminated on return
+ * Return: Length of the encrypted name, -ENAMETOOLONG past NAME_CRYPT_MAX,
+ *         -EIO on error
+ */
+extern int name_encrypt(name_crypt* nc, const char* name, size_t len, char* out);
+
+/* int name_decrypt(name_crypt* nc, const char* name, size_t len, char* out)
+ * Purpose: Decrypt and authenticate one mirror name
+ * Args: char* out : NAME_MAX + 1 bytes, NUL terminated on return
+ * Return: Length of the plain name, -EINVAL if it isn't one of ours
+ */
+extern int name_decrypt(name_crypt* nc, const char* name, size_t len, char* out);
+
+/* void name_decrypt_batch(name_crypt* nc, const char* const* names, int n, char (*out)[NAME_MAX + 1], int* lens)
+ * Purpose: name_decrypt() of n names: cache hits first, then every miss
+ *          with one cipher context
+ * Args: int* lens : Per name, as name_decrypt() returns
+ */
+extern void name_decrypt_batch(name_crypt* nc, const char* const* names, int n,
+			       char (*out)[NAME_MAX + 1], int* lens);
+
+/* int name_encrypt_path(name_crypt* nc, const char* path, char* out, size_t cap)
+ * Purpose: Encrypt every component of a mount path ("/a/b" -> "/X/Y")
+ * Return: 0 on success, -ENAMETOOLONG if a name or out is too long, -EIO on error
+ */
+extern int name_encrypt_path(name_crypt* nc, const char* path, char* out, size_t cap);
+
+#endif
@@ -43,11 +43,63 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include "aes-crypt.h"
+#include "attr-cache.h"
+#include "buf-pool.h"
+#include "dir-scan.h"
+#include "encfs-block.h"
+#include "journal.h"
+#include "meta-index.h"
+#include "pack-store.h"
+#include "dedup-store.h"
+#include "name-crypt.h"
+#include "rekey.h"
+#include "sync-group.h"
+#include "write-behind.h"
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
+#define NODE_BUCKETS 1024
+#define DEFAULT_POOL_MAX 64 //MiB
+#define NAME_BATCH 64       //directory entries decrypted at a time
+
+// How the bytes of a backing file are stored
+enum { FMT_PLAIN, FMT_LEGACY, FMT_BLOCK, FMT_PACK };
+
+// Node table key of packed files, which have no backing inode (ino = entry id)
+#define PACK_DEV ((dev_t) -1)
+
+// One per open backing inode, shared by all of its handles
+typedef struct encfs_node {
+	dev_t dev;
+	ino_t ino;
+	int refcnt;
+	int fd;
+	int writable;
+	int format;
+	encfs_file ef;             //valid when format == FMT_BLOCK
+	pack_entry *pe;            //valid when format == FMT_PACK
+	char *pbuf;                //packed contents being edited, PACK_MAX_FILE bytes
+	size_t plen;
+	int pdirty;
+	pthread_rwlock_t lock;     //readers share, writers and truncate exclude
+	wb_queue wb;               //staged writes (write-behind mode)
+	journal_file jf;           //ef's updates go through the journal (journal mode)
+	encfs_file *shadow;        //copy under the new key being built (re-keying)
+	off_t shadow_pos;          //shadow is complete below this offset
+	struct encfs_node *next;
+} encfs_node;
+
+// One per open(), stored in fi->fh
+typedef struct {
+	encfs_node *node;
+	int flags;
+} encfs_handle;
+
 //----Thank you, https://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/html/private.html----
 // maintain fs state in here
 #include <limits.h>
@@ -55,41 +107,1068 @@
 typedef struct {
     char *rootdir;
     char *key;
+    crypt_key *block_key;      //derived once at mount, lives in pool memory
+    uint32_t key_id;           //encfs_key_id(block_key)
+    char *old_key;             //-o rekey=<old phrase>
+    crypt_key *old_block_key;
+    const crypt_key *keys[2];  //keys files may be under, current one first
+    int nkeys;
+    unsigned long rekey_rate;  //-o rekey_rate=<MiB/s>
+    rekey_walker rk;
+    bufpool pool;              //ENCFS_MAX_BLOCK_SIZE crypto and I/O buffers
+    unsigned long pool_max;    //-o pool_max=<MiB>
+    int hugepages;             //-o hugepages
+    int lock_memory;           //-o mlock
+    int compress;              //-o compress
+    int pack;                  //-o pack
+    unsigned long pack_max;    //-o pack_max=<KiB>
+    pack_store ps;
+    int dedup;                 //-o dedup (implied when the mirror has a store)
+    dedup_store ds;
+    int names;                 //-o names (implied when the mirror uses them)
+    unsigned long name_cache;  //-o name_cache=<entries>
+    name_crypt nc;
+    unsigned long attr_entries; //-o attr_cache=<entries>, 0 for off
+    attr_cache ac;
+    int meta;                  //-o meta_index (implied when the mirror has one)
+    unsigned long meta_slots;  //-o meta_slots=<n>, size of a new index
+    meta_index mi;
+    int stream;                //-o stream: every file is streamed
+    char *stream_match;        //-o stream_match=<glob>[:<glob>...]
+    int mmap;                  //-o mmap: page-sized blocks, page cache kept across opens
+    int write_behind;          //-o write_behind
+    unsigned long wb_threads;  //-o wb_threads=<n>
+    unsigned long wb_max;      //-o wb_max=<MiB>
+    wb_engine wb;
+    unsigned long sync_window; //-o sync_window=<us>, group commit window
+    unsigned long sync_fs;     //-o sync_fs=<files>, batch size for syncfs(), 0 for never
+    sync_group sg;
+    int journal;               //-o journal (implied when the mirror has one)
+    unsigned long journal_max; //-o journal_max=<MiB>
+    journal jr;
+    pthread_mutex_t node_lock;
+    encfs_node *nodes[NODE_BUCKETS];
 } fs_state;
 #define FS_DATA ((fs_state *) fuse_get_context()->private_data)
 
-FILE *open_memstream(char **ptr, size_t *sizeloc);
+// Compressed files use larger blocks so the savings outlast 4K allocation,
+// unless pages of mapped files are to be read and written back one block each
+#define BLOCK_SIZE(fs) ((fs)->compress && !(fs)->mmap ? ENCFS_LZ_BLOCK_SIZE : ENCFS_BLOCK_SIZE)
+
+// Files up to this size live in the container in pack mode
+#define PACK_LIMIT(fs) ((off_t) (fs)->pack_max << 10)
+
+// Shared block store for block files, if any
+#define DEDUP(fs) ((fs)->dedup ? &(fs)->ds : NULL)
+
+// Legacy files predate any re-keying, so they are under the old phrase
+#define LEGACY_KEY(fs) ((fs)->old_key ? (fs)->old_key : (fs)->key)
 
 static void fullpath(char fpath[PATH_MAX], const char *path)
 {
-    strcpy(fpath, FS_DATA->rootdir);
-    strncat(fpath, path, PATH_MAX); // ridiculously long paths will break here
+    fs_state *fs = FS_DATA;
+    size_t len = strlen(fs->rootdir);
+
+    strcpy(fpath, fs->rootdir);
+    if (!fs->names) {
+	strncat(fpath, path, PATH_MAX - len - 1); // ridiculously long paths will break here
+	return;
+    }
+    // A name that can't be encrypted becomes one no system call accepts, so
+    // the operation fails with ENAMETOOLONG instead of touching a plain name
+    if (name_encrypt_path(&fs->nc, path, fpath + len, PATH_MAX - len)) {
+	memset(fpath + len, 'x', NAME_MAX + 2);
+	fpath[len] = '/';
+	fpath[len + NAME_MAX + 2] = '\0';
+    }
+}
+
+// Attribute cache upkeep, after path changed (parent: its directory did too)
+static void attr_forget(fs_state *fs, const char *path, int parent)
+{
+	char dir[PATH_MAX];
+	char *slash;
+
+	if (!fs->attr_entries)
+		return;
+	attr_cache_forget(&fs->ac, path);
+	if (parent) {
+		strcpy(dir, path);
+		slash = strrchr(dir, '/');
+		if (slash != NULL) {
+			slash[slash == dir ? 1 : 0] = '\0';
+			attr_cache_forget(&fs->ac, dir);
+		}
+	}
+}
+
+// ... after the link count or ctime of an inode with other names changed
+static void attr_forget_ino(fs_state *fs, const struct stat *st)
+{
+	if (fs->attr_entries)
+		attr_cache_forget_ino(&fs->ac, st->st_dev, st->st_ino);
+}
+
+// ... and after a rename of from over to (st_mode 0: nothing was there)
+static void attr_rename(fs_state *fs, const char *from, const char *to,
+			const struct stat *stFrom, const struct stat *stTo)
+{
+	if (!fs->attr_entries)
+		return;
+	attr_forget(fs, from, 1);
+	attr_forget(fs, to, 1);
+	//everything below a renamed directory moves with it
+	if (S_ISDIR(stFrom->st_mode))
+		attr_cache_forget_tree(&fs->ac, from);
+	//other names see the ctime change, and a replaced file loses a link
+	else if (stFrom->st_mode && stFrom->st_nlink > 1)
+		attr_forget_ino(fs, stFrom);
+	if (stTo->st_mode && !S_ISDIR(stTo->st_mode) && stTo->st_nlink > 1)
+		attr_forget_ino(fs, stTo);
+}
+
+//----open node table---------------------------------------------------------------
+
+static unsigned node_hash(dev_t dev, ino_t ino)
+{
+	return (unsigned) ((ino * 0x9e3779b97f4a7c15ULL) ^ dev) % NODE_BUCKETS;
+}
+
+static encfs_node *node_find(fs_state *fs, dev_t dev, ino_t ino)
+{
+	encfs_node *node;
+
+	for (node = fs->nodes[node_hash(dev, ino)]; node != NULL; node = node->next)
+		if (node->dev == dev && node->ino == ino)
+			return node;
+	return NULL;
+}
+
+static void node_unlink(fs_state *fs, encfs_node *node)
+{
+	encfs_node **pp = &fs->nodes[node_hash(node->dev, node->ino)];
+
+	while (*pp != node)
+		pp = &(*pp)->next;
+	*pp = node->next;
+}
+
+static void node_link(fs_state *fs, encfs_node *node)
+{
+	unsigned b = node_hash(node->dev, node->ino);
+
+	node->next = fs->nodes[b];
+	fs->nodes[b] = node;
+}
+
+// Send a block node's updates through the journal (journal mode)
+static int node_journal(fs_state *fs, encfs_node *node)
+{
+	if (!fs->journal)
+		return 0;
+	return journal_attach(&node->jf, &fs->jr, &node->ef, &node->lock);
+}
+
+// Work out how fd is stored; fills node->format and node->ef
+static int node_probe(fs_state *fs, encfs_node *node)
+{
+	char xval[5];
+	int res;
+
+	res = encfs_probe(node->fd, NULL);
+	if (res < 0)
+		return res;
+	if (res) {
+		node->format = FMT_BLOCK;
+		node->ef.compress = fs->compress;
+		node->ef.dedup = DEDUP(fs);
+		res = encfs_open_keys(&node->ef, node->fd, fs->keys, fs->nkeys, &fs->pool);
+		return res ? res : node_journal(fs, node);
+	}
+	if (fgetxattr(node->fd, "user.encrypted", xval, sizeof(xval)) != -1)
+		node->format = FMT_LEGACY;
+	else
+		node->format = FMT_PLAIN;
+	return 0;
+}
+
+// Take a reference on the node for an already open backing fd (consumes fd)
+static int node_get_fd(fs_state *fs, int fd, int writable, encfs_node **out)
+{
+	encfs_node *node, *found;
+	struct stat st;
+	int res;
+
+	if (fstat(fd, &st) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	//fast path: the inode is already open
+	pthread_mutex_lock(&fs->node_lock);
+	found = node_find(fs, st.st_dev, st.st_ino);
+	if (found != NULL)
+		found->refcnt++;
+	pthread_mutex_unlock(&fs->node_lock);
+
+	if (found == NULL) {
+		node = calloc(1, sizeof(*node));
+		if (node == NULL) {
+			close(fd);
+			return -ENOMEM;
+		}
+		node->dev = st.st_dev;
+		node->ino = st.st_ino;
+		node->refcnt = 1;
+		node->fd = fd;
+		node->writable = writable;
+		res = node_probe(fs, node);
+		if (res) {
+			close(fd);
+			free(node);
+			return res;
+		}
+		pthread_rwlock_init(&node->lock, NULL);
+		wb_queue_init(&node->wb, &node->ef, &node->lock);
+
+		//someone may have raced us here
+		pthread_mutex_lock(&fs->node_lock);
+		found = node_find(fs, st.st_dev, st.st_ino);
+		if (found != NULL)
+			found->refcnt++;
+		else
+			node_link(fs, node);
+		pthread_mutex_unlock(&fs->node_lock);
+
+		if (found == NULL) {
+			*out = node;
+			return 0;
+		}
+		wb_queue_destroy(&node->wb);
+		pthread_rwlock_destroy(&node->lock);
+		free(node);
+	}
+
+	//upgrade a read-only shared fd if this open can write
+	if (writable && !found->writable) {
+		pthread_rwlock_wrlock(&found->lock);
+		if (!found->writable && dup2(fd, found->fd) != -1)
+			found->writable = 1;
+		pthread_rwlock_unlock(&found->lock);
+	}
+	close(fd);
+	*out = found;
+	return 0;
+}
+
+static int node_get(const char *fullPath, encfs_node **out)
+{
+	int fd;
+	int writable = 1;
+
+	fd = open(fullPath, O_RDWR);
+	if (fd == -1 && (errno == EACCES || errno == EROFS)) {
+		writable = 0;
+		fd = open(fullPath, O_RDONLY);
+	}
+	if (fd == -1)
+		return -errno;
+
+	return node_get_fd(FS_DATA, fd, writable, out);
+}
+
+// Take a reference on the node for a packed file (consumes the entry reference)
+static int node_get_pack(pack_entry *pe, encfs_node **out)
+{
+	fs_state *fs = FS_DATA;
+	encfs_node *node, *found;
+
+	pthread_mutex_lock(&fs->node_lock);
+	found = node_find(fs, PACK_DEV, pe->id);
+	if (found != NULL)
+		found->refcnt++;
+	pthread_mutex_unlock(&fs->node_lock);
+
+	if (found == NULL) {
+		node = calloc(1, sizeof(*node));
+		if (node == NULL) {
+			pack_release(&fs->ps, pe);
+			return -ENOMEM;
+		}
+		node->dev = PACK_DEV;
+		node->ino = pe->id;
+		node->refcnt = 1;
+		node->fd = -1;
+		node->writable = 1;
+		node->format = FMT_PACK;
+		node->pe = pe;
+		pthread_rwlock_init(&node->lock, NULL);
+		wb_queue_init(&node->wb, &node->ef, &node->lock);
+
+		pthread_mutex_lock(&fs->node_lock);
+		found = node_find(fs, PACK_DEV, pe->id);
+		if (found != NULL)
+			found->refcnt++;
+		else
+			node_link(fs, node);
+		pthread_mutex_unlock(&fs->node_lock);
+
+		if (found == NULL) {
+			*out = node;
+			return 0;
+		}
+		wb_queue_destroy(&node->wb);
+		pthread_rwlock_destroy(&node->lock);
+		free(node);
+	}
+	pack_release(&fs->ps, pe);
+	*out = found;
+	return 0;
+}
+
+// node_get() for a mount path: packed files first
+static int node_get_path(const char *path, const char *fullPath, encfs_node **out)
+{
+	fs_state *fs = FS_DATA;
+	pack_entry *pe;
+
+	if (fs->pack && (pe = pack_lookup(&fs->ps, path)) != NULL)
+		return node_get_pack(pe, out);
+	return node_get(fullPath, out);
+}
+
+static void node_put(fs_state *fs, encfs_node *node)
+{
+	struct stat st;
+	int last;
+
+	pthread_mutex_lock(&fs->node_lock);
+	last = (--node->refcnt == 0);
+	if (last)
+		node_unlink(fs, node);
+	pthread_mutex_unlock(&fs->node_lock);
+
+	if (last) {
+		if (node->format == FMT_PACK) {
+			if (node->pdirty)
+				pack_write(&fs->ps, node->pe, node->pbuf, node->plen);
+			pack_release(&fs->ps, node->pe);
+			free(node->pbuf);
+		} else {
+			if (node->format == FMT_BLOCK) {
+				encfs_set_direct(&node->ef, 0);
+				encfs_set_append(&node->ef, 0);
+			}
+			//records of a file with no name left needn't be put in place
+			if (node->ef.redo != NULL) {
+				if (fstat(node->fd, &st) == 0 && st.st_nlink == 0) {
+					pthread_rwlock_wrlock(&node->lock);
+					journal_forget(&node->jf);
+					pthread_rwlock_unlock(&node->lock);
+				} else
+					journal_detach(&node->jf);
+			}
+			//the last name went while open: the chunks can go now
+			if (node->format == FMT_BLOCK && fs->dedup && node->writable &&
+			    fstat(node->fd, &st) == 0 && st.st_nlink == 0)
+				encfs_truncate(&node->ef, 0);
+			close(node->fd);
+		}
+		wb_queue_destroy(&node->wb);
+		pthread_rwlock_destroy(&node->lock);
+		free(node);
+	}
+}
+
+// Dedup chunks belong to the file until its last name is gone. Before an
+// unlink or a rename that may remove a file's last name, grab the file
+// (regular files only, and read-only: dropping references writes nothing)...
+static int dedup_hold(fs_state *fs, const char *fullPath)
+{
+	struct stat st;
+	int fd;
+
+	if (!fs->dedup || lstat(fullPath, &st) == -1 || !S_ISREG(st.st_mode))
+		return -1;
+	fd = open(fullPath, O_RDONLY);
+	//swapped for something else since the lstat(): leave it alone
+	if (fd != -1 && (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// ...and afterwards, if that was its last name and nobody has it open,
+// drop its references (open files do it in node_put())
+static void dedup_drop(fs_state *fs, int fd)
+{
+	encfs_file ef;
+	struct stat st;
+
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 0) {
+		pthread_mutex_lock(&fs->node_lock);
+		if (node_find(fs, st.st_dev, st.st_ino) == NULL &&
+		    encfs_probe(fd, NULL) == 1) {
+			ef.compress = fs->compress;
+			ef.dedup = &fs->ds;
+			if (encfs_open_keys(&ef, fd, fs->keys, fs->nkeys, &fs->pool) == 0)
+				encfs_release_chunks(&ef);
+		}
+		pthread_mutex_unlock(&fs->node_lock);
+	}
+	close(fd);
+}
+
+// Re-key the node under the inode now behind node->fd (after a conversion)
+static void node_rehash(fs_state *fs, encfs_node *node)
+{
+	struct stat st;
+
+	if (fstat(node->fd, &st) == 0) {
+		pthread_mutex_lock(&fs->node_lock);
+		node_unlink(fs, node);
+		node->dev = st.st_dev;
+		node->ino = st.st_ino;
+		node_link(fs, node);
+		pthread_mutex_unlock(&fs->node_lock);
+	}
+}
+
+// Collects full blocks from do_crypt_fd() and appends them to a block file
+typedef struct {
+	encfs_file *ef;
+	unsigned char *blk;
+	size_t fill;
+	off_t pos;
+	int err;
+} import_state;
+
+static int import_flush(import_state *im)
+{
+	ssize_t res;
+
+	if (im->fill == 0)
+		return 0;
+	res = encfs_pwrite(im->ef, (char *) im->blk, im->fill, im->pos);
+	if (res != (ssize_t) im->fill) {
+		im->err = res < 0 ? (int) res : -EIO;
+		return -1;
+	}
+	im->pos += im->fill;
+	im->fill = 0;
+	return 0;
+}
+
+static int import_sink(void *arg, const unsigned char *data, int len)
+{
+	import_state *im = arg;
+
+	while (len > 0) {
+		size_t n = im->ef->hdr.block_size - im->fill;
+		if (n > (size_t) len)
+			n = len;
+		memcpy(im->blk + im->fill, data, n);
+		im->fill += n;
+		data += n;
+		len -= n;
+		if (im->fill == im->ef->hdr.block_size && import_flush(im))
+			return -1;
+	}
+	return 0;
+}
+
+// Rewrite a plaintext or legacy (whole-file CBC) file in block format, as
+// a new file renamed over the old one: the node's own descriptor is only
+// read. Called with node->lock held for writing.
+static int node_import(fs_state *fs, encfs_node *node, const char *fullPath)
+{
+	char tmpPath[PATH_MAX];
+	import_state im;
+	struct stat st;
+	int fd, res;
+
+	if (fstat(node->fd, &st) == -1)
+		return -errno;
+
+	//writable by its owner until the xattr is set, whatever the mode
+	snprintf(tmpPath, sizeof(tmpPath), "%s.pa4-encfs~", fullPath);
+	fd = open(tmpPath, O_RDWR | O_CREAT | O_EXCL, (st.st_mode & 07777) | S_IWUSR);
+	if (fd == -1)
+		return -errno;
+
+	memset(&im, 0, sizeof(im));
+	im.ef = &node->ef;
+	node->ef.compress = fs->compress;
+	node->ef.dedup = DEDUP(fs);
+	res = encfs_create(&node->ef, fd, fs->block_key, &fs->pool, BLOCK_SIZE(fs));
+	if (res == 0) {
+		im.blk = bufpool_get(&fs->pool);
+		if (im.blk == NULL)
+			res = -ENOMEM;
+	}
+	if (res == 0) {
+		if (!do_crypt_fd(node->fd, node->format == FMT_LEGACY ? 0 : -1,
+				 LEGACY_KEY(fs), import_sink, &im))
+			res = im.err ? im.err : -EIO;
+		else if (import_flush(&im))
+			res = im.err;
+		bufpool_put(&fs->pool, im.blk);
+	}
+	if (res == 0 && fsetxattr(fd, "user.encrypted", "true", 4, 0) == -1)
+		res = -errno;
+	if (res == 0 && fchmod(fd, st.st_mode & 07777) == -1)
+		res = -errno;
+	if (res == 0 && rename(tmpPath, fullPath) == -1)
+		res = -errno;
+	if (res) {
+		unlink(tmpPath);
+		close(fd);
+		return res;
+	}
+
+	//swap the node over to the new inode
+	dup2(fd, node->fd);
+	close(fd);
+	node->ef.fd = node->fd;
+	node->format = FMT_BLOCK;
+	node_rehash(fs, node);
+	return node_journal(fs, node);
+}
+
+// node_import() on behalf of a write: only for a node opened for writing
+static int node_convert(fs_state *fs, encfs_node *node, const char *fullPath)
+{
+	if (node->format == FMT_BLOCK)
+		return 0;
+	if (!node->writable)
+		return -EACCES;
+	return node_import(fs, node, fullPath);
+}
+
+// Bring a packed file's contents into memory for editing
+static int node_pack_load(encfs_node *node)
+{
+	ssize_t res;
+
+	if (node->pbuf != NULL)
+		return 0;
+	node->pbuf = malloc(PACK_MAX_FILE);
+	if (node->pbuf == NULL)
+		return -ENOMEM;
+	res = pack_read(&FS_DATA->ps, node->pe, node->pbuf, PACK_MAX_FILE, 0);
+	if (res < 0) {
+		free(node->pbuf);
+		node->pbuf = NULL;
+		return res;
+	}
+	node->plen = res;
+	return 0;
+}
+
+// Write a packed file edited in memory back to the container.
+// Called with node->lock held for writing.
+static int node_pack_commit(encfs_node *node)
+{
+	int res;
+
+	if (!node->pdirty)
+		return 0;
+	res = pack_write(&FS_DATA->ps, node->pe, node->pbuf, node->plen);
+	if (res == 0)
+		node->pdirty = 0;
+	return res;
+}
+
+// Resize a packed file in memory (zero filling), within PACK_LIMIT
+static int node_pack_resize(encfs_node *node, size_t size)
+{
+	int res;
+
+	res = node_pack_load(node);
+	if (res)
+		return res;
+	if (size > node->plen)
+		memset(node->pbuf + node->plen, 0, size - node->plen);
+	node->plen = size;
+	node->pdirty = 1;
+	return 0;
+}
+
+// Move a packed file that outgrew the container into its own block file.
+// Called with node->lock held for writing.
+static int node_spill(encfs_node *node, const char *path, const char *fullPath)
+{
+	fs_state *fs = FS_DATA;
+	char tmpPath[PATH_MAX];
+	int fd, res;
+
+	res = node_pack_load(node);
+	if (res)
+		return res;
+
+	//writable by its owner until the xattr is set, whatever the mode
+	snprintf(tmpPath, sizeof(tmpPath), "%s.pa4-encfs~", fullPath);
+	fd = open(tmpPath, O_RDWR | O_CREAT | O_EXCL, (node->pe->rec.mode & 07777) | S_IWUSR);
+	if (fd == -1)
+		return -errno;
+
+	node->ef.compress = fs->compress;
+	node->ef.dedup = DEDUP(fs);
+	res = encfs_create(&node->ef, fd, fs->block_key, &fs->pool, BLOCK_SIZE(fs));
+	if (res == 0 && node->plen > 0 &&
+	    encfs_pwrite(&node->ef, node->pbuf, node->plen, 0) != (ssize_t) node->plen)
+		res = -EIO;
+	if (res == 0 && fsetxattr(fd, "user.encrypted", "true", 4, 0) == -1)
+		res = -errno;
+	if (res == 0 && fchmod(fd, node->pe->rec.mode & 07777) == -1)
+		res = -errno;
+	if (res == 0 && rename(tmpPath, fullPath) == -1)
+		res = -errno;
+	if (res) {
+		unlink(tmpPath);
+		close(fd);
+		return res;
+	}
+
+	//the container copy goes once the file is in place
+	pack_unlink(&fs->ps, path);
+	pack_release(&fs->ps, node->pe);
+	free(node->pbuf);
+	node->pe = NULL;
+	node->pbuf = NULL;
+	node->pdirty = 0;
+
+	node->fd = fd;
+	node->format = FMT_BLOCK;
+	node_rehash(fs, node);
+	return node_journal(fs, node);
+}
+
+// Re-keying copies a block file in pieces of this size, taking the node lock
+// for each piece, so the file stays usable while it moves
+#define REKEY_PIECE (1 << 20)
+
+// Plaintext size of a block node, staged writes included
+static uint64_t node_size(fs_state *fs, encfs_node *node)
+{
+	return fs->write_behind ? wb_size(&node->wb) : node->ef.hdr.size;
+}
+
+// Keep the finished part of a re-keying copy in step with a write.
+// Called with node->lock held for writing.
+static int node_shadow_write(encfs_node *node, const char *buf, size_t size, off_t offset)
+{
+	if (node->shadow == NULL || offset >= node->shadow_pos)
+		return 0;
+	return encfs_pwrite(node->shadow, buf, size, offset) == (ssize_t) size ? 0 : -EIO;
+}
+
+// Same for a truncate
+static int node_shadow_truncate(encfs_node *node, off_t size)
+{
+	if (node->shadow == NULL || size >= node->shadow_pos)
+		return 0;
+	node->shadow_pos = size;
+	return encfs_truncate(node->shadow, size);
+}
+
+// Copy [shadow_pos, size) of the node into its shadow, at most limit bytes.
+// Called with node->lock held.
+static int node_shadow_copy(fs_state *fs, encfs_node *node, char *blk, off_t limit)
+{
+	uint64_t size = node_size(fs, node);
+	ssize_t n;
+
+	while ((uint64_t) node->shadow_pos < size && limit > 0) {
+		n = size - node->shadow_pos;
+		if (n > (ssize_t) fs->pool.block_size)
+			n = fs->pool.block_size;
+		if (fs->write_behind)
+			n = wb_pread(&node->wb, blk, n, node->shadow_pos);
+		else
+			n = encfs_pread(&node->ef, blk, n, node->shadow_pos);
+		if (n <= 0)
+			return n < 0 ? (int) n : -EIO;
+		if (encfs_pwrite(node->shadow, blk, n, node->shadow_pos) != n)
+			return -EIO;
+		node->shadow_pos += n;
+		limit -= n;
+	}
+	return 0;
+}
+
+// Move a block file under an old key to the current one while it stays in
+// use: build a copy under the new key beside it piece by piece, with writes
+// to the part already copied mirrored into it, then swap it in
+static int node_rekey(fs_state *fs, encfs_node *node, const char *fullPath)
+{
+	char tmpPath[PATH_MAX];
+	encfs_file shadow;
+	struct stat st, cur;
+	struct timeval tv[2];
+	char *blk;
+	int fd, res, stop = 0;
+
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->format == FMT_LEGACY) {
+		//whole-file CBC can't be copied piecewise: convert it in one go
+		res = fstat(node->fd, &st) == -1 ? -errno : node_import(fs, node, fullPath);
+		pthread_rwlock_unlock(&node->lock);
+		if (res == 0)
+			rekey_account(&fs->rk, st.st_size);
+		return res;
+	}
+	if (node->format != FMT_BLOCK || node->ef.key == fs->block_key) {
+		pthread_rwlock_unlock(&node->lock);
+		return 0;
+	}
+	res = 0;
+	if (fstat(node->fd, &st) == -1)
+		res = -errno;
+	fd = -1;
+	if (res == 0) {
+		//writable by its owner until the xattr is set, whatever the mode
+		snprintf(tmpPath, sizeof(tmpPath), "%s.pa4-encfs~", fullPath);
+		fd = open(tmpPath, O_RDWR | O_CREAT | O_EXCL, (st.st_mode & 07777) | S_IWUSR);
+		if (fd == -1)
+			res = -errno;
+	}
+	if (res == 0) {
+		shadow.compress = fs->compress;
+		shadow.dedup = DEDUP(fs);
+		res = encfs_create(&shadow, fd, fs->block_key, &fs->pool, node->ef.hdr.block_size);
+	}
+	if (res == 0) {
+		node->shadow = &shadow;
+		node->shadow_pos = 0;
+	}
+	pthread_rwlock_unlock(&node->lock);
+	if (res) {
+		if (fd != -1) {
+			unlink(tmpPath);
+			close(fd);
+		}
+		return res;
+	}
+
+	//bulk of the copy: readers carry on, a writer waits one piece at most
+	blk = bufpool_get(&fs->pool);
+	res = blk ? 0 : -ENOMEM;
+	while (res == 0 && !stop) {
+		off_t before;
+		int done;
+
+		pthread_rwlock_rdlock(&node->lock);
+		before = node->shadow_pos;
+		res = node_shadow_copy(fs, node, blk, REKEY_PIECE);
+		done = (uint64_t) node->shadow_pos >= node_size(fs, node);
+		pthread_rwlock_unlock(&node->lock);
+		stop = rekey_account(&fs->rk, node->shadow_pos > before ?
+				     node->shadow_pos - before : 0);
+		if (done)
+			break;
+	}
+
+	//catch up, then swap the copy in under the old name
+	pthread_rwlock_wrlock(&node->lock);
+	if (res == 0 && stop)
+		res = -EINTR;
+	if (res == 0)
+		res = node_shadow_copy(fs, node, blk, (off_t) node_size(fs, node));
+	if (res == 0 && shadow.hdr.size != node_size(fs, node))
+		res = encfs_truncate(&shadow, node_size(fs, node));
+	if (res == 0 && fsetxattr(fd, "user.encrypted", "true", 4, 0) == -1)
+		res = -errno;
+	if (res == 0 && fstat(node->fd, &st) == -1)
+		res = -errno;
+	if (res == 0) {
+		//ownership is best effort (needs privilege), mode and times are
+		//kept (the mode after chown, which may clear set-id bits)
+		if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+			res = -errno;
+		if (res == 0 && fchmod(fd, st.st_mode & 07777) == -1)
+			res = -errno;
+		tv[0].tv_sec = st.st_atime;
+		tv[0].tv_usec = 0;
+		tv[1].tv_sec = st.st_mtime;
+		tv[1].tv_usec = 0;
+		if (res == 0 && (utimes(tmpPath, tv) == -1 || fsync(fd) == -1))
+			res = -errno;
+	}
+	//the file may have been renamed or replaced meanwhile
+	if (res == 0 && (lstat(fullPath, &cur) == -1 ||
+			 cur.st_dev != node->dev || cur.st_ino != node->ino))
+		res = -ESTALE;
+	if (res == 0 && rename(tmpPath, fullPath) == -1)
+		res = -errno;
+	node->shadow = NULL;
+	if (res == 0) {
+		int direct = node->ef.dfd != -1;
+
+		//the copy was made through the journal: the old file's records can go
+		if (node->ef.redo != NULL)
+			journal_forget(&node->jf);
+		dup2(fd, node->fd);
+		encfs_set_direct(&node->ef, 0);
+		encfs_set_append(&node->ef, 0);
+		node->ef = shadow;
+		node->ef.fd = node->fd;
+		if (direct)
+			encfs_set_direct(&node->ef, 1);
+		node_rehash(fs, node);
+		res = node_journal(fs, node);
+		//cached attributes still have the old inode
+		attr_forget_ino(fs, &st);
+	} else
+		unlink(tmpPath);
+	pthread_rwlock_unlock(&node->lock);
+
+	close(fd);
+	bufpool_put(&fs->pool, blk);
+	return res;
+}
+
+// Walker callback: bring one file under the current key.
+// Runs on the walker thread, outside any FUSE request.
+static int rekey_file(void *arg, const char *path)
+{
+	fs_state *fs = arg;
+	encfs_header hdr;
+	encfs_node *node;
+	struct stat st;
+	char xval[5];
+	int fd, res;
+
+	char fullPath[PATH_MAX];
+	snprintf(fullPath, sizeof(fullPath), "%s%s", fs->rootdir, path);
+
+	//read-only files too: the new copy is a file of its own
+	fd = open(fullPath, O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		return -errno;
+
+	//most files are done (or plain) and cost one header read
+	res = encfs_probe(fd, &hdr);
+	if ((res == 1 && hdr.key_id == fs->key_id) ||
+	    (res == 0 && fgetxattr(fd, "user.encrypted", xval, sizeof(xval)) == -1)) {
+		close(fd);
+		return 0;
+	}
+	//a copy would break the other links, which still lead to the old file
+	if (res < 0 || fstat(fd, &st) == -1 || st.st_nlink > 1) {
+		close(fd);
+		return res < 0 ? res : -EMLINK;
+	}
+
+	res = node_get_fd(fs, fd, 0, &node);
+	if (res)
+		return res;
+	res = node_rekey(fs, node, fullPath);
+	node_put(fs, node);
+	return res;
+}
+
+// Copies the [offset, offset + size) window out of a decrypted stream
+typedef struct {
+	char *buf;
+	size_t size;
+	off_t offset;
+	off_t pos;
+	size_t copied;
+} range_state;
+
+static int range_sink(void *arg, const unsigned char *data, int len)
+{
+	range_state *r = arg;
+	off_t start = r->pos;
+	off_t end = r->pos + len;
+	off_t lo, hi;
+
+	r->pos = end;
+	if (end <= r->offset)
+		return 0;
+	lo = start > r->offset ? start : r->offset;
+	hi = end < r->offset + (off_t) r->size ? end : r->offset + (off_t) r->size;
+	memcpy(r->buf + (lo - r->offset), data + (lo - start), hi - lo);
+	r->copied += hi - lo;
+	return hi == r->offset + (off_t) r->size ? 1 : 0;
+}
+
+// Whether the file st describes is open; if so *size is its current
+// plaintext size (-1 if it isn't a block-format file)
+static int open_file_size(fs_state *fs, const struct stat *st, off_t *size)
+{
+	encfs_node *node;
+
+	pthread_mutex_lock(&fs->node_lock);
+	node = node_find(fs, st->st_dev, st->st_ino);
+	*size = -1;
+	if (node != NULL && node->format == FMT_BLOCK)
+		*size = fs->write_behind ? wb_size(&node->wb) : node->ef.hdr.size;
+	pthread_mutex_unlock(&fs->node_lock);
+	return node != NULL;
+}
+
+// Plaintext size of a block-format file, or -1 if it isn't one. st must be
+// fresh; the file is fullPath, or name in dirfd if fullPath is NULL.
+static off_t block_file_size(fs_state *fs, const struct stat *st, const char *fullPath,
+			     int dirfd, const char *name)
+{
+	encfs_header hdr;
+	uint64_t logged;
+	off_t size;
+	int fd, res;
+
+	if (open_file_size(fs, st, &size))
+		return size;
+	//closed, but grown by records not in place yet: the header is behind
+	if (fs->journal && journal_size(&fs->jr, st->st_ino, &logged))
+		return (off_t) logged;
+	//the index remembers headers from earlier lookups, and earlier mounts
+	if (fs->meta && meta_lookup(&fs->mi, st, &size) == 0)
+		return size;
+
+	fd = fullPath != NULL ? open(fullPath, O_RDONLY) : dir_open_entry(dirfd, name);
+	if (fd < 0)
+		return -1;
+	res = encfs_probe(fd, &hdr);
+	size = res == 1 ? (off_t) hdr.size : -1;
+	close(fd);
+	if (fs->meta && res >= 0)
+		meta_store(&fs->mi, st, size);
+	return size;
+}
+
+// Attributes of a packed file, with the size of unflushed edits
+static int packed_stat(const char *path, struct stat *st)
+{
+	fs_state *fs = FS_DATA;
+	encfs_node *node;
+
+	if (!fs->pack || pack_stat(&fs->ps, path, st))
+		return -ENOENT;
+
+	pthread_mutex_lock(&fs->node_lock);
+	node = node_find(fs, PACK_DEV, st->st_ino);
+	if (node != NULL && node->pbuf != NULL)
+		st->st_size = node->plen;
+	pthread_mutex_unlock(&fs->node_lock);
+	return 0;
+}
+
+// Permission check against the caller's credentials, for packed files, which
+// have no backing inode to ask, and for paths the kernel never looked up
+static int caller_access(const struct stat *st, int mask)
+{
+	struct fuse_context *ctx = fuse_get_context();
+	mode_t bits = st->st_mode;
+
+	if (ctx->uid == 0)
+		return 0;
+	if (ctx->uid == st->st_uid)
+		bits >>= 6;
+	else if (ctx->gid == st->st_gid)
+		bits >>= 3;
+	return (bits & mask & 7) == (mask & 7) ? 0 : -EACCES;
+}
+
+// Copies packed files into a readdir buffer
+typedef struct {
+	void *buf;
+	fuse_fill_dir_t filler;
+} fill_state;
+
+static int pack_fill(void *arg, const char *name, const struct stat *st)
+{
+	fill_state *f = arg;
+
+	return f->filler(f->buf, name, st, 0);
+}
+
+static int pack_any(void *arg, const char *name, const struct stat *st)
+{
+	(void) arg;
+	(void) name;
+	(void) st;
+	return 1;
+}
+
+// Our own files in the mirror root
+static int internal_file(const char *name)
+{
+	return strcmp(name, PACK_FILE_NAME) == 0 ||
+	       strcmp(name, NAME_MARKER_NAME) == 0 ||
+	       strcmp(name, META_INDEX_NAME) == 0 ||
+	       strcmp(name, DEDUP_DATA_NAME) == 0 ||
+	       strcmp(name, DEDUP_INDEX_NAME) == 0 ||
+	       strcmp(name, JOURNAL_NAME) == 0 ||
+	       strncmp(name, REKEY_CHECKPOINT_NAME, strlen(REKEY_CHECKPOINT_NAME)) == 0;
+}
+
+// Whether directory path holds packed files
+static int packed_children(const char *path)
+{
+	fs_state *fs = FS_DATA;
+
+	return fs->pack && pack_readdir(&fs->ps, path, pack_any, NULL);
 }
 
 //-----------------------------------------------------------------------------------
 
 static int pa4_encfs_getattr(const char *path, struct stat *stbuf)
 {
+	fs_state *fs = FS_DATA;
 	int res;
 
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	//the container, dedup store and checkpoint are not part of the tree
+	if (strchr(path + 1, '/') == NULL && internal_file(path + 1))
+		return -ENOENT;
+
+	//packed files are answered from memory
+	if (packed_stat(path, stbuf) == 0)
+		return 0;
+
+	//so is whatever a directory listing just looked at; open files may have grown since
+	if (fs->attr_entries && attr_cache_get(&fs->ac, path, stbuf) == 0) {
+		off_t size;
+		if (S_ISREG(stbuf->st_mode) && open_file_size(fs, stbuf, &size) && size >= 0)
+			stbuf->st_size = size;
+		return 0;
+	}
+
 	//lstat: get file status
 	res = lstat(fullPath, stbuf);
 	if (res == -1)
 		return -errno;
 
+	//report the plaintext size, not the size of the ciphertext
+	if (S_ISREG(stbuf->st_mode) && stbuf->st_size >= ENCFS_HEADER_SIZE) {
+		off_t size = block_file_size(fs, stbuf, fullPath, -1, NULL);
+		if (size >= 0)
+			stbuf->st_size = size;
+	}
+
 	return 0;
 }
 
 static int pa4_encfs_access(const char *path, int mask)
 {
+	struct stat st;
 	int res;
 
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	if (packed_stat(path, &st) == 0)
+		return caller_access(&st, mask);
+
 	//access: check user's permissions for file
 	res = access(fullPath, mask);
 	if (res == -1)
@@ -115,33 +1194,159 @@ static int pa4_encfs_readlink(const char *path, char *buf, size_t size)
 }
 
 
-static int pa4_encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+// Directory entries whose names are decrypted together
+typedef struct {
+	int n;
+	const char *names[NAME_BATCH];
+	char enc[NAME_BATCH][NAME_MAX + 1];
+	char plain[NAME_BATCH][NAME_MAX + 1];
+	int lens[NAME_BATCH];
+	ino_t ino[NAME_BATCH];
+	unsigned char type[NAME_BATCH];
+	off_t next[NAME_BATCH];
+} name_batch;
+
+// One readdir() call's way through the directory
+typedef struct {
+	fs_state *fs;
+	const char *path;
+	void *buf;
+	fuse_fill_dir_t filler;
+	int offsets;               //resumable: each entry carries the offset after it
+	name_batch *batch;         //names mode
+} list_state;
+
+// Full attributes of an entry, as getattr() would report them, left in the
+// attribute cache for the getattr() that usually follows
+static void attr_prefetch(fs_state *fs, int dirfd, const char *name, const char *path,
+			  struct stat *stbuf)
 {
-	DIR *dp;
-	struct dirent *de;
+	uint64_t token = attr_cache_token(&fs->ac, path);
+	struct stat st;
+	off_t size;
+
+	if (dir_stat(dirfd, name, &st))
+		return;
+	if (S_ISREG(st.st_mode) && st.st_size >= ENCFS_HEADER_SIZE) {
+		size = block_file_size(fs, &st, NULL, dirfd, name);
+		if (size >= 0)
+			st.st_size = size;
+	}
+	attr_cache_put(&fs->ac, path, &st, token);
+	*stbuf = st;
+}
 
-	(void) offset;
-	(void) fi;
+// Hand one entry to FUSE; name is the backing name, plain the one shown
+static int list_entry(list_state *ls, int dirfd, const char *name, const char *plain,
+		      ino_t ino, unsigned char type, off_t next)
+{
+	char childPath[PATH_MAX];
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = type << 12;
+	if (ls->fs->attr_entries && strcmp(plain, ".") && strcmp(plain, "..") &&
+	    snprintf(childPath, sizeof(childPath), "%s/%s",
+		     strcmp(ls->path, "/") ? ls->path : "", plain) < (int) sizeof(childPath))
+		attr_prefetch(ls->fs, dirfd, name, childPath, &st);
+	return ls->filler(ls->buf, plain, &st, ls->offsets ? next : 0);
+}
 
-	char fullPath[PATH_MAX]; 
+static int name_batch_fill(list_state *ls, int dirfd)
+{
+	name_batch *b = ls->batch;
+	int i, full = 0;
+
+	name_decrypt_batch(&ls->fs->nc, b->names, b->n, b->plain, b->lens);
+	for (i = 0; i < b->n && !full; i++) {
+		//names that don't decrypt aren't ours (temporary files and such)
+		if (b->lens[i] < 0)
+			continue;
+		full = list_entry(ls, dirfd, b->enc[i], b->plain[i], b->ino[i], b->type[i],
+				  b->next[i]);
+	}
+	b->n = 0;
+	return full;
+}
+
+static int list_fill(void *arg, int dirfd, const char *name, ino_t ino,
+		     unsigned char type, off_t next)
+{
+	list_state *ls = arg;
+	name_batch *b = ls->batch;
+
+	if (strcmp(ls->path, "/") == 0 && internal_file(name))
+		return 0;
+	//encrypted names are queued up and decrypted a batch at a time
+	if (b != NULL) {
+		strcpy(b->enc[b->n], name);
+		b->names[b->n] = b->enc[b->n];
+		b->ino[b->n] = ino;
+		b->type[b->n] = type;
+		b->next[b->n] = next;
+		return ++b->n == NAME_BATCH ? name_batch_fill(ls, dirfd) : 0;
+	}
+	return list_entry(ls, dirfd, name, name, ino, type, next);
+}
+
+// The directory stays open from opendir() to releasedir() so that a big one
+// can be listed a buffer at a time, picking up at the offset FUSE hands back
+static int pa4_encfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+
+	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
-	//opendir: open a directory
-	dp = opendir(fullPath);
-	if (dp == NULL)
-		return -errno;
+	fd = dir_open(fullPath);
+	if (fd < 0)
+		return fd;
+	fi->fh = fd;
+	return 0;
+}
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
+static int pa4_encfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	fs_state *fs = FS_DATA;
+	name_batch batch;
+	list_state ls = { fs, path, buf, filler, 1, NULL };
+	void *dents;
+	int res;
+
+	//container records have no directory offset: list such directories in one go
+	if (fs->pack && packed_children(path))
+		ls.offsets = 0;
+	if (fs->names) {
+		batch.n = 0;
+		ls.batch = &batch;
 	}
 
-	closedir(dp);
+	//getdents64 a pool buffer at a time
+	dents = bufpool_get(&fs->pool);
+	if (dents == NULL)
+		return -ENOMEM;
+	res = dir_scan(fi->fh, offset, dents, ENCFS_MAX_BLOCK_SIZE, list_fill, &ls);
+	if (res == 0 && ls.batch != NULL && batch.n)
+		res = name_batch_fill(&ls, fi->fh);
+	bufpool_put(&fs->pool, dents);
+	if (res < 0)
+		return res;
+
+	//then the files packed into the container under this directory
+	if (res == 0 && !ls.offsets) {
+		fill_state f = { buf, filler };
+		pack_readdir(&fs->ps, path, pack_fill, &f);
+	}
+	return 0;
+}
+
+static int pa4_encfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	close(fi->fh);
 	return 0;
 }
 
@@ -152,6 +1357,20 @@ static int pa4_encfs_mknod(const char *path, mode_t mode, dev_t rdev)
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	//in pack mode new regular files go to the container
+	if (S_ISREG(mode) && FS_DATA->pack) {
+		struct fuse_context *ctx = fuse_get_context();
+		struct stat st;
+		pack_entry *pe;
+
+		if (lstat(fullPath, &st) == 0)
+			return -EEXIST;
+		res = pack_create(&FS_DATA->ps, path, mode, ctx->uid, ctx->gid, 1, &pe);
+		if (res == 0)
+			pack_release(&FS_DATA->ps, pe);
+		return res;
+	}
+
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
@@ -165,6 +1384,7 @@ static int pa4_encfs_mknod(const char *path, mode_t mode, dev_t rdev)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 1);
 	return 0;
 }
 
@@ -180,21 +1400,43 @@ static int pa4_encfs_mkdir(const char *path, mode_t mode)
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 1);
 	return 0;
 }
 
 static int pa4_encfs_unlink(const char *path)
 {
-	int res;
+	struct stat st;
+	int fd, res;
 
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	if (FS_DATA->pack) {
+		res = pack_unlink(&FS_DATA->ps, path);
+		if (res == 0)
+			attr_forget(FS_DATA, path, 1);
+		if (res != -ENOENT)
+			return res;
+	}
+	if (lstat(fullPath, &st) == -1)
+		st.st_nlink = 0;
+
 	//unlink: remove the specified file.
+	fd = dedup_hold(FS_DATA, fullPath);
 	res = unlink(fullPath);
-	if (res == -1)
-		return -errno;
+	if (res == -1) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		return res;
+	}
+	dedup_drop(FS_DATA, fd);
 
+	attr_forget(FS_DATA, path, 1);
+	//other names of the inode lose a link too
+	if (st.st_nlink > 1)
+		attr_forget_ino(FS_DATA, &st);
 	return 0;
 }
 
@@ -205,11 +1447,16 @@ static int pa4_encfs_rmdir(const char *path)
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	//the backing directory may look empty while files are packed under it
+	if (packed_children(path))
+		return -ENOTEMPTY;
+
 	//rmdir: remove a directory
 	res = rmdir(fullPath);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 1);
 	return 0;
 }
 
@@ -217,34 +1464,107 @@ static int pa4_encfs_symlink(const char *from, const char *to)
 {
 	int res;
 
+	char fullTo[PATH_MAX];
+	fullpath(fullTo, to);
+
 	//symlink: create a symbolic link named "to" which has the string "from"
-	res = symlink(from, to);
+	//(the target is stored as given; it is resolved through the mount)
+	res = symlink(from, fullTo);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, to, 1);
 	return 0;
 }
 
 static int pa4_encfs_rename(const char *from, const char *to)
 {
-	int res;
+	fs_state *fs = FS_DATA;
+	struct stat st, stFrom, stTo;
+	int fd, res;
+
+	char fullFrom[PATH_MAX];
+	char fullTo[PATH_MAX];
+	fullpath(fullFrom, from);
+	fullpath(fullTo, to);
+
+	//what the names were, for the attribute cache
+	if (lstat(fullFrom, &stFrom) == -1)
+		memset(&stFrom, 0, sizeof(stFrom));
+	if (lstat(fullTo, &stTo) == -1)
+		memset(&stTo, 0, sizeof(stTo));
+
+	if (fs->pack) {
+		//a directory can't be replaced by a file, or while files are packed under it
+		if (lstat(fullTo, &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (packed_children(to))
+				return -ENOTEMPTY;
+			if (pack_stat(&fs->ps, from, &st) == 0)
+				return -EISDIR;
+		}
+		res = pack_rename(&fs->ps, from, to);
+		if (res != -ENOENT) {
+			//a real file at the target is replaced
+			if (res == 0) {
+				fd = dedup_hold(fs, fullTo);
+				if (unlink(fullTo) == -1 && errno != ENOENT) {
+					res = -errno;
+					if (fd != -1)
+						close(fd);
+					return res;
+				}
+				dedup_drop(fs, fd);
+			}
+			attr_rename(fs, from, to, &stFrom, &stTo);
+			return res;
+		}
+	}
 
 	//rename: rename file
-	res = rename(from, to);
-	if (res == -1)
-		return -errno;
+	fd = dedup_hold(fs, fullTo);
+	res = rename(fullFrom, fullTo);
+	if (res == -1) {
+		res = -errno;
+		if (fd != -1)
+			close(fd);
+		return res;
+	}
+	dedup_drop(fs, fd);
+
+	attr_rename(fs, from, to, &stFrom, &stTo);
+
+	if (fs->pack) {
+		//a packed file at the target is replaced; directories take theirs along
+		pack_unlink(&fs->ps, to);
+		if (lstat(fullTo, &st) == 0 && S_ISDIR(st.st_mode))
+			return pack_rename_dir(&fs->ps, from, to);
+	}
 
 	return 0;
 }
 
 static int pa4_encfs_link(const char *from, const char *to)
 {
+	struct stat st;
 	int res;
 
-	res = link(from, to);
+	char fullFrom[PATH_MAX];
+	char fullTo[PATH_MAX];
+	fullpath(fullFrom, from);
+	fullpath(fullTo, to);
+
+	//packed files have no inode to share
+	if (packed_stat(from, &st) == 0)
+		return -EPERM;
+
+	res = link(fullFrom, fullTo);
 	if (res == -1)
 		return -errno;
 
+	//every name of the inode has one more link now
+	attr_forget(FS_DATA, to, 1);
+	if (lstat(fullTo, &st) == 0)
+		attr_forget_ino(FS_DATA, &st);
 	return 0;
 }
 
@@ -255,11 +1575,18 @@ static int pa4_encfs_chmod(const char *path, mode_t mode)
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	if (FS_DATA->pack) {
+		res = pack_setattr(&FS_DATA->ps, path, mode, -1, -1, NULL);
+		if (res != -ENOENT)
+			return res;
+	}
+
 	//chmod: change permissions on a file
 	res = chmod(fullPath, mode);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 0);
 	return 0;
 }
 
@@ -270,27 +1597,85 @@ static int pa4_encfs_chown(const char *path, uid_t uid, gid_t gid)
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
+	if (FS_DATA->pack) {
+		res = pack_setattr(&FS_DATA->ps, path, -1, uid, gid, NULL);
+		if (res != -ENOENT)
+			return res;
+	}
+
 	//lchown: change the owner and group of a file
 	res = lchown(fullPath, uid, gid);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 0);
 	return 0;
 }
 
+static int node_truncate(encfs_node *node, const char *path, const char *fullPath,
+			 off_t size)
+{
+	int res = 0;
+
+	//staged writes were issued before the truncate: apply them first
+	if (FS_DATA->write_behind) {
+		res = wb_drain(&node->wb);
+		if (res)
+			return res;
+	}
+
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->format == FMT_PACK) {
+		//stays packed if it still fits
+		if (size <= PACK_LIMIT(FS_DATA)) {
+			res = node_pack_resize(node, size);
+			if (res == 0)
+				res = node_pack_commit(node);
+			pthread_rwlock_unlock(&node->lock);
+			return res;
+		}
+		res = node_spill(node, path, fullPath);
+	}
+	if (res == 0)
+		res = node_convert(FS_DATA, node, fullPath);
+	if (res == 0)
+		res = encfs_truncate(&node->ef, size);
+	if (res == 0)
+		res = node_shadow_truncate(node, size);
+	pthread_rwlock_unlock(&node->lock);
+
+	attr_forget(FS_DATA, path, 0);
+	return res;
+}
+
 static int pa4_encfs_truncate(const char *path, off_t size)
 {
+	encfs_node *node;
 	int res;
 
 	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
-	//truncate: shrink or extend the size of a file
-	res = truncate(fullPath, size);
-	if (res == -1)
-		return -errno;
+	//truncate: shrink or extend the size of a file (through its header)
+	res = node_get_path(path, fullPath, &node);
+	if (res)
+		return res;
 
-	return 0;
+	res = node_truncate(node, path, fullPath, size);
+	node_put(FS_DATA, node);
+
+	return res;
+}
+
+static int pa4_encfs_ftruncate(const char *path, off_t size,
+			 struct fuse_file_info *fi)
+{
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
+
+	char fullPath[PATH_MAX]; 
+	fullpath(fullPath, path);
+
+	return node_truncate(h->node, path, fullPath, size);
 }
 
 static int pa4_encfs_utimens(const char *path, const struct timespec ts[2])
@@ -306,137 +1691,244 @@ static int pa4_encfs_utimens(const char *path, const struct timespec ts[2])
 	tv[1].tv_sec = ts[1].tv_sec;
 	tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
+	if (FS_DATA->pack) {
+		res = pack_setattr(&FS_DATA->ps, path, -1, -1, -1, &ts[1]);
+		if (res != -ENOENT)
+			return res;
+	}
+
 	//utimes: change file last access and modification times
 	res = utimes(fullPath, tv);
 	if (res == -1)
 		return -errno;
 
+	attr_forget(FS_DATA, path, 0);
 	return 0;
 }
 
-static int pa4_encfs_open(const char *path, struct fuse_file_info *fi)
+// Whether path is streamed: -o stream, or a match of one of the
+// colon-separated -o stream_match patterns (fnmatch(), on the mount path)
+static int stream_path(fs_state *fs, const char *path)
 {
-	int res;
-
-	char fullPath[PATH_MAX]; 
-	fullpath(fullPath, path);
-
-	//open: open a file
-	res = open(fullPath, fi->flags);
-	if (res == -1)
-		return -errno;
-
-	close(res);
+	char pat[PATH_MAX];
+	const char *p, *end;
 
+	if (fs->stream)
+		return 1;
+	for (p = fs->stream_match; p != NULL && *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		if (end - p >= (long) sizeof(pat))
+			continue;
+		memcpy(pat, p, end - p);
+		pat[end - p] = '\0';
+		if (fnmatch(pat, path, 0) == 0)
+			return 1;
+	}
 	return 0;
 }
 
-static int pa4_encfs_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+// Streamed files bypass both page caches: FUSE direct_io keeps the kernel
+// from caching plaintext, and block reads use O_DIRECT on the backing file
+static void stream_open(fs_state *fs, encfs_node *node, const char *path,
+			struct fuse_file_info *fi)
 {
-	int res;
+	if (!stream_path(fs, path))
+		return;
+	fi->direct_io = 1;
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->format == FMT_BLOCK && node->ef.dfd == -1)
+		encfs_set_direct(&node->ef, 1);   //no O_DIRECT: plain reads it is
+	pthread_rwlock_unlock(&node->lock);
+}
 
-	//set up file and mirrored file
-	FILE* file;
-	FILE* mirrorFile;
+// Mapped files are read a page at a time, and a legacy (whole-file CBC)
+// file is decrypted from its start for every read: in mmap mode it moves
+// to the block format when opened (and stays as it is if it can't)
+static void mmap_open(fs_state *fs, encfs_node *node, const char *path,
+		      const char *fullPath)
+{
+	if (!fs->mmap || node->format != FMT_LEGACY)
+		return;
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->format == FMT_LEGACY && node_convert(fs, node, fullPath) == 0)
+		attr_forget(fs, path, 0);
+	pthread_rwlock_unlock(&node->lock);
+}
 
-	//buffer the value and length to be written into for mirroring 
-	char xval[5];
-	(void) fi;
-	char* val;
-	size_t valLength;
+static int pa4_encfs_open(const char *path, struct fuse_file_info *fi)
+{
+	static const int modes[] = { R_OK, W_OK, R_OK | W_OK, R_OK | W_OK };
+	encfs_handle *h;
+	pack_entry *pe;
+	struct stat st;
+	int fd, res;
 
-	char fullPath[PATH_MAX];
+	char fullPath[PATH_MAX]; 
 	fullpath(fullPath, path);
 
-	//fopen: open file with read permissions
-	file = fopen(fullPath, "r"); 
-	if (file == NULL) {
-		return -errno;
+	//packed files: no backing file to open
+	if (packed_stat(path, &st) == 0) {
+		res = caller_access(&st, modes[fi->flags & O_ACCMODE]);
+		if (res)
+			return res;
+		pe = pack_lookup(&FS_DATA->ps, path);
+		if (pe == NULL)
+			return -ENOENT;
+		h = malloc(sizeof(*h));
+		if (h == NULL) {
+			pack_release(&FS_DATA->ps, pe);
+			return -ENOMEM;
+		}
+		res = node_get_pack(pe, &h->node);
+		if (res) {
+			free(h);
+			return res;
+		}
+		h->flags = fi->flags;
+		fi->fh = (uintptr_t) h;
+		stream_open(FS_DATA, h->node, path, fi);
+		return 0;
 	}
 
-	//set file buffer and length for mirror file directory
-	mirrorFile = open_memstream(&val, &valLength);
-	if(mirrorFile == NULL) {
+	//check the caller's access mode, then share one node per inode
+	fd = open(fullPath, fi->flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+	if (fd == -1)
 		return -errno;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		close(fd);
+		return -ENOMEM;
 	}
 
-	if(getxattr(fullPath, "user.encrypted", xval, 5) != -1) {	
-		do_crypt(file, mirrorFile, 0, FS_DATA -> key); //if encrypted decrypt and copy 
+	//the node needs read access even for O_WRONLY (partial block updates)
+	if ((fi->flags & O_ACCMODE) == O_RDWR) {
+		res = node_get_fd(FS_DATA, fd, 1, &h->node);
 	} else {
-		do_crypt(file, mirrorFile, -1, FS_DATA -> key); //if not encrypted pass through case and copies
+		close(fd);
+		res = node_get(fullPath, &h->node);
 	}
-
-	fflush(mirrorFile); //wait for the output file
-	fseek(mirrorFile, offset, SEEK_SET); //determine load location in the mirror
- 
-	res = fread(buf, 1, size, mirrorFile);
-	if (res == -1) {
-		res = -errno;
+	if (res) {
+		free(h);
+		return res;
 	}
+	h->flags = fi->flags;
+	fi->fh = (uintptr_t) h;
+	mmap_open(FS_DATA, h->node, path, fullPath);
+	stream_open(FS_DATA, h->node, path, fi);
 
-	fclose(file);
-	fclose(mirrorFile);
-
-	return res;
+	return 0;
 }
 
-static int pa4_encfs_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+// Read plaintext from a node of any format. Called with node->lock held.
+static int node_read(fs_state *fs, encfs_node *node, char *buf, size_t size, off_t offset)
 {
+	range_state r;
 	int res;
 
-	//set up file and mirrored file
-	FILE* file;
-	FILE* mirrorFile;
-
-	//buffer the value and length to be written into for mirroring
-	char xval[5]; //for xtended attribute "encrypted"
-	char* val;
-	size_t valLength;
-
-	char fullPath[PATH_MAX];
-	fullpath(fullPath, path);
-
-	(void) fi;
-
-	file = fopen(fullPath, "r"); 
-	if (file == NULL) {
-		return -errno;
-	}
-	
-	//set file buffer and length for mirror file directory
-	mirrorFile = open_memstream(&val, &valLength);
-	if (mirrorFile == NULL) {
-		return -errno;
-	}
-
-	if (getxattr(fullPath, "user.encrypted", xval, 5) != -1) {
-		do_crypt(file, mirrorFile, 0, FS_DATA -> key);
+	switch (node->format) {
+	case FMT_BLOCK:
+		//decrypt only the blocks covering the request
+		if (fs->write_behind)
+			res = wb_pread(&node->wb, buf, size, offset);
+		else
+			res = encfs_pread(&node->ef, buf, size, offset);
+		break;
+	case FMT_PACK:
+		//edited copy if there is one, else straight from the container
+		if (node->pbuf != NULL) {
+			res = 0;
+			if (offset < (off_t) node->plen) {
+				res = size < node->plen - offset ? size : node->plen - offset;
+				memcpy(buf, node->pbuf + offset, res);
+			}
+		} else
+			res = pack_read(&fs->ps, node->pe, buf, size, offset);
+		break;
+	case FMT_LEGACY:
+		//whole-file CBC: stream-decrypt up to the end of the request
+		memset(&r, 0, sizeof(r));
+		r.buf = buf;
+		r.size = size;
+		r.offset = offset;
+		if (do_crypt_fd(node->fd, 0, LEGACY_KEY(fs), range_sink, &r))
+			res = r.copied;
+		else
+			res = -EIO;
+		break;
+	default:
+		//not encrypted: pass through
+		res = pread(node->fd, buf, size, offset);
+		if (res == -1)
+			res = -errno;
+		break;
 	}
+	return res;
+}
 
-	fseek(mirrorFile, offset, SEEK_SET);
-	
-	res = fwrite(buf, 1, size, mirrorFile);
-	if (res == -1) {
-		res = -errno;
-	}
-	
-	fflush(mirrorFile);
+static int pa4_encfs_read(const char *path, char *buf, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
+{
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
+	encfs_node *node = h->node;
+	int res;
 
-	fclose(file);
-	file = fopen(fullPath, "w");
+	(void) path;
 
-	fseek(mirrorFile, 0, SEEK_SET);
+	pthread_rwlock_rdlock(&node->lock);
+	res = node_read(FS_DATA, node, buf, size, offset);
+	pthread_rwlock_unlock(&node->lock);
 
-	//write to file (writing always encrypts)
-	do_crypt(mirrorFile, file, 1, FS_DATA -> key);
+	return res;
+}
 
-	setxattr(fullPath, "user.encrypted", "true", 4, 0);
+static int pa4_encfs_write(const char *path, const char *buf, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	fs_state *fs = FS_DATA;
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
+	encfs_node *node = h->node;
+	int res = 0;
 
-	fclose(file);
-	fclose(mirrorFile);
+	char fullPath[PATH_MAX];
+	fullpath(fullPath, path);
 
+	pthread_rwlock_wrlock(&node->lock);
+	//small files stay packed and are edited in memory until flushed
+	if (node->format == FMT_PACK) {
+		if (offset + (off_t) size <= PACK_LIMIT(fs)) {
+			res = node_pack_load(node);
+			if (res == 0 && offset + size > node->plen)
+				res = node_pack_resize(node, offset + size);
+			if (res == 0) {
+				memcpy(node->pbuf + offset, buf, size);
+				node->pdirty = 1;
+				res = size;
+			}
+			pthread_rwlock_unlock(&node->lock);
+			return res;
+		}
+		res = node_spill(node, path, fullPath);
+	}
+	//writing always encrypts: move old files to the block format first
+	if (res == 0)
+		res = node_convert(fs, node, fullPath);
+	//log-style writers: the next append needn't read back the last block
+	if (res == 0 && node->ef.tail == NULL)
+		encfs_set_append(&node->ef, 1);
+	if (res == 0)
+		res = node_shadow_write(node, buf, size, offset);
+	if (res == 0 && !fs->write_behind)
+		res = encfs_pwrite(&node->ef, buf, size, offset);
+	pthread_rwlock_unlock(&node->lock);
+
+	//write-behind: stage the data and let a worker encrypt it
+	if (res == 0 && fs->write_behind)
+		res = wb_write(&fs->wb, &node->wb, buf, size, offset);
+
+	attr_forget(fs, path, 0);
 	return res;
 }
 
@@ -456,77 +1948,370 @@ static int pa4_encfs_statfs(const char *path, struct statvfs *stbuf)
 }
 
 static int pa4_encfs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-	(void) fi;
-	(void) mode;
+	fs_state *fs = FS_DATA;
+	encfs_handle *h;
+	encfs_file ef;
+	struct stat st;
+	int fd, res;
 
 	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
-	int res;
-	
-	FILE* file;
-	FILE* mirrorFile; 
-
-	char* val;
-	size_t valLength;
+	//pack mode: a new file is just a record in the container
+	if (fs->pack && lstat(fullPath, &st) == -1 && errno == ENOENT) {
+		struct fuse_context *ctx = fuse_get_context();
+		pack_entry *pe;
+
+		res = pack_create(&fs->ps, path, mode, ctx->uid, ctx->gid,
+				  fi->flags & O_EXCL, &pe);
+		if (res)
+			return res;
+		h = malloc(sizeof(*h));
+		if (h == NULL) {
+			pack_release(&fs->ps, pe);
+			return -ENOMEM;
+		}
+		res = node_get_pack(pe, &h->node);
+		if (res) {
+			free(h);
+			return res;
+		}
+		h->flags = fi->flags;
+		fi->fh = (uintptr_t) h;
+		stream_open(fs, h->node, path, fi);
+		return 0;
+	}
 
-	file = fopen(fullPath, "w");
-	if(file == NULL)
-		return -errno;
-	
-	mirrorFile = open_memstream(&val, &valLength);
-	if(mirrorFile == NULL) {
+	fd = open(fullPath, O_CREAT | O_RDWR | (fi->flags & O_EXCL), mode);
+	if (fd == -1)
 		return -errno;
+
+	//lay down an empty block-format file, unless we lost a creation race
+	res = fstat(fd, &st) == -1 ? -errno : 0;
+	if (res == 0 && st.st_size == 0) {
+		res = encfs_create(&ef, fd, fs->block_key, &fs->pool, BLOCK_SIZE(fs));
+		if (res == 0 && fsetxattr(fd, "user.encrypted", "true", 4, 0) == -1)
+			res = -errno;
 	}
-	
-	do_crypt(mirrorFile, file, 1, FS_DATA -> key);
-	
-	res = setxattr(fullPath, "user.encrypted", "true", 4, 0);
-	if(res) {
-		return -errno;
+	if (res) {
+		close(fd);
+		return res;
 	}
 
-	fclose(file); 
-	fclose(mirrorFile);
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	res = node_get_fd(fs, fd, 1, &h->node);
+	if (res) {
+		free(h);
+		return res;
+	}
+	h->flags = fi->flags;
+	fi->fh = (uintptr_t) h;
+	stream_open(fs, h->node, path, fi);
 
+	attr_forget(fs, path, 1);
 	return 0;
 }
 
 
+// Write back a packed file's in-memory edits
+static int pack_flush(encfs_node *node)
+{
+	int res = 0;
+
+	//the format only ever moves away from FMT_PACK, so peeking is safe
+	if (node->format != FMT_PACK)
+		return 0;
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->format == FMT_PACK)
+		res = node_pack_commit(node);
+	pthread_rwlock_unlock(&node->lock);
+	return res;
+}
+
+static int pa4_encfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
+	int res = 0;
+
+	(void) path;
+
+	//report write-behind errors at close()
+	if (FS_DATA->write_behind)
+		res = wb_drain(&h->node->wb);
+	if (res == 0)
+		res = pack_flush(h->node);
+	return res;
+}
+
 static int pa4_encfs_release(const char *path, struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
 
 	(void) path;
-	(void) fi;
+
+	if (FS_DATA->write_behind)
+		wb_drain(&h->node->wb);
+	node_put(FS_DATA, h->node);
+	free(h);
 	return 0;
 }
 
+// Group commit callback: the shared stores a batch of fsync()s touched
+static int sync_stores(void *arg, int stores)
+{
+	fs_state *fs = arg;
+	int res = 0;
+
+	if (stores & SYNC_DEDUP)
+		res = dedup_sync(&fs->ds);
+	if (res == 0 && (stores & SYNC_PACK))
+		res = pack_sync(&fs->ps);
+	if (res == 0 && (stores & SYNC_JOURNAL))
+		res = journal_sync(&fs->jr);
+	return res;
+}
+
 static int pa4_encfs_fsync(const char *path, int isdatasync,
 		     struct fuse_file_info *fi)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	fs_state *fs = FS_DATA;
+	encfs_handle *h = (encfs_handle *) (uintptr_t) fi->fh;
+	encfs_node *node = h->node;
+	int res = 0, fd = -1, stores = 0;
 
 	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+
+	//nothing staged may be left behind
+	if (fs->write_behind)
+		res = wb_drain(&node->wb);
+	if (res == 0)
+		res = pack_flush(node);
+	if (res)
+		return res;
+
+	//a copy of the descriptor: re-keying may swap the node's file meanwhile
+	pthread_rwlock_rdlock(&node->lock);
+	if (node->format == FMT_PACK)
+		stores = SYNC_PACK;
+	else if ((fd = dup(node->fd)) == -1)
+		res = -errno;
+	if (node->format == FMT_BLOCK && fs->dedup)
+		stores = SYNC_DEDUP;
+	//blocks not in place yet are in the journal
+	if (node->format == FMT_BLOCK && node->ef.redo != NULL)
+		stores |= SYNC_JOURNAL;
+	pthread_rwlock_unlock(&node->lock);
+	if (res)
+		return res;
+
+	//then commit together with whatever other fsync()s arrive meanwhile
+	res = sync_group_commit(&fs->sg, node, fd, isdatasync, stores);
+	if (fd != -1)
+		close(fd);
+	return res;
 }
 
 #ifdef HAVE_SETXATTR
+// Server-side copy. FUSE 2 has no copy_file_range(), and FICLONE never
+// reaches a FUSE filesystem, so a copy within the mount is asked for by
+// setting this attribute on the destination to the source's path in the
+// mount; cp and copy_file_range() know nothing of it and still copy through
+// the caller. The contents are replaced without the data going out to the
+// caller and back; under the same key sealed blocks move as they are.
+#define COPY_XATTR "user.pa4-encfs.copy-from"
+
+typedef struct copy_state {
+	encfs_node *dst;
+	off_t pos;
+	int res;
+} copy_state;
+
+// Seal whatever comes out of the source at the end of the destination
+static int copy_sink(void *arg, const unsigned char *data, int len)
+{
+	copy_state *c = arg;
+
+	if (encfs_pwrite(&c->dst->ef, (const char *) data, len, c->pos) != len ||
+	    node_shadow_write(c->dst, (const char *) data, len, c->pos)) {
+		c->res = -EIO;
+		return -1;
+	}
+	c->pos += len;
+	return 0;
+}
+
+// Copy a source that isn't in the block format (or into a destination being
+// re-keyed) by decrypting it and sealing it again, a pool buffer at a time.
+// Called with both nodes locked.
+static int node_copy_read(fs_state *fs, encfs_node *dst, encfs_node *src)
+{
+	copy_state c;
+	char *blk;
+	int n;
+
+	memset(&c, 0, sizeof(c));
+	c.dst = dst;
+	c.res = encfs_truncate(&dst->ef, 0);
+	if (c.res == 0)
+		c.res = node_shadow_truncate(dst, 0);
+	if (c.res)
+		return c.res;
+
+	//whole-file CBC: one pass over the stream, not one per buffer
+	if (src->format == FMT_LEGACY) {
+		if (!do_crypt_fd(src->fd, 0, LEGACY_KEY(fs), copy_sink, &c) && c.res == 0)
+			c.res = -EIO;
+		return c.res;
+	}
+	blk = bufpool_get(&fs->pool);
+	if (blk == NULL)
+		return -ENOMEM;
+	while ((n = node_read(fs, src, blk, fs->pool.block_size, c.pos)) > 0)
+		if (copy_sink(&c, (unsigned char *) blk, n))
+			break;
+	bufpool_put(&fs->pool, blk);
+	return n < 0 ? n : c.res;
+}
+
+static int node_copy(fs_state *fs, encfs_node *dst, encfs_node *src, const char *path,
+		     const char *fullPath)
+{
+	int res = 0;
+
+	if (dst == src)
+		return 0;
+	//staged writes to either file were issued before the copy
+	if (fs->write_behind) {
+		res = wb_drain(&src->wb);
+		if (res == 0)
+			res = wb_drain(&dst->wb);
+		if (res)
+			return res;
+	}
+
+	//two copies in opposite directions: take the locks in one order
+	if (dst < src) {
+		pthread_rwlock_wrlock(&dst->lock);
+		pthread_rwlock_rdlock(&src->lock);
+	} else {
+		pthread_rwlock_rdlock(&src->lock);
+		pthread_rwlock_wrlock(&dst->lock);
+	}
+	if (dst->format == FMT_PACK)
+		res = node_spill(dst, path, fullPath);
+	if (res == 0)
+		res = node_convert(fs, dst, fullPath);
+	if (res == 0 && src->format == FMT_BLOCK && dst->shadow == NULL)
+		res = encfs_copy(&dst->ef, &src->ef);
+	else if (res == 0)
+		res = node_copy_read(fs, dst, src);
+	pthread_rwlock_unlock(&dst->lock);
+	pthread_rwlock_unlock(&src->lock);
+
+	attr_forget(fs, path, 0);
+	return res;
+}
+
+// The source comes from an attribute value, not from the kernel, so it gets
+// the checks a lookup would have made: plain names only (".." would survive
+// name encryption and climb out of the mirror), a real directory at every
+// step that the caller may search, and a regular file the caller may read.
+static int copy_source(const char *value, size_t size, char srcPath[PATH_MAX])
+{
+	char prefix[PATH_MAX];
+	char full[PATH_MAX];
+	struct stat st;
+	const char *p, *end;
+	size_t len;
+
+	if (size == 0 || size >= PATH_MAX || value[0] != '/' || memchr(value, '\0', size))
+		return -EINVAL;
+	memcpy(srcPath, value, size);
+	srcPath[size] = '\0';
+
+	for (p = srcPath; *p; p = end) {
+		end = strchr(p + 1, '/');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = end - p - 1;
+		if (len == 0 || (p[1] == '.' && (len == 1 || (len == 2 && p[2] == '.'))))
+			return -EINVAL;
+		if (p == srcPath && *end == '\0' && internal_file(p + 1))
+			return -ENOENT;
+
+		memcpy(prefix, srcPath, end - srcPath);
+		prefix[end - srcPath] = '\0';
+		if (packed_stat(prefix, &st) == 0)
+			return *end == '/' ? -ENOTDIR : caller_access(&st, R_OK);
+		fullpath(full, prefix);
+		if (lstat(full, &st) == -1)
+			return -errno;
+		if (*end == '/' && !S_ISDIR(st.st_mode))
+			return -ENOTDIR;
+		if (*end == '\0' && !S_ISREG(st.st_mode))
+			return -EINVAL;
+		if (caller_access(&st, *end == '/' ? X_OK : R_OK))
+			return -EACCES;
+	}
+	return 0;
+}
+
+static int pa4_encfs_copy(const char *path, const char *fullPath, const char *value,
+			  size_t size)
+{
+	char srcPath[PATH_MAX];
+	char srcFull[PATH_MAX];
+	encfs_node *dst, *src;
+	struct stat st;
+	int res;
+
+	//the kernel looked the destination up but left its permissions to us
+	if (packed_stat(path, &st) && lstat(fullPath, &st) == -1)
+		return -errno;
+	res = caller_access(&st, W_OK);
+	if (res == 0)
+		res = copy_source(value, size, srcPath);
+	if (res)
+		return res;
+	fullpath(srcFull, srcPath);
+
+	res = node_get_path(srcPath, srcFull, &src);
+	if (res)
+		return res;
+	res = node_get_path(path, fullPath, &dst);
+	if (res == 0) {
+		res = node_copy(FS_DATA, dst, src, path, fullPath);
+		node_put(FS_DATA, dst);
+	}
+	node_put(FS_DATA, src);
+	return res;
+}
+
 static int pa4_encfs_setxattr(const char *path, const char *name, const char *value,
 			size_t size, int flags)
 {
 	int res;
 
+	struct stat st;
+
 	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
+	if (strcmp(name, COPY_XATTR) == 0)
+		return pa4_encfs_copy(path, fullPath, value, size);
+
+	//packed files carry no attributes of their own
+	if (packed_stat(path, &st) == 0)
+		return -ENOTSUP;
+
 	res = lsetxattr(fullPath, name, value, size, flags);
 	if (res == -1)
 		return -errno;
+	attr_forget(FS_DATA, path, 0);
 	return 0;
 }
 
@@ -535,9 +2320,23 @@ static int pa4_encfs_getxattr(const char *path, const char *name, char *value,
 {
 	int res;
 
+	struct stat st;
+
 	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
+	//packed files are always encrypted
+	if (packed_stat(path, &st) == 0) {
+		if (strcmp(name, "user.encrypted"))
+			return -ENODATA;
+		if (size == 0)
+			return 4;
+		if (size < 4)
+			return -ERANGE;
+		memcpy(value, "true", 4);
+		return 4;
+	}
+
 	res = lgetxattr(fullPath, name, value, size);
 	if (res == -1)
 		return -errno;
@@ -549,9 +2348,20 @@ static int pa4_encfs_listxattr(const char *path, char *list, size_t size)
 {
 	int res;
 
+	struct stat st;
+
 	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
+	if (packed_stat(path, &st) == 0) {
+		if (size == 0)
+			return sizeof("user.encrypted");
+		if (size < sizeof("user.encrypted"))
+			return -ERANGE;
+		memcpy(list, "user.encrypted", sizeof("user.encrypted"));
+		return sizeof("user.encrypted");
+	}
+
 	res = llistxattr(fullPath, list, size);
 	if (res == -1)
 		return -errno;
@@ -563,22 +2373,254 @@ static int pa4_encfs_removexattr(const char *path, const char *name)
 {
 	int res;
 
+	struct stat st;
+
 	char fullPath[PATH_MAX];
 	fullpath(fullPath, path);
 
+	if (packed_stat(path, &st) == 0)
+		return -ENOTSUP;
+
 	res = lremovexattr(fullPath, name);
 	if (res == -1)
 		return -errno;
+	attr_forget(FS_DATA, path, 0);
 	
 	return 0;
 }
 #endif /* HAVE_SETXATTR */
 
+// Whether dir holds nothing but our own files
+static int mirror_empty(const char *dir)
+{
+	struct dirent *de;
+	DIR *dp;
+	int empty = 1;
+
+	dp = opendir(dir);
+	if (dp == NULL)
+		return 0;
+	while (empty && (de = readdir(dp)) != NULL)
+		empty = strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+			internal_file(de->d_name);
+	closedir(dp);
+	return empty;
+}
+
+// Runs in the mounted (possibly daemonized) process: mappings, mlock and
+// threads set up before fuse_main() forks would not survive the fork
+static void *pa4_encfs_init(struct fuse_conn_info *conn)
+{
+	fs_state *fs = FS_DATA;
+	int res;
+
+	(void) conn;
+
+	//Set up the buffer pool, then derive the block key into locked pool memory
+	res = bufpool_init(&fs -> pool, ENCFS_MAX_BLOCK_SIZE, fs -> pool_max << 20,
+			   (fs -> hugepages ? BUFPOOL_HUGEPAGES : 0) |
+			   (fs -> lock_memory ? BUFPOOL_MLOCK : 0));
+	if(res) {
+		fprintf(stderr, "Failed to set up buffer pool: %s\n", strerror(-res));
+		abort();
+	}
+	fs -> block_key = bufpool_get(&fs -> pool);
+	if(fs -> block_key == NULL || !crypt_derive_key(fs -> key, fs -> block_key)) {
+		fprintf(stderr, "Failed to derive encryption key.\n");
+		abort();
+	}
+	fs -> key_id = encfs_key_id(fs -> block_key);
+	fs -> keys[0] = fs -> block_key;
+	fs -> nkeys = 1;
+
+	//Encrypted names: a mirror is all one way, so only an empty one is switched
+	{
+		char markerPath[PATH_MAX];
+		int fd;
+
+		snprintf(markerPath, sizeof(markerPath), "%s/%s", fs -> rootdir, NAME_MARKER_NAME);
+		if(access(markerPath, F_OK) == 0) {
+			fs -> names = 1;
+		}
+		else if(fs -> names) {
+			if(!mirror_empty(fs -> rootdir)) {
+				fprintf(stderr, "Encrypted names need an empty mirror directory.\n");
+				abort();
+			}
+			fd = open(markerPath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+			if(fd == -1) {
+				fprintf(stderr, "Failed to create %s: %s\n", markerPath, strerror(errno));
+				abort();
+			}
+			close(fd);
+		}
+	}
+	if(fs -> names) {
+		res = name_crypt_init(&fs -> nc, fs -> block_key, fs -> name_cache);
+		if(res) {
+			fprintf(stderr, "Failed to set up name encryption: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	//Re-keying: files under the old key stay readable until they are moved
+	if(fs -> old_key) {
+		fs -> old_block_key = bufpool_get(&fs -> pool);
+		if(fs -> old_block_key == NULL || !crypt_derive_key(fs -> old_key, fs -> old_block_key)) {
+			fprintf(stderr, "Failed to derive old encryption key.\n");
+			abort();
+		}
+		fs -> keys[fs -> nkeys++] = fs -> old_block_key;
+	}
+
+	if(fs -> attr_entries) {
+		res = attr_cache_init(&fs -> ac, fs -> attr_entries);
+		if(res) {
+			fprintf(stderr, "Failed to set up attribute cache: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	if(fs -> write_behind) {
+		res = wb_init(&fs -> wb, fs -> wb_threads, fs -> wb_max << 20,
+			      fs -> lock_memory ? BUFPOOL_MLOCK : 0);
+		if(res) {
+			fprintf(stderr, "Failed to start write-behind: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	res = sync_group_init(&fs -> sg, fs -> sync_window, fs -> sync_fs, sync_stores, fs);
+	if(res) {
+		fprintf(stderr, "Failed to set up fsync group commit: %s\n", strerror(-res));
+		abort();
+	}
+
+	//Load the dedup index; a mirror that has a store keeps using it
+	if(!fs -> dedup) {
+		char dedupPath[PATH_MAX];
+
+		snprintf(dedupPath, sizeof(dedupPath), "%s/%s", fs -> rootdir, DEDUP_INDEX_NAME);
+		fs -> dedup = access(dedupPath, F_OK) == 0;
+	}
+	if(fs -> dedup) {
+		res = dedup_open(&fs -> ds, fs -> rootdir, fs -> block_key, &fs -> pool, BLOCK_SIZE(fs), 0);
+		if(res) {
+			fprintf(stderr, "Failed to open dedup store: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	//Open the journal and replay what a crash left in it; a mirror that has
+	//one keeps using it
+	if(!fs -> journal) {
+		char journalPath[PATH_MAX];
+
+		snprintf(journalPath, sizeof(journalPath), "%s/%s", fs -> rootdir, JOURNAL_NAME);
+		fs -> journal = access(journalPath, F_OK) == 0;
+	}
+	if(fs -> journal) {
+		if(fs -> dedup) {
+			fprintf(stderr, "The journal does not support the dedup store yet.\n");
+			abort();
+		}
+		res = journal_open(&fs -> jr, fs -> rootdir, (off_t) fs -> journal_max << 20, fs -> block_key);
+		if(res == 0)
+			res = journal_replay(&fs -> jr, fs -> rootdir, fs -> keys, fs -> nkeys, &fs -> pool);
+		if(res < 0) {
+			fprintf(stderr, "Failed to open journal: %s\n", strerror(-res));
+			abort();
+		}
+		if(res > 0)
+			fprintf(stderr, "Replayed %d journal records.\n", res);
+	}
+
+	//Open the metadata index; a mirror that has one keeps using it
+	if(!fs -> meta) {
+		char metaPath[PATH_MAX];
+
+		snprintf(metaPath, sizeof(metaPath), "%s/%s", fs -> rootdir, META_INDEX_NAME);
+		fs -> meta = access(metaPath, F_OK) == 0;
+	}
+	if(fs -> meta) {
+		res = meta_open(&fs -> mi, fs -> rootdir, fs -> meta_slots);
+		if(res) {
+			fprintf(stderr, "Failed to open metadata index: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	//Load the container index; small files are served from it
+	if(fs -> pack) {
+		char packPath[PATH_MAX];
+
+		snprintf(packPath, sizeof(packPath), "%s/%s", fs -> rootdir, PACK_FILE_NAME);
+		res = pack_open(&fs -> ps, packPath, fs -> block_key, &fs -> pool, 0);
+		if(res == -EKEYREJECTED) {
+			fprintf(stderr, "Container %s is under another key: wrong key phrase?\n", packPath);
+			abort();
+		}
+		if(res) {
+			fprintf(stderr, "Failed to open container %s: %s\n", packPath, strerror(-res));
+			abort();
+		}
+		if(fs -> ps.bad)
+			fprintf(stderr, "%llu records in %s failed to authenticate and were left alone: run encfs-fsck.\n",
+				(unsigned long long) fs -> ps.bad, packPath);
+	}
+
+	//Start moving files to the new key in the background
+	if(fs -> old_key) {
+		if(fs -> pack || fs -> dedup || fs -> names) {
+			fprintf(stderr, "Re-keying does not support the container, dedup store or encrypted names yet.\n");
+			abort();
+		}
+		res = rekey_start(&fs -> rk, fs -> rootdir, (uint64_t) fs -> rekey_rate << 20,
+				  rekey_file, fs);
+		if(res) {
+			fprintf(stderr, "Failed to start re-keying: %s\n", strerror(-res));
+			abort();
+		}
+	}
+
+	return fs;
+}
+
+static void pa4_encfs_destroy(void *private_data)
+{
+	fs_state *fs = private_data;
+
+	//the walker records where it got to
+	if(fs -> old_key)
+		rekey_stop(&fs -> rk);
+	//push out whatever is still staged before unmounting
+	if(fs -> write_behind)
+		wb_shutdown(&fs -> wb);
+	//put every journaled block in place, so the next mount has nothing to replay
+	if(fs -> journal)
+		journal_close(&fs -> jr);
+	if(fs -> pack)
+		pack_close(&fs -> ps);
+	if(fs -> dedup) {
+		dedup_sync(&fs -> ds);
+		dedup_close(&fs -> ds);
+	}
+	if(fs -> names)
+		name_crypt_destroy(&fs -> nc);
+	if(fs -> attr_entries)
+		attr_cache_destroy(&fs -> ac);
+	if(fs -> meta)
+		meta_close(&fs -> mi);
+	sync_group_destroy(&fs -> sg);
+}
+
 static struct fuse_operations pa4_encfs_oper = {
 	.getattr	= pa4_encfs_getattr,
 	.access		= pa4_encfs_access,
 	.readlink	= pa4_encfs_readlink,
+	.opendir	= pa4_encfs_opendir,
 	.readdir	= pa4_encfs_readdir,
+	.releasedir	= pa4_encfs_releasedir,
 	.mknod		= pa4_encfs_mknod,
 	.mkdir		= pa4_encfs_mkdir,
 	.symlink	= pa4_encfs_symlink,
@@ -589,14 +2631,18 @@ static struct fuse_operations pa4_encfs_oper = {
 	.chmod		= pa4_encfs_chmod,
 	.chown		= pa4_encfs_chown,
 	.truncate	= pa4_encfs_truncate,
+	.ftruncate	= pa4_encfs_ftruncate,
 	.utimens	= pa4_encfs_utimens,
 	.open		= pa4_encfs_open,
 	.read		= pa4_encfs_read,
 	.write		= pa4_encfs_write,
 	.statfs		= pa4_encfs_statfs,
 	.create     = pa4_encfs_create,
+	.flush		= pa4_encfs_flush,
 	.release	= pa4_encfs_release,
 	.fsync		= pa4_encfs_fsync,
+	.init		= pa4_encfs_init,
+	.destroy	= pa4_encfs_destroy,
 #ifdef HAVE_SETXATTR
 	.setxattr	= pa4_encfs_setxattr,
 	.getxattr	= pa4_encfs_getxattr,
@@ -605,20 +2651,51 @@ static struct fuse_operations pa4_encfs_oper = {
 #endif
 };
 
+#define PA4_OPT(t, p, v) { t, offsetof(fs_state, p), v }
+
+static struct fuse_opt pa4_encfs_opts[] = {
+	PA4_OPT("pool_max=%lu",	pool_max, 0),
+	PA4_OPT("hugepages",	hugepages, 1),
+	PA4_OPT("mlock",	lock_memory, 1),
+	PA4_OPT("compress",	compress, 1),
+	PA4_OPT("pack",		pack, 1),
+	PA4_OPT("pack_max=%lu",	pack_max, 0),
+	PA4_OPT("dedup",	dedup, 1),
+	PA4_OPT("names",	names, 1),
+	PA4_OPT("name_cache=%lu",	name_cache, 0),
+	PA4_OPT("attr_cache=%lu",	attr_entries, 0),
+	PA4_OPT("meta_index",	meta, 1),
+	PA4_OPT("meta_slots=%lu",	meta_slots, 0),
+	PA4_OPT("rekey=%s",	old_key, 0),
+	PA4_OPT("rekey_rate=%lu",	rekey_rate, 0),
+	PA4_OPT("stream",	stream, 1),
+	PA4_OPT("stream_match=%s",	stream_match, 0),
+	PA4_OPT("mmap",		mmap, 1),
+	PA4_OPT("write_behind",	write_behind, 1),
+	PA4_OPT("wb_threads=%lu",	wb_threads, 0),
+	PA4_OPT("wb_max=%lu",	wb_max, 0),
+	PA4_OPT("sync_window=%lu",	sync_window, 0),
+	PA4_OPT("sync_fs=%lu",	sync_fs, 0),
+	PA4_OPT("journal",	journal, 1),
+	PA4_OPT("journal_max=%lu",	journal_max, 0),
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]) 
 {
 	//Thanks, http://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/html/init.html
 
 	fs_state *fsState;
+	int res;
 	umask(0);
 
-	//Usage: ./pa4_encfs <Key Phrase> <Mirror Directory> <Mount Point> 
+	//Usage: ./pa4_encfs [-o options] <Key Phrase> <Mirror Directory> <Mount Point> 
 	if(argc < 4) {
-		fprintf(stderr, "Not enough arguments.\nUsage: ./pa4_encfs <Key Phrase> <Mirror Directory> <Mount Point>\n");
+		fprintf(stderr, "Not enough arguments.\nUsage: ./pa4_encfs [-o pool_max=<MiB>,hugepages,mlock,compress,pack,pack_max=<KiB>,dedup,names,name_cache=<entries>,attr_cache=<entries>,meta_index,meta_slots=<n>,rekey=<Old Key Phrase>,rekey_rate=<MiB/s>,stream,stream_match=<glob>[:<glob>...],mmap,write_behind,wb_threads=<n>,wb_max=<MiB>,sync_window=<us>,sync_fs=<files>,journal,journal_max=<MiB>] <Key Phrase> <Mirror Directory> <Mount Point>\n");
 		return 1;
 	}
 
-	fsState = malloc(sizeof(fs_state));
+	fsState = calloc(1, sizeof(fs_state));
 	if(fsState == NULL) {
 		perror("Failure during memory allocation.\n");
 		abort();
@@ -627,6 +2704,18 @@ int main(int argc, char *argv[])
 	//Stores the path and encryption key phrase in struct. realpath() is root dir arguement.
 	fsState -> rootdir = realpath(argv[argc - 2], NULL);
 	fsState -> key = argv[argc - 3]; 
+	fsState -> pool_max = DEFAULT_POOL_MAX;
+	fsState -> wb_threads = WB_DEFAULT_THREADS;
+	fsState -> wb_max = WB_DEFAULT_MAX;
+	fsState -> pack_max = PACK_DEFAULT_MAX;
+	fsState -> rekey_rate = REKEY_DEFAULT_RATE;
+	fsState -> name_cache = NAME_CACHE_DEFAULT;
+	fsState -> attr_entries = ATTR_CACHE_DEFAULT;
+	fsState -> meta_slots = META_DEFAULT_SLOTS;
+	fsState -> sync_window = SYNC_DEFAULT_WINDOW;
+	fsState -> sync_fs = SYNC_DEFAULT_FS_MIN;
+	fsState -> journal_max = JOURNAL_DEFAULT_MAX;
+	pthread_mutex_init(&fsState -> node_lock, NULL);
 
 	//Rearrange command line arguments to pass them into fuse_main */
 	argv[argc - 3] = argv[argc - 1];
@@ -634,5 +2723,33 @@ int main(int argc, char *argv[])
 	argv[argc - 1] = NULL;
 	argc -= 2;
 
-	return fuse_main(argc, argv, &pa4_encfs_oper, fsState);
+	//Pick out our own -o options, the rest go to fuse_main
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if(fuse_opt_parse(&args, fsState, pa4_encfs_opts, NULL) == -1) {
+		return 1;
+	}
+	if(fsState -> pack_max > PACK_MAX_FILE >> 10) {
+		fprintf(stderr, "pack_max is at most %d KiB.\n", PACK_MAX_FILE >> 10);
+		return 1;
+	}
+	if(fsState -> journal_max < 1) {
+		fprintf(stderr, "journal_max is at least 1 MiB.\n");
+		return 1;
+	}
+	//Mapped files: keep the kernel's pages unless getattr shows the file
+	//changed, and write dirty pages back in runs rather than one by one
+	if(fsState -> mmap) {
+		if(fsState -> stream || fsState -> stream_match != NULL) {
+			fprintf(stderr, "mmap and stream/stream_match don't mix: streamed files can't be mapped.\n");
+			return 1;
+		}
+		if(fuse_opt_add_arg(&args, "-oauto_cache") == -1 ||
+		   fuse_opt_add_arg(&args, "-obig_writes") == -1) {
+			return 1;
+		}
+	}
+
+	res = fuse_main(args.argc, args.argv, &pa4_encfs_oper, fsState);
+	fuse_opt_free_args(&args);
+	return res;
 }
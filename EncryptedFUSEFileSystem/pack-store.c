@@ -0,0 +1,995 @@
+/* pack-store.c
+ * Container file packing many small encrypted files for pa4-encfs
+ *
+ * See pack-store.h for the container layout
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+
+#include "pack-store.h"
+
+#define HDR          ((uint64_t)sizeof(pack_record))
+#define MIN_REC      (2 * PACK_ALIGN)     /* Smallest extent worth splitting off */
+#define ALIGN_UP(x)  (((uint64_t)(x) + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1))
+#define SCAN_WINDOW  (1024 * 1024)
+#define MIN_BUCKETS  1024
+
+#define HEADER_MAC_LEN offsetof(pack_header, tag)
+
+/* The path's additional data: the header from seq up to path_iv */
+#define AAD_OFF      offsetof(pack_record, seq)
+#define AAD_LEN      (offsetof(pack_record, path_iv) - AAD_OFF)
+
+/* Sequential reader for the mount-time scan */
+typedef struct scan_window {
+    int fd;
+    unsigned char* buf;
+    uint64_t start;
+    size_t len;
+} scan_window;
+
+static uint64_t hash_bytes(const char* s, size_t len){
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+    size_t i;
+
+    for(i = 0; i < len; i++){
+	h ^= (unsigned char)s[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* Length of the parent directory part of path: "/a/b" -> 2, "/a" -> 0 */
+static size_t parent_len(const char* path){
+    const char* slash = strrchr(path, '/');
+
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+static void now(int64_t* sec, uint32_t* nsec){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+}
+
+/* ---- Index (caller holds ps->lock for writing unless noted) ---- */
+
+/* Caller holds ps->lock */
+static pack_entry* index_find(pack_store* ps, const char* path){
+    pack_entry* pe = ps->paths[hash_bytes(path, strlen(path)) % ps->nbuckets];
+
+    while(pe != NULL && strcmp(pe->path, path)){
+	pe = pe->next;
+    }
+    return pe;
+}
+
+static void index_link(pack_store* ps, pack_entry* pe){
+    size_t p = hash_bytes(pe->path, strlen(pe->path)) % ps->nbuckets;
+    size_t d = hash_bytes(pe->path, parent_len(pe->path)) % ps->nbuckets;
+
+    pe->next = ps->paths[p];
+    ps->paths[p] = pe;
+    pe->dir_next = ps->dirs[d];
+    ps->dirs[d] = pe;
+}
+
+/* Double the tables once there is more than one entry per bucket */
+static void index_grow(pack_store* ps){
+    pack_entry** paths = calloc(ps->nbuckets * 2, sizeof(*paths));
+    pack_entry** dirs = calloc(ps->nbuckets * 2, sizeof(*dirs));
+    pack_entry** old = ps->paths;
+    size_t nbuckets = ps->nbuckets;
+    pack_entry* pe;
+    pack_entry* next;
+    size_t i;
+
+    if(paths == NULL || dirs == NULL){
+	/* Keep going with longer chains */
+	free(paths);
+	free(dirs);
+	return;
+    }
+    free(ps->dirs);
+    ps->paths = paths;
+    ps->dirs = dirs;
+    ps->nbuckets = nbuckets * 2;
+    for(i = 0; i < nbuckets; i++){
+	for(pe = old[i]; pe != NULL; pe = next){
+	    next = pe->next;
+	    index_link(ps, pe);
+	}
+    }
+    free(old);
+}
+
+static void index_add(pack_store* ps, pack_entry* pe){
+    if(ps->nentries >= ps->nbuckets){
+	index_grow(ps);
+    }
+    index_link(ps, pe);
+    ps->nentries++;
+}
+
+static void index_del(pack_store* ps, pack_entry* pe){
+    pack_entry** pp;
+
+    pp = &ps->paths[hash_bytes(pe->path, strlen(pe->path)) % ps->nbuckets];
+    while(*pp != pe){
+	pp = &(*pp)->next;
+    }
+    *pp = pe->next;
+    pp = &ps->dirs[hash_bytes(pe->path, parent_len(pe->path)) % ps->nbuckets];
+    while(*pp != pe){
+	pp = &(*pp)->dir_next;
+    }
+    *pp = pe->dir_next;
+    ps->nentries--;
+}
+
+/* ---- Extent allocator ---- */
+
+static int size_class(uint64_t len){
+    uint64_t c = len / PACK_ALIGN;
+
+    return c < PACK_CLASSES - 1 ? (int)c : PACK_CLASSES - 1;
+}
+
+static void extent_put(pack_store* ps, uint64_t off, uint64_t len){
+    pack_extent* e = malloc(sizeof(*e));
+
+    /* Out of memory only leaks the space until the next mount */
+    if(e == NULL){
+	return;
+    }
+    e->off = off;
+    e->len = len;
+    e->next = ps->free[size_class(len)];
+    ps->free[size_class(len)] = e;
+    ps->free_bytes += len;
+}
+
+/* Write the header of a free extent */
+static int mark_free(pack_store* ps, uint64_t off, uint64_t len){
+    pack_record h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+    h.reclen = len;
+    if(pwrite(ps->fd, &h, offsetof(pack_record, file_id), off) == -1){
+	return -errno;
+    }
+    return 0;
+}
+
+/* Find room for need bytes: an exact fit, else split a bigger extent, else
+ * the end of the container. Sets *len to what the record must cover. */
+static int extent_get(pack_store* ps, uint64_t need, uint64_t* off, uint64_t* len){
+    pack_extent** pp = NULL;
+    pack_extent* e;
+    int c;
+
+    for(c = size_class(need); c < PACK_CLASSES && pp == NULL; c++){
+	for(pp = &ps->free[c]; *pp != NULL && (*pp)->len < need; pp = &(*pp)->next){
+	}
+	if(*pp == NULL){
+	    pp = NULL;
+	}
+    }
+    if(pp == NULL){
+	*off = ps->end;
+	*len = need;
+	ps->end += need;
+	return 0;
+    }
+
+    e = *pp;
+    *off = e->off;
+    *len = e->len;
+    if(e->len - need >= MIN_REC){
+	/* Lay down the remainder's header first: until the record is written
+	 * the old header still spans both */
+	int res = mark_free(ps, e->off + need, e->len - need);
+
+	if(res){
+	    return res;
+	}
+	*len = need;
+	e->off += need;
+	e->len -= need;
+	ps->free_bytes -= need;
+	*pp = e->next;
+	e->next = ps->free[size_class(e->len)];
+	ps->free[size_class(e->len)] = e;
+	return 0;
+    }
+    *pp = e->next;
+    ps->free_bytes -= e->len;
+    free(e);
+    return 0;
+}
+
+/* Mark a record free on disk; its space is reused once handed to extent_put() */
+static void record_kill(pack_store* ps, uint64_t off){
+    uint64_t zero = 0;
+
+    pwrite(ps->fd, &zero, sizeof(zero), off + offsetof(pack_record, seq));
+}
+
+/* ---- Records ---- */
+
+/* Write a new copy of a record for path with header h. The contents are
+ * either sealed from plain, or (plain == NULL) h's existing ciphertext is
+ * copied from src. Fills in the rest of h and the record's offset. */
+static int record_put(pack_store* ps, const char* path, pack_record* h,
+		      const char* plain, uint64_t src, uint64_t* off){
+    size_t pathlen = strlen(path);
+    uint64_t need = ALIGN_UP(HDR + pathlen + h->size);
+    unsigned char* buf;
+    uint64_t len;
+    ssize_t res;
+
+    if(pathlen >= PATH_MAX || h->size > PACK_MAX_FILE){
+	return pathlen >= PATH_MAX ? -ENAMETOOLONG : -EFBIG;
+    }
+    buf = bufpool_get(ps->pool);
+    if(buf == NULL){
+	return -ENOMEM;
+    }
+
+    /* Contents */
+    if(plain != NULL){
+	if(!crypt_random(h->data_iv, CRYPT_IV_BYTES) ||
+	   !crypt_seal_block(ps->key, h->data_iv, &h->file_id, sizeof(h->file_id),
+			     (const unsigned char*)plain, h->size,
+			     buf + HDR + pathlen, h->data_tag)){
+	    bufpool_put(ps->pool, buf);
+	    return -EIO;
+	}
+    }
+    else if(h->size > 0){
+	res = pread(ps->fd, buf + HDR + pathlen, h->size, src);
+	if(res != (ssize_t)h->size){
+	    bufpool_put(ps->pool, buf);
+	    return res == -1 ? -errno : -EIO;
+	}
+    }
+    memset(buf + HDR + pathlen + h->size, 0, need - (HDR + pathlen + h->size));
+
+    res = extent_get(ps, need, off, &len);
+    if(res){
+	bufpool_put(ps->pool, buf);
+	return res;
+    }
+
+    /* Header and path */
+    memcpy(h->magic, PACK_MAGIC, sizeof(h->magic));
+    h->reclen = len;
+    h->seq = ps->seq++;
+    h->pathlen = pathlen;
+    h->pad = 0;
+    if(!crypt_random(h->path_iv, CRYPT_IV_BYTES) ||
+       !crypt_seal_block(ps->key, h->path_iv, (char*)h + AAD_OFF, AAD_LEN,
+			 (const unsigned char*)path, pathlen, buf + HDR, h->path_tag)){
+	res = -EIO;
+    }
+    else{
+	memcpy(buf, h, HDR);
+	res = pwrite(ps->fd, buf, need, *off);
+	res = res == (ssize_t)need ? 0 : (res == -1 ? -errno : -EIO);
+    }
+    bufpool_put(ps->pool, buf);
+    if(res){
+	/* Give the extent back; its old header may be gone, so rewrite it */
+	if(mark_free(ps, *off, len) == 0){
+	    extent_put(ps, *off, len);
+	}
+    }
+    return res;
+}
+
+/* Offset of a record's ciphertext */
+static uint64_t data_off(const pack_entry* pe){
+    return pe->off + HDR + pe->rec.pathlen;
+}
+
+/* Drop a reference with ps->lock held for writing */
+static void entry_drop(pack_store* ps, pack_entry* pe){
+    if(__sync_sub_and_fetch(&pe->refcnt, 1) == 0){
+	extent_put(ps, pe->off, pe->rec.reclen);
+	free(pe->path);
+	free(pe);
+    }
+}
+
+/* Take pe out of the namespace. Open references keep its record (now marked
+ * free on disk) readable until they are dropped. */
+static void entry_unlink(pack_store* ps, pack_entry* pe){
+    index_del(ps, pe);
+    record_kill(ps, pe->off);
+    pe->unlinked = 1;
+    entry_drop(ps, pe);
+}
+
+/* Rewrite pe's record from h (contents copied unless plain is given) under a
+ * new path, replacing any packed file already there */
+static int entry_rewrite(pack_store* ps, pack_entry* pe, const char* path,
+			 pack_record* h, const char* plain){
+    pack_entry* old = NULL;
+    char* newpath = NULL;
+    uint64_t off;
+    int res;
+
+    if(strcmp(path, pe->path)){
+	old = index_find(ps, path);
+	newpath = strdup(path);
+	if(newpath == NULL){
+	    return -ENOMEM;
+	}
+    }
+    res = record_put(ps, path, h, plain, data_off(pe), &off);
+    if(res == 0 && fdatasync(ps->fd) == -1){
+	/* The old copy must outlive any doubt about the new one */
+	res = -errno;
+	record_kill(ps, off);
+	extent_put(ps, off, h->reclen);
+    }
+    if(res){
+	free(newpath);
+	return res;
+    }
+
+    if(old != NULL){
+	entry_unlink(ps, old);
+    }
+    record_kill(ps, pe->off);
+    extent_put(ps, pe->off, pe->rec.reclen);
+    if(newpath != NULL){
+	index_del(ps, pe);
+	free(pe->path);
+	pe->path = newpath;
+	index_add(ps, pe);
+    }
+    pe->off = off;
+    pe->rec = *h;
+    return 0;
+}
+
+static void fill_stat(const pack_entry* pe, struct stat* st){
+    memset(st, 0, sizeof(*st));
+    st->st_ino = pe->id;
+    st->st_mode = pe->rec.mode;
+    st->st_nlink = 1;
+    st->st_uid = pe->rec.uid;
+    st->st_gid = pe->rec.gid;
+    st->st_size = pe->rec.size;
+    st->st_blksize = 4096;
+    st->st_blocks = (pe->rec.reclen + 511) / 512;
+    st->st_atim.tv_sec = st->st_mtim.tv_sec = pe->rec.mtime_sec;
+    st->st_atim.tv_nsec = st->st_mtim.tv_nsec = pe->rec.mtime_nsec;
+    st->st_ctim.tv_sec = pe->rec.ctime_sec;
+    st->st_ctim.tv_nsec = pe->rec.ctime_nsec;
+}
+
+/* ---- Mount-time scan ---- */
+
+static const unsigned char* scan_at(scan_window* w, uint64_t off, size_t len){
+    ssize_t res;
+
+    if(off < w->start || off + len > w->start + w->len){
+	res = pread(w->fd, w->buf, SCAN_WINDOW, off);
+	if(res < 0){
+	    res = 0;
+	}
+	w->start = off;
+	w->len = res;
+	if((size_t)res < len){
+	    return NULL;
+	}
+    }
+    return w->buf + (off - w->start);
+}
+
+/* Decode the live record at off; returns its path (malloc()ed) or NULL if
+ * the record doesn't hold up */
+static char* scan_record(pack_store* ps, scan_window* w, uint64_t off, const pack_record* h){
+    const unsigned char* p;
+    char* path;
+
+    if(h->pathlen == 0 || h->pathlen >= PATH_MAX || h->size > PACK_MAX_FILE ||
+       HDR + h->pathlen + h->size > h->reclen){
+	return NULL;
+    }
+    p = scan_at(w, off, HDR + h->pathlen);
+    path = p ? malloc(h->pathlen + 1) : NULL;
+    if(path == NULL){
+	return NULL;
+    }
+    if(!crypt_open_block(ps->key, h->path_iv, (const char*)h + AAD_OFF, AAD_LEN,
+			 p + HDR, h->pathlen, (unsigned char*)path, h->path_tag) ||
+       memchr(path, '\0', h->pathlen)){
+	free(path);
+	return NULL;
+    }
+    path[h->pathlen] = '\0';
+    return path;
+}
+
+/* Nothing but zeros from off to size: an append the crash tore */
+static int scan_zero(scan_window* w, uint64_t off, uint64_t size){
+    const unsigned char* p;
+    size_t len;
+    size_t i;
+
+    for(; off < size; off += len){
+	len = size - off < SCAN_WINDOW ? size - off : SCAN_WINDOW;
+	p = scan_at(w, off, len);
+	if(p == NULL){
+	    return 0;
+	}
+	for(i = 0; i < len; i++){
+	    if(p[i]){
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+/* Queue a header for tidy() to rewrite as free */
+static int fix_add(pack_extent** fix, uint64_t off, uint64_t len){
+    pack_extent* e = malloc(sizeof(*e));
+
+    if(e == NULL){
+	return -ENOMEM;
+    }
+    e->off = off;
+    e->len = len;
+    e->next = *fix;
+    *fix = e;
+    return 0;
+}
+
+/* Rebuild the index and the free lists. Writes nothing: the headers that
+ * should say free (merged runs, copies a newer one replaced) are queued on
+ * fix, and *end is where the container's last record or free run ends. */
+static int scan(pack_store* ps, uint64_t size, pack_extent** fix, uint64_t* end){
+    uint64_t run_off = 0;
+    uint64_t run_len = 0;
+    int run_count = 0;
+    int run_stale = 0;
+    scan_window w;
+    uint64_t off;
+    int res = 0;
+
+    w.fd = ps->fd;
+    w.buf = malloc(SCAN_WINDOW);
+    w.start = 0;
+    w.len = 0;
+    if(w.buf == NULL){
+	return -ENOMEM;
+    }
+
+    for(off = PACK_ALIGN; off + HDR <= size && res == 0; ){
+	const unsigned char* p = scan_at(&w, off, HDR);
+	int stale = 0;
+	int live = 0;
+	pack_record h;
+
+	if(p == NULL){
+	    break;
+	}
+	memcpy(&h, p, HDR);
+	if(memcmp(h.magic, PACK_MAGIC, sizeof(h.magic)) || h.reclen < MIN_REC ||
+	   h.reclen % PACK_ALIGN){
+	    /* Only an append leaves zeros behind; anything else is damage,
+	     * and the records after it can't be found */
+	    if(!scan_zero(&w, off, size)){
+		res = -EIO;
+	    }
+	    break;
+	}
+	if(off + h.reclen > size){
+	    /* Torn append: the container ends here */
+	    break;
+	}
+
+	if(h.seq != 0){
+	    char* path = scan_record(ps, &w, off, &h);
+	    pack_entry* old = path ? index_find(ps, path) : NULL;
+
+	    if(h.seq >= ps->seq){
+		ps->seq = h.seq + 1;
+	    }
+	    if(path == NULL){
+		/* Not ours to reuse: it stays as it is, like a live record */
+		ps->bad++;
+		live = 1;
+	    }
+	    else if(old != NULL && old->rec.seq > h.seq){
+		/* A newer copy is already indexed */
+		free(path);
+		stale = 1;
+	    }
+	    else{
+		pack_entry* pe;
+
+		if(old != NULL){
+		    res = fix_add(fix, old->off, old->rec.reclen);
+		    index_del(ps, old);
+		    extent_put(ps, old->off, old->rec.reclen);
+		    free(old->path);
+		    free(old);
+		}
+		pe = calloc(1, sizeof(*pe));
+		if(pe == NULL){
+		    free(path);
+		    res = -ENOMEM;
+		    break;
+		}
+		pe->path = path;
+		pe->id = ps->next_id++;
+		pe->off = off;
+		pe->rec = h;
+		pe->refcnt = 1;
+		index_add(ps, pe);
+		live = 1;
+	    }
+	}
+
+	if(!live){
+	    /* Merge runs of free extents */
+	    if(run_len == 0){
+		run_off = off;
+		run_count = 0;
+		run_stale = 0;
+	    }
+	    run_len += h.reclen;
+	    run_count++;
+	    run_stale |= stale;
+	}
+	else if(run_len){
+	    if((run_count > 1 || run_stale) && res == 0){
+		res = fix_add(fix, run_off, run_len);
+	    }
+	    extent_put(ps, run_off, run_len);
+	    run_len = 0;
+	}
+	off += h.reclen;
+    }
+    free(w.buf);
+
+    /* Free space (or a torn record) at the end is cut off by tidy() */
+    *end = run_len ? run_off : off;
+    return res;
+}
+
+/* Write back what scan() queued: fix headers and cut the end off */
+static int tidy(pack_store* ps, pack_extent* fix, uint64_t end, uint64_t size){
+    pack_extent* e;
+    int res;
+
+    /* The copies that replace the ones being freed must be on disk first */
+    if(fix != NULL && fdatasync(ps->fd) == -1){
+	return -errno;
+    }
+    for(e = fix; e != NULL; e = e->next){
+	res = mark_free(ps, e->off, e->len);
+	if(res){
+	    return res;
+	}
+    }
+    if(end < size && ftruncate(ps->fd, end) == -1){
+	return -errno;
+    }
+    return 0;
+}
+
+/* Check the container's header against the key, or lay one down in a new
+ * container (unless read only) */
+static int header_check(pack_store* ps, uint64_t size, int flags){
+    unsigned char buf[PACK_ALIGN];
+    unsigned char tag[CRYPT_TAG_BYTES];
+    pack_header hdr;
+    ssize_t res;
+
+    if(size < PACK_ALIGN){
+	/* New, or its creation was cut short: nothing in it yet */
+	if(flags & PACK_RDONLY){
+	    return 0;
+	}
+	memset(buf, 0, sizeof(buf));
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PACK_HEADER_MAGIC, sizeof(hdr.magic));
+	crypt_mac(ps->key, &hdr, HEADER_MAC_LEN, hdr.tag);
+	memcpy(buf, &hdr, sizeof(hdr));
+	res = pwrite(ps->fd, buf, sizeof(buf), 0);
+	if(res != sizeof(buf)){
+	    return res == -1 ? -errno : -EIO;
+	}
+	return fdatasync(ps->fd) == -1 ? -errno : 0;
+    }
+
+    res = pread(ps->fd, &hdr, sizeof(hdr), 0);
+    if(res != sizeof(hdr)){
+	return res == -1 ? -errno : -EIO;
+    }
+    if(memcmp(hdr.magic, PACK_HEADER_MAGIC, sizeof(hdr.magic))){
+	return -EINVAL;
+    }
+    crypt_mac(ps->key, &hdr, HEADER_MAC_LEN, tag);
+    return CRYPTO_memcmp(tag, hdr.tag, sizeof(tag)) ? -EKEYREJECTED : 0;
+}
+
+/* ---- Interface ---- */
+
+extern int pack_open(pack_store* ps, const char* file, const crypt_key* key, bufpool* pool,
+		     int flags){
+    pack_extent* fix = NULL;
+    struct stat st;
+    int res;
+
+    memset(ps, 0, sizeof(*ps));
+    pthread_rwlock_init(&ps->lock, NULL);
+    ps->fd = -1;
+    ps->key = key;
+    ps->pool = pool;
+    ps->seq = 1;
+    ps->next_id = 1;
+    ps->nbuckets = MIN_BUCKETS;
+    ps->paths = calloc(ps->nbuckets, sizeof(*ps->paths));
+    ps->dirs = calloc(ps->nbuckets, sizeof(*ps->dirs));
+    if(ps->paths == NULL || ps->dirs == NULL){
+	pack_close(ps);
+	return -ENOMEM;
+    }
+
+    ps->fd = flags & PACK_RDONLY ? open(file, O_RDONLY) : open(file, O_RDWR | O_CREAT, 0600);
+    if(ps->fd == -1 || fstat(ps->fd, &st) == -1){
+	res = -errno;
+	pack_close(ps);
+	return res;
+    }
+    res = header_check(ps, st.st_size, flags);
+    if(res == 0){
+	res = scan(ps, st.st_size, &fix, &ps->end);
+    }
+    if(res == 0 && !(flags & PACK_RDONLY)){
+	res = tidy(ps, fix, ps->end, st.st_size);
+    }
+    while(fix != NULL){
+	pack_extent* next = fix->next;
+
+	free(fix);
+	fix = next;
+    }
+    if(res){
+	pack_close(ps);
+	return res;
+    }
+    return 0;
+}
+
+extern void pack_close(pack_store* ps){
+    pack_entry* pe;
+    pack_entry* next;
+    pack_extent* e;
+    pack_extent* enext;
+    size_t i;
+
+    for(i = 0; ps->paths && i < ps->nbuckets; i++){
+	for(pe = ps->paths[i]; pe != NULL; pe = next){
+	    next = pe->next;
+	    free(pe->path);
+	    free(pe);
+	}
+    }
+    for(i = 0; i < PACK_CLASSES; i++){
+	for(e = ps->free[i]; e != NULL; e = enext){
+	    enext = e->next;
+	    free(e);
+	}
+    }
+    free(ps->paths);
+    free(ps->dirs);
+    ps->paths = NULL;
+    ps->dirs = NULL;
+    if(ps->fd != -1){
+	close(ps->fd);
+    }
+    ps->fd = -1;
+    pthread_rwlock_destroy(&ps->lock);
+}
+
+extern pack_entry* pack_lookup(pack_store* ps, const char* path){
+    pack_entry* pe;
+
+    pthread_rwlock_rdlock(&ps->lock);
+    pe = index_find(ps, path);
+    if(pe != NULL){
+	__sync_add_and_fetch(&pe->refcnt, 1);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return pe;
+}
+
+extern void pack_release(pack_store* ps, pack_entry* pe){
+    /* Only unlinked entries can lose their last reference here */
+    if(__sync_sub_and_fetch(&pe->refcnt, 1) == 0){
+	pthread_rwlock_wrlock(&ps->lock);
+	extent_put(ps, pe->off, pe->rec.reclen);
+	pthread_rwlock_unlock(&ps->lock);
+	free(pe->path);
+	free(pe);
+    }
+}
+
+extern int pack_stat(pack_store* ps, const char* path, struct stat* st){
+    pack_entry* pe;
+
+    pthread_rwlock_rdlock(&ps->lock);
+    pe = index_find(ps, path);
+    if(pe != NULL){
+	fill_stat(pe, st);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return pe ? 0 : -ENOENT;
+}
+
+extern int pack_create(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid,
+		       int excl, pack_entry** out){
+    pack_entry* pe;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&ps->lock);
+    pe = index_find(ps, path);
+    if(pe != NULL){
+	if(excl){
+	    res = -EEXIST;
+	}
+	else{
+	    __sync_add_and_fetch(&pe->refcnt, 1);
+	    *out = pe;
+	}
+	pthread_rwlock_unlock(&ps->lock);
+	return res;
+    }
+
+    pe = calloc(1, sizeof(*pe));
+    if(pe != NULL){
+	pe->path = strdup(path);
+    }
+    if(pe == NULL || pe->path == NULL){
+	res = -ENOMEM;
+    }
+    else if(!crypt_random((unsigned char*)&pe->rec.file_id, sizeof(pe->rec.file_id))){
+	res = -EIO;
+    }
+    else{
+	pe->rec.mode = S_IFREG | (mode & 07777);
+	pe->rec.uid = uid;
+	pe->rec.gid = gid;
+	now(&pe->rec.mtime_sec, &pe->rec.mtime_nsec);
+	pe->rec.ctime_sec = pe->rec.mtime_sec;
+	pe->rec.ctime_nsec = pe->rec.mtime_nsec;
+	res = record_put(ps, path, &pe->rec, "", 0, &pe->off);
+    }
+    if(res){
+	pthread_rwlock_unlock(&ps->lock);
+	if(pe != NULL){
+	    free(pe->path);
+	}
+	free(pe);
+	return res;
+    }
+    pe->id = ps->next_id++;
+    pe->refcnt = 2;
+    index_add(ps, pe);
+    pthread_rwlock_unlock(&ps->lock);
+    *out = pe;
+    return 0;
+}
+
+extern ssize_t pack_read(pack_store* ps, pack_entry* pe, char* buf, size_t size, off_t offset){
+    unsigned char* tmp;
+    ssize_t res;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    tmp = bufpool_get(ps->pool);
+    if(tmp == NULL){
+	return -ENOMEM;
+    }
+
+    pthread_rwlock_rdlock(&ps->lock);
+    if((uint64_t)offset >= pe->rec.size){
+	res = 0;
+    }
+    else{
+	res = pread(ps->fd, tmp, pe->rec.size, data_off(pe));
+	if(res != (ssize_t)pe->rec.size){
+	    res = res == -1 ? -errno : -EIO;
+	}
+	else if(!crypt_open_block(ps->key, pe->rec.data_iv, &pe->rec.file_id,
+				  sizeof(pe->rec.file_id), tmp, pe->rec.size,
+				  tmp, pe->rec.data_tag)){
+	    res = -EIO;
+	}
+	else{
+	    if(size > pe->rec.size - (uint64_t)offset){
+		size = pe->rec.size - offset;
+	    }
+	    memcpy(buf, tmp + offset, size);
+	    res = size;
+	}
+    }
+    pthread_rwlock_unlock(&ps->lock);
+
+    bufpool_put(ps->pool, tmp);
+    return res;
+}
+
+extern int pack_write(pack_store* ps, pack_entry* pe, const char* data, size_t size){
+    pack_record h;
+    int res = 0;
+
+    if(size > PACK_MAX_FILE){
+	return -EFBIG;
+    }
+    pthread_rwlock_wrlock(&ps->lock);
+    /* Nobody can see an unlinked file's new contents */
+    if(!pe->unlinked){
+	h = pe->rec;
+	h.size = size;
+	now(&h.mtime_sec, &h.mtime_nsec);
+	h.ctime_sec = h.mtime_sec;
+	h.ctime_nsec = h.mtime_nsec;
+	res = entry_rewrite(ps, pe, pe->path, &h, data);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return res;
+}
+
+extern int pack_unlink(pack_store* ps, const char* path){
+    pack_entry* pe;
+
+    pthread_rwlock_wrlock(&ps->lock);
+    pe = index_find(ps, path);
+    if(pe != NULL){
+	entry_unlink(ps, pe);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return pe ? 0 : -ENOENT;
+}
+
+/* Move pe to path, refreshing its ctime */
+static int entry_move(pack_store* ps, pack_entry* pe, const char* path){
+    pack_record h = pe->rec;
+
+    now(&h.ctime_sec, &h.ctime_nsec);
+    return entry_rewrite(ps, pe, path, &h, NULL);
+}
+
+extern int pack_rename(pack_store* ps, const char* from, const char* to){
+    pack_entry* pe;
+    int res;
+
+    pthread_rwlock_wrlock(&ps->lock);
+    pe = index_find(ps, from);
+    if(pe == NULL){
+	res = -ENOENT;
+    }
+    else if(!strcmp(from, to)){
+	res = 0;
+    }
+    else{
+	res = entry_move(ps, pe, to);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return res;
+}
+
+extern int pack_rename_dir(pack_store* ps, const char* from, const char* to){
+    size_t flen = strlen(from);
+    char path[PATH_MAX];
+    pack_entry** moved;
+    pack_entry* pe;
+    size_t n = 0;
+    size_t i;
+    int res = 0;
+
+    pthread_rwlock_wrlock(&ps->lock);
+    /* Collect first: moving entries reshuffles the index */
+    moved = malloc((ps->nentries + 1) * sizeof(*moved));
+    if(moved == NULL){
+	pthread_rwlock_unlock(&ps->lock);
+	return -ENOMEM;
+    }
+    for(i = 0; i < ps->nbuckets; i++){
+	for(pe = ps->paths[i]; pe != NULL; pe = pe->next){
+	    if(!strncmp(pe->path, from, flen) && pe->path[flen] == '/'){
+		moved[n++] = pe;
+	    }
+	}
+    }
+    for(i = 0; i < n && res == 0; i++){
+	if(snprintf(path, sizeof(path), "%s%s", to, moved[i]->path + flen) >= (int)sizeof(path)){
+	    res = -ENAMETOOLONG;
+	}
+	else{
+	    res = entry_move(ps, moved[i], path);
+	}
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    free(moved);
+    return res;
+}
+
+extern int pack_setattr(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid,
+			const struct timespec* mtime){
+    pack_entry* pe;
+    pack_record h;
+    int res = -ENOENT;
+
+    pthread_rwlock_wrlock(&ps->lock);
+    pe = index_find(ps, path);
+    if(pe != NULL){
+	h = pe->rec;
+	if(mode != (mode_t)-1){
+	    h.mode = S_IFREG | (mode & 07777);
+	}
+	if(uid != (uid_t)-1){
+	    h.uid = uid;
+	}
+	if(gid != (gid_t)-1){
+	    h.gid = gid;
+	}
+	now(&h.ctime_sec, &h.ctime_nsec);
+	if(mtime != NULL){
+	    h.mtime_sec = mtime->tv_sec;
+	    h.mtime_nsec = mtime->tv_nsec;
+	}
+	res = entry_rewrite(ps, pe, pe->path, &h, NULL);
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return res;
+}
+
+extern int pack_readdir(pack_store* ps, const char* dir,
+			int (*fn)(void*, const char*, const struct stat*), void* arg){
+    size_t dlen = strlen(dir);
+    struct stat st;
+    pack_entry* pe;
+    int res = 0;
+
+    while(dlen > 0 && dir[dlen - 1] == '/'){
+	dlen--;
+    }
+    pthread_rwlock_rdlock(&ps->lock);
+    pe = ps->dirs[hash_bytes(dir, dlen) % ps->nbuckets];
+    for(; pe != NULL && res == 0; pe = pe->dir_next){
+	if(parent_len(pe->path) == dlen && !strncmp(pe->path, dir, dlen)){
+	    fill_stat(pe, &st);
+	    res = fn(arg, pe->path + dlen + 1, &st);
+	}
+    }
+    pthread_rwlock_unlock(&ps->lock);
+    return res;
+}
+
+extern int pack_sync(pack_store* ps){
+    return fdatasync(ps->fd) == -1 ? -errno : 0;
+}
@@ -0,0 +1,226 @@
+/* pack-store.h
+ * Container file packing many small encrypted files for pa4-encfs
+ *
+ * In pack mode small regular files don't get a backing file of their own.
+ * They live as records in one container file in the mirror root:
+ *
+ *   [header][record][record][free][record]...
+ *
+ * The header is an HMAC under the mount key, checked before anything else is
+ * read: a container under another key is refused with -EKEYREJECTED.
+ *
+ * A record is a header, the encrypted path and the encrypted contents, padded
+ * to PACK_ALIGN bytes. Contents are sealed with AES-256-GCM under the file's
+ * random id, so renames and attribute changes copy them without decrypting.
+ * The path is sealed with the header fields as additional data, which
+ * authenticates the size, attributes and the contents' IV and tag.
+ *
+ * The container is log structured: records are never changed in place.
+ * An update writes a new copy with a higher sequence number into free space,
+ * syncs it and only then marks the old copy free, so after a crash the newest
+ * complete copy of every path wins. The index (path -> record) is kept in
+ * memory and rebuilt at mount by one sequential pass over the container. A
+ * live record that doesn't authenticate is left as it is, and its space is
+ * never reused: it is counted in bad for the caller to report. Free space is
+ * handed out by an extent allocator with per-size free lists; extents that
+ * are too big are split, and neighbouring free extents are merged at mount.
+ *
+ * Directories stay real directories in the mirror. A file that grows past
+ * the pack limit is moved out to a normal block-format file by pa4-encfs.
+ *
+ */
+
+#ifndef PACK_STORE_H
+#define PACK_STORE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+#include "buf-pool.h"
+
+#define PACK_FILE_NAME   ".pa4-encfs.pack"
+#define PACK_HEADER_MAGIC "PA4PACK1"
+#define PACK_MAGIC       "PA4R"
+#define PACK_ALIGN       64         /* Also the room left for the header */
+#define PACK_DEFAULT_MAX 16         /* KiB: bigger files get their own file */
+#define PACK_MAX_FILE    32768      /* Largest pack limit; a record must fit
+				     * in one pool buffer with its path */
+
+/* pack_open() flags */
+#define PACK_RDONLY      0x1        /* Look, don't touch: for offline checks */
+
+/* Container header on disk, at offset 0 */
+typedef struct pack_header {
+    char magic[8];
+    unsigned char tag[CRYPT_TAG_BYTES];   /* HMAC of the fields above */
+} pack_header;
+
+/* Record header on disk (host byte order) */
+typedef struct pack_record {
+    char magic[4];
+    uint32_t reclen;                            /* Bytes on disk, header included */
+    uint64_t seq;                               /* 0: free extent */
+    uint64_t file_id;
+    uint32_t pathlen;
+    uint32_t size;                              /* Plaintext contents */
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pad;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    unsigned char data_iv[CRYPT_IV_BYTES];
+    unsigned char data_tag[CRYPT_TAG_BYTES];
+    unsigned char path_iv[CRYPT_IV_BYTES];      /* Everything above is the */
+    unsigned char path_tag[CRYPT_TAG_BYTES];    /* path's additional data */
+} pack_record;
+
+/* One live file */
+typedef struct pack_entry {
+    char* path;                   /* Mount relative, "/dir/name" */
+    uint64_t id;                  /* Stable while mounted, reported as st_ino */
+    uint64_t off;                 /* Record in the container */
+    pack_record rec;              /* Cached header */
+    int refcnt;                   /* Index reference + pack_lookup() callers */
+    int unlinked;
+    struct pack_entry* next;      /* Path hash chain */
+    struct pack_entry* dir_next;  /* Parent directory hash chain */
+} pack_entry;
+
+/* Free space */
+typedef struct pack_extent {
+    uint64_t off;
+    uint64_t len;
+    struct pack_extent* next;
+} pack_extent;
+
+/* Free lists by size in PACK_ALIGN units; the last one holds the rest */
+#define PACK_CLASSES 1024
+
+typedef struct pack_store {
+    int fd;
+    const crypt_key* key;
+    bufpool* pool;                /* Record buffers */
+    pthread_rwlock_t lock;        /* Readers share, changes exclude */
+    uint64_t end;                 /* Container size */
+    uint64_t seq;                 /* Next sequence number */
+    uint64_t next_id;
+    size_t nentries;
+    size_t nbuckets;
+    pack_entry** paths;
+    pack_entry** dirs;
+    pack_extent* free[PACK_CLASSES];
+    uint64_t free_bytes;
+    uint64_t bad;                 /* Live records that failed authentication */
+} pack_store;
+
+/* int pack_open(pack_store* ps, const char* file, const crypt_key* key, bufpool* pool, int flags)
+ * Purpose: Open (or create) a container and rebuild its index
+ * Args: pack_store* ps       : Store to set up
+ *       const char* file     : Container path
+ *       const crypt_key* key : Key for records
+ *       bufpool* pool        : Buffers of at least ENCFS_MAX_BLOCK_SIZE bytes
+ *       int flags            : PACK_RDONLY opens an existing container
+ *                              without writing to it (no headers fixed, no
+ *                              free space cut off); only pack_lookup(),
+ *                              pack_stat(), pack_read() and pack_readdir()
+ *                              may be used on it
+ * Return: 0 on success (ps->bad records were left alone),
+ *         -EKEYREJECTED if the container is under another key,
+ *         -EIO if it is damaged past its last record, -errno on error
+ */
+extern int pack_open(pack_store* ps, const char* file, const crypt_key* key, bufpool* pool,
+		     int flags);
+
+/* void pack_close(pack_store* ps)
+ * Purpose: Close the container and free the index
+ */
+extern void pack_close(pack_store* ps);
+
+/* pack_entry* pack_lookup(pack_store* ps, const char* path)
+ * Purpose: Find a packed file and take a reference on it
+ * Return: The entry, or NULL if path isn't packed
+ */
+extern pack_entry* pack_lookup(pack_store* ps, const char* path);
+
+/* void pack_release(pack_store* ps, pack_entry* pe)
+ * Purpose: Drop a reference taken by pack_lookup() or pack_create()
+ */
+extern void pack_release(pack_store* ps, pack_entry* pe);
+
+/* int pack_stat(pack_store* ps, const char* path, struct stat* st)
+ * Purpose: Attributes of a packed file, from memory
+ * Return: 0 on success, -ENOENT if path isn't packed
+ */
+extern int pack_stat(pack_store* ps, const char* path, struct stat* st);
+
+/* int pack_create(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid, int excl, pack_entry** out)
+ * Purpose: Create an empty packed file, or find the existing one
+ * Args: int excl        : Fail with -EEXIST if path is already packed
+ *       pack_entry** out: Referenced entry on success
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_create(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid,
+		       int excl, pack_entry** out);
+
+/* ssize_t pack_read(pack_store* ps, pack_entry* pe, char* buf, size_t size, off_t offset)
+ * Purpose: Read committed contents of a packed file
+ * Return: Bytes read, -errno on error
+ */
+extern ssize_t pack_read(pack_store* ps, pack_entry* pe, char* buf, size_t size, off_t offset);
+
+/* int pack_write(pack_store* ps, pack_entry* pe, const char* data, size_t size)
+ * Purpose: Replace the contents of a packed file (at most PACK_MAX_FILE bytes)
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_write(pack_store* ps, pack_entry* pe, const char* data, size_t size);
+
+/* int pack_unlink(pack_store* ps, const char* path)
+ * Purpose: Remove a packed file; open references keep the entry alive
+ * Return: 0 on success, -ENOENT if path isn't packed
+ */
+extern int pack_unlink(pack_store* ps, const char* path);
+
+/* int pack_rename(pack_store* ps, const char* from, const char* to)
+ * Purpose: Rename a packed file, replacing a packed file at to
+ * Return: 0 on success, -ENOENT if from isn't packed, -errno on error
+ */
+extern int pack_rename(pack_store* ps, const char* from, const char* to);
+
+/* int pack_rename_dir(pack_store* ps, const char* from, const char* to)
+ * Purpose: Move every packed file under directory from to directory to.
+ *          Walks the whole index.
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_rename_dir(pack_store* ps, const char* from, const char* to);
+
+/* int pack_setattr(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid, const struct timespec* mtime)
+ * Purpose: chmod/chown/utimens for a packed file. (mode_t)-1, (uid_t)-1,
+ *          (gid_t)-1 and a NULL mtime leave that attribute alone.
+ * Return: 0 on success, -ENOENT if path isn't packed, -errno on error
+ */
+extern int pack_setattr(pack_store* ps, const char* path, mode_t mode, uid_t uid, gid_t gid,
+			const struct timespec* mtime);
+
+/* int pack_readdir(pack_store* ps, const char* dir, int (*fn)(void*, const char*, const struct stat*), void* arg)
+ * Purpose: Call fn for every packed file directly inside dir, stopping
+ *          when it returns non-zero
+ * Return: 0, or what fn returned
+ */
+extern int pack_readdir(pack_store* ps, const char* dir,
+			int (*fn)(void*, const char*, const struct stat*), void* arg);
+
+/* int pack_sync(pack_store* ps)
+ * Purpose: fdatasync() the container
+ * Return: 0 on success, -errno on error
+ */
+extern int pack_sync(pack_store* ps);
+
+#endif
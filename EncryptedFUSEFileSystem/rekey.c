@@ -0,0 +1,277 @@
+/* rekey.c
+ * Background tree walker that moves a pa4-encfs mirror to a new key
+ *
+ * See rekey.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "rekey.h"
+
+#define INTERNAL_PREFIX ".pa4-encfs."  /* Stores and the checkpoint */
+#define TEMP_SUFFIX     ".pa4-encfs~"  /* Conversions in progress */
+
+/* Order of the walk: '/' sorts before every other byte, so a directory's
+ * contents come right after it and before its longer-named siblings */
+static int path_cmp(const char* a, const char* b){
+    while(*a && *a == *b){
+	a++;
+	b++;
+    }
+    if(*a == *b){
+	return 0;
+    }
+    if(*a == '/' || *b == '/'){
+	return *a == '/' ? (*b ? -1 : 1) : (*a ? 1 : -1);
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+static int name_cmp(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Our own files are not part of the tree */
+static int internal_name(const char* name){
+    size_t len = strlen(name);
+
+    return strncmp(name, INTERNAL_PREFIX, strlen(INTERNAL_PREFIX)) == 0 ||
+	(len >= strlen(TEMP_SUFFIX) && strcmp(name + len - strlen(TEMP_SUFFIX), TEMP_SUFFIX) == 0);
+}
+
+/* Name of the checkpoint file (suffix "~" for the one being written) */
+static int checkpoint_path(const rekey_walker* rk, char* path, const char* suffix){
+    return snprintf(path, PATH_MAX, "%s/%s%s", rk->root, REKEY_CHECKPOINT_NAME, suffix)
+	< PATH_MAX;
+}
+
+static void checkpoint_write(rekey_walker* rk){
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    FILE* fp;
+
+    if(!checkpoint_path(rk, path, "") || !checkpoint_path(rk, tmp, "~")){
+	return;
+    }
+    fp = fopen(tmp, "w");
+    if(fp == NULL){
+	return;
+    }
+    fprintf(fp, "%s\n", rk->last);
+    if(fflush(fp) == 0 && fdatasync(fileno(fp)) == 0 && fclose(fp) == 0){
+	rename(tmp, path);
+    }
+    else{
+	unlink(tmp);
+    }
+}
+
+static void checkpoint_read(rekey_walker* rk){
+    char path[PATH_MAX];
+    FILE* fp;
+
+    rk->resume[0] = '\0';
+    if(!checkpoint_path(rk, path, "")){
+	return;
+    }
+    fp = fopen(path, "r");
+    if(fp == NULL){
+	return;
+    }
+    if(fgets(rk->resume, sizeof(rk->resume), fp) == NULL){
+	rk->resume[0] = '\0';
+    }
+    rk->resume[strcspn(rk->resume, "\n")] = '\0';
+    fclose(fp);
+}
+
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+extern int rekey_account(rekey_walker* rk, uint64_t bytes){
+    double due;
+    struct timespec ts;
+    int stop;
+
+    pthread_mutex_lock(&rk->mtx);
+    rk->bytes += bytes;
+    if(rk->max_rate && !rk->stop){
+	due = rk->start + (double)rk->bytes / rk->max_rate;
+	if(due > now()){
+	    ts.tv_sec = (time_t)due;
+	    ts.tv_nsec = (long)((due - ts.tv_sec) * 1e9);
+	    while(!rk->stop && pthread_cond_timedwait(&rk->cond, &rk->mtx, &ts) != ETIMEDOUT){
+		;
+	    }
+	}
+    }
+    stop = rk->stop;
+    pthread_mutex_unlock(&rk->mtx);
+    return stop;
+}
+
+/* Walk directory rel ("" for the root). Returns non-zero when stopped. */
+static int walk(rekey_walker* rk, const char* rel){
+    char full[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    char** names = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    size_t i;
+    int stop = 0;
+    DIR* dp;
+
+    /* Read the whole directory first so no descriptors stay open below */
+    if(snprintf(full, sizeof(full), "%s%s", rk->root, rel) >= (int)sizeof(full)){
+	return 0;
+    }
+    dp = opendir(full);
+    if(dp == NULL){
+	rk->errors++;
+	return 0;
+    }
+    while((de = readdir(dp)) != NULL){
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || internal_name(de->d_name)){
+	    continue;
+	}
+	if(n == cap){
+	    char** grown;
+
+	    cap = cap ? cap * 2 : 64;
+	    grown = realloc(names, cap * sizeof(*names));
+	    if(grown == NULL){
+		break;
+	    }
+	    names = grown;
+	}
+	names[n] = strdup(de->d_name);
+	if(names[n] != NULL){
+	    n++;
+	}
+    }
+    closedir(dp);
+    qsort(names, n, sizeof(*names), name_cmp);
+
+    for(i = 0; i < n && !stop; i++){
+	int skip;
+
+	if(snprintf(path, sizeof(path), "%s/%s", rel, names[i]) >= (int)sizeof(path) ||
+	   snprintf(full, sizeof(full), "%s%s", rk->root, path) >= (int)sizeof(full) ||
+	   lstat(full, &st) == -1){
+	    continue;
+	}
+	skip = rk->resume[0] && path_cmp(path, rk->resume) <= 0;
+	if(S_ISDIR(st.st_mode)){
+	    size_t len = strlen(path);
+
+	    /* Enter a skipped directory only if the checkpoint is inside it */
+	    if(!skip || (!strncmp(rk->resume, path, len) && rk->resume[len] == '/')){
+		stop = walk(rk, path);
+	    }
+	}
+	else if(S_ISREG(st.st_mode) && !skip){
+	    int res;
+
+	    rk->resume[0] = '\0';
+	    res = rk->fn(rk->arg, path);
+	    stop = rekey_account(rk, 0);
+	    if(res == -EINTR){
+		/* Dropped half way because we are stopping: redo it next time */
+		break;
+	    }
+	    if(res){
+		rk->errors++;
+		fprintf(stderr, "pa4-encfs: re-keying %s failed: %s\n", path, strerror(-res));
+	    }
+	    rk->files++;
+	    strcpy(rk->last, path);
+	    if(rk->files % REKEY_CHECKPOINT_FILES == 0){
+		checkpoint_write(rk);
+	    }
+	}
+    }
+
+    for(i = 0; i < n; i++){
+	free(names[i]);
+    }
+    free(names);
+    return stop;
+}
+
+static void* rekey_main(void* arg){
+    rekey_walker* rk = arg;
+    char path[PATH_MAX];
+
+    rk->start = now();
+    if(walk(rk, "")){
+	if(rk->last[0]){
+	    checkpoint_write(rk);
+	}
+	return NULL;
+    }
+    if(checkpoint_path(rk, path, "")){
+	unlink(path);
+    }
+    fprintf(stderr, "pa4-encfs: re-keying done: %llu files, %llu MiB rewritten, %llu errors\n",
+	    (unsigned long long)rk->files, (unsigned long long)(rk->bytes >> 20),
+	    (unsigned long long)rk->errors);
+    if(rk->errors){
+	fprintf(stderr, "pa4-encfs: the files that failed are still under the old key: "
+		"mount with -o rekey again before giving it up\n");
+    }
+    return NULL;
+}
+
+extern int rekey_start(rekey_walker* rk, const char* root, uint64_t max_rate,
+		       rekey_fn fn, void* arg){
+    pthread_condattr_t attr;
+    int res;
+
+    memset(rk, 0, sizeof(*rk));
+    snprintf(rk->root, sizeof(rk->root), "%s", root);
+    rk->max_rate = max_rate;
+    rk->fn = fn;
+    rk->arg = arg;
+    checkpoint_read(rk);
+
+    pthread_mutex_init(&rk->mtx, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rk->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    res = pthread_create(&rk->thread, NULL, rekey_main, rk);
+    if(res){
+	pthread_cond_destroy(&rk->cond);
+	pthread_mutex_destroy(&rk->mtx);
+	return -res;
+    }
+    return 0;
+}
+
+extern void rekey_stop(rekey_walker* rk){
+    pthread_mutex_lock(&rk->mtx);
+    rk->stop = 1;
+    pthread_cond_signal(&rk->cond);
+    pthread_mutex_unlock(&rk->mtx);
+    pthread_join(rk->thread, NULL);
+    pthread_cond_destroy(&rk->cond);
+    pthread_mutex_destroy(&rk->mtx);
+}
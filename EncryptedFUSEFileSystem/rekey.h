@@ -0,0 +1,79 @@
+/* rekey.h
+ * Background tree walker that moves a pa4-encfs mirror to a new key
+ *
+ * The walker runs on its own thread while the filesystem stays mounted. It
+ * visits every regular file of the mirror depth first, in byte-wise sorted
+ * order, and hands it to a callback that re-encrypts it (files already under
+ * the new key cost the callback one header read). The callback reports its
+ * progress with rekey_account() as it goes, which sleeps as needed to keep
+ * the average at or below max_rate bytes per second, so a big file is
+ * throttled piece by piece too.
+ *
+ * Progress is checkpointed: every REKEY_CHECKPOINT_FILES files, and when it
+ * is stopped, the walker records the last finished path in
+ * REKEY_CHECKPOINT_NAME in the mirror root. Since the order is fixed, a walk
+ * restarted at the next mount skips straight past it. The checkpoint is
+ * removed once the whole tree is done. Files that fail are named on stderr
+ * and stay under the old key; the next walk, from the top, retries them.
+ *
+ */
+
+#ifndef REKEY_H
+#define REKEY_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define REKEY_CHECKPOINT_NAME  ".pa4-encfs.rekey"
+#define REKEY_CHECKPOINT_FILES 64
+#define REKEY_DEFAULT_RATE     32          /* MiB/s */
+
+/* int rekey_fn(void* arg, const char* path)
+ * Re-encrypt one file; path is mount relative ("/dir/name").
+ * Returns 0, or -errno (the walker counts it and moves on).
+ */
+typedef int (*rekey_fn)(void* arg, const char* path);
+
+typedef struct rekey_walker {
+    char root[PATH_MAX];
+    char resume[PATH_MAX];        /* Checkpoint still to be skipped to */
+    char last[PATH_MAX];          /* Last path handed to fn */
+    uint64_t max_rate;            /* Bytes/s, 0: unthrottled */
+    rekey_fn fn;
+    void* arg;
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;          /* Signalled to cut a throttle sleep short */
+    int stop;
+    double start;                 /* CLOCK_MONOTONIC seconds */
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t errors;
+} rekey_walker;
+
+/* int rekey_start(rekey_walker* rk, const char* root, uint64_t max_rate, rekey_fn fn, void* arg)
+ * Purpose: Start walking root from its checkpoint, if any
+ * Args: const char* root   : Mirror root (backing directory)
+ *       uint64_t max_rate  : Bytes per second, 0 for no limit
+ * Return: 0 on success, -errno on error
+ */
+extern int rekey_start(rekey_walker* rk, const char* root, uint64_t max_rate,
+		       rekey_fn fn, void* arg);
+
+/* int rekey_account(rekey_walker* rk, uint64_t bytes)
+ * Purpose: Called by the callback for every piece it rewrites; sleeps until
+ *          the piece is due at max_rate
+ * Return: Non-zero once the walk is being stopped: the callback should drop
+ *         the file, which is redone from the checkpoint next time
+ */
+extern int rekey_account(rekey_walker* rk, uint64_t bytes);
+
+/* void rekey_stop(rekey_walker* rk)
+ * Purpose: Stop the walk after the current file, record the checkpoint and
+ *          join the thread. Also used to reap a walk that has finished.
+ */
+extern void rekey_stop(rekey_walker* rk);
+
+#endif
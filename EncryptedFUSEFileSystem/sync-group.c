@@ -0,0 +1,185 @@
+/* sync-group.c
+ * Group commit of fsync() calls for pa4-encfs
+ *
+ * See sync-group.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sync-group.h"
+
+/* One syncfs() does when enough files are in the batch, all on one device */
+static int commit_fs(sync_group* sg, sync_batch* b){
+    struct stat st;
+    dev_t dev = 0;
+    int res;
+    int i;
+
+    if(sg->fs_min == 0 || (unsigned long)b->n < sg->fs_min){
+	return 0;
+    }
+    for(i = 0; i < b->n; i++){
+	if(fstat(b->ents[i].fd, &st) == -1 || (i > 0 && st.st_dev != dev)){
+	    return 0;
+	}
+	dev = st.st_dev;
+    }
+    res = syncfs(b->ents[0].fd) == -1 ? -errno : 0;
+    for(i = 0; i < b->n; i++){
+	b->ents[i].res = res;
+    }
+    return 1;
+}
+
+static void commit(sync_group* sg, sync_batch* b){
+    sync_entry* e;
+    int i;
+
+    /* Stores first: block maps may point into the dedup store */
+    if(b->stores){
+	b->store_res = sg->stores(sg->arg, b->stores);
+    }
+    if(commit_fs(sg, b)){
+	return;
+    }
+    for(i = 0; i < b->n; i++){
+	e = &b->ents[i];
+	e->res = (e->full ? fsync(e->fd) : fdatasync(e->fd)) == -1 ? -errno : 0;
+    }
+}
+
+/* Hold b open for the window, so concurrent callers can join */
+static void wait_window(sync_group* sg){
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += sg->window_us / 1000000;
+    until.tv_nsec += (sg->window_us % 1000000) * 1000;
+    if(until.tv_nsec >= 1000000000){
+	until.tv_sec++;
+	until.tv_nsec -= 1000000000;
+    }
+    while(pthread_cond_timedwait(&sg->cond, &sg->mtx, &until) != ETIMEDOUT){
+	;
+    }
+}
+
+extern int sync_group_init(sync_group* sg, unsigned long window_us, unsigned long fs_min,
+			   sync_store_fn stores, void* arg){
+    int res;
+
+    sg->open = NULL;
+    sg->leader = 0;
+    sg->window_us = window_us;
+    sg->fs_min = fs_min;
+    sg->stores = stores;
+    sg->arg = arg;
+    res = pthread_mutex_init(&sg->mtx, NULL);
+    if(res){
+	return -res;
+    }
+    res = pthread_cond_init(&sg->cond, NULL);
+    if(res){
+	pthread_mutex_destroy(&sg->mtx);
+	return -res;
+    }
+    return 0;
+}
+
+extern void sync_group_destroy(sync_group* sg){
+    /* Only a batch every caller of failed to join can be left */
+    if(sg->open != NULL){
+	free(sg->open->ents);
+	free(sg->open);
+    }
+    pthread_cond_destroy(&sg->cond);
+    pthread_mutex_destroy(&sg->mtx);
+}
+
+extern int sync_group_commit(sync_group* sg, const void* key, int fd, int datasync,
+			     int stores){
+    sync_batch* b;
+    int idx = -1;
+    int res;
+    int i;
+
+    pthread_mutex_lock(&sg->mtx);
+    b = sg->open;
+    if(b == NULL){
+	b = calloc(1, sizeof(*b));
+	if(b == NULL){
+	    pthread_mutex_unlock(&sg->mtx);
+	    return -ENOMEM;
+	}
+	b->idle = !sg->leader;
+	sg->open = b;
+    }
+    if(fd != -1){
+	for(i = 0; i < b->n && idx == -1; i++){
+	    if(b->ents[i].key == key){
+		idx = i;
+	    }
+	}
+	if(idx == -1){
+	    if(b->n == b->cap){
+		int cap = b->cap ? b->cap * 2 : 16;
+		sync_entry* grown = realloc(b->ents, cap * sizeof(*grown));
+
+		if(grown == NULL){
+		    /* b stays open for the next caller */
+		    pthread_mutex_unlock(&sg->mtx);
+		    return -ENOMEM;
+		}
+		b->ents = grown;
+		b->cap = cap;
+	    }
+	    idx = b->n++;
+	    b->ents[idx].key = key;
+	    b->ents[idx].fd = fd;
+	    b->ents[idx].full = 0;
+	    b->ents[idx].res = 0;
+	}
+	b->ents[idx].full |= !datasync;
+    }
+    b->stores |= stores;
+    b->waiters++;
+
+    while(!b->done){
+	if(!sg->leader && sg->open == b){
+	    sg->leader = 1;
+	    if(b->idle && sg->window_us){
+		wait_window(sg);
+	    }
+	    sg->open = NULL;
+	    pthread_mutex_unlock(&sg->mtx);
+
+	    commit(sg, b);
+
+	    pthread_mutex_lock(&sg->mtx);
+	    b->done = 1;
+	    sg->leader = 0;
+	    pthread_cond_broadcast(&sg->cond);
+	}
+	else{
+	    pthread_cond_wait(&sg->cond, &sg->mtx);
+	}
+    }
+
+    res = idx != -1 ? b->ents[idx].res : 0;
+    if(res == 0 && stores){
+	res = b->store_res;
+    }
+    if(--b->waiters == 0){
+	free(b->ents);
+	free(b);
+    }
+    pthread_mutex_unlock(&sg->mtx);
+    return res;
+}
@@ -0,0 +1,91 @@
+/* sync-group.h
+ * Group commit of fsync() calls for pa4-encfs
+ *
+ * Each fsync() joins the batch that is currently open. The first caller to
+ * find no commit running becomes the batch's leader: if the file system was
+ * idle it holds the batch open for a short window so that concurrent
+ * fsync()s can join, then closes it and syncs every file in it once (a file
+ * named by several callers is synced once, with fsync() if any of them
+ * asked for metadata too). The shared stores (pack container, dedup store,
+ * journal) are synced at most once per batch, before the files whose maps
+ * point into them. Callers that arrive while a commit is running form the next batch,
+ * whose leader starts as soon as the running commit ends, so no window is
+ * added under load: the batch built up while waiting.
+ *
+ * A batch of at least fs_min files on one file system is committed with a
+ * single syncfs() instead. (Before Linux 5.8 syncfs() doesn't report
+ * write-back errors; leave fs_min at 0 where that matters.)
+ *
+ * Every caller gets its own file's result, and the result of the stores it
+ * asked for.
+ *
+ */
+
+#ifndef SYNC_GROUP_H
+#define SYNC_GROUP_H
+
+#include <pthread.h>
+
+#define SYNC_DEFAULT_WINDOW 500  /* Microseconds */
+#define SYNC_DEFAULT_FS_MIN 16   /* Files per batch for syncfs(), 0 for never */
+
+/* Shared stores a commit can include */
+#define SYNC_PACK    1
+#define SYNC_DEDUP   2
+#define SYNC_JOURNAL 4
+
+/* int sync_store_fn(void* arg, int stores)
+ * Purpose: Sync the SYNC_* stores named; 0 on success, -errno on error
+ */
+typedef int (*sync_store_fn)(void* arg, int stores);
+
+typedef struct sync_entry {
+    const void* key;              /* One entry per key */
+    int fd;
+    int full;                     /* fsync() rather than fdatasync() */
+    int res;
+} sync_entry;
+
+typedef struct sync_batch {
+    sync_entry* ents;
+    int n;
+    int cap;
+    int stores;                   /* SYNC_* wanted */
+    int store_res;
+    int idle;                     /* Formed with no commit running */
+    int waiters;                  /* Callers still to read their result */
+    int done;
+} sync_batch;
+
+typedef struct sync_group {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;          /* A commit ended */
+    sync_batch* open;             /* Batch taking new callers, or NULL */
+    int leader;                   /* A commit is running */
+    unsigned long window_us;
+    unsigned long fs_min;
+    sync_store_fn stores;
+    void* arg;
+} sync_group;
+
+/* int sync_group_init(sync_group* sg, unsigned long window_us, unsigned long fs_min,
+ *                     sync_store_fn stores, void* arg)
+ * Return: 0 on success, -errno on error
+ */
+extern int sync_group_init(sync_group* sg, unsigned long window_us, unsigned long fs_min,
+			   sync_store_fn stores, void* arg);
+
+/* void sync_group_destroy(sync_group* sg) */
+extern void sync_group_destroy(sync_group* sg);
+
+/* int sync_group_commit(sync_group* sg, const void* key, int fd, int datasync, int stores)
+ * Purpose: Make fd (and the stores named) durable, together with whatever
+ *          other commits arrive meanwhile
+ * Args: const void* key : Identifies the file (several fds can share it)
+ *       int fd          : Stays open until this returns; -1 for stores only
+ * Return: 0 on success, -errno on error
+ */
+extern int sync_group_commit(sync_group* sg, const void* key, int fd, int datasync,
+			     int stores);
+
+#endif
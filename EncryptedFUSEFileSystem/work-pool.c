@@ -0,0 +1,231 @@
+/* work-pool.c
+ * Work-stealing thread pool for the pa4-encfs tree utilities
+ *
+ * See work-pool.h for details
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "work-pool.h"
+
+typedef struct worker_arg {
+    work_pool* wp;
+    int id;
+} worker_arg;
+
+static int deque_push(work_deque* d, void* item){
+    pthread_mutex_lock(&d->mtx);
+    if(d->count == d->cap){
+	size_t cap = d->cap ? d->cap * 2 : 64;
+	void** grown = malloc(cap * sizeof(*grown));
+	size_t i;
+
+	if(grown == NULL){
+	    pthread_mutex_unlock(&d->mtx);
+	    return -ENOMEM;
+	}
+	for(i = 0; i < d->count; i++){
+	    grown[i] = d->items[(d->head + i) % d->cap];
+	}
+	free(d->items);
+	d->items = grown;
+	d->head = 0;
+	d->cap = cap;
+    }
+    d->items[(d->head + d->count) % d->cap] = item;
+    d->count++;
+    pthread_mutex_unlock(&d->mtx);
+    return 0;
+}
+
+/* Newest item of our own deque (oldest when stealing) */
+static void* deque_take(work_deque* d, int steal){
+    void* item = NULL;
+
+    pthread_mutex_lock(&d->mtx);
+    if(d->count){
+	if(steal){
+	    item = d->items[d->head];
+	    d->head = (d->head + 1) % d->cap;
+	}
+	else{
+	    item = d->items[(d->head + d->count - 1) % d->cap];
+	}
+	d->count--;
+    }
+    pthread_mutex_unlock(&d->mtx);
+    return item;
+}
+
+static void* take(work_pool* wp, int id){
+    void* item = deque_take(&wp->deques[id], 0);
+    int i;
+
+    for(i = 1; item == NULL && i < wp->nthreads; i++){
+	item = deque_take(&wp->deques[(id + i) % wp->nthreads], 1);
+    }
+    if(item != NULL){
+	pthread_mutex_lock(&wp->mtx);
+	wp->queued--;
+	wp->active++;
+	pthread_cond_signal(&wp->space);
+	pthread_mutex_unlock(&wp->mtx);
+    }
+    return item;
+}
+
+static void* worker_main(void* arg){
+    worker_arg* wa = arg;
+    work_pool* wp = wa->wp;
+    int id = wa->id;
+    void* item;
+
+    free(wa);
+    for(;;){
+	item = take(wp, id);
+	if(item != NULL){
+	    wp->fn(wp->arg, item, id);
+	    pthread_mutex_lock(&wp->mtx);
+	    if(--wp->active == 0 && wp->queued == 0){
+		pthread_cond_broadcast(&wp->work);
+	    }
+	    pthread_mutex_unlock(&wp->mtx);
+	    continue;
+	}
+	pthread_mutex_lock(&wp->mtx);
+	/* Done once closed with nothing queued and nobody left to spawn more */
+	while(wp->queued == 0 && !(wp->closed && wp->active == 0)){
+	    pthread_cond_wait(&wp->work, &wp->mtx);
+	}
+	if(wp->queued == 0){
+	    pthread_mutex_unlock(&wp->mtx);
+	    break;
+	}
+	pthread_mutex_unlock(&wp->mtx);
+	/* Counted but not in a deque yet */
+	sched_yield();
+    }
+    return NULL;
+}
+
+extern int work_pool_start(work_pool* wp, int nthreads, work_fn fn, void* arg){
+    int i;
+    int res = 0;
+
+    if(nthreads < 1){
+	nthreads = 1;
+    }
+    if(nthreads > WORK_POOL_MAX){
+	nthreads = WORK_POOL_MAX;
+    }
+    memset(wp, 0, sizeof(*wp));
+    wp->fn = fn;
+    wp->arg = arg;
+    wp->threads = calloc(nthreads, sizeof(*wp->threads));
+    wp->deques = calloc(nthreads, sizeof(*wp->deques));
+    if(wp->threads == NULL || wp->deques == NULL){
+	free(wp->threads);
+	free(wp->deques);
+	return -ENOMEM;
+    }
+    wp->nthreads = nthreads;
+    for(i = 0; i < nthreads; i++){
+	pthread_mutex_init(&wp->deques[i].mtx, NULL);
+    }
+    pthread_mutex_init(&wp->mtx, NULL);
+    pthread_cond_init(&wp->work, NULL);
+    pthread_cond_init(&wp->space, NULL);
+
+    for(i = 0; i < nthreads; i++){
+	worker_arg* wa = malloc(sizeof(*wa));
+
+	if(wa == NULL){
+	    res = -ENOMEM;
+	    break;
+	}
+	wa->wp = wp;
+	wa->id = i;
+	res = -pthread_create(&wp->threads[i], NULL, worker_main, wa);
+	if(res){
+	    free(wa);
+	    break;
+	}
+    }
+    if(res){
+	wp->started = i;
+	work_pool_finish(wp);
+	return res;
+    }
+    wp->started = nthreads;
+    return 0;
+}
+
+extern int work_pool_push(work_pool* wp, void* item){
+    int res;
+
+    pthread_mutex_lock(&wp->mtx);
+    while(wp->queued >= (size_t)wp->nthreads * WORK_POOL_QUEUED){
+	pthread_cond_wait(&wp->space, &wp->mtx);
+    }
+    /* Counted first, so queued never falls below what the deques hold */
+    wp->queued++;
+    pthread_mutex_unlock(&wp->mtx);
+
+    res = deque_push(&wp->deques[wp->next++ % wp->nthreads], item);
+    pthread_mutex_lock(&wp->mtx);
+    if(res){
+	wp->queued--;
+    }
+    else{
+	pthread_cond_signal(&wp->work);
+    }
+    pthread_mutex_unlock(&wp->mtx);
+    return res;
+}
+
+extern int work_pool_spawn(work_pool* wp, void* item, int worker){
+    int res;
+
+    pthread_mutex_lock(&wp->mtx);
+    wp->queued++;
+    pthread_mutex_unlock(&wp->mtx);
+
+    res = deque_push(&wp->deques[worker], item);
+    pthread_mutex_lock(&wp->mtx);
+    if(res){
+	wp->queued--;
+    }
+    else{
+	pthread_cond_signal(&wp->work);
+    }
+    pthread_mutex_unlock(&wp->mtx);
+    return res;
+}
+
+extern void work_pool_finish(work_pool* wp){
+    int i;
+
+    pthread_mutex_lock(&wp->mtx);
+    wp->closed = 1;
+    pthread_cond_broadcast(&wp->work);
+    pthread_mutex_unlock(&wp->mtx);
+    for(i = 0; i < wp->started; i++){
+	pthread_join(wp->threads[i], NULL);
+    }
+
+    for(i = 0; i < wp->nthreads; i++){
+	free(wp->deques[i].items);
+	pthread_mutex_destroy(&wp->deques[i].mtx);
+    }
+    free(wp->deques);
+    free(wp->threads);
+    pthread_cond_destroy(&wp->space);
+    pthread_cond_destroy(&wp->work);
+    pthread_mutex_destroy(&wp->mtx);
+}
@@ -0,0 +1,81 @@
+/* work-pool.h
+ * Work-stealing thread pool for the pa4-encfs tree utilities
+ *
+ * Each worker has its own deque. Items are dealt round-robin onto the
+ * deques; a worker takes the newest item of its own deque and, once that is
+ * empty, steals the oldest item of another worker's, so a worker stuck on
+ * one huge file doesn't hold up the small ones queued behind it. Every deque
+ * has its own lock: items are whole files or directories, so a lock per
+ * item costs nothing next to the work.
+ *
+ * work_pool_push() blocks while WORK_POOL_QUEUED items per worker are
+ * waiting, so walking a huge tree doesn't queue all of it in memory.
+ * Workers add items with work_pool_spawn() instead, onto their own deque
+ * without waiting (a worker waiting for room could be the one that has to
+ * make it); taking the newest item first keeps what they add small.
+ *
+ */
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define WORK_POOL_QUEUED 1024    /* Per worker */
+#define WORK_POOL_MAX    256     /* Threads */
+
+/* void work_fn(void* arg, void* item, int worker)
+ * Purpose: Handle one item, on worker thread number worker
+ */
+typedef void (*work_fn)(void* arg, void* item, int worker);
+
+typedef struct work_deque {
+    pthread_mutex_t mtx;
+    void** items;                 /* Ring of cap items */
+    size_t head;                  /* Oldest, stolen from here */
+    size_t count;
+    size_t cap;
+} work_deque;
+
+typedef struct work_pool {
+    int nthreads;
+    int started;                  /* Threads running */
+    pthread_t* threads;
+    work_deque* deques;
+    work_fn fn;
+    void* arg;
+    unsigned next;                /* Deque for the next push */
+
+    pthread_mutex_t mtx;          /* Guards queued, active and closed */
+    pthread_cond_t work;          /* Items queued or pool closed */
+    pthread_cond_t space;         /* Queue dropped below the limit */
+    size_t queued;
+    int active;                   /* Workers inside fn, which may spawn more */
+    int closed;
+} work_pool;
+
+/* int work_pool_start(work_pool* wp, int nthreads, work_fn fn, void* arg)
+ * Purpose: Start nthreads workers (clamped to 1..WORK_POOL_MAX)
+ * Return: 0 on success, -errno on error
+ */
+extern int work_pool_start(work_pool* wp, int nthreads, work_fn fn, void* arg);
+
+/* int work_pool_push(work_pool* wp, void* item)
+ * Purpose: Queue one item, blocking while the queue is full
+ * Return: 0 on success, -ENOMEM on error
+ */
+extern int work_pool_push(work_pool* wp, void* item);
+
+/* int work_pool_spawn(work_pool* wp, void* item, int worker)
+ * Purpose: Queue an item from inside fn, on that worker's own deque
+ * Return: 0 on success, -ENOMEM on error
+ */
+extern int work_pool_spawn(work_pool* wp, void* item, int worker);
+
+/* void work_pool_finish(work_pool* wp)
+ * Purpose: Wait for every queued item to be handled, then stop the workers
+ */
+extern void work_pool_finish(work_pool* wp);
+
+#endif
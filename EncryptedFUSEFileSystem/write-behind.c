@@ -0,0 +1,336 @@
+/* write-behind.c
+ * Background write-behind encryption for pa4-encfs
+ *
+ * See write-behind.h for details
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "write-behind.h"
+
+/* Write back everything staged on q up to the current tail */
+static void flush_queue(wb_engine* wb, wb_queue* q){
+    struct iovec iov[WB_IOV_MAX];
+    wb_extent* last;
+    wb_extent* done;
+    wb_extent* e;
+    ssize_t res;
+
+    pthread_rwlock_wrlock(q->lock);
+
+    pthread_mutex_lock(&q->mtx);
+    last = q->tail;
+    pthread_mutex_unlock(&q->mtx);
+
+    /* Extents before 'last' are stable: writers only ever append. Runs of
+     * back-to-back extents go down in one call, so a large block is sealed
+     * once instead of once per staged piece. */
+    e = q->head;
+    while(e != NULL){
+	off_t off = e->off;
+	size_t len = 0;
+	int n = 0;
+
+	for(;;){
+	    iov[n].iov_base = e->data;
+	    iov[n].iov_len = e->len;
+	    len += e->len;
+	    n++;
+	    if(e == last || n == WB_IOV_MAX || e->next->off != off + (off_t)len){
+		break;
+	    }
+	    e = e->next;
+	}
+	res = encfs_pwritev(q->ef, iov, n, off);
+	if(res != (ssize_t)len){
+	    pthread_mutex_lock(&q->mtx);
+	    if(!q->error){
+		q->error = res < 0 ? (int)res : -EIO;
+	    }
+	    pthread_mutex_unlock(&q->mtx);
+	}
+	if(e == last){
+	    break;
+	}
+	e = e->next;
+    }
+
+    /* Unhook what we wrote; readers now find it on disk */
+    pthread_mutex_lock(&q->mtx);
+    done = q->head;
+    q->head = last->next;
+    last->next = NULL;
+    if(q->head == NULL){
+	q->tail = NULL;
+	q->end = 0;
+    }
+    pthread_mutex_unlock(&q->mtx);
+
+    pthread_rwlock_unlock(q->lock);
+
+    /* Recycle buffers and descriptors */
+    for(e = done; e != NULL; e = e->next){
+	bufpool_put(&wb->pool, e->data);
+    }
+    pthread_mutex_lock(&wb->mtx);
+    last->next = wb->free_descs;
+    wb->free_descs = done;
+    pthread_mutex_unlock(&wb->mtx);
+}
+
+/* Put q on the ready list. Called with q->mtx held. */
+static void make_ready(wb_engine* wb, wb_queue* q){
+    if(q->queued){
+	return;
+    }
+    q->queued = 1;
+    pthread_mutex_lock(&wb->mtx);
+    q->next_ready = NULL;
+    if(wb->ready_tail){
+	wb->ready_tail->next_ready = q;
+    }
+    else{
+	wb->ready_head = q;
+    }
+    wb->ready_tail = q;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->mtx);
+}
+
+static void* worker(void* arg){
+    wb_engine* wb = arg;
+    wb_queue* q;
+
+    for(;;){
+	pthread_mutex_lock(&wb->mtx);
+	while(!wb->ready_head && !wb->stop){
+	    pthread_cond_wait(&wb->work, &wb->mtx);
+	}
+	q = wb->ready_head;
+	if(!q){
+	    pthread_mutex_unlock(&wb->mtx);
+	    break;
+	}
+	wb->ready_head = q->next_ready;
+	if(!wb->ready_head){
+	    wb->ready_tail = NULL;
+	}
+	pthread_mutex_unlock(&wb->mtx);
+
+	flush_queue(wb, q);
+
+	/* More may have been staged meanwhile: go round again, in order */
+	pthread_mutex_lock(&q->mtx);
+	q->queued = 0;
+	if(q->head){
+	    make_ready(wb, q);
+	}
+	else{
+	    pthread_cond_broadcast(&q->drained);
+	}
+	pthread_mutex_unlock(&q->mtx);
+    }
+    return NULL;
+}
+
+extern int wb_init(wb_engine* wb, int nthreads, size_t max_bytes, int pool_flags){
+    size_t ndescs;
+    size_t i;
+    int res;
+
+    memset(wb, 0, sizeof(*wb));
+    if(nthreads < 1){
+	nthreads = 1;
+    }
+    res = bufpool_init(&wb->pool, ENCFS_BLOCK_SIZE, max_bytes, pool_flags);
+    if(res){
+	return res;
+    }
+
+    ndescs = wb->pool.max_bytes / wb->pool.block_size;
+    wb->descs = calloc(ndescs, sizeof(*wb->descs));
+    wb->threads = calloc(nthreads, sizeof(*wb->threads));
+    if(!wb->descs || !wb->threads){
+	free(wb->descs);
+	free(wb->threads);
+	bufpool_destroy(&wb->pool);
+	return -ENOMEM;
+    }
+    for(i = 0; i + 1 < ndescs; i++){
+	wb->descs[i].next = &wb->descs[i + 1];
+    }
+    wb->free_descs = wb->descs;
+
+    pthread_mutex_init(&wb->mtx, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    for(wb->nthreads = 0; wb->nthreads < nthreads; wb->nthreads++){
+	res = pthread_create(&wb->threads[wb->nthreads], NULL, worker, wb);
+	if(res){
+	    wb_shutdown(wb);
+	    return -res;
+	}
+    }
+    return 0;
+}
+
+extern void wb_shutdown(wb_engine* wb){
+    int i;
+
+    pthread_mutex_lock(&wb->mtx);
+    wb->stop = 1;
+    pthread_cond_broadcast(&wb->work);
+    pthread_mutex_unlock(&wb->mtx);
+    for(i = 0; i < wb->nthreads; i++){
+	pthread_join(wb->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&wb->work);
+    pthread_mutex_destroy(&wb->mtx);
+    bufpool_destroy(&wb->pool);
+    free(wb->descs);
+    free(wb->threads);
+}
+
+extern void wb_queue_init(wb_queue* q, encfs_file* ef, pthread_rwlock_t* lock){
+    memset(q, 0, sizeof(*q));
+    q->ef = ef;
+    q->lock = lock;
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_cond_init(&q->drained, NULL);
+}
+
+extern void wb_queue_destroy(wb_queue* q){
+    pthread_cond_destroy(&q->drained);
+    pthread_mutex_destroy(&q->mtx);
+}
+
+extern ssize_t wb_write(wb_engine* wb, wb_queue* q, const char* buf, size_t size, off_t offset){
+    size_t done = 0;
+    wb_extent* e;
+
+    if(offset < 0){
+	return -EINVAL;
+    }
+    while(done < size){
+	size_t n = ENCFS_BLOCK_SIZE - (offset + done) % ENCFS_BLOCK_SIZE;
+	char* data;
+
+	if(n > size - done){
+	    n = size - done;
+	}
+	/* Backpressure: blocks here while the staging area is full */
+	data = bufpool_get(&wb->pool);
+	if(!data){
+	    return done ? (ssize_t)done : -ENOMEM;
+	}
+	memcpy(data, buf + done, n);
+
+	/* Every pool buffer has a descriptor waiting for it */
+	pthread_mutex_lock(&wb->mtx);
+	e = wb->free_descs;
+	wb->free_descs = e->next;
+	pthread_mutex_unlock(&wb->mtx);
+
+	e->off = offset + done;
+	e->len = n;
+	e->data = data;
+	e->next = NULL;
+
+	pthread_mutex_lock(&q->mtx);
+	if(q->tail){
+	    q->tail->next = e;
+	}
+	else{
+	    q->head = e;
+	}
+	q->tail = e;
+	if((uint64_t)(e->off + n) > q->end){
+	    q->end = e->off + n;
+	}
+	make_ready(wb, q);
+	pthread_mutex_unlock(&q->mtx);
+
+	done += n;
+    }
+    return done;
+}
+
+extern uint64_t wb_size(wb_queue* q){
+    uint64_t size = q->ef->hdr.size;
+
+    pthread_mutex_lock(&q->mtx);
+    if(q->head && q->end > size){
+	size = q->end;
+    }
+    pthread_mutex_unlock(&q->mtx);
+    return size;
+}
+
+extern ssize_t wb_pread(wb_queue* q, char* buf, size_t size, off_t offset){
+    uint64_t fsize = q->ef->hdr.size;
+    wb_extent* head;
+    wb_extent* tail;
+    wb_extent* e;
+    ssize_t res;
+
+    pthread_mutex_lock(&q->mtx);
+    head = q->head;
+    tail = q->tail;
+    if(head && q->end > fsize){
+	fsize = q->end;
+    }
+    pthread_mutex_unlock(&q->mtx);
+
+    if(!head){
+	return encfs_pread(q->ef, buf, size, offset);
+    }
+    if(offset < 0){
+	return -EINVAL;
+    }
+    if((uint64_t)offset >= fsize){
+	return 0;
+    }
+    if(size > fsize - offset){
+	size = fsize - offset;
+    }
+
+    /* Disk contents first (zeros past its end), then staged data in order.
+     * The worker needs *q->lock for writing to unhook extents, so the
+     * snapshot stays valid while our caller holds it for reading. */
+    res = encfs_pread(q->ef, buf, size, offset);
+    if(res < 0){
+	return res;
+    }
+    memset(buf + res, 0, size - res);
+    for(e = head; e != NULL; e = e->next){
+	off_t lo = e->off > offset ? e->off : offset;
+	off_t hi = e->off + (off_t)e->len;
+
+	if(hi > offset + (off_t)size){
+	    hi = offset + size;
+	}
+	if(lo < hi){
+	    memcpy(buf + (lo - offset), e->data + (lo - e->off), hi - lo);
+	}
+	if(e == tail){
+	    break;
+	}
+    }
+    return size;
+}
+
+extern int wb_drain(wb_queue* q){
+    int res;
+
+    pthread_mutex_lock(&q->mtx);
+    while(q->head || q->queued){
+	pthread_cond_wait(&q->drained, &q->mtx);
+    }
+    res = q->error;
+    q->error = 0;
+    pthread_mutex_unlock(&q->mtx);
+    return res;
+}
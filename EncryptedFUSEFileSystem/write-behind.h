@@ -0,0 +1,108 @@
+/* write-behind.h
+ * Background write-behind encryption for pa4-encfs
+ *
+ * In write-behind mode a write only copies its data into a bounded staging
+ * area and returns. A small pool of worker threads later encrypts the staged
+ * extents and writes them to the backing file, in the order they were staged,
+ * holding the file's lock for writing. Until an extent reaches the disk, reads
+ * overlay it on top of what they decrypted, so readers always see their own
+ * writes. fsync(), flush() and release() wait for the file's queue to drain.
+ *
+ * The staging area comes from its own buffer pool, so its size is capped:
+ * writers block once it is full (backpressure).
+ *
+ */
+
+#ifndef WRITE_BEHIND_H
+#define WRITE_BEHIND_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "buf-pool.h"
+#include "encfs-block.h"
+
+#define WB_DEFAULT_THREADS 2
+#define WB_DEFAULT_MAX     32 /* MiB */
+#define WB_IOV_MAX         64 /* Extents written back per call */
+
+/* One staged write, at most ENCFS_BLOCK_SIZE bytes inside one block */
+typedef struct wb_extent {
+    off_t off;
+    size_t len;
+    char* data;                   /* Pool buffer */
+    struct wb_extent* next;
+} wb_extent;
+
+/* Per-file queue of staged extents, embedded in the open file */
+typedef struct wb_queue {
+    encfs_file* ef;
+    pthread_rwlock_t* lock;       /* The file's lock, taken to write back */
+    pthread_mutex_t mtx;          /* Protects everything below */
+    pthread_cond_t drained;
+    wb_extent* head;
+    wb_extent* tail;
+    uint64_t end;                 /* Highest staged byte + 1 */
+    int queued;                   /* On the ready list or being written */
+    int error;                    /* First write-back error, -errno */
+    struct wb_queue* next_ready;
+} wb_queue;
+
+typedef struct wb_engine {
+    int nthreads;
+    pthread_t* threads;
+    bufpool pool;                 /* Staged data */
+    wb_extent* descs;             /* One descriptor per pool buffer */
+    wb_extent* free_descs;
+    pthread_mutex_t mtx;
+    pthread_cond_t work;
+    wb_queue* ready_head;
+    wb_queue* ready_tail;
+    int stop;
+} wb_engine;
+
+/* int wb_init(wb_engine* wb, int nthreads, size_t max_bytes, int pool_flags)
+ * Purpose: Allocate the staging area and start the worker threads
+ * Return: 0 on success, -errno on error
+ */
+extern int wb_init(wb_engine* wb, int nthreads, size_t max_bytes, int pool_flags);
+
+/* void wb_shutdown(wb_engine* wb)
+ * Purpose: Write back everything still staged, stop the workers, free memory
+ */
+extern void wb_shutdown(wb_engine* wb);
+
+/* void wb_queue_init(wb_queue* q, encfs_file* ef, pthread_rwlock_t* lock) */
+extern void wb_queue_init(wb_queue* q, encfs_file* ef, pthread_rwlock_t* lock);
+
+/* void wb_queue_destroy(wb_queue* q)
+ * Purpose: Free a drained queue
+ */
+extern void wb_queue_destroy(wb_queue* q);
+
+/* ssize_t wb_write(wb_engine* wb, wb_queue* q, const char* buf, size_t size, off_t offset)
+ * Purpose: Stage a write, blocking only while the staging area is full
+ * Return: size on success, -errno on error
+ */
+extern ssize_t wb_write(wb_engine* wb, wb_queue* q, const char* buf, size_t size, off_t offset);
+
+/* ssize_t wb_pread(wb_queue* q, char* buf, size_t size, off_t offset)
+ * Purpose: encfs_pread() plus the staged extents and size of q.
+ *          Call with *q->lock held for reading.
+ * Return: Bytes read, -errno on error
+ */
+extern ssize_t wb_pread(wb_queue* q, char* buf, size_t size, off_t offset);
+
+/* uint64_t wb_size(wb_queue* q)
+ * Purpose: File size including staged writes
+ */
+extern uint64_t wb_size(wb_queue* q);
+
+/* int wb_drain(wb_queue* q)
+ * Purpose: Wait until nothing is staged for q. Must not hold *q->lock.
+ * Return: 0, or the first write-back error since the last drain
+ */
+extern int wb_drain(wb_queue* q);
+
+#endif
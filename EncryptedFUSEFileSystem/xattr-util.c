@@ -14,17 +14,52 @@
  *       For info on enabling xattr on EXT file systems, see
  *	 http://wiki.kaspersandberg.com/doku.php?id=howtos:xattr#getting_ea_s_enabled
  *
+ * Batch (-b) and recursive (-R) modes run one command over many paths in
+ * one process, on a pool of worker threads (see work-pool.h):
+ *
+ *   xattr-util -b [-j N] [-0] <command> <opt args>  paths from stdin
+ *   xattr-util -b [-j N]                            commands from stdin, one
+ *                                                   per line, fields split by
+ *                                                   tabs: -g<TAB>name<TAB>path
+ *   xattr-util -R [-j N] <command> <opt args> <dir> every entry below dir
+ *
+ * The recursive walk lists directories with getdents64() and reaches their
+ * entries through the directory descriptor (see dir-scan.h); subdirectories
+ * are handed back to the pool, so a wide tree is walked in parallel.
+ * Symbolic links are skipped: they can't carry user attributes. Paths and
+ * commands run in parallel, so results come out in no particular order.
+ *
+ * Output is one line per result, path and result split by a tab:
+ *
+ *   path<TAB>value         -g
+ *   path<TAB>name          -l, once per attribute
+ *   path<TAB>ok            -s, -r
+ *   path<TAB>!ENOATTR      or another error name, on failure
+ *
+ * Tabs, newlines, backslashes and other control bytes in paths and values
+ * are escaped (\t, \n, \\, \xHH). A count of results goes to stderr.
+ *
  */
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <sys/types.h>
 
+#include "dir-scan.h"
+#include "work-pool.h"
+
 #define CMDLS "-l"
 #define CMDSET "-s"
 #define CMDGET "-g"
@@ -34,6 +69,12 @@
 #define USAGE_SET CMDSET " <Attr Name> <Attr Value> <path>"
 #define USAGE_GET CMDGET " <Attr Name> <path>"
 #define USAGE_REM CMDREM " <Attr Name> <path>"
+#define USAGE_BATCH "-b [-j <threads>] [-0] [<command> <opt args>]"
+#define USAGE_TREE "-R [-j <threads>] <command> <opt args> <dir>"
+
+#define BATCH_OUT   65536     /* Output buffered per worker */
+#define BATCH_VALUE 65536     /* Largest value or name list (XATTR_SIZE_MAX) */
+#define BATCH_SCAN  65536     /* getdents64() buffer */
 
 #ifdef linux
 /* Linux is missing ENOATTR error, using ENODATA instead */
@@ -71,6 +112,419 @@ static void printUsageRem(char* pgmName){
 	    pgmName, USAGE_REM);    
 }
 
+/* ---- Batch and recursive modes ---- */
+
+/* One command: op is the letter of -l/-s/-g/-r */
+typedef struct xcmd {
+    char op;
+    char name[XATTR_NAME_MAX + 1];  /* With the user. prefix */
+    char* value;
+    size_t vlen;
+} xcmd;
+
+/* A path to run a command on, or a directory to walk */
+typedef struct xjob {
+    const xcmd* cmd;
+    xcmd own;                       /* Commands read from stdin */
+    int walk;
+    char path[];
+} xjob;
+
+/* Per worker output and scratch space */
+typedef struct xworker {
+    char out[BATCH_OUT];
+    size_t len;
+    char val[BATCH_VALUE];
+    char scan[BATCH_SCAN];
+} xworker;
+
+typedef struct xbatch {
+    const xcmd* cmd;
+    work_pool wp;
+    xworker* workers;
+    pthread_mutex_t out_lock;
+    unsigned long long results;     /* Updated with __sync builtins */
+    unsigned long long errors;
+} xbatch;
+
+/* Walk state for one directory */
+typedef struct xwalk {
+    xbatch* xb;
+    const xcmd* cmd;
+    const char* dir;
+    int worker;
+} xwalk;
+
+static const char* errName(int err){
+    switch(err){
+    case ENOATTR: return "ENOATTR";
+    case ENOENT: return "ENOENT";
+    case EACCES: return "EACCES";
+    case EPERM: return "EPERM";
+    case ENOTSUP: return "ENOTSUP";
+    case ERANGE: return "ERANGE";
+    case E2BIG: return "E2BIG";
+    case ENOSPC: return "ENOSPC";
+    case EDQUOT: return "EDQUOT";
+    case ENAMETOOLONG: return "ENAMETOOLONG";
+    case ENOTDIR: return "ENOTDIR";
+    case ELOOP: return "ELOOP";
+    case EIO: return "EIO";
+    case ENOMEM: return "ENOMEM";
+    default: return "EOTHER";
+    }
+}
+
+static void outFlush(xbatch* xb, xworker* w){
+    pthread_mutex_lock(&xb->out_lock);
+    fwrite(w->out, 1, w->len, stdout);
+    pthread_mutex_unlock(&xb->out_lock);
+    w->len = 0;
+}
+
+/* Append escaped bytes; room is checked by the caller */
+static void outEscaped(xworker* w, const char* s, size_t n){
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for(i = 0; i < n; i++){
+	unsigned char c = s[i];
+
+	if(c == '\t' || c == '\n' || c == '\\'){
+	    w->out[w->len++] = '\\';
+	    w->out[w->len++] = c == '\t' ? 't' : c == '\n' ? 'n' : '\\';
+	}
+	else if(c < 0x20 || c == 0x7f){
+	    w->out[w->len++] = '\\';
+	    w->out[w->len++] = 'x';
+	    w->out[w->len++] = hex[c >> 4];
+	    w->out[w->len++] = hex[c & 15];
+	}
+	else{
+	    w->out[w->len++] = c;
+	}
+    }
+}
+
+/* Emit "path<TAB>result". err selects "!ERRNAME" instead of res. */
+static void outLine(xbatch* xb, xworker* w, const char* path, const char* res,
+		    size_t rlen, int err){
+    size_t plen = strlen(path);
+
+    if(err){
+	res = errName(err);
+	rlen = strlen(res);
+	__sync_fetch_and_add(&xb->errors, 1);
+    }
+    else{
+	__sync_fetch_and_add(&xb->results, 1);
+    }
+    /* Worst case every byte takes four */
+    if(w->len + 4 * (plen + rlen) + 3 > BATCH_OUT){
+	outFlush(xb, w);
+	if(4 * (plen + rlen) + 3 > BATCH_OUT){
+	    plen = plen < BATCH_OUT / 8 ? plen : BATCH_OUT / 8;
+	    rlen = rlen < BATCH_OUT / 8 ? rlen : BATCH_OUT / 8;
+	}
+    }
+    outEscaped(w, path, plen);
+    w->out[w->len++] = '\t';
+    if(err){
+	w->out[w->len++] = '!';
+	memcpy(w->out + w->len, res, rlen);
+	w->len += rlen;
+    }
+    else{
+	outEscaped(w, res, rlen);
+    }
+    w->out[w->len++] = '\n';
+}
+
+/* Run cmd on the file open as fd, or on path itself when fd is -1 */
+static void runCmd(xbatch* xb, xworker* w, const xcmd* cmd, int fd, const char* path){
+    ssize_t n;
+    char* p;
+
+    switch(cmd->op){
+    case 'l':
+	n = fd != -1 ? flistxattr(fd, w->val, sizeof(w->val))
+	             : llistxattr(path, w->val, sizeof(w->val));
+	if(n < 0){
+	    outLine(xb, w, path, NULL, 0, errno);
+	    break;
+	}
+	for(p = w->val; p < w->val + n; p += strlen(p) + 1){
+	    outLine(xb, w, path, p, strlen(p), 0);
+	}
+	break;
+    case 'g':
+	n = fd != -1 ? fgetxattr(fd, cmd->name, w->val, sizeof(w->val))
+	             : lgetxattr(path, cmd->name, w->val, sizeof(w->val));
+	outLine(xb, w, path, w->val, n < 0 ? 0 : n, n < 0 ? errno : 0);
+	break;
+    case 's':
+	n = fd != -1 ? fsetxattr(fd, cmd->name, cmd->value, cmd->vlen, 0)
+	             : lsetxattr(path, cmd->name, cmd->value, cmd->vlen, 0);
+	outLine(xb, w, path, "ok", 2, n < 0 ? errno : 0);
+	break;
+    case 'r':
+	n = fd != -1 ? fremovexattr(fd, cmd->name)
+	             : lremovexattr(path, cmd->name);
+	outLine(xb, w, path, "ok", 2, n < 0 ? errno : 0);
+	break;
+    }
+}
+
+static int walkEntry(void* arg, int dirfd, const char* name, ino_t ino,
+		     unsigned char type, off_t next){
+    xwalk* wk = arg;
+    xbatch* xb = wk->xb;
+    xworker* w = &xb->workers[wk->worker];
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    (void)ino;
+    (void)next;
+    if(!strcmp(name, ".") || !strcmp(name, "..")){
+	return 0;
+    }
+    if(snprintf(path, sizeof(path), "%s/%s", wk->dir, name) >= (int)sizeof(path)){
+	outLine(xb, w, wk->dir, NULL, 0, ENAMETOOLONG);
+	return 0;
+    }
+    if(type == DT_UNKNOWN){
+	type = dir_stat(dirfd, name, &st) ? DT_UNKNOWN :
+	    S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+    }
+    if(type == DT_LNK){
+	return 0;
+    }
+    if(type == DT_DIR){
+	size_t len = strlen(path) + 1;
+	xjob* job = malloc(sizeof(*job) + len);
+
+	if(job == NULL){
+	    outLine(xb, w, path, NULL, 0, ENOMEM);
+	    return 0;
+	}
+	job->cmd = wk->cmd;
+	job->walk = 1;
+	memcpy(job->path, path, len);
+	if(work_pool_spawn(&xb->wp, job, wk->worker)){
+	    free(job);
+	    outLine(xb, w, path, NULL, 0, ENOMEM);
+	}
+	return 0;
+    }
+    /* Regular files through the directory: no path lookup per entry.
+     * Devices and fifos by path, opening them could have side effects. */
+    fd = type == DT_REG ? dir_open_entry(dirfd, name) : -1;
+    runCmd(xb, w, wk->cmd, fd < 0 ? -1 : fd, path);
+    if(fd >= 0){
+	close(fd);
+    }
+    return 0;
+}
+
+static void batchJob(void* arg, void* item, int worker){
+    xbatch* xb = arg;
+    xjob* job = item;
+    xworker* w = &xb->workers[worker];
+    xwalk wk;
+    int fd;
+    int res;
+
+    if(!job->walk){
+	runCmd(xb, w, job->cmd, -1, job->path);
+    }
+    else{
+	/* The directory itself, then its entries */
+	fd = dir_open(job->path);
+	if(fd < 0){
+	    outLine(xb, w, job->path, NULL, 0, -fd);
+	}
+	else{
+	    runCmd(xb, w, job->cmd, fd, job->path);
+	    wk.xb = xb;
+	    wk.cmd = job->cmd;
+	    wk.dir = job->path;
+	    wk.worker = worker;
+	    res = dir_scan(fd, 0, w->scan, sizeof(w->scan), walkEntry, &wk);
+	    if(res < 0){
+		outLine(xb, w, job->path, NULL, 0, -res);
+	    }
+	    close(fd);
+	}
+    }
+    if(job->own.value != NULL){
+	free(job->own.value);
+    }
+    free(job);
+}
+
+/* Fill cmd from "-x" and its arguments; returns the arguments used, or -1 */
+static int parseCmd(xcmd* cmd, char** args, int nargs){
+    int need;
+
+    memset(cmd, 0, sizeof(*cmd));
+    if(nargs < 1 || strlen(args[0]) != 2 || args[0][0] != '-' ||
+       !strchr("lsgr", args[0][1])){
+	return -1;
+    }
+    cmd->op = args[0][1];
+    need = cmd->op == 'l' ? 1 : cmd->op == 's' ? 3 : 2;
+    if(nargs < need){
+	return -1;
+    }
+    if(need > 1 && snprintf(cmd->name, sizeof(cmd->name), "%s%s", XATTR_USER_PREFIX,
+			    args[1]) >= (int)sizeof(cmd->name)){
+	return -1;
+    }
+    if(need > 2){
+	cmd->value = args[2];
+	cmd->vlen = strlen(args[2]);
+    }
+    return need;
+}
+
+static int batchMain(int argc, char* argv[]){
+    xbatch xb;
+    xcmd cmd;
+    xjob* job;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int tree = !strcmp(argv[1], "-R");
+    int delim = '\n';
+    int arg = 2;
+    int used = 0;
+    int res;
+    int i;
+    double start;
+    double secs;
+    struct timespec ts;
+
+    while(arg < argc && (!strcmp(argv[arg], "-j") || !strcmp(argv[arg], "-0"))){
+	if(argv[arg][1] == '0'){
+	    delim = '\0';
+	    arg++;
+	}
+	else if(arg + 1 < argc){
+	    nthreads = strtol(argv[arg + 1], NULL, 10);
+	    arg += 2;
+	}
+	else{
+	    break;
+	}
+    }
+    if(arg < argc){
+	used = parseCmd(&cmd, argv + arg, argc - arg);
+    }
+    if(used < 0 || (tree && (used == 0 || arg + used + 1 != argc)) ||
+       (!tree && arg + used != argc)){
+	fprintf(stderr, "Usage: %s %s\n       %s %s\n", argv[0], USAGE_BATCH,
+		argv[0], USAGE_TREE);
+	return EXIT_FAILURE;
+    }
+    if(nthreads < 1 || nthreads > WORK_POOL_MAX){
+	nthreads = nthreads < 1 ? 1 : WORK_POOL_MAX;
+    }
+
+    memset(&xb, 0, sizeof(xb));
+    xb.cmd = used ? &cmd : NULL;
+    xb.workers = calloc(nthreads, sizeof(*xb.workers));
+    if(xb.workers == NULL){
+	perror("calloc of 'workers' error");
+	return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&xb.out_lock, NULL);
+    res = work_pool_start(&xb.wp, (int)nthreads, batchJob, &xb);
+    if(res){
+	fprintf(stderr, "thread pool error: %s\n", strerror(-res));
+	return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    if(tree){
+	const char* root = argv[argc - 1];
+
+	job = malloc(sizeof(*job) + strlen(root) + 1);
+	if(job != NULL){
+	    job->cmd = xb.cmd;
+	    job->own.value = NULL;
+	    job->walk = 1;
+	    strcpy(job->path, root);
+	    if(work_pool_push(&xb.wp, job)){
+		free(job);
+	    }
+	}
+    }
+    while(!tree && (len = getdelim(&line, &cap, delim, stdin)) != -1){
+	char* fields[5];
+	char* save;
+	int n = 0;
+
+	if(len > 0 && line[len - 1] == delim){
+	    line[--len] = '\0';
+	}
+	if(len == 0){
+	    continue;
+	}
+	job = malloc(sizeof(*job) + len + 1);
+	if(job == NULL){
+	    perror("malloc of 'job' error");
+	    break;
+	}
+	job->walk = 0;
+	job->cmd = xb.cmd;
+	job->own.value = NULL;
+	if(xb.cmd != NULL){
+	    memcpy(job->path, line, len + 1);
+	}
+	else{
+	    /* -g<TAB>name<TAB>path and so on: the path is the last field */
+	    for(fields[n] = strtok_r(line, "\t", &save); fields[n] != NULL && n < 4;
+		fields[++n] = strtok_r(NULL, "\t", &save)){
+		;
+	    }
+	    used = parseCmd(&job->own, fields, n);
+	    if(used < 0 || used + 1 != n){
+		fprintf(stderr, "Bad command line: %s\n", line);
+		free(job);
+		continue;
+	    }
+	    if(job->own.value != NULL){
+		job->own.value = strdup(job->own.value);
+	    }
+	    strcpy(job->path, fields[n - 1]);
+	    job->cmd = &job->own;
+	}
+	if(work_pool_push(&xb.wp, job)){
+	    free(job->own.value);
+	    free(job);
+	}
+    }
+    free(line);
+
+    work_pool_finish(&xb.wp);
+    for(i = 0; i < nthreads; i++){
+	outFlush(&xb, &xb.workers[i]);
+    }
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    secs = ts.tv_sec + ts.tv_nsec / 1e9 - start;
+    fprintf(stderr, "%llu results, %llu errors in %.2f s (%.0f/s, %ld threads)\n",
+	    xb.results, xb.errors, secs, secs > 0 ? (xb.results + xb.errors) / secs : 0.0,
+	    nthreads);
+
+    free(xb.workers);
+    pthread_mutex_destroy(&xb.out_lock);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[]){
 
     /* Local vars */
@@ -90,7 +544,10 @@ int main(int argc, char* argv[]){
     }
     
     /* Parse Command */
-    if(!strcmp(argv[1], CMDLS)){
+    if(!strcmp(argv[1], "-b") || !strcmp(argv[1], "-R")){
+	return batchMain(argc, argv);
+    }
+    else if(!strcmp(argv[1], CMDLS)){
 	/* List Case */
 	/* Check proper input */
 	if(argc != 3){
@@ -0,0 +1,153 @@
+/*
+ * Throughput of the shared array at 1-64 threads.
+ *
+ * Half the threads push, half pop, between them moving OPS values. The
+ * 1-thread row runs one producer and one consumer too, the same as the
+ * 2-thread row: a lone thread would fill the ring and wait forever. The
+ * same run goes through a plain mutex/condition-variable ring for
+ * comparison.
+ *
+ * Usage: ./array-bench [capacity]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sharedArray.h"
+
+#define OPS 1000000 //Values moved per run
+#define MAX_THREADS 64
+
+//Baseline: one lock, two condition variables.
+typedef struct {
+	void** slots;
+	int size;
+	int count;
+	int front;
+	pthread_mutex_t lock;
+	pthread_cond_t notFull;
+	pthread_cond_t notEmpty;
+} lockedArray;
+
+static array ring;
+static lockedArray locked;
+static int useRing;
+
+static void lockedPush(lockedArray* a, void* value) {
+	pthread_mutex_lock(&a->lock);
+	while(a->count == a->size) {
+		pthread_cond_wait(&a->notFull, &a->lock);
+	}
+	a->slots[(a->front + a->count++) % a->size] = value;
+	pthread_cond_signal(&a->notEmpty);
+	pthread_mutex_unlock(&a->lock);
+}
+
+static void* lockedPop(lockedArray* a) {
+	void* value;
+
+	pthread_mutex_lock(&a->lock);
+	while(a->count == 0) {
+		pthread_cond_wait(&a->notEmpty, &a->lock);
+	}
+	value = a->slots[a->front];
+	a->front = (a->front + 1) % a->size;
+	a->count--;
+	pthread_cond_signal(&a->notFull);
+	pthread_mutex_unlock(&a->lock);
+	return value;
+}
+
+static void* producer(void* arg) {
+	long n = (long) arg;
+	long i;
+
+	for(i = 1; i <= n; i++) {
+		if(useRing) {
+			pushToArray(&ring, (void*) i);
+		} else {
+			lockedPush(&locked, (void*) i);
+		}
+	}
+	return NULL;
+}
+
+static void* consumer(void* arg) {
+	long n = (long) arg;
+	long i;
+
+	for(i = 0; i < n; i++) {
+		if(useRing) {
+			popFromArray(&ring);
+		} else {
+			lockedPop(&locked);
+		}
+	}
+	return NULL;
+}
+
+//Runs one producer/consumer mix and returns values moved per second.
+static double run(int threads) {
+	pthread_t tids[MAX_THREADS];
+	int producers = threads > 1 ? threads / 2 : 1;
+	int consumers = threads > 1 ? threads - producers : 1;
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < producers; i++) {
+		pthread_create(&tids[i], NULL, producer,
+			       (void*) (long) (OPS / producers + (i < OPS % producers)));
+	}
+	for(i = 0; i < consumers; i++) {
+		pthread_create(&tids[producers + i], NULL, consumer,
+			       (void*) (long) (OPS / consumers + (i < OPS % consumers)));
+	}
+	for(i = 0; i < producers + consumers; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return OPS / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char* argv[]) {
+	int size = argc > 1 ? atoi(argv[1]) : ARRAY_SIZE;
+	int threads;
+
+	if((size = arrayInit(&ring, size)) < 0) {
+		return(EXIT_FAILURE);
+	}
+	locked.slots = malloc(sizeof(void*) * size);
+	if(!locked.slots) {
+		perror("Error on array Malloc");
+		return(EXIT_FAILURE);
+	}
+	locked.size = size;
+	pthread_mutex_init(&locked.lock, NULL);
+	pthread_cond_init(&locked.notFull, NULL);
+	pthread_cond_init(&locked.notEmpty, NULL);
+
+	printf("capacity %d, %d values per run\n", size, OPS);
+	printf("%8s %16s %16s\n", "threads", "lock-free ops/s", "mutex ops/s");
+	for(threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double lockFree, mutex;
+
+		useRing = 1;
+		lockFree = run(threads);
+		useRing = 0;
+		mutex = run(threads);
+		printf("%8d %16.0f %16.0f\n", threads, lockFree, mutex);
+	}
+
+	pthread_cond_destroy(&locked.notEmpty);
+	pthread_cond_destroy(&locked.notFull);
+	pthread_mutex_destroy(&locked.lock);
+	free(locked.slots);
+	freeArrayMemory(&ring);
+
+	return(EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+/*
+ * A stand-in DNS server for trying the asynchronous resolver offline.
+ *
+ * Answers A queries on 127.0.0.1 with made-up but stable addresses:
+ *   localhost        -> 127.0.0.1
+ *   invalid*         -> NXDOMAIN
+ *   www.<name>       -> CNAME <name>, then <name>'s address
+ *   anything else    -> 10.x.y.z, from a hash of the name
+ * and ignores dropPercent% of the queries it gets, so that timeouts and
+ * retransmits get exercised.
+ *
+ * Usage: ./dns-stub [port] [dropPercent]
+ *        DNS_SERVER=127.0.0.1:<port> ./multi-lookup ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define STUB_PORT 5353
+#define PACKET_MAX 512
+
+static unsigned char* putRecord(unsigned char* p, int nameOffset, int type, const unsigned char* data, int length) {
+	p[0] = 0xc0 | (nameOffset >> 8); //Name: a pointer into the question
+	p[1] = nameOffset & 0xff;
+	p[2] = 0;
+	p[3] = type;
+	p[4] = 0;
+	p[5] = 1; //Class IN
+	p[6] = 0;
+	p[7] = 0;
+	p[8] = 0x0e;
+	p[9] = 0x10; //TTL: an hour
+	p[10] = 0;
+	p[11] = length;
+	memcpy(p + 12, data, length);
+	return p + 12 + length;
+}
+
+//Builds the reply to a query in place. Returns its length, -1 to ignore the query.
+static int answer(unsigned char* packet, int length) {
+	char name[256];
+	unsigned char address[4];
+	unsigned char pointer[2];
+	unsigned char* p = packet + 12;
+	unsigned char* end;
+	int nameLength = 0;
+	int target = 12; //Offset of the name the address is for
+	unsigned int hash = 2166136261u;
+	int i;
+
+	if (length < 12 || (packet[2] & 0x80) || packet[4] != 0 || packet[5] != 1) {
+		return -1;
+	}
+	//The question's name, as text
+	while (p < packet + length && *p != 0) {
+		if (*p > 63 || p + 1 + *p >= packet + length || nameLength + *p + 1 > 255) {
+			return -1;
+		}
+		if (nameLength) {
+			name[nameLength++] = '.';
+		}
+		memcpy(name + nameLength, p + 1, *p);
+		nameLength += *p;
+		p += 1 + *p;
+	}
+	//Room for the question and two answers
+	if (p + 5 > packet + length || p + 5 + 2 * 16 > packet + PACKET_MAX) {
+		return -1;
+	}
+	name[nameLength] = '\0';
+	end = p + 5; //Past the root label, type and class
+
+	packet[2] = 0x80 | (packet[2] & 0x01); //QR, RD as asked
+	packet[3] = 0x80; //RA
+	memset(packet + 6, 0, 6);
+
+	if (strncasecmp(name, "invalid", 7) == 0) {
+		packet[3] |= 3; //NXDOMAIN
+		return end - packet;
+	}
+	if (p[1] != 0 || p[2] != 1) {
+		return end - packet; //Not an A query: no answers
+	}
+
+	if (strncasecmp(name, "www.", 4) == 0 && nameLength > 4) {
+		target = 12 + 4;
+		pointer[0] = 0xc0;
+		pointer[1] = target;
+		end = putRecord(end, 12, 5, pointer, 2); //CNAME
+		packet[7]++;
+	}
+	if (strcasecmp(name + target - 12, "localhost") == 0) {
+		address[0] = 127;
+		address[1] = 0;
+		address[2] = 0;
+		address[3] = 1;
+	} else {
+		for (i = target - 12; i < nameLength; i++) {
+			hash = (hash ^ tolower((unsigned char) name[i])) * 16777619u;
+		}
+		address[0] = 10;
+		address[1] = hash >> 16;
+		address[2] = hash >> 8;
+		address[3] = hash;
+	}
+	end = putRecord(end, target, 1, address, 4);
+	packet[7]++;
+	return end - packet;
+}
+
+int main(int argc, char* argv[]) {
+	int port = argc > 1 ? atoi(argv[1]) : STUB_PORT;
+	int dropPercent = argc > 2 ? atoi(argv[2]) : 0;
+	struct sockaddr_in addr;
+	unsigned char packet[PACKET_MAX];
+	int bufferSize = 1 << 22;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("Error: socket");
+		return(EXIT_FAILURE);
+	}
+	//Room for every query a few resolvers can have out at once
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		perror("Error: bind");
+		return(EXIT_FAILURE);
+	}
+	printf("Answering on 127.0.0.1:%d, dropping %d%% of queries.\n", port, dropPercent);
+	fflush(stdout);
+
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t fromLength = sizeof(from);
+		int length = recvfrom(fd, packet, sizeof(packet), 0, (struct sockaddr*) &from, &fromLength);
+
+		if (length < 0 || rand() % 100 < dropPercent) {
+			continue;
+		}
+		length = answer(packet, length);
+		if (length > 0) {
+			sendto(fd, packet, length, 0, (struct sockaddr*) &from, fromLength);
+		}
+	}
+}
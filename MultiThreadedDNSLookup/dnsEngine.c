@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+#include "dnsEngine.h"
+
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#define RECV_BATCH 64          /* Replies read per recvmmsg() */
+#define RECV_BUFFER (1 << 20)  /* Socket buffer for bursts of replies */
+
+#define FLAG_QR 0x8000
+#define FLAG_TC 0x0200
+#define FLAG_RD 0x0100
+#define TYPE_A 1
+#define CLASS_IN 1
+
+
+static long long nowMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void put16(unsigned char* p, unsigned int v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static unsigned int get16(const unsigned char* p) {
+    return (p[0] << 8) | p[1];
+}
+
+/* Header, then the name as labels, then type A, class IN. Returns the
+ * length, -1 if hostname can't be a DNS name. */
+static int encodeQuery(unsigned char* packet, uint16_t id, const char* hostname) {
+    unsigned char* p = packet + 12;
+    const char* label = hostname;
+    const char* end;
+    size_t length;
+
+    memset(packet, 0, 12);
+    put16(packet, id);
+    put16(packet + 2, FLAG_RD);
+    put16(packet + 4, 1);
+
+    while(*label){
+	end = strchr(label, '.');
+	length = end ? (size_t)(end - label) : strlen(label);
+	if(length == 0 || length > 63 || (p - packet) + 1 + length + 1 > 12 + 255){
+	    return -1;
+	}
+	*p++ = length;
+	memcpy(p, label, length);
+	p += length;
+	label += length;
+	if(*label == '.'){
+	    label++;
+	}
+    }
+    if(p == packet + 12){
+	return -1;
+    }
+    *p++ = 0;
+    put16(p, TYPE_A);
+    put16(p + 2, CLASS_IN);
+    return p + 4 - packet;
+}
+
+/* Past the name at pos, without following compression pointers. Returns
+ * -1 if it runs off the end. */
+static int skipName(const unsigned char* buf, int len, int pos) {
+    while(pos < len){
+	if(buf[pos] == 0){
+	    return pos + 1;
+	}
+	if((buf[pos] & 0xc0) == 0xc0){
+	    return pos + 2 <= len ? pos + 2 : -1;
+	}
+	if(buf[pos] & 0xc0){
+	    return -1;
+	}
+	pos += 1 + buf[pos];
+    }
+    return -1;
+}
+
+static void listRemove(dns_engine* e, int slot) {
+    dns_query* q = &e->queries[slot];
+
+    if(q->prev >= 0){
+	e->queries[q->prev].next = q->next;
+    }
+    else{
+	e->head = q->next;
+    }
+    if(q->next >= 0){
+	e->queries[q->next].prev = q->prev;
+    }
+    else{
+	e->tail = q->prev;
+    }
+}
+
+/* Puts a query on the timeout list in deadline order. A normal send
+ * expires last and goes on the end; a send retried soon goes in among the
+ * earliest deadlines, found from the front. */
+static void listInsert(dns_engine* e, int slot) {
+    dns_query* q = &e->queries[slot];
+    int next = -1;
+
+    if(e->tail >= 0 && e->queries[e->tail].deadline > q->deadline){
+	next = e->head;
+	while(e->queries[next].deadline <= q->deadline){
+	    next = e->queries[next].next;
+	}
+    }
+    q->next = next;
+    q->prev = next >= 0 ? e->queries[next].prev : e->tail;
+    if(q->prev >= 0){
+	e->queries[q->prev].next = slot;
+    }
+    else{
+	e->head = slot;
+    }
+    if(next >= 0){
+	e->queries[next].prev = slot;
+    }
+    else{
+	e->tail = slot;
+    }
+}
+
+/* Sends (or resends) a query and puts it on the timeout list. A send the
+ * kernel had no room for isn't counted, and is retried soon. */
+static void sendQuery(dns_engine* e, int slot, long long now) {
+    dns_query* q = &e->queries[slot];
+    long long wait = DNS_TIMEOUT_MS;
+
+    if(send(e->fd, q->packet, q->length, 0) == q->length){
+	q->tries++;
+    }
+    else if(errno == EAGAIN || errno == ENOBUFS || errno == EINTR){
+	wait = 1;
+    }
+    else{
+	q->tries++;  /* E.g. ECONNREFUSED: counts as lost */
+    }
+    q->deadline = now + wait;
+    listInsert(e, slot);
+}
+
+static void finish(dns_engine* e, int slot, dns_result* result, int status, const char* ip) {
+    dns_query* q = &e->queries[slot];
+
+    result->tag = q->tag;
+    result->status = status;
+    strncpy(result->ip, ip, sizeof(result->ip));
+    result->ip[sizeof(result->ip)-1] = '\0';
+
+    listRemove(e, slot);
+    q->inUse = 0;
+    q->tag = NULL;
+    e->freeSlots[e->numFree++] = slot;
+}
+
+/* Finishes the query a reply is for. Returns 1 if it did, 0 if the reply
+ * is not for any query of ours. */
+static int decodeReply(dns_engine* e, const unsigned char* buf, int len, dns_result* result) {
+    dns_query* q;
+    unsigned int flags;
+    char ip[INET6_ADDRSTRLEN];
+    int slot, answers, pos, i;
+
+    if(len < 12){
+	return 0;
+    }
+    slot = get16(buf) & (e->capacity - 1);
+    q = &e->queries[slot];
+    flags = get16(buf + 2);
+    if(!q->inUse || q->id != get16(buf) || !(flags & FLAG_QR) || get16(buf + 4) != 1){
+	return 0;
+    }
+    /* Same question, up to case */
+    if(len < q->length){
+	return 0;
+    }
+    for(i = 12; i < q->length; i++){
+	if(tolower(buf[i]) != tolower(q->packet[i])){
+	    return 0;
+	}
+    }
+
+    if((flags & FLAG_TC) || (flags & 0xf) != 0){
+	finish(e, slot, result, UTIL_FAILURE, "");
+	return 1;
+    }
+    answers = get16(buf + 6);
+    pos = q->length;
+    for(i = 0; i < answers; i++){
+	pos = skipName(buf, len, pos);
+	if(pos < 0 || pos + 10 > len || pos + 10 + (int)get16(buf + pos + 8) > len){
+	    break;
+	}
+	if(get16(buf + pos) == TYPE_A && get16(buf + pos + 2) == CLASS_IN &&
+	   get16(buf + pos + 8) == 4){
+	    inet_ntop(AF_INET, buf + pos + 10, ip, sizeof(ip));
+	    finish(e, slot, result, UTIL_SUCCESS, ip);
+	    break;
+	}
+	pos += 10 + get16(buf + pos + 8);
+    }
+    if(q->inUse){
+	finish(e, slot, result, UTIL_FAILURE, "");  /* No address (e.g. only a CNAME) */
+    }
+    if(e->window < e->capacity){
+	e->window++;
+    }
+    return 1;
+}
+
+static int readReplies(dns_engine* e, dns_result* results, int max) {
+    static __thread unsigned char buffers[RECV_BATCH][DNS_PACKET_MAX];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+    int count = 0;
+    int n, i;
+
+    while(count < max){
+	n = max - count < RECV_BATCH ? max - count : RECV_BATCH;
+	for(i = 0; i < n; i++){
+	    iovs[i].iov_base = buffers[i];
+	    iovs[i].iov_len = DNS_PACKET_MAX;
+	    memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+	    msgs[i].msg_hdr.msg_iov = &iovs[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg(e->fd, msgs, n, MSG_DONTWAIT, NULL);
+	if(n < 0){
+	    if(errno == EINTR || errno == ECONNREFUSED){
+		continue;  /* A refused send showing up; its query times out */
+	    }
+	    break;
+	}
+	for(i = 0; i < n; i++){
+	    count += decodeReply(e, buffers[i], msgs[i].msg_len, &results[count]);
+	}
+	if(n == 0){
+	    break;
+	}
+    }
+    return count;
+}
+
+/* Resends what timed out and gives up on what has had its tries */
+static int expire(dns_engine* e, dns_result* results, int max, long long now) {
+    int count = 0;
+    int slot;
+
+    while(count < max && e->head >= 0 && e->queries[e->head].deadline <= now){
+	slot = e->head;
+	if(e->queries[slot].tries > 0 && now - e->lastCut >= DNS_TIMEOUT_MS){
+	    e->window = e->window > 1 ? e->window / 2 : 1;
+	    e->lastCut = now;
+	}
+	if(e->queries[slot].tries >= DNS_TRIES){
+	    finish(e, slot, &results[count++], UTIL_FAILURE, "");
+	}
+	else{
+	    listRemove(e, slot);
+	    sendQuery(e, slot, now);
+	}
+    }
+    return count;
+}
+
+int dnsEngineInit(dns_engine* e, const char* server, int size) {
+    struct sockaddr_in addr;
+    struct epoll_event ev;
+    char host[INET_ADDRSTRLEN];
+    const char* colon = strchr(server, ':');
+    size_t length = colon ? (size_t)(colon - server) : strlen(server);
+    int bufferSize = RECV_BUFFER;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(colon ? atoi(colon + 1) : DNS_PORT);
+    if(length >= sizeof(host)){
+	length = sizeof(host) - 1;
+    }
+    memcpy(host, server, length);
+    host[length] = '\0';
+    if(inet_pton(AF_INET, host, &addr.sin_addr) != 1 || addr.sin_port == 0){
+	fprintf(stderr, "Error: bad DNS server address: %s\n", server);
+	return -1;
+    }
+
+    e->capacity = 1;
+    while(e->capacity < size && e->capacity < DNS_MAX_IN_FLIGHT){
+	e->capacity <<= 1;
+    }
+    e->queries = calloc(e->capacity, sizeof(dns_query));
+    e->freeSlots = malloc(sizeof(int) * e->capacity);
+    if(!e->queries || !e->freeSlots){
+	perror("Error on engine Malloc");
+	free(e->queries);
+	free(e->freeSlots);
+	return -1;
+    }
+    for(i = 0; i < e->capacity; i++){
+	e->queries[i].id = i;
+	e->freeSlots[i] = e->capacity - 1 - i;
+    }
+    e->numFree = e->capacity;
+    e->window = e->capacity;
+    e->lastCut = 0;
+    e->head = e->tail = -1;
+
+    e->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(e->fd < 0 || e->epfd < 0){
+	perror("Error creating DNS socket");
+	goto fail;
+    }
+    setsockopt(e->fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    if(connect(e->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+	perror("Error connecting DNS socket");
+	goto fail;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if(epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->fd, &ev) < 0){
+	perror("Error on epoll_ctl");
+	goto fail;
+    }
+    return e->capacity;
+
+fail:
+    if(e->fd >= 0){
+	close(e->fd);
+    }
+    if(e->epfd >= 0){
+	close(e->epfd);
+    }
+    free(e->queries);
+    free(e->freeSlots);
+    return -1;
+}
+
+int dnsEngineSubmit(dns_engine* e, const char* hostname, void* tag) {
+    dns_query* q;
+    int slot, length;
+
+    if(dnsEngineRoom(e) == 0){
+	return 1;
+    }
+    slot = e->freeSlots[e->numFree - 1];
+    q = &e->queries[slot];
+    /* A new ID for the slot: the high bits count its uses */
+    q->id = (uint16_t)(q->id + e->capacity);
+    length = encodeQuery(q->packet, q->id, hostname);
+    if(length < 0){
+	return -1;
+    }
+    e->numFree--;
+    q->length = length;
+    q->inUse = 1;
+    q->tries = 0;
+    q->tag = tag;
+    sendQuery(e, slot, nowMs());
+    return 0;
+}
+
+int dnsEnginePoll(dns_engine* e, dns_result* results, int max, int timeoutMs) {
+    struct epoll_event ev;
+    long long now;
+    int count;
+
+    count = readReplies(e, results, max);
+    now = nowMs();
+    if(count == 0 && e->head >= 0 && timeoutMs > 0){
+	if(e->queries[e->head].deadline - now < timeoutMs){
+	    timeoutMs = e->queries[e->head].deadline > now ?
+		e->queries[e->head].deadline - now : 0;
+	}
+	if(epoll_wait(e->epfd, &ev, 1, timeoutMs) > 0){
+	    count = readReplies(e, results, max);
+	}
+	now = nowMs();
+    }
+    return count + expire(e, results + count, max - count, now);
+}
+
+int dnsEngineInFlight(dns_engine* e) {
+    return e->capacity - e->numFree;
+}
+
+int dnsEngineRoom(dns_engine* e) {
+    int room = e->window - dnsEngineInFlight(e);
+
+    return room > 0 ? room : 0;
+}
+
+void dnsEngineFree(dns_engine* e) {
+    close(e->fd);
+    close(e->epfd);
+    free(e->queries);
+    free(e->freeSlots);
+}
+
+
+static pthread_key_t lookupKey;
+static pthread_once_t lookupOnce = PTHREAD_ONCE_INIT;
+
+static void freeLookupEngine(void* engine) {
+    dnsEngineFree(engine);
+    free(engine);
+}
+
+static void makeLookupKey(void) {
+    pthread_key_create(&lookupKey, freeLookupEngine);
+}
+
+int dnsEngineLookup(const char* hostname, char* firstIPstr, int maxSize) {
+    dns_engine* e;
+    dns_result result;
+
+    pthread_once(&lookupOnce, makeLookupKey);
+    e = pthread_getspecific(lookupKey);
+    if(!e){
+	e = malloc(sizeof(dns_engine));
+	if(!e || dnsEngineInit(e, getenv(DNS_SERVER_ENV), 1) < 0){
+	    free(e);
+	    return UTIL_FAILURE;
+	}
+	pthread_setspecific(lookupKey, e);
+    }
+
+    if(dnsEngineSubmit(e, hostname, NULL) != 0){
+	return UTIL_FAILURE;
+    }
+    while(dnsEnginePoll(e, &result, 1, DNS_TIMEOUT_MS) == 0){
+    }
+    if(result.status == UTIL_SUCCESS){
+	strncpy(firstIPstr, result.ip, maxSize);
+	firstIPstr[maxSize-1] = '\0';
+    }
+    return result.status;
+}
@@ -0,0 +1,96 @@
+#ifndef DNS_ENGINE_H
+#define DNS_ENGINE_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "util.h"
+
+/*
+ * Event-driven DNS client: many A queries in flight on one UDP socket.
+ *
+ * Queries are encoded here and sent to one server (a recursive resolver,
+ * or dns-stub for testing) over a connected, non-blocking socket, so only
+ * that server's replies get in. Replies are matched to queries by
+ * transaction ID: the low bits pick the slot, the high bits count how often
+ * the slot was used, so a late reply to an old query is dropped. The
+ * question in the reply must also be ours.
+ *
+ * A query that gets no reply within DNS_TIMEOUT_MS is sent again, and given
+ * up on after DNS_TRIES sends. Timeouts live on a list in deadline order,
+ * so the next one to expire is always first: a send goes on the end, and
+ * a send the kernel had no room for (retried in a millisecond) near the
+ * front.
+ * Timeouts usually mean a buffer overflowed somewhere, so they also halve
+ * how many queries may be out (at most once per timeout period); every
+ * reply lets one more out again, up to the capacity.
+ *
+ * Set DNS_SERVER to "a.b.c.d" or "a.b.c.d:port" to have dnslookup() and the
+ * resolver threads use this instead of getaddrinfo().
+ */
+
+#define DNS_SERVER_ENV "DNS_SERVER"
+#define DNS_PORT 53
+#define DNS_TIMEOUT_MS 500   /* Before a query is sent again */
+#define DNS_TRIES 3          /* Sends before a name is given up on */
+#define DNS_MAX_IN_FLIGHT 16384  /* Leaves two bits of the ID for reuse counts */
+#define DNS_QUERY_MAX 280    /* Header, a 255-byte name, type and class */
+#define DNS_PACKET_MAX 512   /* Largest reply over plain UDP */
+
+
+typedef struct dns_query_struct {
+    unsigned char packet[DNS_QUERY_MAX];
+    int length;
+    uint16_t id;
+    int inUse;
+    int tries;               /* Sends that made it out */
+    long long deadline;      /* Milliseconds, CLOCK_MONOTONIC */
+    int prev;                /* Timeout list neighbours, -1 at the ends */
+    int next;
+    void* tag;
+} dns_query;
+
+typedef struct dns_engine_struct {
+    int fd;
+    int epfd;
+    dns_query* queries;
+    int capacity;            /* A power of two */
+    int window;              /* Queries allowed out right now */
+    long long lastCut;       /* When window was last halved */
+    int* freeSlots;
+    int numFree;
+    int head;                /* Timeout list: earliest deadline first */
+    int tail;
+} dns_engine;
+
+typedef struct dns_result_struct {
+    void* tag;
+    int status;              /* UTIL_SUCCESS or UTIL_FAILURE */
+    char ip[INET6_ADDRSTRLEN];
+} dns_result;
+
+
+/* Capacity is size rounded up to a power of two, at most DNS_MAX_IN_FLIGHT.
+ * server is "a.b.c.d[:port]". Returns the capacity, -1 on error. */
+int dnsEngineInit(dns_engine* e, const char* server, int size);
+
+/* Sends a query for hostname; its result comes back with tag.
+ * 0 if sent, 1 if the engine has no room, -1 if hostname isn't a valid name. */
+int dnsEngineSubmit(dns_engine* e, const char* hostname, void* tag);
+
+/* Collects up to max finished queries, replies or give-ups. Waits up to
+ * timeoutMs for the first one if none are ready. Returns how many. */
+int dnsEnginePoll(dns_engine* e, dns_result* results, int max, int timeoutMs);
+
+/* Queries sent and not finished yet */
+int dnsEngineInFlight(dns_engine* e);
+
+/* How many more dnsEngineSubmit() will take right now */
+int dnsEngineRoom(dns_engine* e);
+
+void dnsEngineFree(dns_engine* e);
+
+/* dnslookup() on the engine: one query at a time, one engine per thread */
+int dnsEngineLookup(const char* hostname, char* firstIPstr, int maxSize);
+
+#endif
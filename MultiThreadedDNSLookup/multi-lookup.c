@@ -2,17 +2,13 @@
 
 
 //Mutex locks
-pthread_mutex_t arrayLock; 
 pthread_mutex_t requestorLock; //Protects counter in "readFile".
 pthread_mutex_t resolverLock; //Protects results.txt in "dns".
 
-//Condition Variables
-pthread_cond_t arrayFull; //Wait/Signal for full array.
-pthread_cond_t arrayEmpty; //Wait/Signal for empty array. 
-
-array sharedArray; //The shared array.
-int numFilesCompleted; 
+array sharedArray; //The shared array (lock free: it blocks on its own when full or empty).
+int nextInputFile; //Index of the next input file a requestor will take (protected by requestorLock).
 int numInputFiles;	
+char** inputFileNames;
 int maxThreads;	
 int numRequestorThreads;
 int numResolverThreads;
@@ -22,41 +18,40 @@ char* resultsFile; //results.txt
 
 
 /*
- * (Currently only works if number of requestor threads equals number of input files.)
- *
- * Create requestor threads to service name files until numRequestorThreads have been created.
+ * Create numRequestorThreads requestor threads, which share the input files between them.
  */
 void* requestorThreadPool(char* inputFiles) {
 	//Pointer magic suppresses the warning: "initialization makes pointer from integer without a cast [-Wint-conversion]"
-	char** inputFileNames = (char**) inputFiles;
+	inputFileNames = (char**) inputFiles;
 	
 	pthread_t requestorThreads[numRequestorThreads]; //Declare specified number of requestor threads
 
 	int i;
 	for(i=0; i < numRequestorThreads; i++) {
-		char* fileName = inputFileNames[i];
-		pthread_create(&requestorThreads[i], NULL, (void*) checkAndReadFiles, (void*) fileName);
-		//Wait until threads have finished. 
+		pthread_create(&requestorThreads[i], NULL, checkAndReadFiles, NULL);
+	}
+	//Wait until threads have finished. 
+	for(i=0; i < numRequestorThreads; i++) {
 		pthread_join(requestorThreads[i], NULL);
 	}
 
-	for(i=0; i < numInputFiles; i++) {
-		pthread_cond_signal(&arrayEmpty); //Signal requestor threads that the array is empty.
-	}
+	arrayClose(&sharedArray); //No more names: resolvers stop once the array is drained.
 
 	return NULL;
 }
 
 /*
- * Create resolver threads to do dns lookups until numResolverThreads have been created.
+ * Create numResolverThreads resolver threads to do dns lookups side by side.
  */
 void* resolverThreadPool(FILE* resultsfp) {
 	pthread_t resolverThreads[numResolverThreads]; //Declare specified number of resolver threads
 	
 	int i;
 	for(i=0; i < numResolverThreads; i++) {
-		pthread_create(&resolverThreads[i], NULL, dns, resultsfp);
-		//Wait until threads have finished. 
+		pthread_create(&resolverThreads[i], NULL, (void*) dns, resultsfp);
+	}
+	//Wait until threads have finished. 
+	for(i=0; i < numResolverThreads; i++) {
 		pthread_join(resolverThreads[i], NULL);
 	}
 
@@ -64,20 +59,40 @@ void* resolverThreadPool(FILE* resultsfp) {
 }
 
 /*
- * Calls readFile() for requestor threads (and will handle logic of threads servicing multiple files).
+ * Requestor thread: keeps taking the next unread input file until there are none left, then
+ * reports how many it serviced.
  */
-void* checkAndReadFiles(char* filename) {
-	int filesServicedByThread = 1;
-	//(Check if this thread can keep servicing files here?)
-	readFile(filename, filesServicedByThread);
+void* checkAndReadFiles() {
+	int filesServicedByThread = 0;
+
+	for(;;) {
+		char* filename = NULL;
+
+		pthread_mutex_lock(&requestorLock);
+			if (nextInputFile < numInputFiles) {
+				filename = inputFileNames[nextInputFile++];
+			}
+		pthread_mutex_unlock(&requestorLock);
+
+		if (!filename) {
+			break;
+		}
+		if (readFile(filename) == 0) {
+			filesServicedByThread++;
+		}
+	}
+
+	pthread_mutex_lock(&requestorLock);
+		fprintf(servicedfp, "Thread <%ld> serviced %d file(s).\n", syscall( __NR_gettid ), filesServicedByThread);
+	pthread_mutex_unlock(&requestorLock);
 	
 	return NULL;
 }
 
 /* 
- * Read names from input files and put them into the shared array.
+ * Read names from an input file and put them into the shared array. Returns -1 if it can't be opened.
  */
-void readFile(char* filename, int filesServicedByThread) {
+int readFile(char* filename) {
 	//int namesServiced = 0; //Count number of names a thread services (unused).
 
 	char filePath[1025] = "input/";
@@ -87,62 +102,64 @@ void readFile(char* filename, int filesServicedByThread) {
 	//Error Handling #3: "Bogus Input File Path"
 	if(!inputfp) {
 		perror("Error: cannot open input file.\n");
-		//Lock counter variable  
-		pthread_mutex_lock(&requestorLock);
-			numFilesCompleted++;
-		//Unlock counter variable
-		pthread_mutex_unlock(&requestorLock);
+		return -1;
 	}
 
 	char hostname[1025];
 	while(fscanf(inputfp, "%1024s", hostname) > 0) {
-		//Lock and check to see if array is full. 
-		pthread_mutex_lock(&arrayLock);
-			while(arrayIsFull(&sharedArray)) { 
-				pthread_cond_wait(&arrayFull, &arrayLock); //If the array is full, thread waits on CV "arrayFull".
-			}
-			pushToArray(&sharedArray, strdup(hostname));
-			//namesServiced++;
-			pthread_cond_signal(&arrayEmpty); //Signal on condition arrayEmpty to let resolver threads know that shared array is populated.
-		// unlock shared array  
-		pthread_mutex_unlock(&arrayLock);
+		//Blocks while the array is full.
+		pushToArray(&sharedArray, strdup(hostname));
+		//namesServiced++;
 	}
- 
-	pthread_mutex_lock(&requestorLock);
-		numFilesCompleted++;	
-		fprintf(servicedfp, "Thread <%ld> serviced %d file(s).\n", syscall( __NR_gettid ), filesServicedByThread);
-	pthread_mutex_unlock(&requestorLock);
 	
 	fclose(inputfp);
+	return 0;
+}
+
+/*
+ * Write a resolver's buffered lines to results.txt in one go.
+ */
+void flushResults(FILE* resultsfp, char* buffer, size_t* length) {
+	if (*length == 0) {
+		return;
+	}
+	pthread_mutex_lock(&resolverLock); //Lock results.txt
+		fwrite(buffer, 1, *length, resultsfp);
+	pthread_mutex_unlock(&resolverLock); //Unlock results.txt
+	*length = 0;
+}
+
+/*
+ * Add a line to a resolver's buffer, writing the buffer out first if it might not fit.
+ */
+void addResult(FILE* resultsfp, char* buffer, size_t* length, char* hostname, char* ip) {
+	//Make room for the longest line: a hostname, a comma, an IP and a newline.
+	if (*length + 1025 + MAX_IP_LENGTH + 1 > RESULTS_BUFFER) {
+		flushResults(resultsfp, buffer, length);
+	}
+	*length += sprintf(buffer + *length, "%s,%s\n", hostname, ip);
 }
 
 /* 
  * Do the dns lookups and write results to results.txt
+ *
+ * Each resolver takes a batch of names at a time and resolves them with no lock held. Results 
+ * go to a buffer of the thread's own, which only takes resolverLock when it is written out.
  */
 void* dns(FILE* resultsfp) {
-	while(1) {
-		//Lock array mutex to access it
-		pthread_mutex_lock(&arrayLock);
-			while(arrayIsEmpty(&sharedArray)) {
-				pthread_mutex_lock(&requestorLock); //Lock access to numFilesCompleted
-					int finished = 0;
-	
-					if(numFilesCompleted == numInputFiles) finished = 1; //if we are at the end of the array
+	if (getenv(DNS_SERVER_ENV) && dnsAsync(resultsfp) == 0) {
+		return NULL;
+	}
 
-				pthread_mutex_unlock(&requestorLock); //Unlock numFilesCompleted
-	
-				if (finished) { 
-		//Unlock array mutex because we're finished
-		pthread_mutex_unlock(&arrayLock);
-					return NULL;
-				}
-				//If the array is empty but there are still files to service, resolver threads must wait on CV arrayEmpty.
-				pthread_cond_wait(&arrayEmpty, &arrayLock);
-			}
+	void* batch[RESOLVER_BATCH];
+	char results[RESULTS_BUFFER];
+	size_t resultsLength = 0;
+	int count, i;
 
-			char* hostname = (char*) popFromArray(&sharedArray);
-			pthread_cond_signal(&arrayFull); //Let resolver threads know there is space in the array.
-		
+	//Blocks while the array is empty; 0 once the requestors are done and it is drained.
+	while((count = popBatchFromArray(&sharedArray, batch, RESOLVER_BATCH)) > 0) {
+		for(i=0; i < count; i++) {
+			char* hostname = batch[i];
 			char firstIp[MAX_IP_LENGTH];
 
 			//Error Handling #1: "Bogus Hostname" 
@@ -151,20 +168,90 @@ void* dns(FILE* resultsfp) {
 				strncpy(firstIp, "", sizeof(firstIp));
 			}
 
-			pthread_mutex_lock(&resolverLock); //Lock results.txt
-				fprintf(resultsfp, "%s,%s\n", hostname, firstIp);
-			pthread_mutex_unlock(&resolverLock); //Unlock results.txt
-		
+			addResult(resultsfp, results, &resultsLength, hostname, firstIp);
 			free(hostname);
-		 
-		pthread_mutex_unlock(&arrayLock);
+		}
 	}
+	flushResults(resultsfp, results, &resultsLength);
 
 	return NULL;
 }
 
+/*
+ * dns() on the asynchronous engine (when DNS_SERVER is set): keeps up to ASYNC_IN_FLIGHT queries
+ * out at once, topping up from the shared array whenever replies come back. Returns -1 if the
+ * engine can't be set up.
+ */
+int dnsAsync(FILE* resultsfp) {
+	dns_engine engine;
+	dns_result done[ASYNC_BATCH];
+	void* batch[ASYNC_BATCH];
+	char results[RESULTS_BUFFER];
+	size_t resultsLength = 0;
+	int drained = 0;
+	int count, i;
+
+	if (dnsEngineInit(&engine, getenv(DNS_SERVER_ENV), ASYNC_IN_FLIGHT) < 0) {
+		return -1;
+	}
+
+	while (!drained || dnsEngineInFlight(&engine) > 0) {
+		//Send more names while there's room; only wait for them when nothing is out.
+		while (!drained && dnsEngineRoom(&engine) > 0) {
+			int room = dnsEngineRoom(&engine);
+			if (room > ASYNC_BATCH) {
+				room = ASYNC_BATCH;
+			}
+			if (dnsEngineInFlight(&engine) == 0) {
+				count = popBatchFromArray(&sharedArray, batch, room);
+				drained = (count == 0); //Closed and empty
+			} else {
+				count = arrayTryPopBatch(&sharedArray, batch, room);
+			}
+			if (count == 0) {
+				break;
+			}
+			for(i=0; i < count; i++) {
+				//Error Handling #1: "Bogus Hostname" (not even a valid name)
+				if (dnsEngineSubmit(&engine, batch[i], batch[i]) != 0) {
+					fprintf(stderr, "Error: DNS lookup failure for hostname: %s\n", (char*) batch[i]);
+					addResult(resultsfp, results, &resultsLength, batch[i], "");
+					free(batch[i]);
+				}
+			}
+		}
+
+		count = dnsEnginePoll(&engine, done, ASYNC_BATCH, ASYNC_POLL_MS);
+		for(i=0; i < count; i++) {
+			char* hostname = done[i].tag;
+
+			//Error Handling #1: "Bogus Hostname" 
+			if (done[i].status == UTIL_FAILURE) {
+				fprintf(stderr, "Error: DNS lookup failure for hostname: %s\n", hostname);
+			}
+			addResult(resultsfp, results, &resultsLength, hostname, done[i].ip);
+			free(hostname);
+		}
+	}
+	flushResults(resultsfp, results, &resultsLength);
+	dnsEngineFree(&engine);
+
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
-	numFilesCompleted = 0;
+	if (argc < MIN_ARGS){
+		fprintf(stderr, "%d arguments is not enough arguments. \n", (argc-1));
+		fprintf(stderr, "USAGE:\n %s %s\n", argv[0], USAGE);
+		return(EXIT_FAILURE);
+	}
+
+	if (atoi(argv[1]) < 1 || atoi(argv[2]) < 1){
+		fprintf(stderr, "There must be at least one requestor and one resolver thread. \n");
+		return(EXIT_FAILURE);
+	}
+
+	nextInputFile = 0;
 	numInputFiles = argc-5;
 	numRequestorThreads = atoi(argv[1]); 
 	numResolverThreads = atoi(argv[2]);
@@ -179,23 +266,14 @@ int main(int argc, char* argv[]) {
 	printf("Allocating %d requestor thread(s).\n", numRequestorThreads);	
 	printf("Allocating %d resolver thread(s).\n", numResolverThreads);
 	
-	arrayInit(&sharedArray, ARRAY_SIZE);
-
-	//Initialize condition variables
-	pthread_cond_init(&arrayFull, NULL);
-	pthread_cond_init(&arrayEmpty, NULL);
+	if (arrayInit(&sharedArray, ARRAY_SIZE) < 0) {
+		return(EXIT_FAILURE);
+	}
 
 	//Initialize mutex locks.
-	pthread_mutex_init(&arrayLock, NULL);
 	pthread_mutex_init(&requestorLock, NULL);
 	pthread_mutex_init(&resolverLock, NULL);	
 
-	if (argc < MIN_ARGS){
-		fprintf(stderr, "%d arguments is not enough arguments. \n", (argc-1));
-		fprintf(stderr, "USAGE:\n %s %s\n", argv[0], USAGE);
-		return(EXIT_FAILURE);
-	}
-
 	//Create an array of input files. 
 	int i;
 	for(i=0; i < numInputFiles; i++) {
@@ -246,15 +324,10 @@ int main(int argc, char* argv[]) {
 
 	//Destroy mutex locks
 	pthread_mutex_destroy(&resolverLock);
-	pthread_mutex_destroy(&arrayLock);
 	pthread_mutex_destroy(&requestorLock);
 
-	//Destroy condition variables
-	pthread_cond_destroy(&arrayEmpty);
-	pthread_cond_destroy(&arrayFull);
-
 	gettimeofday(&end, NULL);
-	printf("Time taken: %ld sec.\n", (end.tv_sec - start.tv_sec));
+	printf("Time taken: %ld ms.\n", (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
 	
 	pthread_exit(NULL);
 	return EXIT_SUCCESS;
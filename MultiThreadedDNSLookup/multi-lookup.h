@@ -9,21 +9,33 @@
 #include <sys/types.h>
 #include "util.h"	
 #include "sharedArray.h"	
+#include "dnsEngine.h"
 
 #define MIN_ARGS 6
 #define USAGE "<numRequestorThreads> <numResolverThreads> <resultsFile> <servicedFile> <inputFiles>"
 #define MAX_IP_LENGTH INET6_ADDRSTRLEN
 #define MIN_RESOLVER_THREADS 2
+#define RESOLVER_BATCH 4 //Names a resolver takes from the shared array at once
+#define RESULTS_BUFFER 16384 //Bytes of results a resolver holds before writing them out
+#define ASYNC_IN_FLIGHT 4096 //Queries each resolver keeps out at once with DNS_SERVER set
+#define ASYNC_BATCH 256 //Names taken from the shared array, or results collected, at once
+#define ASYNC_POLL_MS 10 //Longest a resolver waits on replies before looking for more names
 
-void* checkAndReadFiles(char* filename);
+void* checkAndReadFiles();
 
-void readFile(char* filename, int filesServicedByThread);
+int readFile(char* filename);
 
 void* requestorThreadPool(char* inputFiles);
 
 void* resolverThreadPool();
 
+void flushResults(FILE* resultsfp, char* buffer, size_t* length);
+
+void addResult(FILE* resultsfp, char* buffer, size_t* length, char* hostname, char* ip);
+
 void* dns();
 
+int dnsAsync(FILE* resultsfp);
+
 int main(int argc, char* argv[]);
 
@@ -1,77 +1,214 @@
+#define _GNU_SOURCE
 #include "sharedArray.h"
 
-#define ARRAY_SIZE 15 
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
+#define SPIN_TRIES 64  /* Failed attempts before a thread parks */
 
-int arrayIsEmpty(array* a) {
-    if((a->front == a->rear) && (a->array[a->front].value == NULL)){
-	return 1;
-    }
-    else{
-	return 0;
+
+static void futexWait(atomic_uint* word, unsigned int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(atomic_uint* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Tell up to count parked threads of the other kind that something changed.
+ * The fence pairs with the waiter count increment before parking: either
+ * the waiter sees our slot, or we see the waiter. */
+static void unpark(atomic_uint* word, atomic_uint* waiters, int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(waiters, memory_order_relaxed)){
+	atomic_fetch_add(word, 1);
+	futexWake(word, count);
     }
 }
 
+int arrayIsEmpty(array* a) {
+    return atomic_load(&a->rear) == atomic_load(&a->front);
+}
+
 int arrayIsFull(array* a) {
-    if((a->front == a->rear) && (a->array[a->front].value != NULL)){
-	return 1;
-    }
-    else{
-	return 0;
-    }
+    return atomic_load(&a->rear) - atomic_load(&a->front) >= (size_t)a->maxSize;
 }
 
 int arrayInit(array* a, int size) {
-    a->maxSize = size;
-    
-    a->array = malloc(sizeof(array_node)*(a->maxSize));
-    if(!(a->array)){	
-	perror("Error on array Malloc");
-	return 1;
+    size_t i;
+
+    a->maxSize = 1;
+    while(a->maxSize < size){
+	a->maxSize <<= 1;
     }
+    a->mask = a->maxSize - 1;
 
-    int i;
-    for(i=0; i < a->maxSize; i++) {
+    a->array = aligned_alloc(CACHE_LINE, (sizeof(array_node) * a->maxSize + CACHE_LINE - 1) /
+			     CACHE_LINE * CACHE_LINE);
+    if(!(a->array)){
+	perror("Error on array Malloc");
+	return -1;
+    }
+    for(i = 0; i < (size_t)a->maxSize; i++) {
+	atomic_init(&a->array[i].seq, i);
 	a->array[i].value = NULL;
     }
 
-    a->front = 0;
-    a->rear = 0;
+    atomic_init(&a->rear, 0);
+    atomic_init(&a->front, 0);
+    atomic_init(&a->pushed, 0);
+    atomic_init(&a->popWaiters, 0);
+    atomic_init(&a->popped, 0);
+    atomic_init(&a->pushWaiters, 0);
+    atomic_init(&a->closed, 0);
 
     return a->maxSize;
 }
 
-int pushToArray(array* a, void* newValue){
-    
-    if(arrayIsFull(a)){
-	return 1;
-    }
+int arrayTryPush(array* a, void* newValue) {
+    size_t pos = atomic_load_explicit(&a->rear, memory_order_relaxed);
+    array_node* node;
 
-    a->array[a->rear].value = newValue;
-    a->rear = ((a->rear+1) % a->maxSize);
+    for(;;){
+	node = &a->array[pos & a->mask];
+	intptr_t dif = (intptr_t)atomic_load_explicit(&node->seq, memory_order_acquire) -
+	    (intptr_t)pos;
 
+	if(dif == 0){
+	    if(atomic_compare_exchange_weak_explicit(&a->rear, &pos, pos + 1,
+						     memory_order_relaxed, memory_order_relaxed)){
+		break;
+	    }
+	}
+	else if(dif < 0){
+	    return 1;  /* The slot still holds the value from a lap ago */
+	}
+	else{
+	    pos = atomic_load_explicit(&a->rear, memory_order_relaxed);
+	}
+    }
+    node->value = newValue;
+    atomic_store_explicit(&node->seq, pos + 1, memory_order_release);
+    unpark(&a->pushed, &a->popWaiters, 1);
     return 0;
 }
 
-void* popFromArray(array* a){
+int arrayTryPopBatch(array* a, void** values, int max) {
+    size_t pos = atomic_load_explicit(&a->front, memory_order_relaxed);
+    array_node* node;
+    int count, i;
+
+    for(;;){
+	/* Count the filled slots from the front. Nobody else can empty them
+	 * until front moves past, so they stay filled if the CAS succeeds. */
+	for(count = 0; count < max; count++){
+	    node = &a->array[(pos + count) & a->mask];
+	    if(atomic_load_explicit(&node->seq, memory_order_acquire) != pos + count + 1){
+		break;
+	    }
+	}
+	if(count == 0){
+	    node = &a->array[pos & a->mask];
+	    if((intptr_t)(atomic_load_explicit(&node->seq, memory_order_acquire) -
+			  (pos + 1)) < 0){
+		return 0;  /* Not filled yet */
+	    }
+	    pos = atomic_load_explicit(&a->front, memory_order_relaxed);
+	    continue;
+	}
+	if(atomic_compare_exchange_weak_explicit(&a->front, &pos, pos + count,
+						 memory_order_relaxed, memory_order_relaxed)){
+	    break;
+	}
+    }
+    for(i = 0; i < count; i++){
+	node = &a->array[(pos + i) & a->mask];
+	values[i] = node->value;
+	atomic_store_explicit(&node->seq, pos + i + a->mask + 1, memory_order_release);
+    }
+    unpark(&a->popped, &a->pushWaiters, count);
+    return count;
+}
+
+void* arrayTryPop(array* a) {
     void* returnValue;
-	
-    if(arrayIsEmpty(a)){
-	return NULL;
+
+    return arrayTryPopBatch(a, &returnValue, 1) ? returnValue : NULL;
+}
+
+int pushToArray(array* a, void* newValue) {
+    unsigned int seen;
+    int tries = 0;
+
+    for(;;){
+	if(atomic_load_explicit(&a->closed, memory_order_relaxed)){
+	    return 1;
+	}
+	if(arrayTryPush(a, newValue) == 0){
+	    return 0;
+	}
+	if(++tries < SPIN_TRIES){
+	    continue;
+	}
+	/* Full: register, look once more, then sleep until a pop */
+	atomic_fetch_add(&a->pushWaiters, 1);
+	seen = atomic_load(&a->popped);
+	if(arrayIsFull(a) && !atomic_load(&a->closed)){
+	    futexWait(&a->popped, seen);
+	}
+	atomic_fetch_sub(&a->pushWaiters, 1);
+	tries = 0;
+    }
+}
+
+int popBatchFromArray(array* a, void** values, int max) {
+    unsigned int seen;
+    int count;
+    int tries = 0;
+
+    for(;;){
+	count = arrayTryPopBatch(a, values, max);
+	if(count){
+	    return count;
+	}
+	/* Closed: whatever was pushed is in, and there's nothing left */
+	if(atomic_load(&a->closed)){
+	    return arrayTryPopBatch(a, values, max);
+	}
+	if(++tries < SPIN_TRIES){
+	    continue;
+	}
+	/* Empty: register, look once more, then sleep until a push */
+	atomic_fetch_add(&a->popWaiters, 1);
+	seen = atomic_load(&a->pushed);
+	if(arrayIsEmpty(a) && !atomic_load(&a->closed)){
+	    futexWait(&a->pushed, seen);
+	}
+	atomic_fetch_sub(&a->popWaiters, 1);
+	tries = 0;
     }
-	
-    returnValue = a->array[a->front].value;
-    a->array[a->front].value = NULL;
-    a->front = ((a->front + 1) % a->maxSize);
+}
 
-    return returnValue;
+void* popFromArray(array* a) {
+    void* returnValue;
+
+    return popBatchFromArray(a, &returnValue, 1) ? returnValue : NULL;
+}
+
+void arrayClose(array* a) {
+    atomic_store(&a->closed, 1);
+    atomic_fetch_add(&a->pushed, 1);
+    atomic_fetch_add(&a->popped, 1);
+    futexWake(&a->pushed, INT32_MAX);
+    futexWake(&a->popped, INT32_MAX);
 }
 
 void freeArrayMemory(array* a)
 {
     while(!arrayIsEmpty(a)){
-	popFromArray(a);
+	arrayTryPop(a);
     }
     free(a->array);
 }
-
@@ -1,30 +1,82 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
-#define ARRAY_SIZE 15 
+/*
+ * Bounded multi-producer/multi-consumer queue of pointers, lock free.
+ *
+ * The array is a ring of 2^n slots. Every slot carries a sequence number
+ * that says whose turn it is: a producer may fill slot i when its sequence
+ * is the push position, a consumer may empty it when it is one past it. A
+ * push or pop is one compare-and-swap on the rear or front counter, so
+ * threads only contend on the same cache line when they go for the same end.
+ *
+ * Threads that find the ring full (or empty) spin briefly, then park on a
+ * futex until the other side makes room (or adds a value). Nobody sleeps
+ * while the ring has what they need, and nobody pays for a wakeup when
+ * nobody is parked. Any push or pop, blocking or not, wakes the other side.
+ *
+ * NULL can't be queued: popFromArray() returns it for "closed and empty".
+ */
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE 16  /* Default capacity (a power of two); -DARRAY_SIZE=n to change */
+#endif
+#define CACHE_LINE 64
 
 
 typedef struct array_node_struct {
+    atomic_size_t seq;
     void* value;
 } array_node;
 
 typedef struct array_struct {
     array_node* array;
-    int front;
-    int rear;
+    size_t mask;
     int maxSize;
+    /* Each on its own cache line: producers, consumers and sleepers of
+     * either kind don't slow each other down */
+    _Alignas(CACHE_LINE) atomic_size_t rear;    /* Next push position */
+    _Alignas(CACHE_LINE) atomic_size_t front;   /* Next pop position */
+    _Alignas(CACHE_LINE) atomic_uint pushed;    /* Futex for parked consumers */
+    atomic_uint popWaiters;
+    _Alignas(CACHE_LINE) atomic_uint popped;    /* Futex for parked producers */
+    atomic_uint pushWaiters;
+    atomic_int closed;
 } array;
 
 
+/* Capacity is size rounded up to a power of two. Returns it, -1 on error. */
 int arrayInit(array* a, int size);
 
+/* Snapshots: with other threads at work they may be stale at once */
 int arrayIsEmpty(array* a);
 
 int arrayIsFull(array* a);
 
+/* Non-blocking: 0 if pushed, 1 if the ring is full */
+int arrayTryPush(array* a, void* value);
+
+/* Non-blocking: the oldest value, NULL if the ring is empty */
+void* arrayTryPop(array* a);
+
+/* Non-blocking: takes up to max of the oldest values with one CAS.
+ * Returns how many, 0 if the ring is empty. */
+int arrayTryPopBatch(array* a, void** values, int max);
+
+/* Blocks while the ring is full. 0 if pushed, 1 if the array was closed. */
 int pushToArray(array* a, void* value);
 
+/* Blocks while the ring is empty. NULL once it is closed and drained. */
 void* popFromArray(array* a);
 
-void freeArrayMemory(array* a);
+/* Blocks while the ring is empty, then takes whatever is there, up to max.
+ * Returns how many, 0 once it is closed and drained. */
+int popBatchFromArray(array* a, void** values, int max);
+
+/* No more pushes: wakes every parked thread. Call once every producer is
+ * done, so that nothing is still on its way in. */
+void arrayClose(array* a);
 
+void freeArrayMemory(array* a);
@@ -13,6 +13,7 @@
  */
 
 #include "util.h"
+#include "dnsEngine.h"
 
 int dnslookup(const char* hostname, char* firstIPstr, int maxSize){
 
@@ -30,6 +31,11 @@ int dnslookup(const char* hostname, char* firstIPstr, int maxSize){
     fprintf(stderr, "%s\n", hostname);
 #endif
    
+    /* Ask the named server directly if there is one */
+    if(getenv(DNS_SERVER_ENV)){
+	return dnsEngineLookup(hostname, firstIPstr, maxSize);
+    }
+
     /* Lookup Hostname */
     addrError = getaddrinfo(hostname, NULL, NULL, &headresult);
     if(addrError){